@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+typedef struct job {
+	char *line;
+	void *ctx;
+
+	int *dependents; // the lines waiting on this one.
+	int numDependents;
+	int capDependents;
+
+	// the rest is guarded by the batch's lock while it runs.
+	int waiting; // how many of the lines this one waits on haven't finished.
+	bool done;
+	char *output;
+	size_t size;
+} job;
+
+struct batch {
+	job *jobs;
+	int count;
+	int cap;
+
+	pthread_mutex_t lock;
+	pthread_cond_t readyCond; // a line became ready, or there's nothing left to start.
+	pthread_cond_t doneCond; // a line finished.
+
+	// lines that can run now, as a heap with the earliest line on top, so the
+	// output can be written while the rest is still running.
+	int *ready;
+	int numReady;
+	int started;
+
+	void (*run)(void *ctx, char *line, FILE *out);
+};
+
+static void push_ready(batch *b, int j) {
+	int i = b->numReady++;
+
+	while(i > 0 && b->ready[(i - 1) / 2] > j) {
+		b->ready[i] = b->ready[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	b->ready[i] = j;
+}
+
+static int pop_ready(batch *b) {
+	int top = b->ready[0];
+	int last = b->ready[--b->numReady];
+
+	int i = 0;
+	while(2 * i + 1 < b->numReady) {
+		int c = 2 * i + 1;
+		if(c + 1 < b->numReady && b->ready[c + 1] < b->ready[c]) {
+			c++;
+		}
+
+		if(last <= b->ready[c]) {
+			break;
+		}
+
+		b->ready[i] = b->ready[c];
+		i = c;
+	}
+
+	b->ready[i] = last;
+
+	return top;
+}
+
+/**
+ * Returns a new, empty batch.
+ */
+batch *batch_create() {
+	return calloc(1, sizeof(batch));
+}
+
+/**
+ * Adds a line to the end of the batch, to be run in ctx. Returns its number;
+ * lines are numbered from 0 in the order they're added.
+ */
+int batch_add(batch *b, char *line, void *ctx) {
+	if(b->count == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 64;
+		b->jobs = realloc(b->jobs, b->cap * sizeof(job));
+	}
+
+	job *j = &b->jobs[b->count];
+	memset(j, 0, sizeof(job));
+	j->line = strdup(line);
+	j->ctx = ctx;
+
+	return b->count++;
+}
+
+/**
+ * Makes line job wait until line on has finished. on must have been added
+ * before job. Does nothing if on is negative.
+ */
+void batch_depend(batch *b, int job, int on) {
+	if(on < 0 || on == job) {
+		return;
+	}
+
+	struct job *o = &b->jobs[on];
+
+	// the same pair tends to come up several times in a row.
+	if(o->numDependents > 0 && o->dependents[o->numDependents - 1] == job) {
+		return;
+	}
+
+	if(o->numDependents == o->capDependents) {
+		o->capDependents = o->capDependents ? o->capDependents * 2 : 4;
+		o->dependents = realloc(o->dependents, o->capDependents * sizeof(int));
+	}
+
+	o->dependents[o->numDependents++] = job;
+	b->jobs[job].waiting++;
+}
+
+static void *worker(void *arg) {
+	batch *b = arg;
+
+	pthread_mutex_lock(&b->lock);
+
+	while(true) {
+		while(b->numReady == 0 && b->started < b->count) {
+			pthread_cond_wait(&b->readyCond, &b->lock);
+		}
+
+		if(b->numReady == 0) {
+			break;
+		}
+
+		int n = pop_ready(b);
+		job *j = &b->jobs[n];
+
+		if(++b->started == b->count) {
+			// let the idle workers go.
+			pthread_cond_broadcast(&b->readyCond);
+		}
+
+		pthread_mutex_unlock(&b->lock);
+
+		char *output = NULL;
+		size_t size = 0;
+		FILE *out = open_memstream(&output, &size);
+
+		b->run(j->ctx, j->line, out);
+		fclose(out);
+
+		pthread_mutex_lock(&b->lock);
+
+		j->output = output;
+		j->size = size;
+		j->done = true;
+
+		for(int i = 0; i < j->numDependents; i++) {
+			if(--b->jobs[j->dependents[i]].waiting == 0) {
+				push_ready(b, j->dependents[i]);
+				pthread_cond_signal(&b->readyCond);
+			}
+		}
+
+		pthread_cond_signal(&b->doneCond);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+/**
+ * Runs every line of the batch on workers threads, calling run(ctx, line, out)
+ * for each, and writes what they printed to dest in order. Frees the batch.
+ */
+void batch_run(batch *b, int workers, void (*run)(void *ctx, char *line, FILE *out), FILE *dest) {
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->readyCond, NULL);
+	pthread_cond_init(&b->doneCond, NULL);
+
+	b->run = run;
+	b->ready = malloc((b->count + 1) * sizeof(int));
+
+	for(int i = 0; i < b->count; i++) {
+		if(b->jobs[i].waiting == 0) {
+			push_ready(b, i);
+		}
+	}
+
+	pthread_t *threads = malloc(workers * sizeof(pthread_t));
+	for(int i = 0; i < workers; i++) {
+		pthread_create(&threads[i], NULL, worker, b);
+	}
+
+	// write each line's output as soon as everything before it is written.
+	for(int i = 0; i < b->count; i++) {
+		job *j = &b->jobs[i];
+
+		pthread_mutex_lock(&b->lock);
+		while(!j->done) {
+			pthread_cond_wait(&b->doneCond, &b->lock);
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		fwrite(j->output, 1, j->size, dest);
+
+		free(j->output);
+		free(j->line);
+		free(j->dependents);
+	}
+
+	for(int i = 0; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&b->doneCond);
+	pthread_cond_destroy(&b->readyCond);
+	pthread_mutex_destroy(&b->lock);
+
+	free(threads);
+	free(b->ready);
+	free(b->jobs);
+	free(b);
+}
@@ -0,0 +1,172 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+// the Castagnoli polynomial, bit reversed.
+#define POLY 0x82F63B78
+
+// The crc32 instruction takes three cycles but can start one every cycle, so
+// long runs are split into three lanes checksummed side by side and put back
+// together with shift tables. Three of the long lanes cover all of a 4096
+// byte chunk but 16 bytes, the short ones most of what's left of anything else.
+#define NUM_LANES 2
+static const size_t lanes[NUM_LANES] = {1360, 136};
+
+// table[k][b] is the CRC of byte b followed by k zero bytes, so eight bytes
+// can be folded in with eight lookups and no dependency between them.
+static uint32_t table[8][256];
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+
+// shift[l][k][b] is what byte k of the CRC being b turns into after
+// lanes[l] zero bytes, so a CRC can be moved past a lane with four lookups.
+static uint32_t shift[NUM_LANES][4][256];
+
+static void build_table() {
+	for(uint32_t b = 0; b < 256; b++) {
+		uint32_t crc = b;
+		for(int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+		}
+		table[0][b] = crc;
+	}
+
+	for(uint32_t b = 0; b < 256; b++) {
+		for(int k = 1; k < 8; k++) {
+			table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+		}
+	}
+
+	for(int l = 0; l < NUM_LANES; l++) {
+		for(int k = 0; k < 4; k++) {
+			for(uint32_t b = 0; b < 256; b++) {
+				uint32_t crc = b << (8 * k);
+				for(size_t i = 0; i < lanes[l]; i++) {
+					crc = (crc >> 8) ^ table[0][crc & 0xFF];
+				}
+				shift[l][k][b] = crc;
+			}
+		}
+	}
+}
+
+// the CRC crc turns into after lanes[l] zero bytes.
+static uint32_t shift_lane(int l, uint32_t crc) {
+	return shift[l][0][crc & 0xFF] ^ shift[l][1][(crc >> 8) & 0xFF]
+		^ shift[l][2][(crc >> 16) & 0xFF] ^ shift[l][3][crc >> 24];
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *p, size_t n) {
+	pthread_once(&tableOnce, build_table);
+
+	while(n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+
+		crc = table[7][v & 0xFF] ^ table[6][(v >> 8) & 0xFF]
+			^ table[5][(v >> 16) & 0xFF] ^ table[4][(v >> 24) & 0xFF]
+			^ table[3][(v >> 32) & 0xFF] ^ table[2][(v >> 40) & 0xFF]
+			^ table[1][(v >> 48) & 0xFF] ^ table[0][v >> 56];
+
+		p += 8;
+		n -= 8;
+	}
+
+	while(n > 0) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xFF];
+		p++;
+		n--;
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t n) {
+	uint64_t c = crc;
+
+	if(n >= 3 * lanes[NUM_LANES - 1]) {
+		pthread_once(&tableOnce, build_table);
+	}
+
+	for(int l = 0; l < NUM_LANES; l++) {
+		size_t len = lanes[l];
+
+		while(n >= 3 * len) {
+			uint64_t c1 = 0;
+			uint64_t c2 = 0;
+
+			for(size_t i = 0; i < len; i += 8) {
+				uint64_t v0, v1, v2;
+				memcpy(&v0, p + i, sizeof(v0));
+				memcpy(&v1, p + len + i, sizeof(v1));
+				memcpy(&v2, p + 2 * len + i, sizeof(v2));
+				c = __builtin_ia32_crc32di(c, v0);
+				c1 = __builtin_ia32_crc32di(c1, v1);
+				c2 = __builtin_ia32_crc32di(c2, v2);
+			}
+
+			// the CRC of the lanes in a row, from each of them started at 0.
+			c = shift_lane(l, shift_lane(l, (uint32_t)c) ^ (uint32_t)c1) ^ (uint32_t)c2;
+
+			p += 3 * len;
+			n -= 3 * len;
+		}
+	}
+
+	while(n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		n -= 8;
+	}
+
+	while(n > 0) {
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p);
+		p++;
+		n--;
+	}
+
+	return (uint32_t)c;
+}
+
+/**
+ * Whether crc32c has the SSE4.2 instruction to work with.
+ */
+bool crc32c_hardware() {
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+/**
+ * Whether crc32c has the SSE4.2 instruction to work with.
+ */
+bool crc32c_hardware() {
+	return false;
+}
+
+#endif
+
+/**
+ * CRC32C (the Castagnoli polynomial) of numBytes bytes at data, continuing
+ * from crc, which is 0 to start with. The checksum of a run of bytes is the
+ * same whether it's computed in one call or several in a row. Uses the SSE4.2
+ * crc32 instruction when the processor has it, and slice-by-8 tables when it
+ * doesn't.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t numBytes) {
+	crc = ~crc;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if(crc32c_hardware()) {
+		return ~crc_sse42(crc, data, numBytes);
+	}
+#endif
+
+	return ~crc_slice8(crc, data, numBytes);
+}
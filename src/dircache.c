@@ -0,0 +1,361 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "dircache.h"
+
+// cached directories are found through a hash table of this many chains.
+#define DCACHE_BUCKETS 1024
+
+// Chains only ever grow, at the head and with nodeLock held, so lookups can
+// walk them without locks. A deleted directory keeps its node with no
+// version in it, ready for whatever ends up with its id.
+typedef struct dcache_node {
+	partition *part;
+	block_id dir;
+	dir_version *version; // NULL until it's read from the partition.
+	pthread_mutex_t writeLock; // held by whoever is changing the directory.
+	struct dcache_node *next;
+} dcache_node;
+
+static dcache_node *buckets[DCACHE_BUCKETS];
+
+// guards adding nodes, swapping versions and the limbo list. Only ever held briefly.
+static pthread_mutex_t nodeLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int writing; // how many directories this thread holds the write lock of.
+
+/*
+ * Versions are reclaimed by epoch. Every thread that looks things up has a
+ * reader record saying which epoch it entered its current lookup in, and a
+ * replaced version is tagged with the epoch it was replaced in before the
+ * epoch moves on. Only readers that entered in that epoch or earlier can
+ * still be looking at it, so once none are left it can be freed.
+ */
+typedef struct reader {
+	uint64_t epoch; // when the current lookup started, 0 outside of lookups.
+	bool taken; // whether a thread owns this record.
+	struct reader *next;
+} reader;
+
+// records are never freed, a thread that exits leaves its record for the next one.
+static reader *readers;
+static __thread reader *self;
+
+static pthread_once_t readerKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t readerKey;
+
+static uint64_t globalEpoch = 1;
+
+// a replaced version waiting for its readers to finish.
+typedef struct retired {
+	dir_version *version;
+	uint64_t epoch;
+	struct retired *next;
+} retired;
+
+static retired *limbo; // guarded by nodeLock.
+
+static uint64_t bucket_of(partition *p, block_id dir) {
+	uint64_t h = (dir ^ (uint64_t)(uintptr_t)p) * 0x9E3779B97F4A7C15ull;
+	return (h >> 32) % DCACHE_BUCKETS;
+}
+
+static dcache_node *find_node(partition *p, block_id dir) {
+	dcache_node *n = __atomic_load_n(&buckets[bucket_of(p, dir)], __ATOMIC_ACQUIRE);
+
+	while(n != NULL && (n->part != p || n->dir != dir)) {
+		n = n->next;
+	}
+
+	return n;
+}
+
+// finds the node for dir, adding one if there isn't any.
+static dcache_node *make_node(partition *p, block_id dir) {
+	dcache_node *n = find_node(p, dir);
+
+	if(n != NULL) {
+		return n;
+	}
+
+	pthread_mutex_lock(&nodeLock);
+
+	// someone else may have added it since we looked.
+	n = find_node(p, dir);
+
+	if(n == NULL) {
+		uint64_t b = bucket_of(p, dir);
+
+		n = calloc(1, sizeof(dcache_node));
+		n->part = p;
+		n->dir = dir;
+		pthread_mutex_init(&n->writeLock, NULL);
+		n->next = buckets[b];
+		__atomic_store_n(&buckets[b], n, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&nodeLock);
+
+	return n;
+}
+
+// reads the directory at dir from the partition.
+static dir_version *read_version(block_id dir) {
+	fileHeader fh, child;
+	load_header(dir, &fh);
+
+	uint64_t slots = fh.size / sizeof(block_id);
+	block_id *ids = malloc(fh.size);
+	load_block(fh.contents, ids, fh.size);
+
+	uint64_t count = 0;
+	for(uint64_t i = 0; i < slots; i++) {
+		if(ids[i] != 0) {
+			count++;
+		}
+	}
+
+	dir_version *v = malloc(sizeof(dir_version) + count * sizeof(dir_entry));
+	v->id = dir;
+	v->parent = fh.parent;
+	v->count = count;
+
+	dir_entry *e = v->entries;
+	for(uint64_t i = 0; i < slots; i++) {
+		if(ids[i] == 0) {
+			continue;
+		}
+
+		load_header(ids[i], &child);
+
+		e->id = ids[i];
+		e->isDirectory = child.isDirectory;
+		memcpy(e->name, child.name, sizeof(e->name));
+		e++;
+	}
+
+	free(ids);
+
+	return v;
+}
+
+// frees every retired version no reader can still be looking at. With nodeLock held.
+static void reclaim() {
+	uint64_t oldest = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+
+	for(reader *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		uint64_t e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+
+		if(e != 0 && e < oldest) {
+			oldest = e;
+		}
+	}
+
+	retired **link = &limbo;
+	while(*link != NULL) {
+		retired *old = *link;
+
+		if(old->epoch < oldest) {
+			*link = old->next;
+			free(old->version);
+			free(old);
+		} else {
+			link = &old->next;
+		}
+	}
+}
+
+// makes v the version lookups see for the node, retiring the one it replaces.
+static void replace(dcache_node *n, dir_version *v) {
+	pthread_mutex_lock(&nodeLock);
+
+	dir_version *old = n->version;
+
+	__atomic_store_n(&n->version, v, __ATOMIC_RELEASE);
+
+	if(old != NULL) {
+		retired *r = malloc(sizeof(retired));
+		r->version = old;
+		r->epoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+		r->next = limbo;
+		limbo = r;
+	}
+
+	reclaim();
+
+	pthread_mutex_unlock(&nodeLock);
+}
+
+// a thread exiting in the middle of nothing gives its record back.
+static void release_reader(void *r) {
+	__atomic_store_n(&((reader*)r)->taken, false, __ATOMIC_RELEASE);
+}
+
+static void make_reader_key() {
+	pthread_key_create(&readerKey, release_reader);
+}
+
+// finds this thread a reader record, reusing one left behind by an exited thread if possible.
+static reader *claim_reader() {
+	pthread_once(&readerKeyOnce, make_reader_key);
+
+	reader *r;
+	for(r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		bool unused = false;
+		if(__atomic_compare_exchange_n(&r->taken, &unused, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	if(r == NULL) {
+		r = calloc(1, sizeof(reader));
+		r->taken = true;
+		r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+
+		while(!__atomic_compare_exchange_n(&readers, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			// r->next now holds the new head, try again.
+		}
+	}
+
+	pthread_setspecific(readerKey, r);
+
+	return r;
+}
+
+/**
+ * Starts a lookup. Anything returned by dcache_get stays valid until the
+ * matching dcache_exit. Lookups can't be nested.
+ */
+void dcache_enter() {
+	if(self == NULL) {
+		self = claim_reader();
+	}
+
+	__atomic_store_n(&self->epoch, __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+	// the versions we're about to read must not be loaded before we're seen as reading.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Ends a lookup started with dcache_enter.
+ */
+void dcache_exit() {
+	__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the current copy of the directory whose header is at dir, reading
+ * it from the partition the first time. Must be called inside a lookup.
+ */
+const dir_version *dcache_get(block_id dir) {
+	partition *p = current_partition();
+	dcache_node *n = find_node(p, dir);
+
+	if(n != NULL) {
+		dir_version *v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+
+		if(v != NULL) {
+			return v;
+		}
+	}
+
+	// not cached yet. Read it with its write lock held, so no command is
+	// changing it on the partition while we do. A thread in the middle of
+	// changing directories already holds what it needs.
+	n = make_node(p, dir);
+
+	bool locked = writing == 0;
+	if(locked) {
+		pthread_mutex_lock(&n->writeLock);
+	}
+
+	if(__atomic_load_n(&n->version, __ATOMIC_ACQUIRE) == NULL) {
+		replace(n, read_version(dir));
+	}
+
+	dir_version *v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+
+	if(locked) {
+		pthread_mutex_unlock(&n->writeLock);
+	}
+
+	return v;
+}
+
+/**
+ * Looks name up in the directory whose header is at dir, returning the
+ * child's header id or 0 if there is no directory (or file, depending on
+ * isDirectory) by that name. Takes care of entering and exiting a lookup.
+ * A thread viewing a snapshot reads the directory itself instead.
+ */
+block_id dcache_lookup(block_id dir, char *name, bool isDirectory) {
+	block_id found = 0;
+
+	// the cache has the partition as it is, a snapshot is read as it was.
+	bool snapshot = viewed_snapshot() != 0;
+
+	dir_version *own = NULL;
+	const dir_version *v;
+
+	if(snapshot) {
+		v = own = read_version(dir);
+	} else {
+		dcache_enter();
+		v = dcache_get(dir);
+	}
+
+	for(uint64_t i = 0; i < v->count; i++) {
+		if(v->entries[i].isDirectory == isDirectory && strcmp(v->entries[i].name, name) == 0) {
+			found = v->entries[i].id;
+			break;
+		}
+	}
+
+	if(snapshot) {
+		free(own);
+	} else {
+		dcache_exit();
+	}
+
+	return found;
+}
+
+/**
+ * Serializes commands that change the directory whose header is at dir, or
+ * its own header. Lookups never wait on it, and commands changing other
+ * directories don't either. A command that needs a directory and one of its
+ * children locked takes the parent's lock first.
+ */
+void dcache_write_lock(block_id dir) {
+	pthread_mutex_lock(&make_node(current_partition(), dir)->writeLock);
+	writing++;
+}
+
+/**
+ * Releases the lock taken by dcache_write_lock.
+ */
+void dcache_write_unlock(block_id dir) {
+	writing--;
+	pthread_mutex_unlock(&find_node(current_partition(), dir)->writeLock);
+}
+
+/**
+ * Reads the directory whose header is at dir back from the partition and
+ * makes it the copy lookups see. Call it with the directory's write lock
+ * held, after every change to its entries or to the names of its children.
+ */
+void dcache_publish(block_id dir) {
+	replace(make_node(current_partition(), dir), read_version(dir));
+}
+
+/**
+ * Drops the cached copy of a directory that has been deleted, with its
+ * parent's write lock held.
+ */
+void dcache_forget(block_id dir) {
+	dcache_node *n = find_node(current_partition(), dir);
+
+	if(n != NULL) {
+		replace(n, NULL);
+	}
+}
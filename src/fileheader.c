@@ -0,0 +1,398 @@
+#include <string.h>
+
+#include "crc32c.h"
+#include "fileheader.h"
+
+// "FHv2"
+#define FH_MAGIC 0x32764846
+
+#define FH_DIRECTORY 0x1
+#define FH_INLINE 0x2
+#define FH_SPARSE 0x4
+#define FH_SEALED 0x8 // the header has a checksum, older ones don't.
+#define FH_CHECKED 0x10 // see fileHeader.isChecked.
+
+// the first format version with these headers, older ones used fileHeaderV1.
+#define FORMAT_HEADER_V2 3
+
+// the first format version with sparse files, older programs can't read them.
+#define FORMAT_SPARSE 4
+
+// how much of the name fits in the fixed part of the header.
+#define FH_NAME_HEAD 16
+
+// what's exited with when a header doesn't match its checksum.
+#define DAMAGED 5
+
+/*
+ * On-disk header, packed so it doesn't depend on the compiler. Everything
+ * needed to walk the tree fits in the first 64 bytes, so lookups and listings
+ * can skip the rest. The remainder of a long name follows right after.
+ */
+typedef struct __attribute__((packed)) fileHeaderDisk {
+	uint32_t magic;
+	uint16_t flags;
+	uint8_t nameLength;
+	uint8_t reserved0;
+	uint32_t extents; // this used to be 64 bits, the upper half was always 0.
+	uint32_t check; // CRC32C of the fixed part, the rest of the name and any inline contents, with this field 0.
+	block_id parent;
+	block_id currentID;
+	block_id contents;
+	block_size_t size;
+	char nameHead[FH_NAME_HEAD];
+} fileHeaderDisk;
+
+#define FH_HOT_SIZE sizeof(fileHeaderDisk)
+
+// fails to compile if the fixed part stops being one cache line.
+typedef char fileHeaderDisk_is_64_bytes[FH_HOT_SIZE == 64 ? 1 : -1];
+
+// The header as older versions wrote it: the raw struct, padding and all.
+typedef struct fileHeaderV1 {
+	bool isDirectory;
+	block_id parent;
+	block_id currentID;
+	block_id contents;
+	block_size_t size;
+	char name[MAX_FILENAME+1];
+} fileHeaderV1;
+
+typedef char fileHeaderV1_fits_slot[sizeof(fileHeaderV1) <= FH_SLOT_SIZE ? 1 : -1];
+
+static void unpack(fileHeaderDisk *d, fileHeader *fh) {
+	fh->isDirectory = (d->flags & FH_DIRECTORY) != 0;
+	fh->isInline = (d->flags & FH_INLINE) != 0;
+	fh->isSparse = (d->flags & FH_SPARSE) != 0;
+	fh->isChecked = (d->flags & FH_CHECKED) != 0;
+	fh->extents = d->extents;
+	fh->parent = d->parent;
+	fh->currentID = d->currentID;
+	fh->contents = d->contents;
+	fh->size = d->size;
+	fh->nameLength = d->nameLength;
+
+	size_t head = d->nameLength < FH_NAME_HEAD ? d->nameLength : FH_NAME_HEAD;
+	memcpy(fh->name, d->nameHead, head);
+	fh->name[head] = '\0';
+}
+
+// how many bytes of the slot the header's checksum covers.
+static size_t sealed_size(fileHeaderDisk *d) {
+	size_t size = FH_HOT_SIZE + (d->nameLength > FH_NAME_HEAD ? d->nameLength - FH_NAME_HEAD : 0);
+
+	if((d->flags & FH_INLINE) != 0) {
+		size += d->size;
+	}
+
+	// a damaged size mustn't take the checksum past the slot.
+	return size < FH_SLOT_SIZE ? size : FH_SLOT_SIZE;
+}
+
+// fills in the checksum of the header at the start of buf.
+static void seal(uint8_t *buf) {
+	fileHeaderDisk *d = (fileHeaderDisk*)buf;
+
+	d->flags |= FH_SEALED;
+	d->check = 0;
+	d->check = crc32c(0, buf, sealed_size(d));
+}
+
+// exits if the header at the start of buf, read from id, doesn't match its
+// checksum. Headers from before checksums are taken as they are.
+static void check_header(block_id id, uint8_t *buf) {
+	fileHeaderDisk *d = (fileHeaderDisk*)buf;
+
+	if((d->flags & FH_SEALED) == 0) {
+		return;
+	}
+
+	uint32_t check = d->check;
+	d->check = 0;
+	uint32_t actual = crc32c(0, buf, sealed_size(d));
+	d->check = check;
+
+	if(actual != check) {
+		fprintf(stderr, "Error: the file header at block %" PRIu64 " is damaged, its checksum doesn't match.\n", id);
+		_exit(DAMAGED);
+	}
+}
+
+/**
+ * Returns whether there's an intact file header at id: one inside the partition
+ * that's what save_header writes and matches its checksum, if it has one.
+ * For scrubbing and fsck, which report damage instead of exiting on it.
+ */
+bool header_intact(block_id id) {
+	uint8_t buf[FH_SLOT_SIZE];
+	fileHeaderDisk *d = (fileHeaderDisk*)buf;
+
+	if(!block_in_bounds(id, FH_SLOT_SIZE)) {
+		return false;
+	}
+
+	load_block(id, buf, FH_SLOT_SIZE);
+
+	if(d->magic != FH_MAGIC) {
+		return false;
+	}
+
+	if((d->flags & FH_SEALED) == 0) {
+		return true;
+	}
+
+	uint32_t check = d->check;
+	d->check = 0;
+
+	return crc32c(0, buf, sealed_size(d)) == check;
+}
+
+/**
+ * Reads only the fixed 64 byte part of the header stored at id. Names
+ * longer than 16 characters are cut short, use header_name_is to compare them.
+ */
+void load_header_hot(block_id id, fileHeader *fh) {
+	uint8_t buf[FH_SLOT_SIZE];
+	fileHeaderDisk *d = (fileHeaderDisk*)buf;
+	bool checking = load_block_checking(id, buf, FH_HOT_SIZE);
+
+	if(d->magic != FH_MAGIC) {
+		fprintf(stderr, "Error: block %" PRIu64 " does not hold a file header.\n", id);
+		_exit(4);
+	}
+
+	if(checking) {
+		// the checksum covers all of the name and inline contents. The header
+		// is read again in one piece, in case it's being renamed.
+		if(sealed_size(d) > FH_HOT_SIZE) {
+			checking = load_block_checking(id, buf, FH_SLOT_SIZE);
+		}
+
+		if(checking) {
+			check_header(id, buf);
+		}
+	}
+
+	unpack(d, fh);
+}
+
+// reads the part of the name that didn't fit in the fixed part of the header.
+static void load_name_tail(fileHeader *fh) {
+	if(fh->nameLength <= FH_NAME_HEAD || strlen(fh->name) == fh->nameLength) {
+		return;
+	}
+
+	// the whole slot, since inline contents are checked along with the name.
+	uint8_t buf[FH_SLOT_SIZE];
+	if(load_block_checking(fh->currentID, buf, FH_SLOT_SIZE)) {
+		check_header(fh->currentID, buf);
+	}
+
+	memcpy(fh->name + FH_NAME_HEAD, buf + FH_HOT_SIZE, fh->nameLength - FH_NAME_HEAD);
+	fh->name[fh->nameLength] = '\0';
+}
+
+// reads and unpacks the whole slot at id, leaving the raw slot in buf.
+static void load_slot(block_id id, fileHeader *fh, uint8_t *buf) {
+	bool checking = load_block_checking(id, buf, FH_SLOT_SIZE);
+
+	fileHeaderDisk *d = (fileHeaderDisk*)buf;
+	if(d->magic != FH_MAGIC) {
+		fprintf(stderr, "Error: block %" PRIu64 " does not hold a file header.\n", id);
+		_exit(4);
+	}
+
+	if(checking) {
+		check_header(id, buf);
+	}
+
+	unpack(d, fh);
+
+	if(fh->nameLength > FH_NAME_HEAD) {
+		memcpy(fh->name + FH_NAME_HEAD, buf + FH_HOT_SIZE, fh->nameLength - FH_NAME_HEAD);
+		fh->name[fh->nameLength] = '\0';
+	}
+}
+
+/**
+ * Reads the whole header stored at id, name included.
+ */
+void load_header(block_id id, fileHeader *fh) {
+	uint8_t buf[FH_SLOT_SIZE];
+	load_slot(id, fh, buf);
+}
+
+/**
+ * Reads the whole header stored at id like load_header. If the file is inline,
+ * its contents come from the same read and are copied into data, which must
+ * have room for FH_SLOT_SIZE bytes. Returns true if it was inline.
+ */
+bool load_header_inline(block_id id, fileHeader *fh, void *data) {
+	uint8_t buf[FH_SLOT_SIZE];
+	load_slot(id, fh, buf);
+
+	if(!fh->isInline) {
+		return false;
+	}
+
+	memcpy(data, buf + header_inline_offset(fh), fh->size);
+	return true;
+}
+
+/**
+ * Returns true if the header (loaded with either function above) is named name.
+ * Only reads the rest of the name from the partition when the first part matches.
+ */
+bool header_name_is(fileHeader *fh, char *name) {
+	size_t len = strlen(name);
+
+	if(len != fh->nameLength) {
+		return false;
+	}
+
+	if(strncmp(fh->name, name, FH_NAME_HEAD) != 0) {
+		return false;
+	}
+
+	load_name_tail(fh);
+
+	return strcmp(fh->name, name) == 0;
+}
+
+/**
+ * Writes the header to its block, fh->currentID. An inline file's contents
+ * are checksummed along with the header, so they must be saved first, and
+ * the header saved again whenever they change.
+ */
+void save_header(fileHeader *fh) {
+	uint8_t buf[FH_SLOT_SIZE];
+	fileHeaderDisk *d = (fileHeaderDisk*)buf;
+
+	memset(d, 0, FH_HOT_SIZE);
+
+	fh->nameLength = strlen(fh->name);
+
+	d->magic = FH_MAGIC;
+	d->flags = (fh->isDirectory ? FH_DIRECTORY : 0) | (fh->isInline ? FH_INLINE : 0)
+		| (fh->isSparse ? FH_SPARSE : 0) | (fh->isChecked ? FH_CHECKED : 0);
+	d->extents = fh->extents;
+	d->nameLength = fh->nameLength;
+	d->parent = fh->parent;
+	d->currentID = fh->currentID;
+	d->contents = fh->contents;
+	d->size = fh->size;
+
+	memcpy(d->nameHead, fh->name, fh->nameLength < FH_NAME_HEAD ? fh->nameLength : FH_NAME_HEAD);
+
+	size_t tail = 0;
+	if(fh->nameLength > FH_NAME_HEAD) {
+		tail = fh->nameLength - FH_NAME_HEAD;
+		memcpy(buf + FH_HOT_SIZE, fh->name + FH_NAME_HEAD, tail);
+	}
+
+	// inline contents are checked along with the header, so they have to be
+	// written before it is.
+	if(fh->isInline && fh->size > 0) {
+		load_block(fh->contents, buf + FH_HOT_SIZE + tail, fh->size);
+	}
+
+	seal(buf);
+
+	save_block(fh->currentID, buf, FH_HOT_SIZE + tail);
+}
+
+/**
+ * Where inline contents start, as an offset from the header's block id.
+ */
+block_size_t header_inline_offset(fileHeader *fh) {
+	size_t len = strlen(fh->name);
+
+	return FH_HOT_SIZE + (len > FH_NAME_HEAD ? len - FH_NAME_HEAD : 0);
+}
+
+/**
+ * Bytes of file contents that fit in the unused part of the header's slot,
+ * after the fixed part and the rest of the name. Files this small are stored
+ * there instead of getting contents of their own.
+ */
+block_size_t header_inline_capacity(fileHeader *fh) {
+	return FH_SLOT_SIZE - header_inline_offset(fh);
+}
+
+// converts the header at id and everything below it.
+static void upgrade_tree(block_id id) {
+	fileHeaderV1 old;
+	fileHeader fh;
+
+	load_block(id, &old, sizeof(fileHeaderV1));
+
+	fh.isDirectory = old.isDirectory;
+	fh.isInline = false;
+	fh.isSparse = false;
+	fh.isChecked = false;
+	fh.extents = 0;
+	// blocks may have been moved out of the way of the descriptor, see relocated_id.
+	fh.parent = relocated_id(old.parent);
+	fh.currentID = id; // older versions could save a header into the wrong block on rename.
+	fh.contents = relocated_id(old.contents);
+	fh.size = old.size;
+	strncpy(fh.name, old.name, MAX_FILENAME);
+	fh.name[MAX_FILENAME] = '\0';
+
+	// the new header is never bigger than the old one, so this is done in place.
+	save_header(&fh);
+
+	if(!fh.isDirectory) {
+		return;
+	}
+
+	block_id *child = malloc(fh.size);
+	load_block(fh.contents, child, fh.size);
+
+	bool moved = false;
+	for(unsigned int i = 0; i < fh.size / sizeof(block_id); i++) {
+		if(child[i] != relocated_id(child[i])) {
+			child[i] = relocated_id(child[i]);
+			moved = true;
+		}
+	}
+
+	if(moved) {
+		save_block(fh.contents, child, fh.size);
+	}
+
+	for(unsigned int i = 0; i < fh.size / sizeof(block_id); i++) {
+		if(child[i] != 0) {
+			upgrade_tree(child[i]);
+		}
+	}
+
+	free(child);
+}
+
+/**
+ * Rewrites every header reachable from the root directory from the raw
+ * format used by older partitions to the current one, if needed, and marks
+ * the partition as being in the current format. File headers from before
+ * checksums get theirs the next time they're saved. Call it once the
+ * partition is open, which converts partitions from before the descriptor
+ * grew first: the ids their headers hold are translated to where that moved
+ * the blocks, see relocated_id.
+ */
+void upgrade_headers() {
+	uint64_t version = getFormatVersion();
+
+	if(version < FORMAT_HEADER_V2 && getRootID() != 0) {
+		upgrade_tree(getRootID());
+	}
+
+	// the ids it moved are all updated now.
+	forget_relocation();
+
+	// contiguous files are still understood, they turn sparse as they're resized.
+	if(version < FORMAT_SPARSE) {
+		requireFormatVersion(FORMAT_SPARSE);
+	}
+
+	checksum_block_headers();
+}
@@ -0,0 +1,1075 @@
+#include <string.h>
+
+#include "crc32c.h"
+#include "fileio.h"
+#include "lz.h"
+#include "rangemap.h"
+#include "usage.h"
+
+// partitions with compressed chunks need at least this version, so older
+// builds that would read the compressed bytes as the file's refuse them.
+#define FORMAT_COMPRESSED 8
+
+// a chunk is only kept compressed if that saves at least an eighth of it.
+#define PACK_LIMIT (CHUNK_SIZE - CHUNK_SIZE / 8)
+
+// how many chunks in a row a thread stops trying to compress, at most, after
+// they keep not compressing.
+#define MAX_BACKOFF 64
+
+// exit code for a chunk whose checksum doesn't match, as for block headers.
+#define DAMAGED 5
+
+/*
+ * One entry of a sparse file's map, describing CHUNK_SIZE bytes of the file.
+ * A chunk is only allocated once something is written to it, and only the
+ * bytes up to the furthest write are ever initialized. With compression on,
+ * chunks that fill up are compressed into a block just big enough for them.
+ * Maps made since checksums were added (see fileHeader.isChecked) keep the
+ * CRC32C of each chunk as it's stored, which reads are checked against.
+ */
+typedef struct extent {
+	block_id blk; // 0 if the chunk is a hole.
+	uint16_t stored; // bytes from the start of the chunk that hold data, the rest read as zeros.
+	uint16_t packed; // size of the chunk compressed with lz_compress, 0 if it isn't.
+	uint32_t check; // crc32c of the packed bytes if it's compressed, of the stored ones if not.
+} extent;
+
+// a map entry as maps from before checksums have them, the same size as extent.
+typedef struct old_extent {
+	block_id blk;
+	uint32_t stored;
+	uint32_t packed;
+} old_extent;
+
+// what holes read as.
+static const uint8_t zeros[CHUNK_SIZE];
+
+// chunks this thread won't try to compress before trying again, and how many
+// it skipped last time, doubled every time a chunk doesn't compress.
+static __thread uint32_t packSkip;
+static __thread uint32_t packBackoff;
+
+// true when the contents of fh follow its header's slot in the same block.
+static bool embeddedContents(fileHeader *fh) {
+	return !fh->isInline && !fh->isSparse && fh->contents == fh->currentID + FH_SLOT_SIZE;
+}
+
+// copies up to size bytes of contents from one place to another.
+static void copyContents(block_id from, block_id to, block_size_t size) {
+	if(size == 0) {
+		return;
+	}
+
+	void *buf = malloc(size);
+	load_block(from, buf, size);
+	save_block(to, buf, size);
+	free(buf);
+}
+
+// overwrites len bytes starting at blk with zeros.
+static void zero_range(block_id blk, uint64_t len) {
+	while(len > 0) {
+		uint64_t n = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+		save_block(blk, (void*)zeros, n);
+		blk += n;
+		len -= n;
+	}
+}
+
+// loads the map entries of chunks [first, first + count) into ext. Chunks
+// past the end of the map are holes.
+static void load_extents(fileHeader *fh, uint64_t first, uint64_t count, extent *ext) {
+	memset(ext, 0, count * sizeof(extent));
+
+	if(first >= fh->extents) {
+		return;
+	}
+
+	uint64_t n = fh->extents - first < count ? fh->extents - first : count;
+	load_block(fh->contents + first * sizeof(extent), ext, n * sizeof(extent));
+
+	if(fh->isChecked) {
+		return;
+	}
+
+	for(uint64_t i = 0; i < n; i++) {
+		old_extent old;
+		memcpy(&old, &ext[i], sizeof(old));
+
+		ext[i].blk = old.blk;
+		ext[i].stored = old.stored;
+		ext[i].packed = old.packed;
+		ext[i].check = 0;
+	}
+}
+
+// saves ext as the map entries of chunks [first, first + count), which the
+// map must already have room for.
+static void save_extents(fileHeader *fh, uint64_t first, uint64_t count, extent *ext) {
+	block_id at = fh->contents + first * sizeof(extent);
+
+	if(fh->isChecked) {
+		save_block(at, ext, count * sizeof(extent));
+		return;
+	}
+
+	old_extent *old = malloc(count * sizeof(old_extent));
+	for(uint64_t i = 0; i < count; i++) {
+		old[i].blk = ext[i].blk;
+		old[i].stored = ext[i].stored;
+		old[i].packed = ext[i].packed;
+	}
+
+	save_block(at, old, count * sizeof(old_extent));
+	free(old);
+}
+
+// exits if bytes, the chunk e describes as it's stored, don't match its checksum.
+static void check_chunk(extent *e, const uint8_t *bytes) {
+	uint64_t numBytes = e->packed != 0 ? e->packed : e->stored;
+
+	if(crc32c(0, bytes, numBytes) != e->check) {
+		fprintf(stderr, "Error: the chunk at block %llu is damaged, its checksum doesn't match.\n", (unsigned long long)e->blk);
+		_exit(DAMAGED);
+	}
+}
+
+// the checksum of a chunk that isn't compressed once [from, to) of it has
+// been written with data, when it held stored bytes with e->check before.
+// Carries on from the old checksum when the write only added to the end, and
+// reads the chunk back into whole otherwise.
+static uint32_t rechecked(extent *e, uint64_t stored, uint64_t from, uint64_t to, const uint8_t *data, uint8_t *whole) {
+	if(from >= stored) {
+		uint32_t check = crc32c(e->check, zeros, from - stored);
+		return crc32c(check, data, to - from);
+	}
+
+	if(from == 0 && to >= stored) {
+		return crc32c(0, data, to);
+	}
+
+	load_block(e->blk, whole, e->stored);
+	return crc32c(0, whole, e->stored);
+}
+
+// unpacks the chunk e describes into dst, which must have room for all of
+// it, though only its first e->stored bytes mean anything. The chunk is
+// checked against its checksum if fh's map has them and getVerification
+// says to.
+static void unpack_chunk(fileHeader *fh, extent *e, uint8_t *dst) {
+	if(e->packed == 0) {
+		if(load_block_checking(e->blk, dst, e->stored) && fh->isChecked) {
+			check_chunk(e, dst);
+		}
+		return;
+	}
+
+	uint8_t packed[PACK_LIMIT];
+	if(load_block_checking(e->blk, packed, e->packed) && fh->isChecked) {
+		check_chunk(e, packed);
+	}
+
+	if(!lz_decompress(packed, e->packed, dst, CHUNK_SIZE)) {
+		fprintf(stderr, "Error: the compressed chunk at block %llu is damaged.\n", (unsigned long long)e->blk);
+		_exit(3);
+	}
+}
+
+// whether the next chunk is worth trying to compress. Data that doesn't
+// compress usually comes in runs, so the tries get further apart while it
+// keeps failing.
+static bool worth_packing() {
+	if(packSkip > 0) {
+		packSkip--;
+		return false;
+	}
+
+	return true;
+}
+
+// notes whether the last try at compressing worked, see worth_packing.
+static void packing_worked(bool worked) {
+	if(worked) {
+		packBackoff = 0;
+		return;
+	}
+
+	packBackoff = packBackoff == 0 ? 1 : packBackoff * 2;
+	if(packBackoff > MAX_BACKOFF) {
+		packBackoff = MAX_BACKOFF;
+	}
+	packSkip = packBackoff;
+}
+
+// makes the map long enough to hold an entry for chunk, the new entries are holes.
+static void grow_map(fileHeader *fh, uint64_t chunk) {
+	if(chunk < fh->extents) {
+		return;
+	}
+
+	uint64_t count = chunk + 1;
+
+	// a new map always gets checksums, whatever the file had before.
+	if(fh->contents == 0) {
+		fh->contents = allocate_metadata_block(count * sizeof(extent), fh->currentID);
+		fh->isChecked = true;
+	} else if(count * sizeof(extent) > block_capacity(fh->contents)) {
+		// at least double, so a file written front to back doesn't move its map every chunk.
+		uint64_t want = count > fh->extents * 2 ? count : fh->extents * 2;
+		fh->contents = resize_block(fh->contents, want * sizeof(extent));
+	}
+
+	zero_range(fh->contents + fh->extents * sizeof(extent), (count - fh->extents) * sizeof(extent));
+	fh->extents = count;
+}
+
+// reads len bytes at off from a sparse file, len must not run past the end.
+static void sparse_read(fileHeader *fh, uint64_t off, uint8_t *buf, uint64_t len) {
+	if(len == 0) {
+		return;
+	}
+
+	uint64_t first = off / CHUNK_SIZE;
+	uint64_t count = (off + len - 1) / CHUNK_SIZE - first + 1;
+
+	extent *ext = malloc(count * sizeof(extent));
+	load_extents(fh, first, count, ext);
+
+	uint8_t *whole = NULL; // a compressed chunk, when only part of it is wanted.
+
+	// checking a chunk takes all of it, so only unchecked ones are read in part.
+	bool checking = fh->isChecked && getVerification() != VERIFY_NEVER;
+
+	for(uint64_t i = 0; i < count; i++) {
+		uint64_t start = (first + i) * CHUNK_SIZE;
+		uint64_t from = off > start ? off - start : 0;
+		uint64_t to = off + len - start < CHUNK_SIZE ? off + len - start : CHUNK_SIZE;
+		uint8_t *dst = buf + (start + from - off);
+
+		// only the part of the chunk that was written is read, the rest is zeros.
+		uint64_t held = ext[i].blk == 0 ? 0 : ext[i].stored;
+		if(held > from) {
+			uint64_t n = (held < to ? held : to) - from;
+
+			if(ext[i].packed == 0 && !checking) {
+				load_block(ext[i].blk + from, dst, n);
+			} else if(from == 0 && to >= (ext[i].packed != 0 ? CHUNK_SIZE : held)) {
+				unpack_chunk(fh, &ext[i], dst);
+			} else {
+				if(whole == NULL) {
+					whole = malloc(CHUNK_SIZE);
+				}
+
+				unpack_chunk(fh, &ext[i], whole);
+				memcpy(dst, whole + from, n);
+			}
+
+			dst += n;
+			from += n;
+		}
+
+		memset(dst, 0, to - from);
+	}
+
+	free(ext);
+	free(whole);
+}
+
+// Writes [from, to) of the chunk e describes by putting all of it together
+// in whole first, for chunks that are compressed or that pack says to
+// compress. The result goes in a block of its own, compressed if that saves
+// enough and as it is otherwise, and the old block is let go.
+static void write_packed(fileHeader *fh, extent *e, uint64_t from, uint64_t to, const uint8_t *data, bool pack, bool dedup, block_id hint, uint8_t *whole) {
+	uint64_t stored = e->blk == 0 ? 0 : e->stored;
+
+	if(stored > 0) {
+		unpack_chunk(fh, e, whole);
+	}
+
+	if(from > stored) {
+		memset(whole + stored, 0, from - stored);
+	}
+
+	memcpy(whole + from, data, to - from);
+
+	if(to > stored) {
+		stored = to;
+	}
+
+	uint8_t packed[PACK_LIMIT];
+	uint32_t size = 0;
+
+	if(pack) {
+		size = lz_compress(whole, CHUNK_SIZE, packed, PACK_LIMIT);
+		packing_worked(size != 0);
+	}
+
+	const uint8_t *bytes = size != 0 ? packed : whole;
+	uint64_t numBytes = size != 0 ? size : stored;
+	bool indexed = dedup && (size != 0 || stored == CHUNK_SIZE);
+	block_id old = e->blk;
+
+	e->stored = stored;
+	e->packed = size;
+	e->check = crc32c(0, bytes, numBytes);
+	e->blk = 0;
+
+	// a chunk the partition already has is shared rather than written again.
+	if(indexed) {
+		e->blk = dedup_block(0, bytes, numBytes);
+	}
+
+	if(e->blk == 0) {
+		e->blk = allocate_data_block(size != 0 ? size : CHUNK_SIZE, hint);
+		save_block(e->blk, (void*)bytes, numBytes);
+
+		if(indexed) {
+			block_id same = dedup_block(e->blk, bytes, numBytes);
+			if(same != 0) {
+				free_block(e->blk);
+				e->blk = same;
+			}
+		}
+	}
+
+	if(size != 0) {
+		requireFormatVersion(FORMAT_COMPRESSED);
+	}
+
+	if(old != 0) {
+		free_block(old);
+	}
+}
+
+// writes len bytes at off into a sparse file, allocating chunks as needed.
+// The file's size is left alone, the caller saves the header afterwards.
+static void sparse_write(fileHeader *fh, uint64_t off, const uint8_t *buf, uint64_t len) {
+	if(len == 0) {
+		return;
+	}
+
+	uint64_t first = off / CHUNK_SIZE;
+	uint64_t count = (off + len - 1) / CHUNK_SIZE - first + 1;
+
+	grow_map(fh, first + count - 1);
+
+	extent *ext = malloc(count * sizeof(extent));
+	load_extents(fh, first, count, ext);
+
+	bool dedup = getDedup();
+	bool compress = getCompression();
+	uint8_t *whole = NULL; // a chunk's bytes, when the write only had part of them.
+
+	block_id hint = fh->currentID;
+	for(uint64_t i = 0; i < count; i++) {
+		uint64_t start = (first + i) * CHUNK_SIZE;
+		uint64_t from = off > start ? off - start : 0;
+		uint64_t to = off + len - start < CHUNK_SIZE ? off + len - start : CHUNK_SIZE;
+		const uint8_t *data = buf + (start + from - off);
+
+		// chunks are compressed once they fill up, and have to be put back
+		// together to change once they are.
+		uint64_t end = ext[i].blk == 0 || to > ext[i].stored ? to : ext[i].stored;
+		bool pack = compress && end == CHUNK_SIZE && worth_packing();
+
+		if(pack || ext[i].packed != 0) {
+			if(whole == NULL) {
+				whole = malloc(CHUNK_SIZE);
+			}
+
+			write_packed(fh, &ext[i], from, to, data, pack, dedup, hint, whole);
+			hint = ext[i].blk;
+			continue;
+		}
+
+		// a whole chunk the partition already has is shared rather than written again.
+		if(dedup && from == 0 && to == CHUNK_SIZE) {
+			block_id same = dedup_block(0, data, CHUNK_SIZE);
+
+			if(same != 0) {
+				if(ext[i].blk != 0) {
+					free_block(ext[i].blk);
+				}
+
+				ext[i].blk = same;
+				ext[i].stored = CHUNK_SIZE;
+				ext[i].check = fh->isChecked ? crc32c(0, data, CHUNK_SIZE) : 0;
+				hint = same;
+				continue;
+			}
+		}
+
+		if(ext[i].blk == 0) {
+			ext[i].blk = allocate_data_block(CHUNK_SIZE, hint);
+			ext[i].stored = 0;
+			ext[i].check = 0;
+		} else if(!claim_block(ext[i].blk) || block_capacity(ext[i].blk) < CHUNK_SIZE) {
+			// the chunk is shared with other files, which keep it as it is, or
+			// was deduplicated into a compressed chunk's block, too small to fill.
+			// Only what this write leaves alone needs copying.
+			block_id own = allocate_data_block(CHUNK_SIZE, hint);
+
+			copyContents(ext[i].blk, own, from < ext[i].stored ? from : ext[i].stored);
+			if(to < ext[i].stored) {
+				copyContents(ext[i].blk + to, own + to, ext[i].stored - to);
+			}
+
+			free_block(ext[i].blk);
+			ext[i].blk = own;
+		}
+
+		// only the gap between the data already there and this write needs zeroing.
+		if(from > ext[i].stored) {
+			zero_range(ext[i].blk + ext[i].stored, from - ext[i].stored);
+		}
+
+		save_block(ext[i].blk + from, (void*)data, to - from);
+
+		uint64_t stored = ext[i].stored;
+		if(to > ext[i].stored) {
+			ext[i].stored = to;
+		}
+
+		if(fh->isChecked) {
+			if(whole == NULL) {
+				whole = malloc(CHUNK_SIZE);
+			}
+
+			ext[i].check = rechecked(&ext[i], stored, from, to, data, whole);
+		}
+
+		// a full chunk goes in the dedup index, unless it turns out to be
+		// the same as one already there.
+		if(dedup && ext[i].stored == CHUNK_SIZE) {
+			if(from != 0 || to != CHUNK_SIZE) {
+				if(whole == NULL) {
+					whole = malloc(CHUNK_SIZE);
+				}
+
+				load_block(ext[i].blk, whole, CHUNK_SIZE);
+				data = whole;
+			}
+
+			block_id same = dedup_block(ext[i].blk, data, CHUNK_SIZE);
+			if(same != 0) {
+				free_block(ext[i].blk);
+				ext[i].blk = same;
+			}
+		}
+
+		hint = ext[i].blk;
+	}
+
+	save_extents(fh, first, count, ext);
+	free(ext);
+	free(whole);
+}
+
+// frees the chunks of a sparse file past size, and the map once it's empty.
+static void sparse_truncate(fileHeader *fh, block_size_t size) {
+	uint64_t keep = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	if(keep < fh->extents) {
+		uint64_t count = fh->extents - keep;
+		extent *ext = malloc(count * sizeof(extent));
+		load_extents(fh, keep, count, ext);
+
+		for(uint64_t i = 0; i < count; i++) {
+			if(ext[i].blk != 0) {
+				free_block(ext[i].blk);
+			}
+		}
+
+		free(ext);
+		fh->extents = keep;
+
+		if(keep > 0) {
+			truncate_block(fh->contents, keep * sizeof(extent));
+		}
+	}
+
+	// the last chunk may hold bytes past the new end, which have to read as
+	// zeros if the file grows again.
+	if(size % CHUNK_SIZE != 0 && keep <= fh->extents) {
+		extent last;
+		load_extents(fh, keep - 1, 1, &last);
+
+		if(last.blk != 0 && last.stored > size % CHUNK_SIZE) {
+			last.stored = size % CHUNK_SIZE;
+
+			// a compressed chunk's checksum is of its packed bytes, which stay the same.
+			if(fh->isChecked && last.packed == 0) {
+				uint8_t *buf = malloc(last.stored);
+				load_block(last.blk, buf, last.stored);
+				last.check = crc32c(0, buf, last.stored);
+				free(buf);
+			}
+
+			save_extents(fh, keep - 1, 1, &last);
+		}
+	}
+
+	if(fh->extents == 0 && fh->contents != 0) {
+		free_block(fh->contents);
+		fh->contents = 0;
+	}
+}
+
+// reads len bytes at off from fh's contents, wherever they are kept.
+static void read_contents(fileHeader *fh, uint64_t off, void *buf, uint64_t len) {
+	if(fh->isSparse) {
+		sparse_read(fh, off, buf, len);
+	} else if(len > 0) {
+		load_block(fh->contents + off, buf, len);
+	}
+}
+
+// frees whatever fh's contents occupy outside of its header's slot.
+static void release_contents(fileHeader *fh) {
+	if(fh->isInline) {
+		return;
+	}
+
+	if(fh->isSparse) {
+		sparse_truncate(fh, 0);
+	} else if(embeddedContents(fh)) {
+		truncate_block(fh->currentID, FH_SLOT_SIZE);
+	} else {
+		free_block(fh->contents);
+	}
+}
+
+// moves the first keep bytes of an inline or contiguous file into chunks.
+// Contiguous files are what older versions made, and are converted the first
+// time they change size.
+static void make_sparse(fileHeader *fh, block_size_t keep) {
+	fileHeader old = *fh;
+
+	fh->isInline = false;
+	fh->isSparse = true;
+	fh->extents = 0;
+	fh->contents = 0;
+
+	uint8_t *buf = malloc(CHUNK_SIZE);
+	for(uint64_t off = 0; off < keep; off += CHUNK_SIZE) {
+		uint64_t n = keep - off < CHUNK_SIZE ? keep - off : CHUNK_SIZE;
+		load_block(old.contents + off, buf, n);
+		sparse_write(fh, off, buf, n);
+	}
+	free(buf);
+
+	release_contents(&old);
+}
+
+// allocates what allocateObject describes, leaving the usage table be.
+static void place_object(fileHeader *fh, block_id hint) {
+	fh->isInline = !fh->isDirectory && fh->size <= header_inline_capacity(fh);
+	fh->isSparse = !fh->isDirectory && !fh->isInline;
+	fh->isChecked = false;
+	fh->extents = 0;
+
+	if(fh->isInline) {
+		// tiny files get nothing but the header slot.
+		fh->currentID = allocate_metadata_block(FH_SLOT_SIZE, hint);
+		fh->contents = fh->currentID + header_inline_offset(fh);
+		zero_range(fh->contents, fh->size);
+		return;
+	}
+
+	if(fh->isSparse) {
+		// nothing is allocated for the contents until they're written.
+		fh->currentID = allocate_metadata_block(FH_SLOT_SIZE, hint);
+		fh->contents = 0;
+		return;
+	}
+
+	if(getLayout() == LAYOUT_SPLIT) {
+		fh->currentID = allocate_metadata_block(FH_SLOT_SIZE, hint);
+		fh->contents = allocate_metadata_block(fh->size, fh->currentID);
+		return;
+	}
+
+	fh->currentID = allocate_block_near(fh->size + FH_SLOT_SIZE, hint);
+	fh->contents = fh->currentID + FH_SLOT_SIZE;
+}
+
+/**
+ * Allocates the header and fh->size bytes of contents for a new file or
+ * directory near hint, filling in currentID and contents. The name must be
+ * set already, since it decides how much room is left for inline contents,
+ * and so must the parent, whose usage the new object is counted in.
+ */
+void allocateObject(fileHeader *fh, block_id hint) {
+	place_object(fh, hint);
+
+	if(fh->isDirectory) {
+		usage_attach(fh);
+	} else {
+		usage_add(fh->parent, fh->size, 1, 0);
+	}
+}
+
+/**
+ * Allocates a new file fh near hint as a copy of the file src, like
+ * allocateObject. Only src's chunk map is copied: the copy shares every chunk
+ * src has written, and whichever file writes to a shared chunk first moves
+ * to a copy of it. Inline files, and contiguous ones from older versions,
+ * are copied outright. The name must be set already, the caller saves the
+ * header afterwards.
+ */
+void cloneObject(fileHeader *src, fileHeader *fh, block_id hint) {
+	fh->isDirectory = false;
+	fh->size = src->size;
+	allocateObject(fh, hint);
+
+	if(!src->isSparse || !fh->isSparse) {
+		uint8_t *buf = malloc(CHUNK_SIZE);
+
+		for(uint64_t off = 0; off < src->size; off += CHUNK_SIZE) {
+			uint64_t n = src->size - off < CHUNK_SIZE ? src->size - off : CHUNK_SIZE;
+			read_contents(src, off, buf, n);
+
+			if(fh->isInline) {
+				save_block(fh->contents + off, buf, n);
+			} else {
+				sparse_write(fh, off, buf, n);
+			}
+		}
+
+		free(buf);
+		return;
+	}
+
+	if(src->extents == 0) {
+		return;
+	}
+
+	extent *ext = malloc(src->extents * sizeof(extent));
+	load_extents(src, 0, src->extents, ext);
+
+	for(uint64_t i = 0; i < src->extents; i++) {
+		if(ext[i].blk != 0) {
+			share_block(ext[i].blk);
+		}
+	}
+
+	// the copy's map is in the same layout as src's, with or without checksums.
+	fh->contents = allocate_metadata_block(src->extents * sizeof(extent), fh->currentID);
+	fh->extents = src->extents;
+	fh->isChecked = src->isChecked;
+	save_extents(fh, 0, src->extents, ext);
+
+	free(ext);
+}
+
+/**
+ * Changes the size of fh's contents, the caller saves the header afterwards.
+ * Headers never move, so the parent's entry and the children's parent ids stay
+ * valid; contents that shared a block with the header get a block of their own.
+ * Files moving across the inline threshold are moved in or out of the header.
+ * Whatever the contents grow by reads as zeros.
+ */
+void resizeContents(fileHeader *fh, block_size_t size) {
+	block_size_t keep = size < fh->size ? size : fh->size;
+
+	if(!fh->isDirectory) {
+		usage_add(fh->parent, (int64_t)size - (int64_t)fh->size, 0, 0);
+	}
+
+	if(!fh->isDirectory && size <= header_inline_capacity(fh)) {
+		block_id inlined = fh->currentID + header_inline_offset(fh);
+
+		if(!fh->isInline) {
+			uint8_t buf[FH_SLOT_SIZE];
+			read_contents(fh, 0, buf, keep);
+			release_contents(fh);
+			save_block(inlined, buf, keep);
+
+			fh->isInline = true;
+			fh->isSparse = false;
+			fh->isChecked = false;
+			fh->extents = 0;
+			fh->contents = inlined;
+		}
+
+		// the slot may still hold whatever was there before the file last shrank.
+		zero_range(inlined + keep, size - keep);
+		fh->size = size;
+		return;
+	}
+
+	if(!fh->isDirectory) {
+		if(!fh->isSparse) {
+			make_sparse(fh, keep);
+		} else if(size < fh->size) {
+			sparse_truncate(fh, size);
+		}
+
+		// growing a sparse file just moves the end, the rest is a hole.
+		fh->size = size;
+		return;
+	}
+
+	if(!embeddedContents(fh)) {
+		fh->contents = resize_block(fh->contents, size);
+	} else {
+		block_id blk = allocate_metadata_block(size, fh->currentID);
+		copyContents(fh->contents, blk, keep);
+		truncate_block(fh->currentID, FH_SLOT_SIZE);
+		fh->contents = blk;
+	}
+
+	zero_range(fh->contents + keep, size - keep);
+	fh->size = size;
+}
+
+/**
+ * Renames fh, which must be fully loaded, and saves it. Inline contents sit
+ * right after the name, so they have to move along with a name change.
+ */
+void renameHeader(fileHeader *fh, char *newName) {
+	if(!fh->isInline) {
+		strncpy(fh->name, newName, MAX_FILENAME);
+		save_header(fh);
+		return;
+	}
+
+	void *buf = malloc(fh->size + 1);
+	if(fh->size > 0) {
+		load_block(fh->contents, buf, fh->size);
+	}
+
+	strncpy(fh->name, newName, MAX_FILENAME);
+
+	if(fh->size <= header_inline_capacity(fh)) {
+		fh->contents = fh->currentID + header_inline_offset(fh);
+		if(fh->size > 0) {
+			save_block(fh->contents, buf, fh->size);
+		}
+		save_header(fh);
+	} else {
+		// the longer name pushed the contents out of the header.
+		fh->isInline = false;
+		fh->isSparse = true;
+		fh->extents = 0;
+		fh->contents = 0;
+		sparse_write(fh, 0, buf, fh->size);
+		save_header(fh);
+	}
+
+	free(buf);
+}
+
+/**
+ * Frees the header and contents of fh.
+ */
+void freeObject(fileHeader *fh) {
+	if(fh->isDirectory) {
+		usage_detach(fh);
+	} else {
+		usage_add(fh->parent, -(int64_t)fh->size, -1, 0);
+	}
+
+	release_contents(fh);
+	free_block(fh->currentID);
+}
+
+/**
+ * Deduplicates fh's chunks against the rest of the partition, see
+ * dedup_block: a chunk holding the same bytes as one in the dedup index is
+ * swapped for it, and any other is added to the index. Adds what it finds to
+ * report. Only sparse files have chunks, the rest are left alone.
+ */
+void dedupContents(fileHeader *fh, dedup_report *report) {
+	if(!fh->isSparse || fh->extents == 0) {
+		return;
+	}
+
+	if(report->seen == NULL) {
+		report->seen = rangemap_create();
+	}
+
+	extent *ext = malloc(fh->extents * sizeof(extent));
+	load_extents(fh, 0, fh->extents, ext);
+
+	uint8_t *buf = malloc(CHUNK_SIZE);
+	bool changed = false;
+
+	for(uint64_t i = 0; i < fh->extents; i++) {
+		if(ext[i].blk == 0 || ext[i].stored == 0) {
+			continue;
+		}
+
+		// compressed chunks are compared as they're stored.
+		uint64_t numBytes = ext[i].packed != 0 ? ext[i].packed : ext[i].stored;
+		if(load_block_checking(ext[i].blk, buf, numBytes) && fh->isChecked) {
+			check_chunk(&ext[i], buf);
+		}
+
+		block_id same = dedup_block(ext[i].blk, buf, numBytes);
+		if(same != 0) {
+			free_block(ext[i].blk);
+			ext[i].blk = same;
+			changed = true;
+			report->merged++;
+		}
+
+		report->chunks++;
+		report->logical += ext[i].stored;
+
+		if(rangemap_find(report->seen, ext[i].blk) == NULL) {
+			rangemap_add(report->seen, ext[i].blk, ext[i].blk + 1, 0, 0);
+			report->physical += ext[i].stored;
+		}
+	}
+
+	if(changed) {
+		save_extents(fh, 0, fh->extents, ext);
+	}
+
+	free(buf);
+	free(ext);
+}
+
+/**
+ * Checks every chunk of fh against its checksum, or for maps from before
+ * checksums, that its compressed chunks still decompress. Problems are passed
+ * to found rather than exiting. Adds the chunks checked to *chunks and
+ * returns the bytes read. The caller keeps fh from changing meanwhile.
+ */
+uint64_t scrubContents(fileHeader *fh, scrub_finding found, void *ctx, uint64_t *chunks) {
+	if(!fh->isSparse || fh->extents == 0) {
+		return 0;
+	}
+
+	if(!block_in_bounds(fh->contents, fh->extents * sizeof(extent))) {
+		found(ctx, fh->currentID, "its chunk map is outside the partition");
+		return 0;
+	}
+
+	extent *ext = malloc(fh->extents * sizeof(extent));
+	load_extents(fh, 0, fh->extents, ext);
+
+	uint8_t *buf = malloc(CHUNK_SIZE);
+	uint8_t *whole = malloc(CHUNK_SIZE);
+	uint64_t read = fh->extents * sizeof(extent);
+	char problem[96];
+
+	for(uint64_t i = 0; i < fh->extents; i++) {
+		uint64_t numBytes = ext[i].packed != 0 ? ext[i].packed : ext[i].stored;
+
+		if(ext[i].blk == 0 || numBytes == 0 || (!fh->isChecked && ext[i].packed == 0)) {
+			continue;
+		}
+
+		if(numBytes > CHUNK_SIZE || !block_in_bounds(ext[i].blk, numBytes)) {
+			snprintf(problem, sizeof(problem), "chunk %" PRIu64 " of the file at %" PRIu64 " is outside the partition", i, fh->currentID);
+			found(ctx, ext[i].blk, problem);
+			continue;
+		}
+
+		load_block(ext[i].blk, buf, numBytes);
+		read += numBytes;
+		(*chunks)++;
+
+		bool intact = fh->isChecked ? crc32c(0, buf, numBytes) == ext[i].check
+			: lz_decompress(buf, numBytes, whole, CHUNK_SIZE);
+
+		if(!intact) {
+			snprintf(problem, sizeof(problem), "chunk %" PRIu64 " of the file at %" PRIu64 " is damaged", i, fh->currentID);
+			found(ctx, ext[i].blk, problem);
+		}
+	}
+
+	free(whole);
+	free(buf);
+	free(ext);
+
+	return read;
+}
+
+/**
+ * Passes every block fh's contents take up outside of its header's block to
+ * each, saying what the block is to fh: the contents of a directory or of a
+ * contiguous file, or a sparse file's chunk map or one of its chunks. Holes
+ * are skipped. A chunk map outside the partition is passed to found instead
+ * of being read. The caller keeps fh from changing meanwhile.
+ */
+void contentsBlocks(fileHeader *fh, scrub_finding each, scrub_finding found, void *ctx) {
+	if(fh->isInline || embeddedContents(fh) || (fh->isSparse && fh->contents == 0)) {
+		return;
+	}
+
+	if(!fh->isSparse) {
+		each(ctx, fh->contents, fh->isDirectory ? "its entries" : "its contents");
+		return;
+	}
+
+	each(ctx, fh->contents, "its chunk map");
+
+	if(fh->extents == 0) {
+		return;
+	}
+
+	if(!block_in_bounds(fh->contents, fh->extents * sizeof(extent))) {
+		found(ctx, fh->currentID, "its chunk map is outside the partition");
+		return;
+	}
+
+	extent *ext = malloc(fh->extents * sizeof(extent));
+	load_extents(fh, 0, fh->extents, ext);
+	char what[48];
+
+	for(uint64_t i = 0; i < fh->extents; i++) {
+		if(ext[i].blk != 0) {
+			snprintf(what, sizeof(what), "its chunk %" PRIu64, i);
+			each(ctx, ext[i].blk, what);
+		}
+	}
+
+	free(ext);
+}
+
+/**
+ * Frees what dedupContents kept in report.
+ */
+void dedupFinish(dedup_report *report) {
+	if(report->seen != NULL) {
+		rangemap_destroy(report->seen);
+		report->seen = NULL;
+	}
+}
+
+/**
+ * Copies up to len bytes starting at off from the file whose header is at id
+ * into buf. Returns the number of bytes read, which is short at the end of
+ * the file, or -1 if id is a directory.
+ */
+int64_t read_file(block_id id, uint64_t off, void *buf, uint64_t len) {
+	uint8_t slot[FH_SLOT_SIZE];
+	fileHeader fh;
+
+	// inline files come back with the header, so they take a single read.
+	bool isInline = load_header_inline(id, &fh, slot);
+
+	if(fh.isDirectory) {
+		return -1;
+	}
+
+	if(off >= fh.size) {
+		return 0;
+	}
+
+	if(len > fh.size - off) {
+		len = fh.size - off;
+	}
+
+	if(isInline) {
+		memcpy(buf, slot + off, len);
+	} else {
+		read_contents(&fh, off, buf, len);
+	}
+
+	return len;
+}
+
+/**
+ * Writes len bytes from buf into the file whose header is at id, starting at
+ * off. Writing past the end grows the file, and any gap before off reads back
+ * as zeros. Returns len, or -1 if id is a directory.
+ */
+int64_t write_file(block_id id, uint64_t off, const void *buf, uint64_t len) {
+	fileHeader fh;
+	load_header(id, &fh);
+
+	if(fh.isDirectory) {
+		return -1;
+	}
+
+	if(len == 0) {
+		return 0;
+	}
+
+	block_id contents = fh.contents;
+	uint64_t extents = fh.extents;
+	bool grew = off + len > fh.size;
+
+	if(grew) {
+		resizeContents(&fh, off + len);
+	}
+
+	if(fh.isSparse) {
+		sparse_write(&fh, off, buf, len);
+	} else {
+		save_block(fh.contents + off, (void*)buf, len);
+	}
+
+	// inline contents are part of the header's checksum.
+	if(grew || fh.isInline || fh.contents != contents || fh.extents != extents) {
+		save_header(&fh);
+	}
+
+	return len;
+}
+
+/**
+ * Zero-copy version of read_file. Returns a pointer to the file's bytes
+ * starting at off and sets *avail to how many of the len requested can be
+ * read through it, which can be fewer than asked for (sparse files are viewed
+ * a chunk at a time), or returns NULL with *avail = 0 at the end of the file.
+ * Also returns NULL if the partition can't be mapped or the bytes are
+ * compressed, in which case *avail is still set and read_file should be used
+ * instead. The pointer is only valid until the next write to the partition.
+ */
+const void *view_file(block_id id, uint64_t off, uint64_t len, uint64_t *avail) {
+	fileHeader fh;
+	load_header_hot(id, &fh);
+
+	*avail = 0;
+	if(fh.isDirectory || off >= fh.size) {
+		return NULL;
+	}
+
+	*avail = len < fh.size - off ? len : fh.size - off;
+
+	if(!fh.isSparse) {
+		return map_block(fh.contents + off, *avail);
+	}
+
+	// a sparse file can only be viewed a chunk, or a hole, at a time.
+	uint64_t from = off % CHUNK_SIZE;
+	if(*avail > CHUNK_SIZE - from) {
+		*avail = CHUNK_SIZE - from;
+	}
+
+	extent e;
+	load_extents(&fh, off / CHUNK_SIZE, 1, &e);
+
+	uint64_t held = e.blk == 0 ? 0 : e.stored;
+	if(from >= held) {
+		return zeros;
+	}
+
+	if(*avail > held - from) {
+		*avail = held - from;
+	}
+
+	// compressed chunks have to be unpacked by read_file.
+	if(e.packed != 0) {
+		return NULL;
+	}
+
+	if(!fh.isChecked || getVerification() == VERIFY_NEVER) {
+		return map_block(e.blk + from, *avail);
+	}
+
+	// the mapping is always of the partition file, so the whole chunk is checked.
+	const uint8_t *bytes = map_block(e.blk, held);
+	if(bytes != NULL) {
+		check_chunk(&e, bytes);
+		bytes += from;
+	}
+
+	return bytes;
+}
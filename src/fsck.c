@@ -0,0 +1,581 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fsck.h"
+#include "partitioner.h"
+#include "fileheader.h"
+#include "fileio.h"
+#include "usage.h"
+
+// directories with more entries than this are split up between threads.
+#define DIR_SLICE 256
+
+// the oldest format fsck can read file headers of, older partitions are
+// converted the first time pr4 opens them.
+#define FSCK_OLDEST_FORMAT 3
+
+typedef struct finding {
+	block_id blk;
+	char *problem;
+} finding;
+
+// A change to a file header or directory entry, made once the partition is
+// mounted again after fsck_repair.
+typedef enum fix_kind {
+	FIX_DROP, // clear entry index of dir.
+	FIX_PARENT, // make dir the parent of the header at id.
+	FIX_SELF // make the header at id say it's at id.
+} fix_kind;
+
+typedef struct fix {
+	fix_kind kind;
+	block_id dir;
+	uint64_t index;
+	block_id id;
+} fix;
+
+// entries [from, from + DIR_SLICE) of the directory whose header is at dir.
+typedef struct work {
+	block_id dir;
+	uint64_t from;
+	struct work *next;
+} work;
+
+typedef struct fsck_run {
+	partition *p;
+	block_table *t;
+	bool gaps; // the walk couldn't find the blocks in some stretch of the partition.
+
+	pthread_mutex_t lock; // guards everything below.
+	pthread_cond_t more; // something was queued, or there's nothing left to do.
+	work *queue;
+	uint64_t pending; // directory slices queued or being checked.
+
+	finding *found;
+	uint64_t numFound;
+	uint64_t capFound;
+
+	fix *fixes;
+	uint64_t numFixes;
+	uint64_t capFixes;
+
+	uint64_t files;
+	uint64_t dirs;
+	bool complete; // every file header reachable from the root could be read.
+
+	// the usage table, NULL if there's none or it couldn't be read, and what
+	// the walk adds up for each slot, with whether a directory had it yet.
+	usage_slot *slots;
+	uint64_t numSlots;
+	dir_usage *sums;
+	uint8_t *seen;
+	bool usageLost; // the usage table isn't an allocated block.
+	bool usageDamaged; // the usage table has to be built again.
+} fsck_run;
+
+// whatever uses blocks, for claim_used.
+typedef struct owner {
+	fsck_run *r;
+	block_id id;
+} owner;
+
+// a scrub_finding for the run, keeping the problem to be written out in
+// block order once everything has been checked.
+static void report(void *ctx, block_id blk, const char *problem) {
+	fsck_run *r = ctx;
+
+	pthread_mutex_lock(&r->lock);
+	if(r->numFound == r->capFound) {
+		r->capFound = r->capFound ? r->capFound * 2 : 64;
+		r->found = realloc(r->found, r->capFound * sizeof(finding));
+	}
+
+	r->found[r->numFound].blk = blk;
+	r->found[r->numFound].problem = strdup(problem);
+	r->numFound++;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void add_fix(fsck_run *r, fix_kind kind, block_id dir, uint64_t index, block_id id) {
+	pthread_mutex_lock(&r->lock);
+	if(r->numFixes == r->capFixes) {
+		r->capFixes = r->capFixes ? r->capFixes * 2 : 64;
+		r->fixes = realloc(r->fixes, r->capFixes * sizeof(fix));
+	}
+
+	r->fixes[r->numFixes++] = (fix){ kind, dir, index, id };
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void incomplete(fsck_run *r) {
+	pthread_mutex_lock(&r->lock);
+	r->complete = false;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void push_work(fsck_run *r, block_id dir, uint64_t from) {
+	work *w = malloc(sizeof(work));
+	w->dir = dir;
+	w->from = from;
+
+	pthread_mutex_lock(&r->lock);
+	w->next = r->queue;
+	r->queue = w;
+	r->pending++;
+	pthread_cond_signal(&r->more);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// passed to contentsBlocks, with an owner.
+static void owner_found(void *ctx, block_id blk, const char *problem) {
+	owner *o = ctx;
+	report(o->r, blk, problem);
+}
+
+// passed to contentsBlocks, with an owner.
+static void claim_used(void *ctx, block_id blk, const char *what) {
+	owner *o = ctx;
+	char problem[128];
+
+	// shared chunks are claimed once for every file sharing them, fsck_finish
+	// checks that against the share table.
+	if(!block_in_bounds(blk, 0) || fsck_claim(o->r->t, blk) == 0) {
+		snprintf(problem, sizeof(problem), "the file at %" PRIu64 " has it as %s, but it isn't an allocated block", o->id, what);
+		report(o->r, blk, problem);
+	}
+}
+
+static void usage_damaged(fsck_run *r) {
+	pthread_mutex_lock(&r->lock);
+	r->usageDamaged = true;
+	pthread_mutex_unlock(&r->lock);
+}
+
+// adds what the object fh, in the directory with slot parent, adds to that
+// directory's usage, checking a directory's own slot on the way.
+static void count_usage(fsck_run *r, fileHeader *fh, uint64_t parent) {
+	if(r->slots == NULL) {
+		return;
+	}
+
+	uint64_t add[3] = { fh->size, 1, 0 };
+
+	if(fh->isDirectory) {
+		uint64_t slot = fh->extents;
+
+		if(slot == 0 || slot >= r->numSlots || r->slots[slot].dir != fh->currentID
+				|| r->slots[slot].parent != parent || __atomic_exchange_n(&r->seen[slot], 1, __ATOMIC_RELAXED) != 0) {
+			report(r, fh->currentID, "its slot in the usage table is wrong");
+			usage_damaged(r);
+			return;
+		}
+
+		dir_usage *u = &r->slots[slot].usage;
+		add[0] = u->bytes;
+		add[1] = u->files;
+		add[2] = u->dirs + 1;
+	}
+
+	// the root is in no directory, and a directory with a bad slot was reported already.
+	if(parent == 0 || parent >= r->numSlots) {
+		return;
+	}
+
+	__atomic_add_fetch(&r->sums[parent].bytes, add[0], __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->sums[parent].files, add[1], __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->sums[parent].dirs, add[2], __ATOMIC_RELAXED);
+}
+
+// checks the header at id, which dir (0 for the root) lists and which was
+// just claimed for it, claims what it uses and queues a directory to be
+// gone through. slot is dir's slot in the usage table.
+static void check_object(fsck_run *r, block_id dir, uint64_t slot, block_id id) {
+	char problem[128];
+
+	if(!header_intact(id)) {
+		report(r, id, "its file header is damaged");
+		incomplete(r);
+		return;
+	}
+
+	fileHeader fh;
+	load_header(id, &fh);
+
+	if(fh.currentID != id) {
+		snprintf(problem, sizeof(problem), "its file header says it's at %" PRIu64, fh.currentID);
+		report(r, id, problem);
+		add_fix(r, FIX_SELF, dir, 0, id);
+		fh.currentID = id;
+	}
+
+	if(fh.parent != dir) {
+		snprintf(problem, sizeof(problem), "its file header says it's in directory %" PRIu64 ", but it's listed in %" PRIu64, fh.parent, dir);
+		report(r, id, problem);
+		add_fix(r, FIX_PARENT, dir, 0, id);
+	}
+
+	owner o = { r, id };
+	contentsBlocks(&fh, claim_used, owner_found, &o);
+	count_usage(r, &fh, slot);
+
+	if(!fh.isDirectory) {
+		__atomic_add_fetch(&r->files, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&r->dirs, 1, __ATOMIC_RELAXED);
+
+	if(!block_in_bounds(fh.contents, fh.size)) {
+		report(r, id, "its entries are outside the partition");
+		incomplete(r);
+		return;
+	}
+
+	if(fh.size > 0) {
+		push_work(r, id, 0);
+	}
+}
+
+// checks entry id of the directory at dir, whose slot in the usage table is
+// slot. Returns false if it should be dropped from dir.
+static bool check_entry(fsck_run *r, block_id dir, uint64_t slot, block_id id) {
+	char problem[128];
+	uint32_t claims = block_in_bounds(id, FH_SLOT_SIZE) ? fsck_claim(r->t, id) : 0;
+
+	if(claims == 0) {
+		snprintf(problem, sizeof(problem), "directory %" PRIu64 " lists it, but it isn't an allocated block", dir);
+		report(r, id, problem);
+
+		// it may be in a stretch the walk couldn't get through.
+		if(r->gaps && block_in_bounds(id, FH_SLOT_SIZE)) {
+			incomplete(r);
+			return true;
+		}
+		return false;
+	}
+
+	if(claims > 1) {
+		snprintf(problem, sizeof(problem), "directory %" PRIu64 " lists it, but it's listed somewhere else too", dir);
+		report(r, id, problem);
+		fsck_unclaim(r->t, id);
+		return false;
+	}
+
+	check_object(r, dir, slot, id);
+	return true;
+}
+
+// checks one slice of a directory's entries, queueing the rest.
+static void check_slice(fsck_run *r, work *w) {
+	fileHeader dir;
+	load_header(w->dir, &dir);
+
+	uint64_t count = dir.size / sizeof(block_id);
+	uint64_t to = w->from + DIR_SLICE < count ? w->from + DIR_SLICE : count;
+
+	if(to < count) {
+		push_work(r, w->dir, to);
+	}
+
+	block_id *child = malloc((to - w->from) * sizeof(block_id) + 1);
+	load_block(dir.contents + w->from * sizeof(block_id), child, (to - w->from) * sizeof(block_id));
+
+	for(uint64_t i = w->from; i < to; i++) {
+		block_id id = child[i - w->from];
+
+		if(id != 0 && !check_entry(r, w->dir, dir.extents, id)) {
+			add_fix(r, FIX_DROP, w->dir, i, id);
+		}
+	}
+
+	free(child);
+}
+
+static void *tree_thread(void *arg) {
+	fsck_run *r = arg;
+	use_partition(r->p);
+
+	pthread_mutex_lock(&r->lock);
+	while(true) {
+		while(r->queue == NULL && r->pending > 0) {
+			pthread_cond_wait(&r->more, &r->lock);
+		}
+
+		if(r->queue == NULL) {
+			break;
+		}
+
+		work *w = r->queue;
+		r->queue = w->next;
+		pthread_mutex_unlock(&r->lock);
+
+		check_slice(r, w);
+		free(w);
+
+		pthread_mutex_lock(&r->lock);
+		if(--r->pending == 0) {
+			pthread_cond_broadcast(&r->more);
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+// claims and reads the usage table, if there is one, for the walk to check
+// against.
+static void read_usage(fsck_run *r) {
+	block_id table = getUsageTableID();
+
+	if(table == 0) {
+		return;
+	}
+
+	if(!block_in_bounds(table, 0) || fsck_claim(r->t, table) == 0) {
+		report(r, table, "the usage table should be here, but it isn't an allocated block");
+		r->usageLost = true;
+		r->usageDamaged = true;
+		return;
+	}
+
+	r->slots = usage_read_all(&r->numSlots);
+
+	if(r->slots == NULL) {
+		report(r, table, "the usage table is damaged");
+		r->usageDamaged = true;
+		return;
+	}
+
+	r->sums = calloc(r->numSlots, sizeof(dir_usage));
+	r->seen = calloc(r->numSlots, 1);
+}
+
+// checks that every directory's usage adds up to what's in it, and that
+// every slot in use belongs to a directory, once the walk got through the
+// whole tree.
+static void check_usage(fsck_run *r) {
+	if(r->slots == NULL || !r->complete) {
+		return;
+	}
+
+	for(uint64_t i = 1; i < r->numSlots; i++) {
+		usage_slot *s = &r->slots[i];
+
+		if(s->dir == 0) {
+			continue;
+		}
+
+		if(!r->seen[i]) {
+			report(r, getUsageTableID(), "the usage table has a slot for a directory that isn't in the tree");
+			r->usageDamaged = true;
+		} else if(memcmp(&s->usage, &r->sums[i], sizeof(dir_usage)) != 0) {
+			report(r, s->dir, "its usage in the usage table doesn't add up to what's in it");
+			r->usageDamaged = true;
+		}
+	}
+}
+
+// checks the root, then everything below it with threads threads.
+static void check_tree(fsck_run *r, int threads) {
+	block_id root = getRootID();
+
+	// a partition that was never given a root directory has no files.
+	if(root == 0) {
+		return;
+	}
+
+	read_usage(r);
+
+	if(!block_in_bounds(root, FH_SLOT_SIZE) || fsck_claim(r->t, root) == 0) {
+		report(r, root, "the root directory should be here, but it isn't an allocated block");
+		r->complete = false;
+		return;
+	}
+
+	fileHeader fh;
+	if(header_intact(root)) {
+		load_header(root, &fh);
+
+		if(!fh.isDirectory) {
+			report(r, root, "the root directory should be here, but it's a file");
+			r->complete = false;
+			return;
+		}
+	}
+
+	check_object(r, 0, 0, root);
+
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+
+	for(int i = 0; i < threads; i++) {
+		pthread_create(&tids[i], NULL, tree_thread, r);
+	}
+
+	for(int i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	free(tids);
+
+	check_usage(r);
+}
+
+static int by_block(const void *a, const void *b) {
+	const finding *x = a, *y = b;
+
+	if(x->blk != y->blk) {
+		return x->blk < y->blk ? -1 : 1;
+	}
+	return strcmp(x->problem, y->problem);
+}
+
+// writes the problems found from the from'th on, in block order.
+static void print_found(fsck_run *r, uint64_t from, FILE *out) {
+	qsort(r->found + from, r->numFound - from, sizeof(finding), by_block);
+
+	for(uint64_t i = from; i < r->numFound; i++) {
+		fprintf(out, "block %" PRIu64 ": %s\n", r->found[i].blk, r->found[i].problem);
+	}
+}
+
+// makes the changes to file headers and directory entries the tree walk
+// decided on, once the partition has been mounted again, and builds the
+// usage table again if they or the walk call for it.
+static void apply_fixes(fsck_run *r) {
+	begin_transaction();
+
+	// fsck_repair took back whatever wasn't an allocated block.
+	if(r->usageLost) {
+		saveUsageTableID(0);
+	}
+
+	for(uint64_t i = 0; i < r->numFixes; i++) {
+		fix *f = &r->fixes[i];
+		fileHeader fh;
+
+		switch(f->kind) {
+			case FIX_DROP: {
+				block_id none = 0;
+				load_header(f->dir, &fh);
+				save_block(fh.contents + f->index * sizeof(block_id), &none, sizeof(block_id));
+				break;
+			}
+			case FIX_PARENT:
+				load_header(f->id, &fh);
+				fh.parent = f->dir;
+				save_header(&fh);
+				break;
+			case FIX_SELF:
+				load_header(f->id, &fh);
+				if(fh.isInline) {
+					fh.contents = f->id + header_inline_offset(&fh);
+				}
+				fh.currentID = f->id;
+				save_header(&fh);
+				break;
+		}
+	}
+
+	if(r->usageDamaged || (getUsageTableID() != 0 && r->numFixes > 0)) {
+		usage_rebuild();
+	}
+
+	end_transaction();
+}
+
+static double seconds_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Checks the partition in filename from scratch, with threads threads: every
+ * block from the start of the partition to its end, the free and allocated
+ * lists, the partition's own tables, and every file and directory reachable
+ * from the root, which has to be listed once, in the directory its header
+ * says it's in, account for every allocated block along with the tables,
+ * and add up to what the usage table says each directory holds. Writes a line for every problem to out, followed by a summary.
+ * With repair, fixes what can be fixed and checks the partition again.
+ * Returns one of the FSCK_ results.
+ */
+int fsck_partition(char *filename, int threads, bool repair, FILE *out) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	partition *p = fsck_open(filename);
+	if(p == NULL) {
+		return FSCK_UNCHECKED;
+	}
+
+	use_partition(p);
+
+	if(getFormatVersion() < FSCK_OLDEST_FORMAT) {
+		fprintf(out, "%s is from an older version, open it with pr4 once to convert it before checking it.\n", filename);
+		close_partition(p);
+		use_partition(NULL);
+		return FSCK_UNCHECKED;
+	}
+
+	fsck_run r = { 0 };
+	r.p = p;
+	r.complete = true;
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.more, NULL);
+
+	r.t = fsck_blocks(threads, report, &r);
+
+	uint64_t allocated, unused, gaps;
+	fsck_counts(r.t, &allocated, &unused, &gaps);
+	r.gaps = gaps > 0;
+
+	check_tree(&r, threads);
+	fsck_finish(r.t, r.complete, report, &r);
+
+	print_found(&r, 0, out);
+
+	fprintf(out, "%s: %" PRIu64 " blocks in use, %" PRIu64 " free, %" PRIu64 " files, %" PRIu64 " directories, %" PRIu64 " problems, %.3fs\n",
+		filename, allocated, unused, r.files, r.dirs, r.numFound, seconds_since(&start));
+
+	int result = r.numFound == 0 ? FSCK_CLEAN : FSCK_PROBLEMS;
+	bool repaired = false;
+
+	if(repair && r.numFound > 0) {
+		uint64_t before = r.numFound;
+		repaired = fsck_repair(r.t);
+
+		// whatever it couldn't repair.
+		print_found(&r, before, out);
+
+		if(repaired) {
+			fsck_mount();
+			apply_fixes(&r);
+		}
+	}
+
+	fsck_free(r.t);
+	for(uint64_t i = 0; i < r.numFound; i++) {
+		free(r.found[i].problem);
+	}
+	free(r.found);
+	free(r.fixes);
+	free(r.slots);
+	free(r.sums);
+	free(r.seen);
+	pthread_cond_destroy(&r.more);
+	pthread_mutex_destroy(&r.lock);
+
+	close_partition(p);
+	use_partition(NULL);
+
+	if(repaired) {
+		fprintf(out, "repaired, checking again\n");
+		result = fsck_partition(filename, threads, false, out) == FSCK_CLEAN ? FSCK_REPAIRED : FSCK_PROBLEMS;
+	}
+
+	return result;
+}
@@ -0,0 +1,38 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stdio.h>
+
+/**
+ * A list of lines to run, each of which may have to wait for some of the
+ * lines before it. Lines that don't wait on each other run at the same time
+ * on a pool of threads, but whatever each one prints is held back and written
+ * out in the order the lines were added, so the output is the same as running
+ * them one after the other.
+ */
+typedef struct batch batch;
+
+/**
+ * Returns a new, empty batch.
+ */
+batch *batch_create();
+
+/**
+ * Adds a line to the end of the batch, to be run in ctx. Returns its number;
+ * lines are numbered from 0 in the order they're added.
+ */
+int batch_add(batch *b, char *line, void *ctx);
+
+/**
+ * Makes line job wait until line on has finished. on must have been added
+ * before job. Does nothing if on is negative.
+ */
+void batch_depend(batch *b, int job, int on);
+
+/**
+ * Runs every line of the batch on workers threads, calling run(ctx, line, out)
+ * for each, and writes what they printed to dest in order. Frees the batch.
+ */
+void batch_run(batch *b, int workers, void (*run)(void *ctx, char *line, FILE *out), FILE *dest);
+
+#endif /* __BATCH_H */
@@ -0,0 +1,22 @@
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C (the Castagnoli polynomial) of numBytes bytes at data, continuing
+ * from crc, which is 0 to start with. The checksum of a run of bytes is the
+ * same whether it's computed in one call or several in a row. Uses the SSE4.2
+ * crc32 instruction when the processor has it, and slice-by-8 tables when it
+ * doesn't.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t numBytes);
+
+/**
+ * Whether crc32c has the SSE4.2 instruction to work with.
+ */
+bool crc32c_hardware();
+
+#endif /* __CRC32C_H */
@@ -0,0 +1,84 @@
+#ifndef __DIRCACHE_H
+#define __DIRCACHE_H
+
+#include "fileheader.h"
+
+/**
+ * An in-memory copy of a directory's entries, keyed by the block id of the
+ * directory's header. Lookups read the cached copy without taking any locks.
+ * Commands that change a directory hold its write lock while they change it
+ * on the partition, then publish a new copy; copies replaced this way are
+ * only freed once no lookup can still be reading them.
+ */
+
+/**
+ * One entry of a cached directory.
+ */
+typedef struct dir_entry {
+	block_id id; // the child's header.
+	bool isDirectory;
+	char name[MAX_FILENAME+1];
+} dir_entry;
+
+/**
+ * A directory as it was when it was published. Never changes once published.
+ */
+typedef struct dir_version {
+	block_id id;
+	block_id parent;
+	uint64_t count;
+	dir_entry entries[];
+} dir_version;
+
+/**
+ * Starts a lookup. Anything returned by dcache_get stays valid until the
+ * matching dcache_exit. Lookups can't be nested.
+ */
+void dcache_enter();
+
+/**
+ * Ends a lookup started with dcache_enter.
+ */
+void dcache_exit();
+
+/**
+ * Returns the current copy of the directory whose header is at dir, reading
+ * it from the partition the first time. Must be called inside a lookup.
+ */
+const dir_version *dcache_get(block_id dir);
+
+/**
+ * Looks name up in the directory whose header is at dir, returning the
+ * child's header id or 0 if there is no directory (or file, depending on
+ * isDirectory) by that name. Takes care of entering and exiting a lookup.
+ * A thread viewing a snapshot reads the directory itself instead.
+ */
+block_id dcache_lookup(block_id dir, char *name, bool isDirectory);
+
+/**
+ * Serializes commands that change the directory whose header is at dir, or
+ * its own header. Lookups never wait on it, and commands changing other
+ * directories don't either. A command that needs a directory and one of its
+ * children locked takes the parent's lock first.
+ */
+void dcache_write_lock(block_id dir);
+
+/**
+ * Releases the lock taken by dcache_write_lock.
+ */
+void dcache_write_unlock(block_id dir);
+
+/**
+ * Reads the directory whose header is at dir back from the partition and
+ * makes it the copy lookups see. Call it with the directory's write lock
+ * held, after every change to its entries or to the names of its children.
+ */
+void dcache_publish(block_id dir);
+
+/**
+ * Drops the cached copy of a directory that has been deleted, with its
+ * parent's write lock held.
+ */
+void dcache_forget(block_id dir);
+
+#endif /* __DIRCACHE_H */
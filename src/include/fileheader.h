@@ -0,0 +1,92 @@
+#ifndef __FILEHEADER_H
+#define __FILEHEADER_H
+
+#include "partitioner.h"
+
+#define MAX_FILENAME 128
+
+// Bytes set aside for a header at the start of its block. This is the size
+// the old raw header happened to have, so converted partitions keep their layout.
+#define FH_SLOT_SIZE 176
+
+/**
+ * The in-memory form of a file header. It is never written to the partition
+ * as is, load_header and save_header translate to and from the on-disk format.
+ */
+typedef struct fileHeader
+{
+  bool isDirectory;
+  bool isInline; // contents live in the header's slot, see header_inline_capacity.
+  bool isSparse; // contents is a map of chunks, see fileio.h.
+  bool isChecked; // the map's entries have checksums of the chunks, see fileio.h.
+  uint64_t extents; // entries in use in a sparse file's map.
+  block_id parent;
+  block_id currentID;
+  block_id contents;
+  block_size_t size;
+  uint8_t nameLength;
+  char name[MAX_FILENAME+1];   // max filename size is 128 characters
+} fileHeader;
+
+/**
+ * Reads the whole header stored at id, name included.
+ */
+void load_header(block_id id, fileHeader *fh);
+
+/**
+ * Reads the whole header stored at id like load_header. If the file is inline,
+ * its contents come from the same read and are copied into data, which must
+ * have room for FH_SLOT_SIZE bytes. Returns true if it was inline.
+ */
+bool load_header_inline(block_id id, fileHeader *fh, void *data);
+
+/**
+ * Reads only the fixed 64 byte part of the header stored at id. Names
+ * longer than 16 characters are cut short, use header_name_is to compare them.
+ */
+void load_header_hot(block_id id, fileHeader *fh);
+
+/**
+ * Returns whether there's an intact file header at id: one inside the partition
+ * that's what save_header writes and matches its checksum, if it has one.
+ * For scrubbing and fsck, which report damage instead of exiting on it.
+ */
+bool header_intact(block_id id);
+
+/**
+ * Returns true if the header (loaded with either function above) is named name.
+ * Only reads the rest of the name from the partition when the first part matches.
+ */
+bool header_name_is(fileHeader *fh, char *name);
+
+/**
+ * Writes the header to its block, fh->currentID. An inline file's contents
+ * are checksummed along with the header, so they must be saved first, and
+ * the header saved again whenever they change.
+ */
+void save_header(fileHeader *fh);
+
+/**
+ * Bytes of file contents that fit in the unused part of the header's slot,
+ * after the fixed part and the rest of the name. Files this small are stored
+ * there instead of getting contents of their own.
+ */
+block_size_t header_inline_capacity(fileHeader *fh);
+
+/**
+ * Where inline contents start, as an offset from the header's block id.
+ */
+block_size_t header_inline_offset(fileHeader *fh);
+
+/**
+ * Rewrites every header reachable from the root directory from the raw
+ * format used by older partitions to the current one, if needed, and marks
+ * the partition as being in the current format. File headers from before
+ * checksums get theirs the next time they're saved. Call it once the
+ * partition is open, which converts partitions from before the descriptor
+ * grew first: the ids their headers hold are translated to where that moved
+ * the blocks, see relocated_id.
+ */
+void upgrade_headers();
+
+#endif /* __FILEHEADER_H */
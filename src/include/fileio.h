@@ -0,0 +1,118 @@
+#ifndef __FILEIO_H
+#define __FILEIO_H
+
+#include "fileheader.h"
+
+/**
+ * Files too big to be inline are sparse: their contents is a map with an
+ * entry for every CHUNK_SIZE bytes of the file, and a chunk is only allocated
+ * once something is written to it. Holes read back as zeros, so creating or
+ * growing a file costs nothing until it is written.
+ */
+#define CHUNK_SIZE 4096
+
+/**
+ * What dedupContents found, added up over the files it was given.
+ */
+typedef struct dedup_report {
+	uint64_t chunks; // chunks looked at.
+	uint64_t merged; // chunks found to be the same as another, and shared with it.
+	uint64_t logical; // bytes held in chunks, once for every file holding them.
+	uint64_t physical; // bytes held in distinct chunks.
+	struct rangemap *seen; // the chunks counted in physical, NULL to start with.
+} dedup_report;
+
+/**
+ * Allocates the header and fh->size bytes of contents for a new file or
+ * directory near hint, filling in currentID and contents. The name must be
+ * set already, since it decides how much room is left for inline contents,
+ * and so must the parent, whose usage the new object is counted in.
+ */
+void allocateObject(fileHeader *fh, block_id hint);
+
+/**
+ * Allocates a new file fh near hint as a copy of the file src, like
+ * allocateObject. Only src's chunk map is copied: the copy shares every chunk
+ * src has written, and whichever file writes to a shared chunk first moves
+ * to a copy of it. Inline files, and contiguous ones from older versions,
+ * are copied outright. The name must be set already, the caller saves the
+ * header afterwards.
+ */
+void cloneObject(fileHeader *src, fileHeader *fh, block_id hint);
+
+/**
+ * Changes the size of fh's contents, the caller saves the header afterwards.
+ * Headers never move, so the parent's entry and the children's parent ids stay
+ * valid; contents that shared a block with the header get a block of their own.
+ * Files moving across the inline threshold are moved in or out of the header.
+ * Whatever the contents grow by reads as zeros.
+ */
+void resizeContents(fileHeader *fh, block_size_t size);
+
+/**
+ * Renames fh, which must be fully loaded, and saves it. Inline contents sit
+ * right after the name, so they have to move along with a name change.
+ */
+void renameHeader(fileHeader *fh, char *newName);
+
+/**
+ * Frees the header and contents of fh.
+ */
+void freeObject(fileHeader *fh);
+
+/**
+ * Deduplicates fh's chunks against the rest of the partition, see
+ * dedup_block: a chunk holding the same bytes as one in the dedup index is
+ * swapped for it, and any other is added to the index. Adds what it finds to
+ * report. Only sparse files have chunks, the rest are left alone.
+ */
+void dedupContents(fileHeader *fh, dedup_report *report);
+
+/**
+ * Frees what dedupContents kept in report.
+ */
+void dedupFinish(dedup_report *report);
+
+/**
+ * Checks every chunk of fh against its checksum, or for maps from before
+ * checksums, that its compressed chunks still decompress. Problems are passed
+ * to found rather than exiting. Adds the chunks checked to *chunks and
+ * returns the bytes read. The caller keeps fh from changing meanwhile.
+ */
+uint64_t scrubContents(fileHeader *fh, scrub_finding found, void *ctx, uint64_t *chunks);
+
+/**
+ * Passes every block fh's contents take up outside of its header's block to
+ * each, saying what the block is to fh: the contents of a directory or of a
+ * contiguous file, or a sparse file's chunk map or one of its chunks. Holes
+ * are skipped. A chunk map outside the partition is passed to found instead
+ * of being read. The caller keeps fh from changing meanwhile.
+ */
+void contentsBlocks(fileHeader *fh, scrub_finding each, scrub_finding found, void *ctx);
+
+/**
+ * Copies up to len bytes starting at off from the file whose header is at id
+ * into buf. Returns the number of bytes read, which is short at the end of
+ * the file, or -1 if id is a directory.
+ */
+int64_t read_file(block_id id, uint64_t off, void *buf, uint64_t len);
+
+/**
+ * Writes len bytes from buf into the file whose header is at id, starting at
+ * off. Writing past the end grows the file, and any gap before off reads back
+ * as zeros. Returns len, or -1 if id is a directory.
+ */
+int64_t write_file(block_id id, uint64_t off, const void *buf, uint64_t len);
+
+/**
+ * Zero-copy version of read_file. Returns a pointer to the file's bytes
+ * starting at off and sets *avail to how many of the len requested can be
+ * read through it, which can be fewer than asked for (sparse files are viewed
+ * a chunk at a time), or returns NULL with *avail = 0 at the end of the file.
+ * Also returns NULL if the partition can't be mapped or the bytes are
+ * compressed, in which case *avail is still set and read_file should be used
+ * instead. The pointer is only valid until the next write to the partition.
+ */
+const void *view_file(block_id id, uint64_t off, uint64_t len, uint64_t *avail);
+
+#endif /* __FILEIO_H */
@@ -0,0 +1,29 @@
+#ifndef __FSCK_H
+#define __FSCK_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * What fsck_partition returns: the partition was fine, everything wrong with
+ * it was repaired, some of what's wrong was left as it is, or it couldn't be
+ * checked at all. Nothing else may have the partition open meanwhile.
+ */
+#define FSCK_CLEAN 0
+#define FSCK_REPAIRED 1
+#define FSCK_PROBLEMS 4
+#define FSCK_UNCHECKED 8
+
+/**
+ * Checks the partition in filename from scratch, with threads threads: every
+ * block from the start of the partition to its end, the free and allocated
+ * lists, the partition's own tables, and every file and directory reachable
+ * from the root, which has to be listed once, in the directory its header
+ * says it's in, account for every allocated block along with the tables,
+ * and add up to what the usage table says each directory holds. Writes a line for every problem to out, followed by a summary.
+ * With repair, fixes what can be fixed and checks the partition again.
+ * Returns one of the FSCK_ results.
+ */
+int fsck_partition(char *filename, int threads, bool repair, FILE *out);
+
+#endif /* __FSCK_H */
@@ -0,0 +1,142 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A write-ahead log kept next to a partition file. Writes to the partition
+ * go to the log instead of their place in the file: each one is added to the
+ * running transaction and to an in-memory copy of the pages it touches, which
+ * reads consult first. A background thread commits the running transaction
+ * a few milliseconds after its first write, appending it to the log as one
+ * record and syncing the log once for every command in it, and only then
+ * writes it to its place in the partition file. Once the log has grown large
+ * (or the partition has gone quiet) the partition file is synced and the log
+ * starts over. Opening a partition replays whatever committed transactions
+ * its log still holds, so after a crash either all of a transaction's writes
+ * are there or none are.
+ */
+typedef struct journal journal;
+
+/**
+ * How hard the journal tries to keep what's been written. With
+ * DURABILITY_NONE transactions are written to the log in the background and
+ * nothing is synced unless asked to, so a crash of the host (but not of the
+ * program, once a transaction is in the log) can lose them. DURABILITY_FLUSH
+ * also has every transaction written to the log before its command returns,
+ * without syncing it. DURABILITY_PERIODIC syncs the log with every commit,
+ * committing every intervalMs milliseconds or once ops transactions have
+ * ended, whichever comes first; commands don't wait for it. DURABILITY_FSYNC
+ * has every command wait until its transaction is synced, sharing the sync
+ * with whatever commands ended around the same time.
+ */
+typedef enum durability_mode {
+	DURABILITY_NONE = 0,
+	DURABILITY_FLUSH = 1,
+	DURABILITY_PERIODIC = 2,
+	DURABILITY_FSYNC = 3
+} durability_mode;
+
+typedef struct durability_policy {
+	durability_mode mode;
+	uint64_t intervalMs; // used by DURABILITY_PERIODIC.
+	uint64_t ops; // used by DURABILITY_PERIODIC, 0 for no limit.
+} durability_policy;
+
+/**
+ * What the journal has done since it was opened, to see what a durability
+ * mode costs.
+ */
+typedef struct journal_stats {
+	uint64_t transactions; // that have ended.
+	uint64_t commits;
+	uint64_t syncs; // of the log.
+	uint64_t syncNs; // spent syncing the log.
+	uint64_t waits; // for a commit, by journal_flush or journal_sync.
+	uint64_t waitNs; // spent in them.
+} journal_stats;
+
+/**
+ * Opens the log at path for the partition file open as fd, starting it over
+ * if fresh is set (the partition file was just created) and otherwise
+ * replaying whatever it holds into the partition file first.
+ */
+journal *journal_open(char *path, int fd, bool fresh);
+
+/**
+ * Commits everything written so far, writes it to the partition file, syncs
+ * it and removes the log. Ends the calling thread's transaction if it has
+ * one; no other thread may still be in one.
+ */
+void journal_close(journal *j);
+
+/**
+ * Starts a transaction for the calling thread: everything it writes until
+ * journal_stop is committed together. Transactions nest, only the outermost
+ * pair counts. Must not be called while holding locks another transaction
+ * may wait on, since it waits for the transaction being committed to finish.
+ */
+void journal_start(journal *j);
+
+/**
+ * Ends the calling thread's transaction. Returns whether it was the outermost
+ * one, so the transaction is really over.
+ */
+bool journal_stop(journal *j);
+
+/**
+ * Logs numBytes bytes of data to be written at offset in the partition file.
+ * Writes made outside a transaction are committed with whatever is running.
+ */
+void journal_write(journal *j, uint64_t offset, const void *data, uint64_t numBytes);
+
+/**
+ * Fills data with numBytes bytes at offset as the partition currently has
+ * them, if any of them haven't made it to the partition file yet. Returns
+ * false without touching data otherwise, in which case the file is current.
+ */
+bool journal_read(journal *j, uint64_t offset, void *data, uint64_t numBytes);
+
+/**
+ * Whether any of numBytes bytes at offset haven't made it to the partition
+ * file yet.
+ */
+bool journal_pending(journal *j, uint64_t offset, uint64_t numBytes);
+
+/**
+ * Hands numBytes bytes at offset back to the host filesystem once the
+ * running transaction has been committed, ahead of any later writes there.
+ */
+void journal_punch(journal *j, uint64_t offset, uint64_t numBytes);
+
+/**
+ * Commits everything written so far and waits until it's in the log on
+ * stable storage. Ends and restarts the calling thread's transaction if it
+ * has one, so it's committed too.
+ */
+void journal_sync(journal *j);
+
+/**
+ * Like journal_sync, but only waits until everything is written to the log,
+ * not until it's on stable storage.
+ */
+void journal_flush(journal *j);
+
+/**
+ * Changes when the journal commits and syncs, see durability_mode. Starts out
+ * as DURABILITY_PERIODIC every 5 milliseconds.
+ */
+void journal_set_policy(journal *j, durability_policy policy);
+
+/**
+ * Retrieves the journal's durability policy.
+ */
+durability_policy journal_get_policy(journal *j);
+
+/**
+ * Retrieves what the journal has done so far.
+ */
+journal_stats journal_get_stats(journal *j);
+
+#endif /* __JOURNAL_H */
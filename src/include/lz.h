@@ -0,0 +1,29 @@
+#ifndef __LZ_H
+#define __LZ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A small LZ77 codec in the style of LZ4, for compressing file chunks. The
+ * compressed form is a series of sequences, each a token byte (the number of
+ * literals in its top four bits, the match length less four in the bottom
+ * four, 15 meaning more length bytes follow), the literals, and a two byte
+ * offset back to where the match starts. The last sequence has no match.
+ * Fast rather than thorough: it only looks for matches through a table of
+ * where each hash of four bytes was last seen.
+ */
+
+/**
+ * Compresses len bytes of src into dst, which has room for cap bytes.
+ * Returns the compressed size, or 0 if it would take more than cap bytes.
+ */
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap);
+
+/**
+ * Decompresses the len bytes at src, which must come out as exactly out
+ * bytes, into dst. Returns false if src isn't something lz_compress made.
+ */
+bool lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out);
+
+#endif /* __LZ_H */
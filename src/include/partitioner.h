@@ -8,9 +8,145 @@
 
 #include <stdlib.h>
 
+#include "journal.h"
+
 typedef uint64_t block_id;
 typedef uint64_t block_size_t;
 
+/**
+ * How a partition arranges its blocks. In the mixed layout headers, directory
+ * entries and file contents are allocated wherever they fit. The split layout
+ * keeps headers and directory entries in a metadata zone at the start of the
+ * partition and file contents in the data zone after it, so metadata-only
+ * scans stay dense.
+ */
+typedef enum partition_layout {
+	LAYOUT_MIXED = 0,
+	LAYOUT_SPLIT = 1
+} partition_layout;
+
+/**
+ * What happens to the host file's storage under free blocks. With PUNCH_OFF
+ * freed space stays allocated in the host file. PUNCH_IMMEDIATE hands the
+ * interior of every large free block back to the host filesystem as soon as
+ * it is freed, PUNCH_DEFERRED does the same in batches once enough has been
+ * freed, trading a little host disk space for far fewer system calls.
+ */
+typedef enum punch_mode {
+	PUNCH_OFF = 0,
+	PUNCH_IMMEDIATE = 1,
+	PUNCH_DEFERRED = 2
+} punch_mode;
+
+/**
+ * When checksums are checked. Block headers, file headers and file chunks
+ * carry CRC32C checksums. VERIFY_ALWAYS checks them every time they're read.
+ * VERIFY_FILL only checks what's read from the partition file, not what
+ * comes out of the journal's pages, which this program wrote itself and
+ * which haven't been to the disk yet. VERIFY_NEVER doesn't check them at
+ * all, though they're still kept up to date.
+ */
+typedef enum verify_mode {
+	VERIFY_ALWAYS = 0,
+	VERIFY_FILL = 1,
+	VERIFY_NEVER = 2
+} verify_mode;
+
+/**
+ * What exportLayout writes: one JSON object, or CSV tables separated by blank
+ * lines, each with a line of column names.
+ */
+typedef enum export_format {
+	EXPORT_JSON = 0,
+	EXPORT_CSV = 1
+} export_format;
+
+/**
+ * How the partition grows when an allocation doesn't fit. GROW_OFF fails the
+ * allocation as before, GROW_FIXED adds increment bytes at a time and
+ * GROW_DOUBLE doubles the partition. Either way the partition grows by at
+ * least enough for the request, and never past limit bytes (0 for no limit).
+ */
+typedef enum growth_mode {
+	GROW_OFF = 0,
+	GROW_FIXED = 1,
+	GROW_DOUBLE = 2
+} growth_mode;
+
+typedef struct growth_policy {
+	growth_mode mode;
+	block_size_t increment; // used by GROW_FIXED.
+	block_size_t limit;
+} growth_policy;
+
+// the longest a snapshot's name can be.
+#define SNAPSHOT_NAME_MAX 63
+
+/**
+ * How big the dedup index is, see dedup_block.
+ */
+typedef struct dedup_stats {
+	uint64_t entries; // blocks in the index.
+	uint64_t memory; // bytes the index takes up in memory.
+	uint64_t hits; // duplicates found since the partition was opened.
+} dedup_stats;
+
+// how many size classes free blocks are counted in, see space_stats.
+#define FREE_CLASSES 24
+
+/**
+ * How the partition's space is used, kept up to date as blocks are allocated
+ * and freed so it never takes a walk over the lists. Sizes include block
+ * headers. Blocks whose free is still queued are on neither list, and are
+ * counted in queued. classes[i] counts the free blocks of at least 32 << i
+ * bytes and less than twice that, except that the first class also has
+ * anything smaller and the last anything bigger.
+ */
+typedef struct space_stats {
+	block_size_t size; // the partition's size.
+	block_size_t allocatedBytes;
+	uint64_t allocatedBlocks;
+	block_size_t freeBytes;
+	uint64_t freeBlocks;
+	block_size_t queuedBytes;
+	block_size_t largestFree; // the biggest free block, 0 if there is none.
+	uint64_t classes[FREE_CLASSES];
+} space_stats;
+
+/**
+ * A snapshot of a partition, see create_snapshot.
+ */
+typedef struct snapshot_info {
+	uint64_t id;
+	char name[SNAPSHOT_NAME_MAX + 1];
+	block_id root; // the root directory as it was when it was taken.
+	uint64_t created; // seconds since the epoch.
+	block_size_t kept; // bytes kept for it as the partition changed since.
+} snapshot_info;
+
+/**
+ * An open partition. Every function below acts on the calling thread's
+ * current partition, which is the one opened by initialize unless the thread
+ * picked another with use_partition.
+ *
+ * Any number of threads can use a partition at once. Allocating and freeing
+ * only lock the part of the free list they change, so threads working in
+ * different allocation groups don't wait on each other; growing the partition
+ * stops everything briefly. Reading and writing block contents takes no locks,
+ * it's up to the caller not to have two threads change the same block.
+ *
+ * Each thread allocates from an arena with a home slice of the partition, and
+ * blocks freed in another arena's slice are queued and handed back to it in
+ * batches. The queues only live in memory, so frees a crash left in them
+ * are finished the next time the partition is opened.
+ *
+ * Writes are kept in a journal next to the partition file (foo.journal for
+ * foo) until they're committed, see begin_transaction. Opening a partition
+ * replays the committed writes a crash left in its journal, and closing it
+ * writes everything back and removes the journal.
+ */
+typedef struct partition partition;
+
 /**
  * Creates the file represting our file system partition on
  * in the current OS's filesystem.
@@ -26,6 +162,44 @@ typedef uint64_t block_size_t;
  */
 int initialize(char* filename, uint64_t numBytes);
 
+/**
+ * Same as initialize, but a newly created partition uses the given layout.
+ * The layout of an existing partition is whatever it was created with.
+ */
+int initializeWithLayout(char* filename, uint64_t numBytes, partition_layout layout);
+
+/**
+ * Opens the partition in filename, creating it with numBytes bytes and the
+ * given layout if it doesn't exist yet, and sets created to say which
+ * happened. Unlike initialize this doesn't change which partition the
+ * other functions act on, see use_partition. Returns NULL if a new
+ * partition file can't be given its full size.
+ */
+partition *open_partition(char *filename, uint64_t numBytes, partition_layout layout, bool *created);
+
+/**
+ * Makes p the partition this thread's calls act on, so several partitions can
+ * be used at once. Passing NULL goes back to the one opened by initialize.
+ */
+void use_partition(partition *p);
+
+/**
+ * Retrieves the partition this thread's calls act on.
+ */
+partition *current_partition();
+
+/**
+ * Closes a partition opened with open_partition, once everything written
+ * to it is committed and in the partition file. Ends the calling thread's
+ * transaction if it's in one; no other thread may still be using it.
+ */
+void close_partition(partition *p);
+
+/**
+ * Retrieves the layout this partition was created with.
+ */
+partition_layout getLayout();
+
 /**
  * Retrieves the block_id representing the root directory in this partition.
  * If the returned value is equal to 0, then there does not exist a root directory
@@ -39,15 +213,337 @@ block_id getRootID();
  */
 void saveRootID(block_id id);
 
+/**
+ * Where the block at id is now, for ids saved before the partition was
+ * converted from the format it had before the descriptor grew, which moved
+ * the blocks in its way. Other ids come back as they are.
+ */
+block_id relocated_id(block_id id);
+
+/**
+ * Forgets where the conversion moved blocks to, once the layers above have
+ * updated every id they saved, see relocated_id.
+ */
+void forget_relocation();
+
+/**
+ * Saves the block holding the layers above's usage table in the descriptor,
+ * so it can be found again when the partition is reopened. 0 for none.
+ */
+void saveUsageTableID(block_id id);
+
+/**
+ * Retrieves the block saved with saveUsageTableID, 0 if there isn't one.
+ */
+block_id getUsageTableID();
+
+/**
+ * Retrieves the on-disk format version of this partition.
+ */
+uint64_t getFormatVersion();
+
+/**
+ * Records that the partition has been converted to the given format version.
+ */
+void saveFormatVersion(uint64_t version);
+
+/**
+ * Raises the partition's format version to at least version, for the layers
+ * above to mark a partition older builds mustn't open once they start using
+ * something those builds don't understand. Safe to call from any thread.
+ */
+void requireFormatVersion(uint64_t version);
+
+/**
+ * Gives every block header a checksum if the partition is from before they
+ * had them, and marks it as having them. The layers above call this while
+ * upgrading, once they're done with anything that depends on the old version.
+ */
+void checksum_block_headers();
+
+/**
+ * Told about every problem a scrub finds, with the block it's in and what's
+ * wrong with it.
+ */
+typedef void (*scrub_finding)(void *ctx, block_id blk, const char *problem);
+
+/**
+ * Checks the blocks of the partition in address order, from where an earlier
+ * call left off (from, or the start of the partition if from is 0), until
+ * about budget bytes have been read. Every block header has to look like one,
+ * fit in the partition and match its checksum. Free blocks have to be on the
+ * free list in address order, with no two next to each other, and start
+ * their group in the group index when they're the first in it. Allocated
+ * blocks have to be on the allocated list, linked both ways. Blocks whose
+ * free is still queued are only checked for their size. Problems are passed
+ * to found rather than exiting. Adds the blocks checked and the bytes read to
+ * *blocks and *bytes and returns where to carry on, 0 once it got to the end
+ * of the partition. Allocations and frees wait while it runs, so budgets
+ * should be small.
+ */
+block_id scrub_blocks(block_id from, uint64_t budget, uint64_t *blocks, uint64_t *bytes, scrub_finding found, void *ctx);
+
+/**
+ * What fsck_blocks found at every block of a partition, see fsck_claim.
+ */
+typedef struct block_table block_table;
+
+/**
+ * Opens the partition in filename for fsck_blocks, replaying what its
+ * journal holds but trusting nothing else: unlike open_partition, the free
+ * list isn't indexed and the snapshot, share and dedup tables aren't loaded
+ * until fsck_mount. Returns NULL, saying why on stderr, if the file doesn't
+ * hold a partition this program can read.
+ */
+partition *fsck_open(char *filename);
+
+/**
+ * Walks every block of the current partition, which fsck_open opened, from
+ * its start to its end, split across threads. Every header has to look
+ * like one, match its checksum and fit, and the blocks have to follow each
+ * other without overlapping all the way to the end of the partition. The
+ * free list has to hold every free block in address order, with no two
+ * next to each other, and the allocated list every allocated block, linked
+ * both ways. The snapshot, share and dedup tables have to hold allocated
+ * blocks, the index checkpoint has to match the free list if it's current,
+ * and the descriptor's space counts have to match the blocks. Problems are
+ * passed to found, which is called from several threads at once. Returns
+ * what it found, for fsck_claim.
+ */
+block_table *fsck_blocks(int threads, scrub_finding found, void *ctx);
+
+/**
+ * Claims the allocated block starting at blk for something that uses it: a
+ * file header, a directory's entries, a chunk. Returns how many times it's
+ * been claimed, this time included, or 0 if no allocated block starts there.
+ * Safe to call from several threads at once.
+ */
+uint32_t fsck_claim(block_table *t, block_id blk);
+
+/**
+ * Takes back a claim fsck_claim made, for something found not to use the
+ * block after all.
+ */
+void fsck_unclaim(block_table *t, block_id blk);
+
+/**
+ * Checks the claims made on every allocated block once everything using
+ * blocks has claimed them. A block has to be claimed once, or as many times
+ * as the share table says it's shared, unless snapshots are keeping it. If
+ * complete is false, not everything could be read, so blocks nobody claimed
+ * aren't taken to be lost. Problems are passed to found.
+ */
+void fsck_finish(block_table *t, bool complete, scrub_finding found, void *ctx);
+
+/**
+ * Retrieves how many blocks fsck_blocks found allocated and free (or being
+ * freed), and how many stretches of the partition it couldn't find blocks in.
+ */
+void fsck_counts(block_table *t, uint64_t *allocated, uint64_t *unused, uint64_t *gaps);
+
+/**
+ * Fixes what fsck_blocks and fsck_finish found that can be fixed without
+ * knowing what the blocks hold: frees blocks nothing uses and blocks whose
+ * free never finished, merges free blocks that are next to each other,
+ * links both lists again in address order if they need it, writes headers
+ * that don't match their checksum again, writes the share table again from
+ * the claims, drops a damaged dedup index or index checkpoint, and counts
+ * the space again. Stretches the walk found no blocks in are left as they
+ * are, unless something claimed a block at the start of one, which is then
+ * given back its header as a single block. Returns whether the partition
+ * can be mounted with fsck_mount afterwards.
+ */
+bool fsck_repair(block_table *t);
+
+/**
+ * Finishes opening the partition fsck_open opened, once fsck_repair has
+ * made its lists sound, so it can be written to like any other.
+ */
+void fsck_mount();
+
+/**
+ * Frees what fsck_blocks returned.
+ */
+void fsck_free(block_table *t);
+
+/**
+ * Changes how the partition grows when it runs out of space, see growth_mode.
+ * Defaults to GROW_DOUBLE with no limit.
+ */
+void setGrowthPolicy(growth_policy policy);
+
+/**
+ * Retrieves the current growth policy.
+ */
+growth_policy getGrowthPolicy();
+
+/**
+ * Adds numBytes bytes to the end of the partition, extending the host file.
+ * The new space joins the free list, merging with a free block at the old end.
+ * In the split layout it all goes to the data zone. The growth policy's limit
+ * does not apply. Returns a non-zero value if the host file can't be extended.
+ */
+int grow_partition(block_size_t numBytes);
+
+/**
+ * Retrieves the number of bytes in the partition, not counting the descriptor.
+ */
+block_size_t getPartitionSize();
+
+/**
+ * Whether numBytes bytes of contents of a block at blk would lie inside the
+ * partition, for ids read from something that may be damaged.
+ */
+bool block_in_bounds(block_id blk, size_t numBytes);
+
+/**
+ * Changes how freed space is handed back to the host, see punch_mode.
+ * Defaults to PUNCH_OFF.
+ */
+void setPunchMode(punch_mode mode);
+
+/**
+ * Retrieves the current punch mode.
+ */
+punch_mode getPunchMode();
+
+/**
+ * Hands the interior of every large free block back to the host right away,
+ * whatever the mode. Use this to finish what PUNCH_DEFERRED has put off.
+ */
+void punch_free_space();
+
+/**
+ * Starts a transaction: everything the calling thread writes to its partition
+ * until end_transaction is committed to the journal together, so after a
+ * crash either all of it is there or none of it is. Commands from every
+ * thread that end around the same time are committed as a group with a
+ * single sync. Transactions nest, and must be started before taking any
+ * locks that another thread's transaction may wait on.
+ */
+void begin_transaction();
+
+/**
+ * Ends the calling thread's transaction. It's committed shortly after, in
+ * the background. Under DURABILITY_FLUSH or DURABILITY_FSYNC (the calling
+ * thread's, if it has one, see setSessionDurability) it waits until it's
+ * committed, or synced, before returning.
+ */
+void end_transaction();
+
+/**
+ * Waits until everything written to the partition so far, including the
+ * calling thread's transaction, is committed to stable storage.
+ */
+void sync_partition();
+
+/**
+ * Changes when the partition's journal commits and syncs, see
+ * durability_mode. Defaults to DURABILITY_PERIODIC every 5 milliseconds.
+ */
+void setDurability(durability_policy policy);
+
+/**
+ * Retrieves the partition's durability policy.
+ */
+durability_policy getDurability();
+
+/**
+ * Makes end_transaction on the calling thread wait as mode says rather than
+ * as the partition's policy does, for a session that wants its commands kept
+ * more (or less) carefully than everyone else's. Only whether and how long
+ * commands wait changes, DURABILITY_PERIODIC waits as little as
+ * DURABILITY_NONE. Pass false for own to follow the partition again.
+ */
+void setSessionDurability(bool own, durability_mode mode);
+
+/**
+ * Retrieves what the partition's journal has done since it was opened.
+ */
+journal_stats getJournalStats();
+
+/**
+ * Takes a snapshot of the partition called name: the directory tree as it is
+ * now, kept as it is however the partition changes later. Nothing is copied
+ * when it's taken. Writing to bytes a snapshot still shares copies them to a
+ * new block first, and freeing a block it still shares leaves the block to it.
+ * Waits until every other thread is between transactions. Returns the
+ * snapshot's id, or 0 if there already is one called name.
+ */
+uint64_t create_snapshot(char *name);
+
+/**
+ * Deletes a snapshot, freeing whatever was kept only for it. Waits until
+ * every other thread is between transactions. Returns a non-zero value,
+ * without deleting it, if it's mounted.
+ */
+int delete_snapshot(uint64_t id);
+
+/**
+ * Returns the id of the snapshot called name, or 0 if there isn't one.
+ */
+uint64_t find_snapshot(char *name);
+
+/**
+ * Fills info with up to max of the partition's snapshots, oldest first, and
+ * returns how many there are.
+ */
+uint64_t list_snapshots(snapshot_info *info, uint64_t max);
+
+/**
+ * Marks the snapshot with the given id as mounted, so it isn't deleted until
+ * it's unmounted as many times, and fills info in. Returns false if there's
+ * no such snapshot.
+ */
+bool mount_snapshot(uint64_t id, snapshot_info *info);
+
+/**
+ * Undoes one mount_snapshot.
+ */
+void unmount_snapshot(uint64_t id);
+
+/**
+ * Makes the calling thread's reads see the snapshot with the given id
+ * instead of the partition as it is now, or the partition again for 0. The
+ * thread can't change anything while it's viewing a snapshot, and map_block
+ * always returns NULL.
+ */
+void view_snapshot(uint64_t id);
+
+/**
+ * Retrieves the id of the snapshot the calling thread is viewing, 0 if none.
+ */
+uint64_t viewed_snapshot();
+
+/**
+ * Retrieves how the partition's space is used, see space_stats. Only takes
+ * a walk over the free list if the free blocks that were the biggest have
+ * all gone since it last did.
+ */
+space_stats getSpaceStats();
+
 /**
  * Prints info about the state of the partition (descriptor block and free block table stats)
  * to the specified file descriptor.
  */
 void printInfo(FILE *dest);
 
+/**
+ * Writes how the partition is laid out to dest in format, taking one pass
+ * over the blocks in address order with nothing changing meanwhile. The
+ * partition is cut into at most buckets equal stretches, each written as
+ * soon as the pass is through it with the bytes in it that are allocated,
+ * free, waiting to be freed or unreadable, the blocks starting in it, the
+ * biggest free block reaching into it and the biggest one so far. A
+ * histogram of free blocks by size class and the totals follow.
+ */
+void exportLayout(FILE *dest, uint64_t buckets, export_format format);
+
 /**
  * Resizes an already allocated block in this partition, potentially moving it,
  * so you should upate the pointer to the one that is returned.
+ * The old contents are carried over (cut short if the block shrinks),
+ * anything past them is not initialized.
  *
  * Passing 0 in for the blk is equivalent to calling allocate_block.
  * 
@@ -59,18 +555,137 @@ block_id resize_block(block_id blk, block_size_t size);
  */
 block_id allocate_block(block_size_t size);
 
+/**
+ * Allocates a new block in the partition, preferring the allocation group
+ * containing hint. If that group can't satisfy the request, the following
+ * groups are tried in address order, wrapping around to the start of the partition.
+ *
+ * Passing 0 in for the hint is equivalent to calling allocate_block.
+ */
+block_id allocate_block_near(block_size_t size, block_id hint);
+
+/**
+ * Allocates a block for file headers or directory entries. In the split layout
+ * these go in the metadata zone (spilling into the data zone only once it is full),
+ * otherwise this is the same as allocate_block_near.
+ */
+block_id allocate_metadata_block(block_size_t size, block_id hint);
+
+/**
+ * Allocates a block for file contents. In the split layout these go in the
+ * data zone, in the slice matching the hint's position in the metadata zone,
+ * otherwise this is the same as allocate_block_near.
+ */
+block_id allocate_data_block(block_size_t size, block_id hint);
+
+/**
+ * Picks a placement hint for a new directory created under parent.
+ * New directories stay in their parent's group, unless that group is
+ * getting crowded, in which case they move to the emptiest group so
+ * their own children have room to cluster around them.
+ */
+block_id directory_hint(block_id parent);
+
 /**
  * Frees the given block.
  * Do not call free on an already freed block.
  */
 void free_block(block_id blk);
 
+/**
+ * Gives blk one more owner, so files can share a block rather than each
+ * having a copy. free_block on a shared block only gives up one owner's
+ * share of it, and the block is freed once its last owner frees it. The
+ * contents are the same for every owner, so whoever is about to change them
+ * should check block_refs and move to a copy of their own first, which is
+ * what resize_block does. A shared block must not be truncated.
+ */
+void share_block(block_id blk);
+
+/**
+ * Retrieves how many owners blk has, 1 unless it's been shared with
+ * share_block.
+ */
+uint64_t block_refs(block_id blk);
+
+/**
+ * Turns deduplication of file contents on or off, see dedup_block. This
+ * only tells the layers above whether to use it, the index is kept either
+ * way. Defaults to off.
+ */
+void setDedup(bool on);
+
+/**
+ * Retrieves whether deduplication is on.
+ */
+bool getDedup();
+
+/**
+ * Turns compression of file contents on or off. Like setDedup this only
+ * tells the layers above whether to compress what they write, whatever is
+ * compressed already stays readable either way. Defaults to off.
+ */
+void setCompression(bool on);
+
+/**
+ * Retrieves whether compression is on.
+ */
+bool getCompression();
+
+/**
+ * Changes when checksums are checked, see verify_mode. Defaults to
+ * VERIFY_FILL.
+ */
+void setVerification(verify_mode mode);
+
+/**
+ * Retrieves the current verification mode.
+ */
+verify_mode getVerification();
+
+/**
+ * Looks in the partition's dedup index for a block other than blk whose
+ * first numBytes bytes are the same as data. If there is one it gets another
+ * owner, as with share_block, and is returned for the caller to use instead
+ * of blk. Otherwise blk, unless it's 0, is added to the index as holding
+ * data, and 0 is returned. Blocks are looked up by a hash of their bytes and
+ * then compared byte for byte. A block in the index must not be changed
+ * until claim_block has taken it out.
+ */
+block_id dedup_block(block_id blk, const void *data, block_size_t numBytes);
+
+/**
+ * Takes blk out of the dedup index, so nobody can start sharing it, and
+ * returns whether the caller is its only owner. If so its contents can be
+ * changed in place, otherwise the caller should move to a copy of its own.
+ */
+bool claim_block(block_id blk);
+
+/**
+ * Retrieves how big the dedup index is and what it has found.
+ */
+dedup_stats getDedupStats();
+
+/**
+ * Shrinks an allocated block in place to size bytes, handing the tail back to
+ * the free list. Unlike resize_block the block never moves, though the tail
+ * is kept if it is too small to be worth freeing.
+ */
+void truncate_block(block_id blk, block_size_t size);
+
 /**
  * Copies at most numBytes bytes from this block into the specified pointer.
  * Use this to read the block, and you can modify and save it back.
  */
 void load_block(block_id blk, void* destination, size_t numBytes);
 
+/**
+ * Loads the block like load_block, and returns whether what it loaded should
+ * be checked against its checksum under the current verification mode. For
+ * the layers above, which keep checksums of their own in what they store.
+ */
+bool load_block_checking(block_id blk, void* destination, size_t numBytes);
+
 /**
  * Overwrites the block's contents (starting at the beginning of the block) with
  * at most min(numBytes, block size) bytes, effectively saving it to the disk. 
@@ -78,6 +693,19 @@ void load_block(block_id blk, void* destination, size_t numBytes);
  */
 void save_block(block_id blk, void *source, size_t numBytes);
 
+/**
+ * Retrieves how many bytes of contents the block can hold. This can be more
+ * than was asked for when it was allocated, since small remnants are absorbed.
+ */
+block_size_t block_capacity(block_id blk);
+
+/**
+ * Returns a pointer to numBytes bytes of the block without copying them, or
+ * NULL if the partition can't be mapped. The bytes are read-only and only
+ * valid until the next call that writes to the partition.
+ */
+const void *map_block(block_id blk, size_t numBytes);
+
 /*
 	Example usage of this interface:
 
@@ -0,0 +1,73 @@
+#ifndef __RANGEMAP_H
+#define __RANGEMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A set of non-overlapping byte ranges of the partition, each carrying two
+ * values for whoever keeps it, that can be looked up by any address inside
+ * them. Ranges are filed under every 4KB page they touch, so finding the
+ * ranges around an address only looks at the ranges sharing its pages.
+ * Not thread safe.
+ */
+typedef struct rangemap rangemap;
+
+typedef struct range {
+	uint64_t start;
+	uint64_t end; // one past the last byte.
+	uint64_t value;
+	uint64_t extra;
+	uint64_t index; // where it is in the map, see rangemap_get.
+} range;
+
+/**
+ * Creates an empty map.
+ */
+rangemap *rangemap_create();
+
+/**
+ * Frees the map and every range in it. Does nothing given NULL.
+ */
+void rangemap_destroy(rangemap *m);
+
+/**
+ * Adds the range [start, end), which must not overlap any range already in
+ * the map. The range returned stays valid until it's removed, only its
+ * values may be changed.
+ */
+range *rangemap_add(rangemap *m, uint64_t start, uint64_t end, uint64_t value, uint64_t extra);
+
+/**
+ * Removes (and frees) a range of the map.
+ */
+void rangemap_remove(rangemap *m, range *r);
+
+/**
+ * Returns the range containing addr, or NULL.
+ */
+range *rangemap_find(rangemap *m, uint64_t addr);
+
+/**
+ * Calls fn on every range overlapping [start, end), in address order. fn
+ * must not change the map.
+ */
+void rangemap_each(rangemap *m, uint64_t start, uint64_t end, void (*fn)(range *r, void *ctx), void *ctx);
+
+/**
+ * Retrieves how many ranges are in the map.
+ */
+uint64_t rangemap_count(rangemap *m);
+
+/**
+ * Retrieves the i'th range of the map, in no particular order, for going
+ * through all of them. Removing a range moves the last one into its place.
+ */
+range *rangemap_get(rangemap *m, uint64_t i);
+
+/**
+ * Retrieves roughly how many bytes of memory the map takes up.
+ */
+uint64_t rangemap_memory(rangemap *m);
+
+#endif /* __RANGEMAP_H */
@@ -0,0 +1,68 @@
+#ifndef __SCRUB_H
+#define __SCRUB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "partitioner.h"
+
+/**
+ * A background thread that goes over the partition looking for damage, so
+ * it's found while there's still time to do something about it rather than
+ * when something reads it. Each pass checks every block header and the lists
+ * they're on with scrub_blocks, a little at a time, then calls the files
+ * function it was started with to check whatever the layers above keep
+ * checksums of. Everything read counts against a budget of bytes a second,
+ * so the scrubber only ever takes its share of the disk. Problems are
+ * written to a report file as they're found, along with a line for every pass.
+ */
+typedef struct scrubber scrubber;
+
+/**
+ * What the scrubber has done since it was started.
+ */
+typedef struct scrub_stats {
+	uint64_t rate; // bytes a second it may read.
+	uint64_t passes; // finished.
+	uint64_t blocks; // headers checked.
+	uint64_t chunks; // of files checked.
+	uint64_t bytes; // read.
+	uint64_t problems; // found.
+} scrub_stats;
+
+/**
+ * Starts scrubbing the current partition at rate bytes a second, appending
+ * problems to the file at reportPath. files is called from the scrubber's
+ * thread at the end of every pass, with the partition in use, and should
+ * report through scrub_found and pace itself with scrub_throttle. Returns
+ * NULL if the report can't be opened.
+ */
+scrubber *scrub_start(char *reportPath, uint64_t rate, void (*files)(scrubber *s));
+
+/**
+ * Stops the scrubber, waiting for whatever it's checking to finish, and frees it.
+ */
+void scrub_stop(scrubber *s);
+
+/**
+ * Changes how many bytes a second the scrubber may read.
+ */
+void scrub_set_rate(scrubber *s, uint64_t rate);
+
+scrub_stats scrub_get_stats(scrubber *s);
+
+/**
+ * Counts bytes read and chunks checked by the files function, then waits
+ * until the budget allows for them. Returns false if the scrubber is being
+ * stopped, in which case the files function should return. Nothing should
+ * be locked while calling it.
+ */
+bool scrub_throttle(scrubber *s, uint64_t bytes, uint64_t chunks);
+
+/**
+ * Writes a problem to the scrubber's report. A scrub_finding, with the
+ * scrubber as its context.
+ */
+void scrub_found(void *ctx, block_id blk, const char *problem);
+
+#endif /* __SCRUB_H */
@@ -0,0 +1,36 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/**
+ * Returned by a session handler's run to end the session.
+ */
+#define SESSION_END 1
+
+/**
+ * How a server runs its sessions. open returns the state of a new session.
+ * run executes one line the client sent, writing whatever it prints to out,
+ * and returns 0 or -1 as the command did, or SESSION_END to hang up. close
+ * frees the state once the client is gone. A session's lines are run one at
+ * a time and in order, but different sessions run on different threads.
+ */
+typedef struct session_handler {
+	void *(*open)();
+	int (*run)(void *state, char *line, FILE *out);
+	void (*close)(void *state);
+} session_handler;
+
+/**
+ * Listens on a Unix domain socket at socketPath, replacing whatever is there,
+ * and serves every client that connects as a session of its own with a pool
+ * of workers threads. Clients send one command per line and may send many
+ * without waiting; each gets back the command's output followed by a line
+ * "== 0" or "== -1" with its result, in the order they were sent. Returns 0
+ * after SIGINT or SIGTERM once the sessions in progress have finished the
+ * lines they were running, or -1 if the socket can't be set up.
+ */
+int serve(char *socketPath, int workers, session_handler *handler);
+
+#endif /* __SERVER_H */
@@ -0,0 +1,78 @@
+#ifndef __USAGE_H
+#define __USAGE_H
+
+#include "fileheader.h"
+
+/**
+ * What a directory holds, all the way down. Every directory has a slot in
+ * the partition's usage table, which allocateObject, resizeContents and
+ * freeObject keep up to date as files come and go and change size, so
+ * asking what a directory holds takes one read however big it is. A
+ * directory's header keeps its slot in extents, which only sparse files
+ * use otherwise.
+ */
+typedef struct dir_usage {
+	uint64_t bytes; // the sizes of the files, added up.
+	uint64_t files;
+	uint64_t dirs; // not counting the directory itself.
+} dir_usage;
+
+/**
+ * A directory's slot in the usage table. Slot 0 is never a directory's.
+ */
+typedef struct usage_slot {
+	block_id dir; // the directory's header, 0 if the slot is free.
+	uint64_t parent; // the slot of the directory it's in, 0 for the root.
+	dir_usage usage;
+} usage_slot;
+
+/**
+ * Builds the usage table by walking the tree if the partition doesn't have
+ * one yet, as partitions from older versions don't. Call it once the
+ * partition is open and its headers are in the current format, before
+ * loading any directory header that's saved again later, since this gives
+ * every directory its slot.
+ */
+void usage_load();
+
+/**
+ * Throws the usage table away and builds it again by walking the tree, for
+ * after fsck has changed it. Damaged headers are left out, along with
+ * everything below them.
+ */
+void usage_rebuild();
+
+/**
+ * Gives the new directory fh a slot, for its header to be saved with, and
+ * counts it in the directories above it.
+ */
+void usage_attach(fileHeader *fh);
+
+/**
+ * Gives back the slot of the directory fh, which is being deleted, and takes
+ * it and whatever is still counted below it off the directories above it.
+ */
+void usage_detach(fileHeader *fh);
+
+/**
+ * Adds what changed below the directory at dir to it and every directory
+ * above it. Any of the changes can be negative.
+ */
+void usage_add(block_id dir, int64_t bytes, int64_t files, int64_t dirs);
+
+/**
+ * Fills u in with what the directory at dir holds. Returns false if that
+ * isn't known without walking it: the partition has no usage table, or the
+ * calling thread is viewing a snapshot, whose tree the table doesn't
+ * describe.
+ */
+bool usage_get(block_id dir, dir_usage *u);
+
+/**
+ * Reads the whole usage table for fsck, slot 0 included, and sets count to
+ * how many slots it has. Returns NULL if there's no table or it doesn't look
+ * like one. The caller frees it.
+ */
+usage_slot *usage_read_all(uint64_t *count);
+
+#endif /* __USAGE_H */
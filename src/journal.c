@@ -0,0 +1,869 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// marks the start and the end of a transaction in the log.
+static const uint64_t TXN_START = 0x4A4E4C5354585431;
+static const uint64_t TXN_COMMIT = 0x4A4E4C434D495431;
+
+// the in-memory copy of the partition is kept in pages this big.
+#define JOURNAL_PAGE 4096
+#define JOURNAL_BUCKETS 4096
+
+// a transaction is committed this long after its first write, so every
+// command that writes in the meantime shares its sync. DURABILITY_PERIODIC
+// can change it.
+#define COMMIT_INTERVAL_MS 5
+
+// or sooner, once this much has been written in it.
+#define COMMIT_BYTES (4 * 1024 * 1024)
+
+// the partition file is synced and the log started over once it's this big,
+// or once nothing has been written for IDLE_MS.
+#define LOG_LIMIT (16 * 1024 * 1024)
+#define IDLE_MS 1000
+
+// In the log, a transaction is a record_head, then for every write its
+// offset and length followed by the bytes written, then a record_tail
+// whose checksum covers everything before it back to the head.
+typedef struct record_head {
+	uint64_t magic;
+	uint64_t id;
+	uint64_t bytes; // of writes between the head and the tail.
+	uint64_t count; // of writes.
+} record_head;
+
+typedef struct record_tail {
+	uint64_t magic;
+	uint64_t id;
+	uint64_t checksum;
+	uint64_t reserved;
+} record_tail;
+
+typedef struct txn {
+	uint64_t id;
+	int handles; // threads in the transaction.
+	bool locked; // being committed, so no more threads may join it.
+
+	// the record as it will go in the log, starting with room for its head.
+	uint8_t *buf;
+	size_t used;
+	size_t cap;
+	uint64_t count;
+	uint64_t ended; // transactions of threads that have finished.
+	struct timespec first; // when the first write came in.
+
+	uint64_t *punches; // offset and length pairs.
+	size_t numPunches;
+	size_t capPunches;
+} txn;
+
+// the latest contents of a page some transaction has written to that hasn't
+// made it to the partition file yet.
+typedef struct page {
+	uint64_t number;
+	uint64_t txn; // the last transaction that wrote to it.
+	uint8_t data[JOURNAL_PAGE];
+	struct page *next;
+} page;
+
+struct journal {
+	int fd; // the partition file.
+	int logFd;
+	char *path;
+	uint64_t logSize; // only touched by the journal thread once it's running.
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // the journal thread has something to do.
+	pthread_cond_t changed; // a transaction drained, was replaced or became durable.
+
+	txn *running;
+	uint64_t lastClosed; // the last transaction handed to the journal thread.
+	uint64_t written; // the last transaction that's in the log.
+	uint64_t durable; // the last transaction that's in the log on stable storage.
+	bool flushRequested;
+	bool syncRequested;
+	bool closing;
+	pthread_t thread;
+
+	durability_policy policy;
+	journal_stats stats;
+
+	// reads take it shared, writes and the journal thread exclusively.
+	pthread_rwlock_t overlayLock;
+	page *pages[JOURNAL_BUCKETS];
+	uint64_t numPages;
+};
+
+// the journal the calling thread has a transaction in, and how deeply nested.
+static __thread journal *handleJournal;
+static __thread int handleDepth;
+
+static void read_fully(int fd, uint64_t offset, void *data, uint64_t numBytes) {
+	uint8_t *dst = data;
+
+	while(numBytes > 0) {
+		ssize_t n = pread(fd, dst, numBytes, offset);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(n < 0) {
+			fprintf(stderr, "Error: reading from partition at offset %" PRIu64 " failed.\n", offset);
+			_exit(0xcafebabe);
+		}
+
+		if(n == 0) {
+			// past the end of the file, which reads back as zeros.
+			memset(dst, 0, numBytes);
+			return;
+		}
+
+		dst += n;
+		offset += n;
+		numBytes -= n;
+	}
+}
+
+static void write_fully(int fd, uint64_t offset, const void *data, uint64_t numBytes) {
+	const uint8_t *src = data;
+
+	while(numBytes > 0) {
+		ssize_t n = pwrite(fd, src, numBytes, offset);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(n <= 0) {
+			fprintf(stderr, "Error: writing to partition failed.\n");
+			_exit(0xcafebabe);
+		}
+
+		src += n;
+		offset += n;
+		numBytes -= n;
+	}
+}
+
+// FNV-1a, good enough to spot a record that was only partly written.
+static uint64_t checksum(const uint8_t *data, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	for(size_t i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+static txn *new_txn(uint64_t id) {
+	txn *t = calloc(1, sizeof(txn));
+	t->id = id;
+	t->cap = 64 * 1024;
+	t->buf = malloc(t->cap);
+	t->used = sizeof(record_head);
+	return t;
+}
+
+static void free_txn(txn *t) {
+	free(t->buf);
+	free(t->punches);
+	free(t);
+}
+
+static bool txn_empty(txn *t) {
+	return t->count == 0 && t->numPunches == 0;
+}
+
+static void append(txn *t, const void *data, size_t len) {
+	if(t->used + len > t->cap) {
+		while(t->used + len > t->cap) {
+			t->cap *= 2;
+		}
+		t->buf = realloc(t->buf, t->cap);
+	}
+
+	memcpy(t->buf + t->used, data, len);
+	t->used += len;
+}
+
+static page **bucket_of(journal *j, uint64_t number) {
+	return &j->pages[(number * 0x9E3779B97F4A7C15ull) >> 52];
+}
+
+// With overlayLock held.
+static page *find_page(journal *j, uint64_t number) {
+	page *pg = *bucket_of(j, number);
+
+	while(pg != NULL && pg->number != number) {
+		pg = pg->next;
+	}
+
+	return pg;
+}
+
+// whether we have any of the pages numBytes bytes at offset lie in. With
+// overlayLock held.
+static bool overlaps(journal *j, uint64_t offset, uint64_t numBytes) {
+	if(numBytes == 0) {
+		return false;
+	}
+
+	for(uint64_t n = offset / JOURNAL_PAGE; n <= (offset + numBytes - 1) / JOURNAL_PAGE; n++) {
+		if(find_page(j, n) != NULL) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// applies a write to the in-memory pages, reading the ones it doesn't have
+// from the partition file first. With overlayLock held exclusively.
+static void overlay_write(journal *j, uint64_t id, uint64_t offset, const uint8_t *data, uint64_t numBytes) {
+	while(numBytes > 0) {
+		uint64_t number = offset / JOURNAL_PAGE;
+		uint64_t in = offset % JOURNAL_PAGE;
+		uint64_t len = JOURNAL_PAGE - in < numBytes ? JOURNAL_PAGE - in : numBytes;
+
+		page *pg = find_page(j, number);
+		if(pg == NULL) {
+			pg = malloc(sizeof(page));
+			pg->number = number;
+			read_fully(j->fd, number * JOURNAL_PAGE, pg->data, JOURNAL_PAGE);
+
+			page **b = bucket_of(j, number);
+			pg->next = *b;
+			*b = pg;
+			__atomic_add_fetch(&j->numPages, 1, __ATOMIC_RELEASE);
+		}
+
+		memcpy(pg->data + in, data, len);
+		pg->txn = id;
+
+		offset += len;
+		data += len;
+		numBytes -= len;
+	}
+}
+
+// writes every write in a transaction's record to its place in the
+// partition file, in order.
+static void write_in_place(journal *j, const uint8_t *writes, uint64_t bytes) {
+	uint64_t pos = 0;
+
+	while(pos < bytes) {
+		uint64_t entry[2]; // offset and length.
+		memcpy(entry, writes + pos, sizeof(entry));
+		pos += sizeof(entry);
+
+		write_fully(j->fd, entry[0], writes + pos, entry[1]);
+		pos += entry[1];
+	}
+}
+
+static uint64_t elapsed_ns(struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000000000ull + now.tv_nsec - since->tv_nsec;
+}
+
+// syncs the log, returning how long it took.
+static uint64_t sync_log(journal *j) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(fdatasync(j->logFd) != 0) {
+		fprintf(stderr, "Error: syncing the journal failed.\n");
+		_exit(0xcafebabe);
+	}
+
+	return elapsed_ns(&start);
+}
+
+// appends a closed transaction to the log.
+static void commit(journal *j, txn *t) {
+	record_head head = { TXN_START, t->id, t->used - sizeof(record_head), t->count };
+	memcpy(t->buf, &head, sizeof(head));
+
+	record_tail tail = { TXN_COMMIT, t->id, checksum(t->buf, t->used), 0 };
+	append(t, &tail, sizeof(tail));
+
+	write_fully(j->logFd, j->logSize, t->buf, t->used);
+
+	j->logSize += t->used;
+}
+
+// records that everything up to transaction id is in the log, and on stable
+// storage if syncNs is set. With j->lock held.
+static void committed(journal *j, uint64_t id, uint64_t syncNs) {
+	j->written = id;
+
+	if(syncNs > 0) {
+		j->durable = id;
+		j->stats.syncs++;
+		j->stats.syncNs += syncNs;
+	}
+
+	pthread_cond_broadcast(&j->changed);
+}
+
+// writes a committed transaction to its place in the partition file, and lets
+// go of the pages nothing later has written to.
+static void apply(journal *j, txn *t) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	for(size_t i = 0; i < t->numPunches; i++) {
+		// only saves space, so it doesn't matter if the host can't.
+		if(fallocate(j->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, t->punches[2 * i], t->punches[2 * i + 1]) != 0) {
+			break;
+		}
+	}
+#endif
+
+	write_in_place(j, t->buf + sizeof(record_head), t->used - sizeof(record_head) - sizeof(record_tail));
+
+	pthread_rwlock_wrlock(&j->overlayLock);
+
+	for(int b = 0; b < JOURNAL_BUCKETS; b++) {
+		page **link = &j->pages[b];
+
+		while(*link != NULL) {
+			page *pg = *link;
+
+			if(pg->txn <= t->id) {
+				*link = pg->next;
+				free(pg);
+				__atomic_sub_fetch(&j->numPages, 1, __ATOMIC_RELEASE);
+			} else {
+				link = &pg->next;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&j->overlayLock);
+}
+
+// everything in the log is in the partition file, so make sure it stays
+// there and start the log over.
+static void checkpoint(journal *j) {
+	if(fdatasync(j->fd) != 0 || ftruncate(j->logFd, 0) != 0) {
+		fprintf(stderr, "Error: checkpointing the journal failed.\n");
+		_exit(0xcafebabe);
+	}
+
+	j->logSize = 0;
+}
+
+// replays the committed transactions in the log into the partition file.
+static void replay(journal *j) {
+	struct stat st;
+	if(fstat(j->logFd, &st) != 0 || st.st_size == 0) {
+		return;
+	}
+
+	uint8_t *log = malloc(st.st_size);
+	read_fully(j->logFd, 0, log, st.st_size);
+
+	uint64_t pos = 0;
+	uint64_t expected = 0;
+
+	while(pos + sizeof(record_head) + sizeof(record_tail) <= (uint64_t)st.st_size) {
+		record_head head;
+		memcpy(&head, log + pos, sizeof(head));
+
+		if(head.magic != TXN_START || (expected != 0 && head.id != expected)
+			|| head.bytes > st.st_size - pos - sizeof(record_head) - sizeof(record_tail)) {
+			break;
+		}
+
+		uint64_t len = sizeof(record_head) + head.bytes;
+
+		record_tail tail;
+		memcpy(&tail, log + pos + len, sizeof(tail));
+
+		// a transaction that didn't make it to the log in one piece never happened.
+		if(tail.magic != TXN_COMMIT || tail.id != head.id || tail.checksum != checksum(log + pos, len)) {
+			break;
+		}
+
+		write_in_place(j, log + pos + sizeof(record_head), head.bytes);
+
+		expected = head.id + 1;
+		pos += len + sizeof(record_tail);
+	}
+
+	free(log);
+
+	checkpoint(j);
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms) {
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void *journal_thread(void *arg) {
+	journal *j = arg;
+
+	pthread_mutex_lock(&j->lock);
+
+	while(true) {
+		txn *t = j->running;
+
+		if(txn_empty(t)) {
+			if(j->closing) {
+				break;
+			}
+
+			if(j->syncRequested && j->durable < j->written) {
+				// everything's in the log, but not all of it was synced.
+				uint64_t id = j->written;
+				j->syncRequested = false;
+
+				pthread_mutex_unlock(&j->lock);
+				uint64_t ns = sync_log(j);
+				pthread_mutex_lock(&j->lock);
+
+				committed(j, id, ns);
+				continue;
+			}
+
+			j->flushRequested = false;
+			j->syncRequested = false;
+
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			timespec_add_ms(&until, IDLE_MS);
+
+			// once things are quiet, there's no reason to keep the log around.
+			if(pthread_cond_timedwait(&j->wake, &j->lock, &until) == ETIMEDOUT && j->logSize > 0) {
+				uint64_t id = j->written;
+
+				pthread_mutex_unlock(&j->lock);
+				checkpoint(j);
+				pthread_mutex_lock(&j->lock);
+
+				// the partition file has it all now.
+				if(j->durable < id) {
+					j->durable = id;
+					pthread_cond_broadcast(&j->changed);
+				}
+			}
+
+			continue;
+		}
+
+		uint64_t interval = COMMIT_INTERVAL_MS;
+		bool enough = false;
+		if(j->policy.mode == DURABILITY_PERIODIC) {
+			interval = j->policy.intervalMs;
+			enough = j->policy.ops > 0 && t->ended >= j->policy.ops;
+		}
+
+		if(!j->flushRequested && !j->syncRequested && !j->closing && !enough && t->used < COMMIT_BYTES) {
+			struct timespec until = t->first;
+			timespec_add_ms(&until, interval);
+
+			if(pthread_cond_timedwait(&j->wake, &j->lock, &until) != ETIMEDOUT) {
+				continue;
+			}
+		}
+
+		bool sync = j->syncRequested || j->policy.mode >= DURABILITY_PERIODIC;
+		j->flushRequested = false;
+		j->syncRequested = false;
+
+		// nobody new may join it, and everyone in it has to finish.
+		t->locked = true;
+		while(t->handles > 0) {
+			pthread_cond_wait(&j->changed, &j->lock);
+		}
+
+		j->running = new_txn(t->id + 1);
+		j->lastClosed = t->id;
+		pthread_cond_broadcast(&j->changed);
+
+		pthread_mutex_unlock(&j->lock);
+
+		commit(j, t);
+		uint64_t ns = sync ? sync_log(j) : 0;
+
+		pthread_mutex_lock(&j->lock);
+		j->stats.commits++;
+		committed(j, t->id, ns);
+		pthread_mutex_unlock(&j->lock);
+
+		uint64_t id = t->id;
+		apply(j, t);
+		free_txn(t);
+
+		if(j->logSize >= LOG_LIMIT) {
+			checkpoint(j);
+
+			pthread_mutex_lock(&j->lock);
+			if(j->durable < id) {
+				j->durable = id;
+				pthread_cond_broadcast(&j->changed);
+			}
+			pthread_mutex_unlock(&j->lock);
+		}
+
+		pthread_mutex_lock(&j->lock);
+	}
+
+	pthread_mutex_unlock(&j->lock);
+
+	return NULL;
+}
+
+/**
+ * Opens the log at path for the partition file open as fd, starting it over
+ * if fresh is set (the partition file was just created) and otherwise
+ * replaying whatever it holds into the partition file first.
+ */
+journal *journal_open(char *path, int fd, bool fresh) {
+	journal *j = calloc(1, sizeof(journal));
+
+	j->fd = fd;
+	j->path = strdup(path);
+	j->logFd = open(path, O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0), 0644);
+
+	if(j->logFd < 0) {
+		fprintf(stderr, "Unable to open the journal %s!\n", path);
+		_exit(2);
+	}
+
+	if(!fresh) {
+		replay(j);
+	}
+
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->wake, NULL);
+	pthread_cond_init(&j->changed, NULL);
+	// lookups walking the free list without locks take it over and over when
+	// they retry, so writers must not have to wait for readers to run out.
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&j->overlayLock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	j->running = new_txn(1);
+	j->policy.mode = DURABILITY_PERIODIC;
+	j->policy.intervalMs = COMMIT_INTERVAL_MS;
+
+	pthread_create(&j->thread, NULL, journal_thread, j);
+
+	return j;
+}
+
+/**
+ * Commits everything written so far, writes it to the partition file, syncs
+ * it and removes the log. Ends the calling thread's transaction if it has
+ * one; no other thread may still be in one.
+ */
+void journal_close(journal *j) {
+	if(handleJournal == j && handleDepth > 0) {
+		handleDepth = 1;
+		journal_stop(j);
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->closing = true;
+	pthread_cond_signal(&j->wake);
+	pthread_mutex_unlock(&j->lock);
+
+	pthread_join(j->thread, NULL);
+
+	// the log is only needed until the partition file is synced.
+	checkpoint(j);
+	close(j->logFd);
+	unlink(j->path);
+
+	free_txn(j->running);
+
+	pthread_rwlock_destroy(&j->overlayLock);
+	pthread_cond_destroy(&j->changed);
+	pthread_cond_destroy(&j->wake);
+	pthread_mutex_destroy(&j->lock);
+
+	free(j->path);
+	free(j);
+}
+
+/**
+ * Starts a transaction for the calling thread: everything it writes until
+ * journal_stop is committed together. Transactions nest, only the outermost
+ * pair counts. Must not be called while holding locks another transaction
+ * may wait on, since it waits for the transaction being committed to finish.
+ */
+void journal_start(journal *j) {
+	if(handleDepth++ > 0) {
+		return;
+	}
+
+	handleJournal = j;
+
+	pthread_mutex_lock(&j->lock);
+
+	while(j->running->locked) {
+		pthread_cond_wait(&j->changed, &j->lock);
+	}
+
+	j->running->handles++;
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * Ends the calling thread's transaction. Returns whether it was the outermost
+ * one, so the transaction is really over.
+ */
+bool journal_stop(journal *j) {
+	if(handleDepth == 0 || --handleDepth > 0) {
+		return false;
+	}
+
+	handleJournal = NULL;
+
+	pthread_mutex_lock(&j->lock);
+
+	// the transaction can't have been replaced while we were in it.
+	txn *t = j->running;
+	j->stats.transactions++;
+
+	if(--t->handles == 0 && t->locked) {
+		pthread_cond_broadcast(&j->changed);
+	}
+
+	if(++t->ended == j->policy.ops && j->policy.mode == DURABILITY_PERIODIC) {
+		pthread_cond_signal(&j->wake);
+	}
+
+	pthread_mutex_unlock(&j->lock);
+
+	return true;
+}
+
+/**
+ * Logs numBytes bytes of data to be written at offset in the partition file.
+ * Writes made outside a transaction are committed with whatever is running.
+ */
+void journal_write(journal *j, uint64_t offset, const void *data, uint64_t numBytes) {
+	pthread_mutex_lock(&j->lock);
+
+	txn *t = j->running;
+
+	if(txn_empty(t)) {
+		clock_gettime(CLOCK_REALTIME, &t->first);
+		pthread_cond_signal(&j->wake);
+	}
+
+	uint64_t entry[2] = { offset, numBytes };
+	append(t, entry, sizeof(entry));
+	append(t, data, numBytes);
+	t->count++;
+
+	if(t->used >= COMMIT_BYTES) {
+		pthread_cond_signal(&j->wake);
+	}
+
+	pthread_rwlock_wrlock(&j->overlayLock);
+	overlay_write(j, t->id, offset, data, numBytes);
+	pthread_rwlock_unlock(&j->overlayLock);
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * Fills data with numBytes bytes at offset as the partition currently has
+ * them, if any of them haven't made it to the partition file yet. Returns
+ * false without touching data otherwise, in which case the file is current.
+ */
+bool journal_read(journal *j, uint64_t offset, void *data, uint64_t numBytes) {
+	if(__atomic_load_n(&j->numPages, __ATOMIC_ACQUIRE) == 0) {
+		return false;
+	}
+
+	pthread_rwlock_rdlock(&j->overlayLock);
+
+	if(!overlaps(j, offset, numBytes)) {
+		pthread_rwlock_unlock(&j->overlayLock);
+		return false;
+	}
+
+	// pages we don't have are current in the file. The ones we do have can't
+	// be let go while we hold the lock, so whatever we read of them is
+	// overwritten with the right contents.
+	read_fully(j->fd, offset, data, numBytes);
+
+	uint8_t *dst = data;
+	while(numBytes > 0) {
+		uint64_t number = offset / JOURNAL_PAGE;
+		uint64_t in = offset % JOURNAL_PAGE;
+		uint64_t len = JOURNAL_PAGE - in < numBytes ? JOURNAL_PAGE - in : numBytes;
+
+		page *pg = find_page(j, number);
+		if(pg != NULL) {
+			memcpy(dst, pg->data + in, len);
+		}
+
+		offset += len;
+		dst += len;
+		numBytes -= len;
+	}
+
+	pthread_rwlock_unlock(&j->overlayLock);
+
+	return true;
+}
+
+/**
+ * Whether any of numBytes bytes at offset haven't made it to the partition
+ * file yet.
+ */
+bool journal_pending(journal *j, uint64_t offset, uint64_t numBytes) {
+	if(__atomic_load_n(&j->numPages, __ATOMIC_ACQUIRE) == 0) {
+		return false;
+	}
+
+	pthread_rwlock_rdlock(&j->overlayLock);
+	bool pending = overlaps(j, offset, numBytes);
+	pthread_rwlock_unlock(&j->overlayLock);
+
+	return pending;
+}
+
+/**
+ * Hands numBytes bytes at offset back to the host filesystem once the
+ * running transaction has been committed, ahead of any later writes there.
+ */
+void journal_punch(journal *j, uint64_t offset, uint64_t numBytes) {
+	pthread_mutex_lock(&j->lock);
+
+	txn *t = j->running;
+
+	if(txn_empty(t)) {
+		clock_gettime(CLOCK_REALTIME, &t->first);
+		pthread_cond_signal(&j->wake);
+	}
+
+	if(t->numPunches == t->capPunches) {
+		t->capPunches = t->capPunches ? t->capPunches * 2 : 16;
+		t->punches = realloc(t->punches, 2 * t->capPunches * sizeof(uint64_t));
+	}
+
+	t->punches[2 * t->numPunches] = offset;
+	t->punches[2 * t->numPunches + 1] = numBytes;
+	t->numPunches++;
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+// commits everything written so far and waits until it's in the log, and on
+// stable storage too if sync is set. Ends and restarts the calling thread's
+// transaction if it has one, so it's committed too.
+static void wait_committed(journal *j, bool sync) {
+	int depth = (handleJournal == j) ? handleDepth : 0;
+
+	if(depth > 0) {
+		handleDepth = 1;
+		journal_stop(j);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&j->lock);
+
+	uint64_t target = txn_empty(j->running) ? j->lastClosed : j->running->id;
+
+	if(sync) {
+		j->syncRequested = true;
+	} else {
+		j->flushRequested = true;
+	}
+	pthread_cond_signal(&j->wake);
+
+	while((sync ? j->durable : j->written) < target) {
+		pthread_cond_wait(&j->changed, &j->lock);
+	}
+
+	j->stats.waits++;
+	j->stats.waitNs += elapsed_ns(&start);
+
+	pthread_mutex_unlock(&j->lock);
+
+	if(depth > 0) {
+		journal_start(j);
+		handleDepth = depth;
+	}
+}
+
+/**
+ * Commits everything written so far and waits until it's in the log on
+ * stable storage. Ends and restarts the calling thread's transaction if it
+ * has one, so it's committed too.
+ */
+void journal_sync(journal *j) {
+	wait_committed(j, true);
+}
+
+/**
+ * Like journal_sync, but only waits until everything is written to the log,
+ * not until it's on stable storage.
+ */
+void journal_flush(journal *j) {
+	wait_committed(j, false);
+}
+
+/**
+ * Changes when the journal commits and syncs, see durability_mode. Starts out
+ * as DURABILITY_PERIODIC every 5 milliseconds.
+ */
+void journal_set_policy(journal *j, durability_policy policy) {
+	pthread_mutex_lock(&j->lock);
+	j->policy = policy;
+	pthread_cond_signal(&j->wake);
+	pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * Retrieves the journal's durability policy.
+ */
+durability_policy journal_get_policy(journal *j) {
+	pthread_mutex_lock(&j->lock);
+	durability_policy policy = j->policy;
+	pthread_mutex_unlock(&j->lock);
+
+	return policy;
+}
+
+/**
+ * Retrieves what the journal has done so far.
+ */
+journal_stats journal_get_stats(journal *j) {
+	pthread_mutex_lock(&j->lock);
+	journal_stats stats = j->stats;
+	pthread_mutex_unlock(&j->lock);
+
+	return stats;
+}
@@ -0,0 +1,202 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+// the match table has 1 << HASH_BITS entries.
+#define HASH_BITS 12
+
+// after this many misses in a row the compressor starts skipping ahead.
+#define SKIP_AFTER 32
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// appends what's left of a length that didn't fit in its token's four bits.
+static bool put_length(uint8_t *dst, uint32_t *out, uint32_t cap, uint32_t n) {
+	while(n >= 255) {
+		if(*out >= cap) {
+			return false;
+		}
+		dst[(*out)++] = 255;
+		n -= 255;
+	}
+
+	if(*out >= cap) {
+		return false;
+	}
+	dst[(*out)++] = n;
+
+	return true;
+}
+
+// appends a sequence of litLen literals followed by a match, or by nothing
+// if matchLen is 0.
+static bool put_sequence(uint8_t *dst, uint32_t *out, uint32_t cap, const uint8_t *lit, uint32_t litLen, uint32_t offset, uint32_t matchLen) {
+	uint32_t litCode = litLen < 15 ? litLen : 15;
+	uint32_t matchCode = 0;
+
+	if(matchLen > 0) {
+		matchCode = matchLen - MIN_MATCH < 15 ? matchLen - MIN_MATCH : 15;
+	}
+
+	if(*out >= cap) {
+		return false;
+	}
+	dst[(*out)++] = (litCode << 4) | matchCode;
+
+	if(litCode == 15 && !put_length(dst, out, cap, litLen - 15)) {
+		return false;
+	}
+
+	if(litLen > cap - *out) {
+		return false;
+	}
+	memcpy(dst + *out, lit, litLen);
+	*out += litLen;
+
+	if(matchLen == 0) {
+		return true;
+	}
+
+	if(cap - *out < 2) {
+		return false;
+	}
+	dst[(*out)++] = offset & 0xFF;
+	dst[(*out)++] = offset >> 8;
+
+	return matchCode < 15 || put_length(dst, out, cap, matchLen - MIN_MATCH - 15);
+}
+
+// reads the rest of a length whose token said 15.
+static bool get_length(const uint8_t *src, uint32_t *in, uint32_t len, uint32_t *n) {
+	uint8_t b;
+
+	do {
+		if(*in >= len) {
+			return false;
+		}
+		b = src[(*in)++];
+		*n += b;
+	} while(b == 255);
+
+	return true;
+}
+
+/**
+ * Compresses len bytes of src into dst, which has room for cap bytes.
+ * Returns the compressed size, or 0 if it would take more than cap bytes.
+ */
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap) {
+	uint32_t table[1 << HASH_BITS]; // where each hash was last seen, plus one.
+	uint32_t anchor = 0; // the first byte not in a sequence yet.
+	uint32_t pos = 0;
+	uint32_t out = 0;
+	uint32_t misses = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while(pos + MIN_MATCH <= len) {
+		uint32_t v = read32(src + pos);
+		uint32_t h = hash4(v);
+		uint32_t cand = table[h];
+		table[h] = pos + 1;
+
+		if(cand == 0 || pos - (cand - 1) > MAX_OFFSET || read32(src + cand - 1) != v) {
+			// the longer nothing matches, the further ahead the next look is, so
+			// data that doesn't compress is got through quickly.
+			pos += 1 + misses++ / SKIP_AFTER;
+			continue;
+		}
+
+		cand--;
+
+		uint32_t matchLen = MIN_MATCH;
+		while(pos + matchLen < len && src[cand + matchLen] == src[pos + matchLen]) {
+			matchLen++;
+		}
+
+		if(!put_sequence(dst, &out, cap, src + anchor, pos - anchor, pos - cand, matchLen)) {
+			return 0;
+		}
+
+		pos += matchLen;
+		anchor = pos;
+		misses = 0;
+	}
+
+	if(!put_sequence(dst, &out, cap, src + anchor, len - anchor, 0, 0)) {
+		return 0;
+	}
+
+	return out;
+}
+
+/**
+ * Decompresses the len bytes at src, which must come out as exactly out
+ * bytes, into dst. Returns false if src isn't something lz_compress made.
+ */
+bool lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out) {
+	uint32_t in = 0;
+	uint32_t at = 0;
+
+	while(in < len) {
+		uint8_t token = src[in++];
+
+		uint32_t litLen = token >> 4;
+		if(litLen == 15 && !get_length(src, &in, len, &litLen)) {
+			return false;
+		}
+
+		if(litLen > len - in || litLen > out - at) {
+			return false;
+		}
+
+		memcpy(dst + at, src + in, litLen);
+		in += litLen;
+		at += litLen;
+
+		// the last sequence has no match.
+		if(in == len) {
+			break;
+		}
+
+		if(len - in < 2) {
+			return false;
+		}
+
+		uint32_t offset = src[in] | (src[in + 1] << 8);
+		in += 2;
+
+		uint32_t matchLen = token & 15;
+		if(matchLen == 15 && !get_length(src, &in, len, &matchLen)) {
+			return false;
+		}
+		matchLen += MIN_MATCH;
+
+		if(offset == 0 || offset > at || matchLen > out - at) {
+			return false;
+		}
+
+		// a match can overlap what it's copying, a byte at a time handles that.
+		if(offset >= matchLen) {
+			memcpy(dst + at, dst + at - offset, matchLen);
+		} else {
+			for(uint32_t i = 0; i < matchLen; i++) {
+				dst[at + i] = dst[at - offset + i];
+			}
+		}
+		at += matchLen;
+	}
+
+	return at == out;
+}
@@ -1,93 +1,480 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
 #include "partitioner.h"
+#include "rangemap.h"
 
-// file pointer to beginning of this partition
-static FILE *part;
 
-// in-memory version of the partition directory
-static void* partDir;
+// Mark the start of every block header. Before headers had checksums these
+// were 64 bits (0xEDA70C110A and 0xEEF4EEF4), these are the halves a little
+// endian machine put first, so older headers still read as what they are.
+const uint32_t ALLOCATED = 0xA70C110A;
+const uint32_t FREE = 0xEEF4EEF4;
 
+// identifies a partition with a full size descriptor. Older partitions had a
+// 32 byte descriptor, so this spot held the magic of the first block instead.
+const uint64_t SUPERBLOCK = 0x5041525449544E32;
 
-// little endian machines flip these Magic values.
-const uint64_t ALLOCATED =  0xEDA70C110A;
-const uint64_t FREE = 0xEEF4EEF4;
+// bumped whenever the on-disk layout changes. Partitions as old as
+// FORMAT_OLDEST are still loaded so the layers above can convert them.
+#define FORMAT_VERSION 11
+#define FORMAT_OLDEST 2
+
+// partitions with snapshots need at least this version, so older builds that
+// would write over what the snapshots share refuse them.
+#define FORMAT_SNAPSHOTS 5
+
+// marks the start of the snapshot table.
+const uint64_t SNAPSHOTS = 0x534E415053484F54;
+
+// partitions with shared blocks need at least this version, so older builds
+// that would free a block other files still use refuse them.
+#define FORMAT_SHARES 6
+
+// marks the start of the share table.
+const uint64_t SHARES = 0x5348415245544253;
+
+// partitions with a dedup index need at least this version, so older builds
+// that would change indexed blocks without taking them out of it refuse them.
+#define FORMAT_DEDUP 7
+
+// marks the start of the dedup table.
+const uint64_t DEDUP = 0x4445445550494458;
+
+// partitions whose block headers all have checksums are at least this
+// version, older ones get them in checksum_block_headers.
+#define FORMAT_CHECKSUMS 9
+
+// partitions that may have an index checkpoint are at least this version,
+// so older builds that would change the free list without moving the
+// generation on, leaving a stale checkpoint looking current, refuse them.
+#define FORMAT_CHECKPOINT 10
+
+// marks the start of the index checkpoint.
+const uint64_t CHECKPOINT = 0x43484B504F494E54;
+
+// partitions whose descriptor counts their space are at least this version,
+// so older builds that would change the lists without counting refuse them.
+#define FORMAT_COUNTERS 11
+
+// how many of the biggest free blocks the descriptor keeps track of.
+#define FREE_TOP 4
+
+// what's exited with when something doesn't match its checksum.
+#define DAMAGED 5
+
+// the journal of partition file foo is kept in foo.journal.
+#define JOURNAL_SUFFIX ".journal"
+
+// the descriptor is padded out so new fields don't move the first block.
+#define DESCRIPTOR_SIZE 512
+
+// share of the partition reserved for metadata in the split layout.
+#define META_ZONE_SHARE 8
+
+// a free block in the descriptor's list of the biggest ones, id 0 if unused.
+typedef struct free_extent {
+	block_id id;
+	block_size_t size;
+} free_extent;
 
 typedef struct directory {
 	block_id alloc_block_id;
 	block_id free_block_id;
 	block_id root_dir_id;
 	block_size_t partition_size;
+	uint64_t magic;
+	uint64_t version;
+	uint64_t layout;
+	block_size_t meta_zone_size; // bytes at the start of the partition set aside for metadata.
+	block_id snapshot_table; // block holding the snapshot table, 0 if there are no snapshots.
+	block_id share_table; // block holding the share table, 0 if no block is shared.
+	block_id dedup_table; // block holding the dedup table, 0 if the dedup index is empty.
+	block_id checkpoint; // block holding the index checkpoint, 0 if there's none.
+	uint64_t generation; // moved on every time the partition is opened, see load_checkpoint.
+	block_id usage_table; // block holding the layers above's usage table, 0 if there's none.
+	// how the space is used, see note_free and space_stats.
+	block_size_t allocated_bytes;
+	uint64_t allocated_blocks;
+	block_size_t free_bytes;
+	uint64_t free_blocks;
+	free_extent largest[FREE_TOP]; // the biggest free blocks, biggest first.
+	block_size_t free_floor; // no free block missing from largest is bigger than this.
+	uint64_t free_classes[FREE_CLASSES];
+	// the blocks convert_legacy moved out of the descriptor's way, see relocated_id.
+	block_id relocated_from;
+	block_id relocated_to;
+	block_size_t relocated_size;
+	uint8_t reserved[DESCRIPTOR_SIZE - 432];
 } directory;
 
+// fails to compile if the fields outgrow the descriptor.
+typedef char directory_fits[sizeof(directory) == DESCRIPTOR_SIZE ? 1 : -1];
+
+// The descriptor of partitions from before it grew, with their first block
+// right after it.
+typedef struct legacy_directory {
+	block_id alloc_block_id;
+	block_id free_block_id;
+	block_id root_dir_id;
+	block_size_t partition_size;
+} legacy_directory;
+
 typedef struct block_header {
-	uint64_t magic; // indicates allocated or free.
+	uint32_t magic; // indicates allocated or free.
+	uint32_t check; // CRC32C of the header with this field 0, see seal_header.
 	uint64_t size; // size of the _contents_ of this block.
 	block_id previous_id;
 	block_id next_id;
 	// between here and the end of the block is the contents of the block.
 } block_header;
 
-/*
+// free blocks smaller than this aren't worth splitting off from an allocation.
+#define MIN_REMNANT 512
+
+// The partition is divided into allocation groups of this many bytes so that
+// related blocks (a directory and its children) can be kept close together.
+#define GROUP_SIZE (4 * 1024 * 1024)
+
+// In-memory index over the free list, rebuilt when the partition is loaded.
+// Both fields are read without locks, so they're only touched atomically.
+typedef struct group_info {
+	block_id first_free; // first free block starting in this group, 0 if none.
+	block_size_t free_bytes; // free bytes lying inside this group.
+} group_info;
+
+// free blocks smaller than this are never punched, the system call isn't worth it.
+#define PUNCH_MIN (64 * 1024)
+
+// in deferred mode, the free list is punched after this many bytes have been freed.
+#define PUNCH_BATCH (16 * 1024 * 1024)
+
+// holes are punched in whole host pages.
+#define PUNCH_PAGE 4096
+
+// Free blocks are guarded by stripe locks, group g by stripe g % NUM_STRIPES.
+// One more lock after them guards the head of the free list.
+#define NUM_STRIPES 64
+#define HEAD_STRIPE NUM_STRIPES
+
+// the most stripes a single free list change needs.
+#define LOCKSET_MAX 5
+
+// a free list change that finds the list changed under it this many times
+// in a row stops racing the others and holds every stripe while it looks.
+#define MAX_RETRIES 64
+
+// Threads are handed out arenas in the order they first allocate or free,
+// wrapping around once there are more threads than arenas. Each arena has a
+// home slice of the allocation groups.
+#define NUM_ARENAS 16
+
+// frees a thread makes in another arena's slice are queued for that arena
+// and released together once this many have piled up.
+#define REMOTE_BATCH 64
+
+// a block freed in another arena's slice, waiting to go back on the free list.
+typedef struct remote_free {
+	block_id blk;
+	block_size_t size; // header included.
+	struct remote_free *next;
+} remote_free;
+
+typedef struct arena {
+	remote_free *inbox; // pushed onto by other threads without locks.
+	uint64_t inboxCount;
+} arena;
+
+// The snapshot table starts with this, followed by a record for every
+// snapshot, oldest first.
+typedef struct snapshot_table {
+	uint64_t magic;
+	uint64_t nextGen; // the generation the next snapshot gets.
+	uint64_t count;
+	uint64_t reserved;
+} snapshot_table;
+
+typedef struct snapshot_record {
+	char name[SNAPSHOT_NAME_MAX + 1];
+	uint64_t gen;
+	block_id root;
+	uint64_t created;
+	block_id entries; // block holding its remap entries, 0 if it has none.
+	uint64_t count; // remap entries.
+} snapshot_record;
+
+// bytes [start, end) of the partition as a snapshot has them are at copy
+// now, in block blk.
+typedef struct remap_entry {
+	uint64_t start;
+	uint64_t end;
+	uint64_t copy;
+	block_id blk;
+} remap_entry;
+
+// A snapshot, see create_snapshot. Its generation doubles as its id. The
+// remap has a range for every part of the partition the snapshot still needs
+// that has been changed since, the value saying where the old bytes were
+// copied to and extra the block holding them.
+typedef struct snapshot {
+	uint64_t gen;
+	char name[SNAPSHOT_NAME_MAX + 1];
+	block_id root;
+	uint64_t created;
+	block_id entries;
+	block_size_t kept; // bytes in the remap.
+	uint64_t mounts; // see mount_snapshot.
+	rangemap *remap;
+	struct snapshot *next;
+} snapshot;
+
+// The share table starts with this, followed by an entry for every block
+// with more than one owner, in no particular order.
+typedef struct share_table {
+	uint64_t magic;
+	uint64_t count;
+} share_table;
+
+typedef struct share_entry {
+	block_id blk;
+	uint64_t refs;
+} share_entry;
+
+// The dedup table starts with this, followed by an entry for every block in
+// the dedup index, in no particular order.
+typedef struct dedup_table {
+	uint64_t magic;
+	uint64_t count;
+} dedup_table;
+
+typedef struct dedup_entry {
+	uint64_t hash;
+	block_id blk;
+	uint64_t bytes; // how many bytes from the start of the block were hashed.
+	uint64_t reserved;
+} dedup_entry;
+
+// a mapping map_block has outgrown, kept so pointers into it stay valid.
+typedef struct old_mapping {
+	const uint8_t *addr;
+	size_t size;
+	struct old_mapping *next;
+} old_mapping;
 
-size_t fread(void *buffer, size_t size, size_t count, FILE *stream);
+/*
+ * Everything there is to know about an open partition.
+ *
+ * Block contents are read and written with pread/pwrite and need no locks.
+ * Writes go through the journal, which holds on to them until they're
+ * committed and reads check first.
+ * Changes to the free list take the shared side of lock plus the stripes of
+ * the free blocks involved, found by walking the list without locks and
+ * checked again once the stripes are held. Growing the partition takes lock
+ * exclusively, since it moves the group index.
+ */
+struct partition {
+	int fd;
+	directory dir; // in-memory version of the partition directory
+
+	journal *journal;
+
+	group_info *groups;
+	uint64_t numGroups;
+
+	pthread_rwlock_t lock;
+	pthread_mutex_t stripes[NUM_STRIPES + 1];
+	pthread_mutex_t allocLock; // guards the allocated list, allocated block headers and the space counters.
+
+	// read-only view of the partition file for map_block, replaced when the file grows.
+	pthread_mutex_t mapLock;
+	const uint8_t *mapping;
+	size_t mappingSize;
+	old_mapping *oldMappings;
+
+	punch_mode punchMode;
+	block_size_t punchPending; // bytes freed since the last deferred pass.
+
+	verify_mode verify;
+
+	growth_policy growth;
+
+	arena arenas[NUM_ARENAS];
+	uint32_t arenasActive; // bit i is set once a thread has used arena i.
+
+	// Every transaction holds snapLock shared, so taking it exclusively waits
+	// for everyone to be between commands, which is when snapshots are taken
+	// and deleted. snapMutex guards the rest. Blocks allocated while there
+	// are snapshots are in births with the generation they were allocated
+	// in, so writing to them copies nothing aside for snapshots older than
+	// them; anything not in it may be shared with every snapshot. refs has a
+	// one byte range at every block holding bytes kept for snapshots, with
+	// how many snapshots use it.
+	pthread_rwlock_t snapLock;
+	pthread_mutex_t snapMutex;
+	snapshot *snapshots; // oldest first.
+	uint64_t numSnapshots; // read without snapMutex to skip all of this when there are none.
+	uint64_t nextGen;
+	rangemap *births;
+	rangemap *refs;
+
+	// shares has a one byte range at every block shared with share_block,
+	// with how many owners it has, in the same order as the share table.
+	pthread_mutex_t shareMutex;
+	rangemap *shares;
+	uint64_t numShared; // read without shareMutex to skip it when nothing is shared.
+
+	// The dedup index, see dedup_block. byHash has a one byte range at the
+	// hash of every block in it, with the block and how many of its bytes
+	// were hashed, in the same order as the dedup table. byBlock has one at
+	// every block in it, with its hash. Lock dedupMutex before shareMutex.
+	pthread_mutex_t dedupMutex;
+	bool dedup; // see setDedup.
+	bool compress; // see setCompression.
+	rangemap *byHash;
+	rangemap *byBlock;
+	uint64_t numIndexed; // read without dedupMutex to skip it when the index is empty.
+	uint64_t dedupHits;
+};
+
+// the partition opened by initialize, used by threads that haven't picked one.
+static partition *defaultPartition;
+static __thread partition *threadPartition;
+
+static partition *current() {
+	return threadPartition != NULL ? threadPartition : defaultPartition;
+}
 
-buffer	 -	 pointer to the array where the read objects are stored
-size	 -	 size of each object in bytes
-count	 -	 the number of the objects to be read
-stream	 -	 the stream to read
+// handed out to threads as they first touch a partition, see arena_of.
+static uint32_t threadsSeen;
+static __thread int threadIndex = -1;
 
--------------
+// how end_transaction waits on this thread, see setSessionDurability.
+static __thread bool sessionDurable;
+static __thread durability_mode sessionDurability;
 
-size_t fwrite(const void *buffer, size_t size, size_t count, FILE *stream);
+// the snapshot this thread reads from, 0 for none, see view_snapshot.
+static __thread uint64_t threadView;
 
-buffer	 -	 pointer to the first object object in the array to be written
-size	 -	 size of each object
-count	 -	 the number of the objects to be written
+// how deep this thread is in transactions, it holds snapLock shared while it's in one.
+static __thread int transactionDepth;
 
-*/
+// where an allocation is allowed to go in the split layout.
+typedef enum zone {
+	ZONE_ANY,
+	ZONE_META,
+	ZONE_DATA
+} zone;
 
-// Byte offset from the beginning of the file
-void readPartition(uint64_t offset, void *data, uint64_t numBytes) {
-	rewind(part);
-	// The amount of rewinding is likely excessive, but has nice guarentees.
+// Byte offset from the beginning of the file. Returns true if some of it came
+// from the journal instead, whose pages this program wrote itself.
+bool readPartition(partition *p, uint64_t offset, void *data, uint64_t numBytes) {
+	uint8_t *dst = data;
 
-	if(fseek(part, offset, SEEK_SET)) {
-		fprintf(stderr, "Error: seeking within partition failed.\n");
-		_exit(0xbabecafe);
+	// the journal may have newer contents than the file.
+	if(journal_read(p->journal, offset, data, numBytes)) {
+		return true;
 	}
 
-	if(fread(data, numBytes, 1, part) != 1) {
-		fprintf(stderr, "Error: reading from partition at offset %llu failed.\n", offset);
-		_exit(0xcafebabe);
+	while(numBytes > 0) {
+		ssize_t n = pread(p->fd, dst, numBytes, offset);
+
+		if(n <= 0) {
+			fprintf(stderr, "Error: reading from partition at offset %" PRIu64 " failed.\n", offset);
+			_exit(0xcafebabe);
+		}
+
+		dst += n;
+		offset += n;
+		numBytes -= n;
 	}
-	
-	rewind(part);
+
+	return false;
 }
 
 // Offset from the beginning of the file.
-void writePartition(uint64_t offset, void *data, uint64_t numBytes) {
-	rewind(part);
-	// The amount of rewinding is likely excessive, but has nice guarentees.
+// The write reaches the file once the transaction it's in has been committed.
+void writePartition(partition *p, uint64_t offset, void *data, uint64_t numBytes) {
+	journal_write(p->journal, offset, data, numBytes);
+}
 
-	if(fseek(part, offset, SEEK_SET)) {
-		fprintf(stderr, "Error: seeking within partition failed.\n");
-		_exit(0xbabecafe);
+// writes one field of the in-memory descriptor back, so changes to different
+// fields don't have to be serialized against each other.
+#define save_field(p, field) \
+	writePartition((p), offsetof(directory, field), &(p)->dir.field, sizeof((p)->dir.field))
+
+// whether something just read should be checked against its checksum, given
+// whether it came from the journal, see verify_mode.
+static bool should_check(partition *p, bool fromJournal) {
+	switch(__atomic_load_n(&p->verify, __ATOMIC_RELAXED)) {
+		case VERIFY_ALWAYS:
+			return true;
+		case VERIFY_FILL:
+			return !fromJournal;
+		default:
+			return false;
 	}
-	
-	if(fwrite(data, numBytes, 1, part) != 1) {
-		fprintf(stderr, "Error: writing to partition failed.\n");
-		_exit(0xcafebabe);
+}
+
+// fills in the header's checksum, which covers the rest of it.
+static void seal_header(block_header *bh) {
+	bh->check = 0;
+	bh->check = crc32c(0, bh, sizeof(block_header));
+}
+
+// exits if the header read from id doesn't match its checksum, when it
+// should be checked at all.
+static void check_header(partition *p, block_id id, block_header *bh, bool fromJournal) {
+	if(__atomic_load_n(&p->dir.version, __ATOMIC_RELAXED) < FORMAT_CHECKSUMS || !should_check(p, fromJournal)) {
+		return;
 	}
 
-	rewind(part);
+	block_header copy = *bh;
+	seal_header(&copy);
+
+	if(copy.check != bh->check) {
+		fprintf(stderr, "Error: the header of block %" PRIu64 " is damaged, its checksum doesn't match.\n", id);
+		_exit(DAMAGED);
+	}
+}
+
+// reads the header of the block at id, checking it.
+static void read_header(partition *p, block_id id, block_header *bh) {
+	check_header(p, id, bh, readPartition(p, id, bh, sizeof(block_header)));
+}
+
+// seals bh and writes it as the header of the block at id.
+static void write_header(partition *p, block_id id, block_header *bh) {
+	seal_header(bh);
+	writePartition(p, id, bh, sizeof(block_header));
+}
+
+// raises the partition's format version to at least version. Callers hold
+// different locks, or none, so the version only moves up through a CAS.
+static void raise_version(partition *p, uint64_t version) {
+	uint64_t old = __atomic_load_n(&p->dir.version, __ATOMIC_RELAXED);
+
+	while(old < version) {
+		if(__atomic_compare_exchange_n(&p->dir.version, &old, version, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			save_field(p, version);
+			return;
+		}
+	}
 }
 
 // we identify the block physically adjacent s.t. it follows the specified block
 block_id look_right(block_id blknum) {
+	partition *p = current();
 	block_header bh;
-	readPartition(blknum, &bh, sizeof(block_header));
+	read_header(p, blknum, &bh);
 
 	uint64_t next = blknum + bh.size + (bh.magic == ALLOCATED ? sizeof(block_header) : 0);
-	if(next >= sizeof(directory) + ((directory*)partDir)->partition_size) {
+	if(next >= sizeof(directory) + p->dir.partition_size) {
 		// this is the last block in the filesystem.
 		return 0;
 	}
@@ -124,519 +511,5200 @@ block_id look_left(block_id blk) {
 	return currentBlk;
 }
 
-//////
-//
-// PUBLICLY ACCESSIBLE FUNCTIONS BELOW.
-//
-/////
-
-
-/**
- * Creates a file represting our file system partition on
- * in the current OS's filesystem.
- *
- * If the file specified already exists, it is simply loaded in order
- * to allow for further interaction with the partition.
- *
- * If the file does not exist, one is created with at least the specified
- * number of bytes.
- *
- * Returns a non-zero value if it opened an existing file.
- *
- */
-int initialize(char* filename, uint64_t numBytes) {
-	if(access(filename, F_OK ) != -1) {
-		// file already exists
-
-		part = fopen(filename, "rb+");
-
-		if(part == NULL) {
-			fprintf(stderr, "Unable to open file!\n");
-			_exit(2);
-		}
+static uint64_t group_of(block_id blk) {
+	return (blk - sizeof(directory)) / GROUP_SIZE;
+}
 
-		// make space for it in memory
-		partDir = malloc(sizeof(directory));
-		// copy directory to memory.
-		readPartition(0, partDir, sizeof(directory));
+static block_id group_start(uint64_t group) {
+	return sizeof(directory) + group * GROUP_SIZE;
+}
 
-		return 1;
+static block_id partition_end(partition *p) {
+	return sizeof(directory) + p->dir.partition_size;
+}
 
-	} else {
-		part = fopen(filename, "w+"); // open for read/write, at beginning
+// adds or removes the byte range from the free byte counts of the groups it spans.
+static void index_account(partition *p, block_id start, block_size_t len, bool add) {
+	while(len > 0) {
+		uint64_t g = group_of(start);
+		block_size_t piece = group_start(g + 1) - start;
 
-		if(part == NULL) {
-			fprintf(stderr, "Unable to open file!\n");
-			_exit(2);
+		if(piece > len) {
+			piece = len;
 		}
 
-		partDir = calloc(1, sizeof(directory));
-		directory *dirPtr = (directory*)partDir;
-
-		dirPtr->free_block_id = sizeof(directory); // we know the id's are just byte offsets, this is the first block.
-		dirPtr->partition_size = numBytes;
-		writePartition(0, dirPtr, sizeof(directory));
-
-
-		block_header newBlock;
-		newBlock.size = numBytes;
-		newBlock.magic = FREE;
-		newBlock.previous_id = 0;
-		newBlock.next_id = 0;
-
-		// now we need to fill the file in with enough space for the sectors to
-		// have it simulate being a hard drive.
-		uint8_t zeroed_sector = 0;
-
-		fseek(part, sizeof(directory), SEEK_SET); // start at the end of the partition directory.		
-		for(block_size_t i = 0; i < numBytes; i++) {
-			if(fwrite(&zeroed_sector, 1, 1, part) != 1) {
-				fprintf(stderr, "Unable to completely allocate the partition!!\n");
-				return 1;
+		if(g < p->numGroups) {
+			if(add) {
+				__atomic_fetch_add(&p->groups[g].free_bytes, piece, __ATOMIC_RELAXED);
+			} else {
+				__atomic_fetch_sub(&p->groups[g].free_bytes, piece, __ATOMIC_RELAXED);
 			}
 		}
-		rewind(part);
-
-		// now we need to initialize the initial free block
-		writePartition(dirPtr->free_block_id, &newBlock, sizeof(block_header));
 
-		fflush(part);
+		start += piece;
+		len -= piece;
+	}
+}
 
-		return 0;
+// a free block was added to the free list. The caller holds its stripe.
+static void index_link(partition *p, block_id blk) {
+	group_info *g = &p->groups[group_of(blk)];
+	block_id first = __atomic_load_n(&g->first_free, __ATOMIC_RELAXED);
 
+	if(first == 0 || blk < first) {
+		__atomic_store_n(&g->first_free, blk, __ATOMIC_RELAXED);
 	}
 }
 
-/**
- * Prints info about the state of the partition (descriptor block and free block table stats)
- * to the specified file descriptor.
- */
-void printInfo(FILE *dest) {
-	fprintf(dest, "\n\t* Partition Information *\n\nAllocated Space:\n");
-
-	directory d = *((directory*)partDir);
-	block_size_t totalBytes = 0;
+// a free block was removed from the free list, next is whatever followed it.
+// The caller holds its stripe.
+static void index_unlink(partition *p, block_id blk, block_id next) {
+	group_info *g = &p->groups[group_of(blk)];
 
-	block_id i = d.alloc_block_id;
-	uint64_t numBlocks = 0;
-	block_header bh;
-	while(i != 0) {
-		readPartition(i, &bh, sizeof(block_header));
-		fprintf(dest, "offset %llu: %llu bytes  (%llu usable)\n", i, bh.size + sizeof(block_header), bh.size);
-		totalBytes += bh.size + sizeof(block_header);
-		i = bh.next_id;
-		numBlocks++;
+	if(__atomic_load_n(&g->first_free, __ATOMIC_RELAXED) == blk) {
+		block_id first = (next != 0 && group_of(next) == group_of(blk)) ? next : 0;
+		__atomic_store_n(&g->first_free, first, __ATOMIC_RELAXED);
 	}
+}
 
-	fprintf(dest, "--> total allocated: %llu bytes  (%llu usable)\n\nFree Space:\n", totalBytes, totalBytes - (numBlocks * sizeof(block_header)));
-
-	totalBytes = 0;
-	numBlocks = 0;
+// the size class of a free block of size bytes, see space_stats.
+static int free_class(block_size_t size) {
+	int c = 0;
 
-	i = d.free_block_id;
-	while(i != 0) {
-		readPartition(i, &bh, sizeof(block_header));
-		fprintf(dest, "offset %llu: %llu bytes\n", i, bh.size);
-		totalBytes += bh.size;
-		i = bh.next_id;
-		numBlocks++;
+	while(c < FREE_CLASSES - 1 && size >= ((block_size_t)64 << c)) {
+		c++;
 	}
 
-	fprintf(dest, "--> total free: %llu bytes\n\n", totalBytes);
+	return c;
 }
 
-/**
- * Resizes an already allocated block in this partition, potentially moving it,
- * so you should upate the pointer to the one that is returned.
- *
- * Passing 0 in for the blk is equivalent to calling allocate_block.
- * 
- */
-block_id resize_block(block_id blk, block_size_t size) {
+// adds a free block to the descriptor's list of the biggest ones if it's one
+// of them. Whatever falls off the end, or doesn't make it on, raises the
+// floor, so the list's first block is the biggest one as long as the list
+// isn't empty. Returns whether anything changed.
+static bool rank_free(directory *d, block_id blk, block_size_t size) {
+	if(size <= d->free_floor) {
+		return false;
+	}
 
-	if(blk == 0) {
-		return allocate_block(size);
+	int i = 0;
+	while(i < FREE_TOP && d->largest[i].id != 0 && d->largest[i].size >= size) {
+		i++;
 	}
 
-	block_header head;
-	readPartition(blk, &head, sizeof(block_header));
+	if(i == FREE_TOP) {
+		d->free_floor = size;
+		return true;
+	}
 
-	block_id newBlk = allocate_block(size);
-	if(newBlk == 0) {
-		fprintf(stderr, "Error: request to resize block in partition failed, not enough space!");
-		_exit(-1);
+	if(d->largest[FREE_TOP - 1].id != 0 && d->largest[FREE_TOP - 1].size > d->free_floor) {
+		d->free_floor = d->largest[FREE_TOP - 1].size;
 	}
 
-	void* buf = malloc(size);
-	if(buf == NULL) {
-		fprintf(stderr, "The file you're moving is quite large, and this version of the partitioner only supports files that can wholly fit in the heap.\n");
-		_exit(-1);
+	memmove(&d->largest[i + 1], &d->largest[i], (FREE_TOP - 1 - i) * sizeof(free_extent));
+	d->largest[i].id = blk;
+	d->largest[i].size = size;
+
+	return true;
+}
+
+// counts a free block of size bytes at blk joining the free list, or with
+// gone, leaving it. A block that changes size leaves and joins again.
+// The caller holds allocLock.
+static void note_free(partition *p, block_id blk, block_size_t size, bool gone) {
+	directory *d = &p->dir;
+	int c = free_class(size);
+	bool ranked = false;
+
+	if(gone) {
+		d->free_bytes -= size;
+		d->free_blocks--;
+		d->free_classes[c]--;
+
+		for(int i = 0; i < FREE_TOP; i++) {
+			if(d->largest[i].id == blk) {
+				memmove(&d->largest[i], &d->largest[i + 1], (FREE_TOP - 1 - i) * sizeof(free_extent));
+				memset(&d->largest[FREE_TOP - 1], 0, sizeof(free_extent));
+				ranked = true;
+				break;
+			}
+		}
+	} else {
+		d->free_bytes += size;
+		d->free_blocks++;
+		d->free_classes[c]++;
+		ranked = rank_free(d, blk, size);
 	}
 
-	// will truncate the file if the request is smaller.
-	
-	load_block(blk, buf, size);
+	save_field(p, free_bytes);
+	save_field(p, free_blocks);
+	writePartition(p, offsetof(directory, free_classes) + c * sizeof(uint64_t), &d->free_classes[c], sizeof(uint64_t));
 
-	save_block(newBlk, buf, size);
+	if(ranked) {
+		save_field(p, largest);
+		save_field(p, free_floor);
+	}
+}
 
-	free(buf);
+// counts bytes (header included) and blocks joining the allocated list, or
+// leaving it if they're negative. The caller holds allocLock.
+static void note_allocated(partition *p, int64_t bytes, int64_t blocks) {
+	p->dir.allocated_bytes += bytes;
+	p->dir.allocated_blocks += blocks;
 
-	free_block(blk);
+	save_field(p, allocated_bytes);
+	save_field(p, allocated_blocks);
+}
 
-	return newBlk;
+// adds the block at id, with header bh, to the space counters.
+static void count_block(directory *d, block_id id, block_header *bh) {
+	if(bh->magic == FREE) {
+		d->free_bytes += bh->size;
+		d->free_blocks++;
+		d->free_classes[free_class(bh->size)]++;
+		rank_free(d, id, bh->size);
+	} else {
+		d->allocated_bytes += bh->size + sizeof(block_header);
+		d->allocated_blocks++;
+	}
 }
 
-/**
- * Allocates a new block in the partition.
- */
-block_id allocate_block(block_size_t request_size) {
-	block_header current;
-	block_id currentPosition;
-	directory *dir = (directory*)partDir;
+static void clear_space(directory *d) {
+	d->allocated_bytes = 0;
+	d->allocated_blocks = 0;
+	d->free_bytes = 0;
+	d->free_blocks = 0;
+	d->free_floor = 0;
+	memset(d->largest, 0, sizeof(d->largest));
+	memset(d->free_classes, 0, sizeof(d->free_classes));
+}
 
-	// actual size of the block we'll be allocating must include space for the header.
-	uint64_t size = request_size + sizeof(block_header);
+static void save_space(partition *p) {
+	writePartition(p, offsetof(directory, allocated_bytes), &p->dir.allocated_bytes, offsetof(directory, reserved) - offsetof(directory, allocated_bytes));
+}
+
+// counts the space from scratch by walking both lists, for partitions from
+// before the descriptor counted it. The caller makes sure nothing changes
+// meanwhile.
+static void count_space(partition *p) {
+	block_header bh;
+	block_id lists[] = { p->dir.alloc_block_id, p->dir.free_block_id };
 
-	currentPosition = dir->free_block_id;
-	readPartition(currentPosition, &current, sizeof(block_header));
+	clear_space(&p->dir);
 
-	if(currentPosition == 0) {
-		fprintf(stderr, "Error: Partition is full!!\n");
-		_exit(2);
+	for(int l = 0; l < 2; l++) {
+		for(block_id i = lists[l]; i != 0; i = bh.next_id) {
+			read_header(p, i, &bh);
+			count_block(&p->dir, i, &bh);
+		}
 	}
 
-	if(current.magic != FREE) {
-		// Somebody done fucked up....
-		fprintf(stderr, "Somehow, the free list contains an allocated block :O\n");
-		_exit(1231231);
+	save_space(p);
+}
 
-		// not sure if its worth putting these checks in everywhere because they're
-		// only caused by programming errors internal to this code, and it "looks good to me" (tm)
-	}
-	
-	// find the FIRST block that FITs.
-	while(current.next_id != 0 && current.size < size) {
-		currentPosition = current.next_id;
-		readPartition(currentPosition, &current, sizeof(block_header));
+// reads the header of what should be a free block. Without its stripe held
+// the list can change under us, so anything that doesn't look like a free
+// block inside the partition is reported rather than trusted.
+static bool read_free(partition *p, block_id id, block_header *bh) {
+	if(id < sizeof(directory) || id + sizeof(block_header) > partition_end(p)) {
+		return false;
 	}
 
-	if(current.size < size) {
-		// then we must not have found a block large enough.
-		fprintf(stderr, "Error: There are no free blocks large enough for a %llu byte request!\n", size);
-		_exit(1);
+	bool fromJournal = readPartition(p, id, bh, sizeof(block_header));
+	if(bh->magic != FREE) {
+		return false;
 	}
 
-	// now we have a usable free block
-	block_size_t oldSize = current.size;
-	block_id oldNext = current.next_id;
-	block_id oldPrev = current.previous_id;
+	// a stale id doesn't land on a free block's magic, a damaged header does.
+	check_header(p, id, bh, fromJournal);
 
-	// If the residual free block is less than 512 bytes, we give the whole block to the request...
-	// there's enough overhead to make that remaining amount of space almost useless anyway.
+	return true;
+}
 
-	// If we were a little more clever, we'd overallocate slightly if it meant realignment
-	// for the block following this one.
+// finds the last free block starting at or before pos, 0 if there is none.
+// Returns false if the list changed while we were walking it.
+static bool free_block_before(partition *p, block_id pos, block_id *found) {
+	*found = 0;
 
-	if(oldSize - size >= 512) {
-		
-		// carve off a piece of this block for allocation.
+	if(pos < sizeof(directory)) {
+		return true;
+	}
 
-		current.size = request_size;
+	uint64_t g = group_of(pos);
+	if(g >= p->numGroups) {
+		g = p->numGroups - 1;
+	}
 
-		block_header newFree;
-		newFree.magic = FREE;
-		newFree.next_id = oldNext;
-		newFree.previous_id = oldPrev;
-		newFree.size = oldSize - size;
+	while(true) {
+		block_id id = __atomic_load_n(&p->groups[g].first_free, __ATOMIC_RELAXED);
 
-		writePartition(currentPosition + size, &newFree, sizeof(block_header));
+		if(id != 0 && id <= pos) {
+			block_header bh;
+			if(!read_free(p, id, &bh)) {
+				return false;
+			}
 
-		// update previous and next blocks with this new block.
-		block_header temp;
+			while(bh.next_id != 0 && bh.next_id <= pos) {
+				id = bh.next_id;
+				if(!read_free(p, id, &bh)) {
+					return false;
+				}
+			}
 
-		// note this block in the partition directory
-		if(oldPrev == 0) {
-			dir->free_block_id = currentPosition + size;
-			writePartition(0, dir, sizeof(directory));
-		} else {
-			readPartition(oldPrev, &temp, sizeof(block_header));
-			temp.next_id = currentPosition + size;
-			writePartition(oldPrev, &temp, sizeof(block_header));
+			*found = id;
+			return true;
 		}
 
-		if(oldNext != 0) {
-			readPartition(oldNext, &temp, sizeof(block_header));
-			temp.previous_id = currentPosition + size;
-			writePartition(oldNext, &temp, sizeof(block_header));
+		if(g == 0) {
+			return true;
 		}
 
-	} else {
-		// We're taking the whole block, so, just link previous and next
-		// with each other to remove this block from the list.
-
-		block_header temp;
-
-		current.size = oldSize - sizeof(block_header);
+		g--;
+	}
+}
 
-		// just note the next block in the partition directory
-		if(oldPrev == 0) {
-			dir->free_block_id = oldNext;
-			writePartition(0, dir, sizeof(directory));
-		} else {
-			readPartition(oldPrev, &temp, sizeof(block_header));
-			temp.next_id = oldNext;
-			writePartition(oldPrev, &temp, sizeof(block_header));
-		}
-		
-		if(oldNext != 0) {
-			readPartition(oldNext, &temp, sizeof(block_header));
-			temp.previous_id = oldPrev;
-			writePartition(oldNext, &temp, sizeof(block_header));
+// the stripes a free list change needs, taken in ascending order so two
+// changes can never wait on each other.
+typedef struct lockset {
+	uint64_t stripe[LOCKSET_MAX];
+	int count;
+	bool all; // every stripe instead, see lockset_all.
+} lockset;
+
+static void lockset_add_stripe(lockset *set, uint64_t s) {
+	int i = set->count;
+	for(int j = 0; j < set->count; j++) {
+		if(set->stripe[j] == s) {
+			return;
 		}
 	}
 
-	// now that free list is fixed, we need to add this newly allocated block
-	// to the allocated list. there's no actual reason why the allocated
-	// list needs to be sorted by id, it only matters for the free list in order
-	// to support a simpler block coalescing system.
-
-	current.magic = ALLOCATED;
-	current.previous_id = 0;
-	current.next_id = 0;
-
-	if(dir->alloc_block_id != 0) {
-		uint64_t currentFirstPos = dir->alloc_block_id;
-		block_header currentFirst;
+	// keep it sorted.
+	while(i > 0 && set->stripe[i - 1] > s) {
+		set->stripe[i] = set->stripe[i - 1];
+		i--;
+	}
 
-		readPartition(currentFirstPos, &currentFirst, sizeof(block_header));
-		currentFirst.previous_id = currentPosition;
-		writePartition(currentFirstPos, &currentFirst, sizeof(block_header));
+	set->stripe[i] = s;
+	set->count++;
+}
 
-		current.next_id = currentFirstPos;
+// adds the stripe guarding the free block at blk, nothing if blk is 0.
+static void lockset_add(lockset *set, block_id blk) {
+	if(blk != 0) {
+		lockset_add_stripe(set, group_of(blk) % NUM_STRIPES);
 	}
+}
 
-	dir->alloc_block_id = currentPosition;
-	writePartition(0, dir, sizeof(directory));
+// adds the lock guarding the head of the free list.
+static void lockset_add_head(lockset *set) {
+	lockset_add_stripe(set, HEAD_STRIPE);
+}
 
-	// and save the new header.
-	writePartition(currentPosition, &current, sizeof(block_header));
+// makes the set every stripe, head included, for a change that has lost too
+// many races to keep looking without locks. Nothing else can change the free
+// list while it's held.
+static void lockset_all(lockset *set) {
+	set->count = 0;
+	set->all = true;
+}
 
-	return currentPosition;
+static void lockset_lock(partition *p, lockset *set) {
+	int count = set->all ? NUM_STRIPES + 1 : set->count;
 
+	for(int i = 0; i < count; i++) {
+		pthread_mutex_lock(&p->stripes[set->all ? (uint64_t)i : set->stripe[i]]);
+	}
 }
 
-/**
- * Frees the given block.
- * Do not call free on an already freed block pls.
- * Coalesces adjacent blocks.
- */
-void free_block(block_id blk) {
-	block_id left_id;
-	block_id right_id;
-	block_id newFree_id;
-
-	block_header leftHead, rightHead, currentHead;
-	block_header newFree;
-	
-	readPartition(blk, &currentHead, sizeof(block_header));
+static void lockset_unlock(partition *p, lockset *set) {
+	int count = set->all ? NUM_STRIPES + 1 : set->count;
 
-	if(currentHead.magic != ALLOCATED) {
-		fprintf(stderr, "You're trying to free a block that is not allocated!\n");
-		_exit(31337);
+	for(int i = count - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&p->stripes[set->all ? (uint64_t)i : set->stripe[i]]);
 	}
+}
 
-	// remove from allocated list
+// reports a free list found inconsistent while every stripe was held, so it
+// wasn't another change getting there first.
+static void list_broken() {
+	// Somebody done fucked up....
+	fprintf(stderr, "Somehow, the free list contains an allocated block :O\n");
+	_exit(1231231);
+}
 
-	left_id = currentHead.previous_id;
-	right_id = currentHead.next_id;
+// the byte range [lo, hi) allocations in the given zone are confined to.
+static void zone_bounds(partition *p, zone z, block_id *lo, block_id *hi) {
+	block_id split = sizeof(directory) + p->dir.meta_zone_size;
 
-	if(left_id != 0) {
-		readPartition(left_id, &leftHead, sizeof(block_header));
-	}
+	*lo = sizeof(directory);
+	*hi = partition_end(p);
 
-	if(right_id != 0) {
-		readPartition(right_id, &rightHead, sizeof(block_header));
+	if(p->dir.layout != LAYOUT_SPLIT || z == ZONE_ANY) {
+		return;
 	}
 
-	if(left_id == 0) {
-		((directory*)partDir)->alloc_block_id = right_id;
-		writePartition(0, partDir, sizeof(directory));
-
+	if(z == ZONE_META) {
+		*hi = split;
 	} else {
-		leftHead.next_id = right_id;
-		writePartition(left_id, &leftHead, sizeof(block_header));
+		*lo = split;
 	}
+}
 
-	if(right_id != 0) {
-		// update right_id too
-		rightHead.previous_id = left_id;
-		writePartition(right_id, &rightHead, sizeof(block_header));
+static zone zone_of(partition *p, block_id blk) {
+	if(p->dir.layout != LAYOUT_SPLIT) {
+		return ZONE_ANY;
 	}
 
+	return blk < sizeof(directory) + p->dir.meta_zone_size ? ZONE_META : ZONE_DATA;
+}
 
-	// add it to the free list.
-	left_id = look_left(blk);
-	right_id = look_right(blk);
+static block_id allocate_zone(partition *p, block_size_t request_size, block_id hint, zone z);
+static void release(partition *p, block_id blk, block_size_t size);
 
-	newFree_id = blk;
-	newFree.magic = FREE;
-	newFree.size = currentHead.size + sizeof(block_header); // allocated blocks don't include header in its field
+// the arena the calling thread allocates from.
+static int arena_of(partition *p) {
+	if(threadIndex < 0) {
+		threadIndex = __atomic_fetch_add(&threadsSeen, 1, __ATOMIC_RELAXED);
+	}
+
+	int a = threadIndex % NUM_ARENAS;
+	uint32_t bit = 1u << a;
+
+	if((__atomic_load_n(&p->arenasActive, __ATOMIC_RELAXED) & bit) == 0) {
+		__atomic_fetch_or(&p->arenasActive, bit, __ATOMIC_RELAXED);
+	}
+
+	return a;
+}
+
+// the first group of arena a's home slice.
+static uint64_t arena_home(partition *p, int a) {
+	return a * p->numGroups / NUM_ARENAS;
+}
+
+// the arena whose home slice holds blk, or -1 if the slice isn't the arena's
+// alone. That's the case for every block when there are fewer groups than
+// arenas, and for slices of arenas no thread is using.
+static int arena_owner(partition *p, block_id blk) {
+	uint64_t n = p->numGroups;
+
+	if(n < NUM_ARENAS) {
+		return -1;
+	}
+
+	int a = ((group_of(blk) + 1) * NUM_ARENAS + n - 1) / n - 1;
+	if(a >= NUM_ARENAS) {
+		a = NUM_ARENAS - 1;
+	}
+
+	if((__atomic_load_n(&p->arenasActive, __ATOMIC_RELAXED) & (1u << a)) == 0) {
+		return -1;
+	}
+
+	return a;
+}
+
+// puts everything queued for arena a on the free list. Returns whether there
+// was anything. The caller holds the partition lock, either way.
+static bool drain_arena(partition *p, arena *a) {
+	if(__atomic_load_n(&a->inbox, __ATOMIC_RELAXED) == NULL) {
+		return false;
+	}
+
+	remote_free *r = __atomic_exchange_n(&a->inbox, NULL, __ATOMIC_ACQUIRE);
+	bool any = r != NULL;
+
+	while(r != NULL) {
+		remote_free *next = r->next;
+
+		__atomic_fetch_sub(&a->inboxCount, 1, __ATOMIC_RELAXED);
+		release(p, r->blk, r->size);
+		free(r);
+
+		r = next;
+	}
+
+	return any;
+}
+
+static bool drain_all(partition *p) {
+	bool any = false;
+
+	for(int i = 0; i < NUM_ARENAS; i++) {
+		any |= drain_arena(p, &p->arenas[i]);
+	}
+
+	return any;
+}
+
+// hands a block freed by this thread back to the free list, or if it lies in
+// another arena's slice, queues it for that arena so we stay off its stripes.
+static void release_from(partition *p, block_id blk, block_size_t size) {
+	int owner = arena_owner(p, blk);
+
+	if(owner < 0 || owner == arena_of(p)) {
+		release(p, blk, size);
+		return;
+	}
+
+	arena *a = &p->arenas[owner];
+	remote_free *r = malloc(sizeof(remote_free));
+	r->blk = blk;
+	r->size = size;
+	r->next = __atomic_load_n(&a->inbox, __ATOMIC_RELAXED);
+
+	while(!__atomic_compare_exchange_n(&a->inbox, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// r->next now holds the new head, try again.
+	}
+
+	// if the owner isn't freeing up its queue fast enough, do it for them.
+	if(__atomic_add_fetch(&a->inboxCount, 1, __ATOMIC_RELAXED) >= REMOTE_BATCH) {
+		drain_arena(p, a);
+	}
+}
+static void punch_freed(partition *p, block_id blk, block_size_t size, block_size_t released);
+static void punch_pass(partition *p);
+static int grow_locked(partition *p, block_size_t numBytes);
+
+// The index checkpoint starts with this, followed by the group index as it
+// was when the partition was last closed.
+typedef struct checkpoint_head {
+	uint64_t magic;
+	uint64_t generation; // the descriptor's when it was written.
+	uint64_t numGroups;
+	uint32_t check; // CRC32C of the groups that follow.
+	uint32_t reserved;
+} checkpoint_head;
+
+// walks the free list to build the group index from scratch.
+static void build_index(partition *p) {
+	p->numGroups = (p->dir.partition_size + GROUP_SIZE - 1) / GROUP_SIZE;
+	p->groups = calloc(p->numGroups, sizeof(group_info));
+
+	block_header bh;
+	block_id i = p->dir.free_block_id;
+	while(i != 0) {
+		read_header(p, i, &bh);
+		index_link(p, i);
+		index_account(p, i, bh.size, true);
+		i = bh.next_id;
+	}
+}
+
+static void free_locked(partition *p, block_id blk);
+static block_id allocate_zone(partition *p, block_size_t request_size, block_id hint, zone z);
+static block_id allocate_locked(block_size_t request_size, block_id hint, zone z);
+
+// Snapshots keep their tables and the bytes they've been left in blocks that
+// no directory points to, so these go straight to the allocator and never
+// copy anything aside themselves.
+static block_id raw_allocate(partition *p, block_size_t size) {
+	pthread_rwlock_rdlock(&p->lock);
+	block_id blk = allocate_zone(p, size, 0, ZONE_DATA);
+	pthread_rwlock_unlock(&p->lock);
+
+	return blk;
+}
+
+static void raw_free(partition *p, block_id blk) {
+	pthread_rwlock_rdlock(&p->lock);
+	free_locked(p, blk);
+	pthread_rwlock_unlock(&p->lock);
+}
+
+static block_size_t raw_capacity(partition *p, block_id blk) {
+	block_header head;
+	read_header(p, blk, &head);
+
+	return head.size;
+}
+
+// Loads the group index from the checkpoint instead of walking the free
+// list, with a single read, if close_partition wrote it and nothing has
+// opened the partition since: opening moves the descriptor's generation on,
+// so the checkpoint only matches it again once it's written at a clean
+// close. Returns false if the index has to be built from scratch.
+static bool load_checkpoint(partition *p) {
+	if(p->dir.checkpoint == 0 || p->dir.version < FORMAT_CHECKPOINT) {
+		return false;
+	}
+
+	uint64_t numGroups = (p->dir.partition_size + GROUP_SIZE - 1) / GROUP_SIZE;
+	uint64_t size = sizeof(checkpoint_head) + numGroups * sizeof(group_info);
+
+	if(p->dir.checkpoint < sizeof(directory) || p->dir.checkpoint + sizeof(block_header) + size > partition_end(p)) {
+		return false;
+	}
+
+	checkpoint_head *head = malloc(size);
+	readPartition(p, p->dir.checkpoint + sizeof(block_header), head, size);
+
+	group_info *groups = (group_info*)(head + 1);
+
+	if(head->magic != CHECKPOINT || head->generation != p->dir.generation || head->numGroups != numGroups
+			|| head->check != crc32c(0, groups, numGroups * sizeof(group_info))) {
+		free(head);
+		return false;
+	}
+
+	p->numGroups = numGroups;
+	p->groups = malloc(numGroups * sizeof(group_info));
+	memcpy(p->groups, groups, numGroups * sizeof(group_info));
+
+	free(head);
+	return true;
+}
+
+// Puts the blocks whose free was still queued for an arena when the program
+// last stopped back on the free list. free_locked takes a block off the
+// allocated list in the same transaction as the command freeing it, but the
+// queue only lives in memory, so a crash leaves the block on neither list,
+// its magic 0 and its size still in its header. A clean close empties every
+// queue first, so this only walks the blocks when there's no checkpoint.
+static void finish_frees(partition *p) {
+	uint64_t count = 0, capacity = 64;
+	block_id *queued = malloc(capacity * sizeof(block_id));
+
+	// found first and freed after, since freeing one can merge away the header of the next.
+	block_id pos = sizeof(directory);
+	while(pos < partition_end(p)) {
+		block_header bh;
+		readPartition(p, pos, &bh, sizeof(block_header));
+
+		// allocated blocks, and those whose free is queued, don't count their header.
+		uint64_t size = bh.magic == FREE ? bh.size : bh.size + sizeof(block_header);
+
+		if((bh.magic != ALLOCATED && bh.magic != FREE && bh.magic != 0) || (bh.magic == 0 && bh.size == 0)
+				|| size < sizeof(block_header) || size > partition_end(p) - pos) {
+			// there's no telling where the next block starts, that's up to fsck.
+			break;
+		}
+
+		if(bh.magic == 0) {
+			if(count == capacity) {
+				capacity *= 2;
+				queued = realloc(queued, capacity * sizeof(block_id));
+			}
+
+			queued[count++] = pos;
+		}
+
+		pos += size;
+	}
+
+	if(count > 0) {
+		journal_start(p->journal);
+		pthread_rwlock_rdlock(&p->lock);
+
+		for(uint64_t i = 0; i < count; i++) {
+			block_header bh;
+			readPartition(p, queued[i], &bh, sizeof(block_header));
+			release(p, queued[i], bh.size + sizeof(block_header));
+		}
+
+		pthread_rwlock_unlock(&p->lock);
+		journal_stop(p->journal);
+	}
+
+	free(queued);
+}
+
+// Writes the group index to the checkpoint for the next open, see
+// load_checkpoint, in a block kept for it from one close to the next.
+// Partitions still being converted to checksums don't get one.
+static void save_checkpoint(partition *p) {
+	if(p->dir.version < FORMAT_CHECKSUMS) {
+		return;
+	}
+
+	journal_start(p->journal);
+
+	uint64_t size = sizeof(checkpoint_head) + p->numGroups * sizeof(group_info);
+	block_id blk = p->dir.checkpoint;
+
+	if(blk != 0 && raw_capacity(p, blk) < size) {
+		raw_free(p, blk);
+		blk = 0;
+	}
+
+	// room for the partition to grow a little before it needs another.
+	if(blk == 0) {
+		blk = raw_allocate(p, size + size / 4);
+	}
+
+	// whatever that freed has to be in the index before it's written.
+	drain_all(p);
+
+	// allocating may have grown the partition past what fits.
+	size = sizeof(checkpoint_head) + p->numGroups * sizeof(group_info);
+	if(blk != 0 && raw_capacity(p, blk) < size) {
+		raw_free(p, blk);
+		drain_all(p);
+		blk = 0;
+	}
+
+	if(blk != 0) {
+		checkpoint_head *head = calloc(1, size);
+		group_info *groups = (group_info*)(head + 1);
+
+		memcpy(groups, p->groups, p->numGroups * sizeof(group_info));
+		head->magic = CHECKPOINT;
+		head->generation = p->dir.generation;
+		head->numGroups = p->numGroups;
+		head->check = crc32c(0, groups, p->numGroups * sizeof(group_info));
+
+		writePartition(p, blk + sizeof(block_header), head, size);
+		free(head);
+
+		raise_version(p, FORMAT_CHECKPOINT);
+	}
+
+	p->dir.checkpoint = blk;
+	save_field(p, checkpoint);
+
+	journal_stop(p->journal);
+}
+
+// copies numBytes bytes of the partition at from to to, a piece at a time.
+static void copy_bytes(partition *p, uint64_t from, uint64_t to, uint64_t numBytes) {
+	uint64_t piece = numBytes < 1024 * 1024 ? numBytes : 1024 * 1024;
+	void *buf = malloc(piece);
+
+	for(uint64_t done = 0; done < numBytes; done += piece) {
+		if(numBytes - done < piece) {
+			piece = numBytes - done;
+		}
+
+		readPartition(p, from + done, buf, piece);
+		writePartition(p, to + done, buf, piece);
+	}
+
+	free(buf);
+}
+
+// With snapMutex held.
+static snapshot *find_gen(partition *p, uint64_t gen) {
+	snapshot *s = p->snapshots;
+
+	while(s != NULL && s->gen != gen) {
+		s = s->next;
+	}
+
+	return s;
+}
+
+// Writes the snapshot table back, moving it to a bigger block if it has
+// outgrown its own. With snapMutex held.
+static void save_snapshots(partition *p) {
+	uint64_t size = sizeof(snapshot_table) + p->numSnapshots * sizeof(snapshot_record);
+	snapshot_table *t = calloc(1, size);
+	snapshot_record *rec = (snapshot_record*)(t + 1);
+
+	t->magic = SNAPSHOTS;
+	t->nextGen = p->nextGen;
+	t->count = p->numSnapshots;
+
+	for(snapshot *s = p->snapshots; s != NULL; s = s->next, rec++) {
+		memcpy(rec->name, s->name, sizeof(rec->name));
+		rec->gen = s->gen;
+		rec->root = s->root;
+		rec->created = s->created;
+		rec->entries = s->entries;
+		rec->count = rangemap_count(s->remap);
+	}
+
+	block_id table = p->dir.snapshot_table;
+
+	if(table != 0 && (p->numSnapshots == 0 || raw_capacity(p, table) < size)) {
+		raw_free(p, table);
+		table = 0;
+	}
+
+	if(table == 0 && p->numSnapshots > 0) {
+		// room for a few more, so taking one doesn't move it every time.
+		table = raw_allocate(p, size + 8 * sizeof(snapshot_record));
+	}
+
+	if(table != 0) {
+		writePartition(p, table + sizeof(block_header), t, size);
+	}
+
+	if(table != p->dir.snapshot_table) {
+		p->dir.snapshot_table = table;
+		save_field(p, snapshot_table);
+	}
+
+	free(t);
+}
+
+// Saves the range just added to s's remap, moving its entries to a bigger
+// block if they've outgrown theirs. With snapMutex held.
+static void save_entry(partition *p, snapshot *s, range *r) {
+	uint64_t count = rangemap_count(s->remap);
+
+	if(s->entries == 0 || raw_capacity(p, s->entries) < count * sizeof(remap_entry)) {
+		block_id blk = raw_allocate(p, 2 * count * sizeof(remap_entry) + 64 * sizeof(remap_entry));
+		remap_entry *all = malloc(count * sizeof(remap_entry));
+
+		// ranges are never removed from a remap, so they're still in the order they were saved in.
+		for(uint64_t i = 0; i < count; i++) {
+			range *e = rangemap_get(s->remap, i);
+			all[i] = (remap_entry){ e->start, e->end, e->value, e->extra };
+		}
+
+		writePartition(p, blk + sizeof(block_header), all, count * sizeof(remap_entry));
+		free(all);
+
+		if(s->entries != 0) {
+			raw_free(p, s->entries);
+		}
+		s->entries = blk;
+		return;
+	}
+
+	remap_entry e = { r->start, r->end, r->value, r->extra };
+	writePartition(p, s->entries + sizeof(block_header) + r->index * sizeof(remap_entry), &e, sizeof(e));
+}
+
+// the parts of a range of the partition a snapshot hasn't got in its remap.
+typedef struct gaps {
+	uint64_t at; // where the last range looked at ended.
+	uint64_t *bounds; // start and end of every gap.
+	uint64_t count;
+	uint64_t capacity;
+} gaps;
+
+static void add_gap(gaps *g, uint64_t start, uint64_t end) {
+	if(start >= end) {
+		return;
+	}
+
+	if(2 * g->count + 2 > g->capacity) {
+		g->capacity = g->capacity ? g->capacity * 2 : 16;
+		g->bounds = realloc(g->bounds, g->capacity * sizeof(uint64_t));
+	}
+
+	g->bounds[2 * g->count] = start;
+	g->bounds[2 * g->count + 1] = end;
+	g->count++;
+}
+
+static void gap_before(range *r, void *ctx) {
+	gaps *g = ctx;
+
+	add_gap(g, g->at, r->start);
+	if(r->end > g->at) {
+		g->at = r->end;
+	}
+}
+
+// finds the parts of [start, end) that s still shares with the partition.
+static void find_gaps(snapshot *s, uint64_t start, uint64_t end, gaps *g) {
+	g->at = start;
+	g->count = 0;
+
+	rangemap_each(s->remap, start, end, gap_before, g);
+	add_gap(g, g->at, end);
+}
+
+// Before [start, end) is overwritten or handed back to the free list, copies
+// it to a new block for every snapshot that still shares some of it.
+static void keep_copy(partition *p, uint64_t start, uint64_t end) {
+	pthread_mutex_lock(&p->snapMutex);
+
+	range *b = rangemap_find(p->births, start);
+	uint64_t born = b != NULL ? b->value : 0;
+
+	gaps g = { 0 };
+	block_id copy = 0;
+	uint64_t users = 0;
+
+	for(snapshot *s = p->snapshots; s != NULL; s = s->next) {
+		if(s->gen < born) {
+			continue;
+		}
+
+		find_gaps(s, start, end, &g);
+		if(g.count == 0) {
+			continue;
+		}
+
+		if(copy == 0) {
+			copy = raw_allocate(p, end - start);
+			copy_bytes(p, start, copy + sizeof(block_header), end - start);
+		}
+
+		for(uint64_t i = 0; i < g.count; i++) {
+			uint64_t from = g.bounds[2 * i], to = g.bounds[2 * i + 1];
+
+			save_entry(p, s, rangemap_add(s->remap, from, to, copy + sizeof(block_header) + (from - start), copy));
+			s->kept += to - from;
+		}
+
+		users++;
+	}
+
+	if(copy != 0) {
+		rangemap_add(p->refs, copy, copy + 1, users, 0);
+		save_snapshots(p);
+	}
+
+	free(g.bounds);
+
+	pthread_mutex_unlock(&p->snapMutex);
+}
+
+// Called instead of freeing blk: leaves it to every snapshot that still
+// shares some of it, rather than copying it. Returns whether any does, in
+// which case it's not to be freed.
+static bool keep_block(partition *p, block_id blk) {
+	block_header head;
+	read_header(p, blk, &head);
+
+	if(head.size == 0) {
+		return false;
+	}
+
+	uint64_t start = blk + sizeof(block_header);
+	uint64_t end = start + head.size;
+
+	pthread_mutex_lock(&p->snapMutex);
+
+	range *b = rangemap_find(p->births, start);
+	uint64_t born = 0;
+	if(b != NULL) {
+		born = b->value;
+		rangemap_remove(p->births, b);
+	}
+
+	gaps g = { 0 };
+	uint64_t users = 0;
+
+	for(snapshot *s = p->snapshots; s != NULL; s = s->next) {
+		if(s->gen < born) {
+			continue;
+		}
+
+		find_gaps(s, start, end, &g);
+		if(g.count == 0) {
+			continue;
+		}
+
+		// the bytes stay where they are.
+		for(uint64_t i = 0; i < g.count; i++) {
+			uint64_t from = g.bounds[2 * i], to = g.bounds[2 * i + 1];
+
+			save_entry(p, s, rangemap_add(s->remap, from, to, from, blk));
+			s->kept += to - from;
+		}
+
+		users++;
+	}
+
+	if(users > 0) {
+		rangemap_add(p->refs, blk, blk + 1, users, 0);
+		save_snapshots(p);
+	}
+
+	free(g.bounds);
+
+	pthread_mutex_unlock(&p->snapMutex);
+
+	return users > 0;
+}
+
+// remembers the generation blk was allocated in, so snapshots taken before
+// it don't get copies of what's written to it.
+static void note_birth(partition *p, block_id blk) {
+	if(__atomic_load_n(&p->numSnapshots, __ATOMIC_ACQUIRE) == 0) {
+		return;
+	}
+
+	block_header head;
+	read_header(p, blk, &head);
+
+	if(head.size == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->snapMutex);
+	rangemap_add(p->births, blk + sizeof(block_header), blk + sizeof(block_header) + head.size, p->nextGen, 0);
+	pthread_mutex_unlock(&p->snapMutex);
+}
+
+// Gives a snapshot that is going away's share of the blocks holding its
+// bytes back, freeing those nobody else uses. With snapMutex held.
+static void drop_snapshot(partition *p, snapshot *s) {
+	rangemap *seen = rangemap_create();
+
+	for(uint64_t i = 0; i < rangemap_count(s->remap); i++) {
+		block_id blk = rangemap_get(s->remap, i)->extra;
+
+		if(rangemap_find(seen, blk) != NULL) {
+			continue;
+		}
+		rangemap_add(seen, blk, blk + 1, 0, 0);
+
+		range *ref = rangemap_find(p->refs, blk);
+		if(--ref->value == 0) {
+			rangemap_remove(p->refs, ref);
+			raw_free(p, blk);
+		}
+	}
+
+	rangemap_destroy(seen);
+
+	if(s->entries != 0) {
+		raw_free(p, s->entries);
+	}
+
+	rangemap_destroy(s->remap);
+	free(s);
+}
+
+// Reads the snapshot table back in, working out how many snapshots use each
+// block holding their bytes. Which blocks were allocated since which snapshot
+// isn't saved, so until the partition is closed again anything allocated
+// before it was opened counts as shared with all of them.
+static void load_snapshots(partition *p) {
+	p->births = rangemap_create();
+	p->refs = rangemap_create();
+	p->nextGen = 1;
+
+	if(p->dir.snapshot_table == 0) {
+		return;
+	}
+
+	snapshot_table t;
+	readPartition(p, p->dir.snapshot_table + sizeof(block_header), &t, sizeof(t));
+
+	if(t.magic != SNAPSHOTS) {
+		fprintf(stderr, "Error: the snapshot table at %" PRIu64 " is damaged.\n", p->dir.snapshot_table);
+		_exit(3);
+	}
+
+	p->nextGen = t.nextGen;
+
+	snapshot **tail = &p->snapshots;
+	for(uint64_t i = 0; i < t.count; i++) {
+		snapshot_record rec;
+		readPartition(p, p->dir.snapshot_table + sizeof(block_header) + sizeof(t) + i * sizeof(rec), &rec, sizeof(rec));
+
+		snapshot *s = calloc(1, sizeof(snapshot));
+		memcpy(s->name, rec.name, sizeof(s->name));
+		s->gen = rec.gen;
+		s->root = rec.root;
+		s->created = rec.created;
+		s->entries = rec.entries;
+		s->remap = rangemap_create();
+
+		remap_entry *all = malloc(rec.count * sizeof(remap_entry) + 1);
+		if(rec.count > 0) {
+			readPartition(p, rec.entries + sizeof(block_header), all, rec.count * sizeof(remap_entry));
+		}
+
+		rangemap *seen = rangemap_create();
+
+		for(uint64_t j = 0; j < rec.count; j++) {
+			rangemap_add(s->remap, all[j].start, all[j].end, all[j].copy, all[j].blk);
+			s->kept += all[j].end - all[j].start;
+
+			if(rangemap_find(seen, all[j].blk) == NULL) {
+				rangemap_add(seen, all[j].blk, all[j].blk + 1, 0, 0);
+
+				range *ref = rangemap_find(p->refs, all[j].blk);
+				if(ref != NULL) {
+					ref->value++;
+				} else {
+					rangemap_add(p->refs, all[j].blk, all[j].blk + 1, 1, 0);
+				}
+			}
+		}
+
+		rangemap_destroy(seen);
+		free(all);
+
+		*tail = s;
+		tail = &s->next;
+		p->numSnapshots++;
+	}
+}
+
+// fills in bytes the snapshot this thread is viewing has kept, after the
+// partition's own have been read into dst.
+typedef struct overlay {
+	partition *p;
+	uint64_t start;
+	uint64_t end;
+	uint8_t *dst;
+} overlay;
+
+static void overlay_range(range *r, void *ctx) {
+	overlay *o = ctx;
+
+	uint64_t from = r->start > o->start ? r->start : o->start;
+	uint64_t to = r->end < o->end ? r->end : o->end;
+
+	readPartition(o->p, r->value + (from - r->start), o->dst + (from - o->start), to - from);
+}
+
+static void overlay_snapshot(partition *p, uint64_t start, void *dst, uint64_t numBytes) {
+	overlay o = { p, start, start + numBytes, dst };
+
+	pthread_mutex_lock(&p->snapMutex);
+
+	snapshot *s = find_gen(p, threadView);
+	if(s == NULL) {
+		fprintf(stderr, "Error: viewing snapshot %" PRIu64 ", which doesn't exist.\n", threadView);
+		_exit(5);
+	}
+
+	rangemap_each(s->remap, o.start, o.end, overlay_range, &o);
+
+	pthread_mutex_unlock(&p->snapMutex);
+}
+
+// snapshots are read-only.
+static void check_writable() {
+	if(threadView != 0) {
+		fprintf(stderr, "Error: can't change the partition while viewing a snapshot.\n");
+		_exit(5);
+	}
+}
+
+// Writes entry i of the share table and its count, moving the table to a
+// bigger block if it has outgrown its own. With shareMutex held.
+static void save_share(partition *p, uint64_t i) {
+	uint64_t count = rangemap_count(p->shares);
+	block_id table = p->dir.share_table;
+
+	if(count == 0) {
+		if(table != 0) {
+			raw_free(p, table);
+			p->dir.share_table = 0;
+			save_field(p, share_table);
+		}
+		return;
+	}
+
+	if(table == 0 || raw_capacity(p, table) < sizeof(share_table) + count * sizeof(share_entry)) {
+		block_id blk = raw_allocate(p, sizeof(share_table) + (2 * count + 64) * sizeof(share_entry));
+		share_entry *all = malloc(count * sizeof(share_entry));
+
+		for(uint64_t j = 0; j < count; j++) {
+			range *r = rangemap_get(p->shares, j);
+			all[j] = (share_entry){ r->start, r->value };
+		}
+
+		writePartition(p, blk + sizeof(block_header) + sizeof(share_table), all, count * sizeof(share_entry));
+		free(all);
+
+		if(table != 0) {
+			raw_free(p, table);
+		}
+
+		table = blk;
+		p->dir.share_table = table;
+		save_field(p, share_table);
+	} else if(i < count) {
+		range *r = rangemap_get(p->shares, i);
+		share_entry e = { r->start, r->value };
+		writePartition(p, table + sizeof(block_header) + sizeof(share_table) + i * sizeof(share_entry), &e, sizeof(e));
+	}
+
+	share_table t = { SHARES, count };
+	writePartition(p, table + sizeof(block_header), &t, sizeof(t));
+}
+
+// Called instead of freeing blk: if it's shared, gives up one owner's share
+// of it and returns true, in which case it's not to be freed.
+static bool drop_share(partition *p, block_id blk) {
+	pthread_mutex_lock(&p->shareMutex);
+
+	range *r = rangemap_find(p->shares, blk);
+	if(r == NULL) {
+		pthread_mutex_unlock(&p->shareMutex);
+		return false;
+	}
+
+	if(--r->value > 1) {
+		save_share(p, r->index);
+	} else {
+		// the last range takes its place in the table as well.
+		uint64_t i = r->index;
+		rangemap_remove(p->shares, r);
+		save_share(p, i);
+		__atomic_store_n(&p->numShared, rangemap_count(p->shares), __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&p->shareMutex);
+
+	return true;
+}
+
+// reads the share table back in.
+static void load_shares(partition *p) {
+	p->shares = rangemap_create();
+
+	if(p->dir.share_table == 0) {
+		return;
+	}
+
+	share_table t;
+	readPartition(p, p->dir.share_table + sizeof(block_header), &t, sizeof(t));
+
+	if(t.magic != SHARES) {
+		fprintf(stderr, "Error: the share table at %" PRIu64 " is damaged.\n", p->dir.share_table);
+		_exit(3);
+	}
+
+	share_entry *all = malloc(t.count * sizeof(share_entry) + 1);
+	readPartition(p, p->dir.share_table + sizeof(block_header) + sizeof(t), all, t.count * sizeof(share_entry));
+
+	for(uint64_t i = 0; i < t.count; i++) {
+		rangemap_add(p->shares, all[i].blk, all[i].blk + 1, all[i].refs, 0);
+	}
+
+	free(all);
+	p->numShared = t.count;
+}
+
+// A quick 64 bit hash of numBytes bytes, eight at a time. It doesn't need to
+// resist collisions, since whatever it matches is compared byte for byte.
+// The top bit is left clear so the hash plus one still fits.
+static uint64_t hash_bytes(const uint8_t *data, uint64_t numBytes) {
+	uint64_t h = numBytes * 0x9E3779B97F4A7C15ull;
+	uint64_t w;
+	uint64_t i = 0;
+
+	for(; i + 8 <= numBytes; i += 8) {
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+
+	w = 0;
+	memcpy(&w, data + i, numBytes - i);
+	h = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 29;
+
+	return h >> 1;
+}
+
+// Writes entry i of the dedup table and its count, moving the table to a
+// bigger block if it has outgrown its own. With dedupMutex held.
+static void save_dedup(partition *p, uint64_t i) {
+	uint64_t count = rangemap_count(p->byHash);
+	block_id table = p->dir.dedup_table;
+
+	if(count == 0) {
+		if(table != 0) {
+			raw_free(p, table);
+			p->dir.dedup_table = 0;
+			save_field(p, dedup_table);
+		}
+		return;
+	}
+
+	if(table == 0 || raw_capacity(p, table) < sizeof(dedup_table) + count * sizeof(dedup_entry)) {
+		block_id blk = raw_allocate(p, sizeof(dedup_table) + (2 * count + 64) * sizeof(dedup_entry));
+		dedup_entry *all = malloc(count * sizeof(dedup_entry));
+
+		for(uint64_t j = 0; j < count; j++) {
+			range *r = rangemap_get(p->byHash, j);
+			all[j] = (dedup_entry){ r->start, r->value, r->extra, 0 };
+		}
+
+		writePartition(p, blk + sizeof(block_header) + sizeof(dedup_table), all, count * sizeof(dedup_entry));
+		free(all);
+
+		if(table != 0) {
+			raw_free(p, table);
+		}
+
+		table = blk;
+		p->dir.dedup_table = table;
+		save_field(p, dedup_table);
+	} else if(i < count) {
+		range *r = rangemap_get(p->byHash, i);
+		dedup_entry e = { r->start, r->value, r->extra, 0 };
+		writePartition(p, table + sizeof(block_header) + sizeof(dedup_table) + i * sizeof(dedup_entry), &e, sizeof(e));
+	}
+
+	dedup_table t = { DEDUP, count };
+	writePartition(p, table + sizeof(block_header), &t, sizeof(t));
+}
+
+// takes blk out of the dedup index, if it's in it. With dedupMutex held.
+static void forget_block(partition *p, block_id blk) {
+	range *b = rangemap_find(p->byBlock, blk);
+	if(b == NULL) {
+		return;
+	}
+
+	range *h = rangemap_find(p->byHash, b->value);
+	uint64_t i = h->index;
+
+	rangemap_remove(p->byBlock, b);
+	rangemap_remove(p->byHash, h);
+
+	// the last entry takes its place in the table.
+	save_dedup(p, i);
+	__atomic_store_n(&p->numIndexed, rangemap_count(p->byHash), __ATOMIC_RELEASE);
+}
+
+// whether the first numBytes bytes of blk are the same as data.
+static bool same_bytes(partition *p, block_id blk, const void *data, uint64_t numBytes) {
+	void *buf = malloc(numBytes + 1);
+	readPartition(p, blk + sizeof(block_header), buf, numBytes);
+
+	bool same = memcmp(buf, data, numBytes) == 0;
+	free(buf);
+
+	return same;
+}
+
+// Called instead of freeing blk, see drop_share. A block that is really
+// going is taken out of the dedup index first, under the same lock that
+// finding it there to share it takes.
+static bool keep_shared(partition *p, block_id blk) {
+	if(__atomic_load_n(&p->numIndexed, __ATOMIC_ACQUIRE) == 0) {
+		return __atomic_load_n(&p->numShared, __ATOMIC_ACQUIRE) > 0 && drop_share(p, blk);
+	}
+
+	pthread_mutex_lock(&p->dedupMutex);
+
+	bool shared = drop_share(p, blk);
+	if(!shared) {
+		forget_block(p, blk);
+	}
+
+	pthread_mutex_unlock(&p->dedupMutex);
+
+	return shared;
+}
+
+// reads the dedup table back in.
+static void load_dedup(partition *p) {
+	p->byHash = rangemap_create();
+	p->byBlock = rangemap_create();
+
+	if(p->dir.dedup_table == 0) {
+		return;
+	}
+
+	dedup_table t;
+	readPartition(p, p->dir.dedup_table + sizeof(block_header), &t, sizeof(t));
+
+	if(t.magic != DEDUP) {
+		fprintf(stderr, "Error: the dedup table at %" PRIu64 " is damaged.\n", p->dir.dedup_table);
+		_exit(3);
+	}
+
+	dedup_entry *all = malloc(t.count * sizeof(dedup_entry) + 1);
+	readPartition(p, p->dir.dedup_table + sizeof(block_header) + sizeof(t), all, t.count * sizeof(dedup_entry));
+
+	for(uint64_t i = 0; i < t.count; i++) {
+		rangemap_add(p->byHash, all[i].hash, all[i].hash + 1, all[i].blk, all[i].bytes);
+		rangemap_add(p->byBlock, all[i].blk, all[i].blk + 1, all[i].hash, 0);
+	}
+
+	free(all);
+	p->numIndexed = t.count;
+}
+
+// a block found walking a partition from before the descriptor grew.
+typedef struct legacy_block {
+	block_id id;
+	block_size_t span; // header included.
+	bool free;
+} legacy_block;
+
+// whether the file holds a partition from before the descriptor grew, going
+// by the magic of the block that followed its descriptor. Fills old in if so.
+static bool is_legacy(partition *p, legacy_directory *old) {
+	block_header first;
+	struct stat st;
+
+	readPartition(p, 0, old, sizeof(legacy_directory));
+	readPartition(p, sizeof(legacy_directory), &first, sizeof(block_header));
+
+	// the old magic was 64 bits, so the top half ends up in check.
+	bool allocated = first.magic == ALLOCATED && first.check == 0xED;
+	bool unused = first.magic == FREE && first.check == 0;
+
+	return (allocated || unused) && old->partition_size >= sizeof(block_header)
+		&& fstat(p->fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(legacy_directory) + old->partition_size;
+}
+
+// copies numBytes bytes at from in the partition file to to, straight to the
+// file since it's past the end of the partition.
+static void copy_out(partition *p, uint64_t from, uint64_t to, uint64_t numBytes) {
+	uint8_t *buf = malloc(1024 * 1024);
+
+	while(numBytes > 0) {
+		uint64_t n = numBytes < 1024 * 1024 ? numBytes : 1024 * 1024;
+		readPartition(p, from, buf, n);
+
+		if(pwrite(p->fd, buf, n, to) != (ssize_t)n) {
+			fprintf(stderr, "Error: writing to partition at offset %" PRIu64 " failed.\n", to);
+			_exit(0xcafebabe);
+		}
+
+		from += n;
+		to += n;
+		numBytes -= n;
+	}
+
+	free(buf);
+}
+
+// Converts a partition from before the descriptor grew from 32 bytes to
+// DESCRIPTOR_SIZE into one in format 2, the oldest this version reads, for
+// the rest of the conversions to take it from there.
+//
+// The blocks used to start right after the old descriptor, so the ones in
+// the way of the new one are moved. Free ones are simply dropped. The
+// allocated ones, along with any free ones between them, are copied as they
+// are to the end of the partition, which grows to make room, and the layers
+// above are told where they went through relocated_id, since their ids are
+// in file headers this doesn't understand. Whatever's left of the space
+// they took up past the new descriptor becomes a free block.
+//
+// The lists are built again from a walk of the blocks rather than followed,
+// as older versions could leave them broken, and linked in address order.
+static void convert_legacy(partition *p, legacy_directory *old, char *filename) {
+	block_id oldEnd = sizeof(legacy_directory) + old->partition_size;
+
+	uint64_t count = 0, capacity = 64;
+	legacy_block *blocks = malloc(capacity * sizeof(legacy_block));
+
+	for(block_id pos = sizeof(legacy_directory); pos < oldEnd; count++) {
+		block_header bh;
+		readPartition(p, pos, &bh, sizeof(block_header));
+
+		bool allocated = bh.magic == ALLOCATED && bh.check == 0xED;
+		bool unused = bh.magic == FREE && bh.check == 0;
+		block_size_t span = unused ? bh.size : bh.size + sizeof(block_header);
+
+		if((!allocated && !unused) || span < sizeof(block_header) || span > oldEnd - pos) {
+			fprintf(stderr, "%s has a damaged block at %" PRIu64 " and can't be converted to this version's format.\n", filename, pos);
+			_exit(3);
+		}
+
+		if(count == capacity) {
+			capacity *= 2;
+			blocks = realloc(blocks, capacity * sizeof(legacy_block));
+		}
+
+		blocks[count].id = pos;
+		blocks[count].span = span;
+		blocks[count].free = unused;
+		pos += span;
+	}
+
+	// the first block the new descriptor leaves alone, with room for a free
+	// block's header between the two if they don't meet.
+	uint64_t keep = 0;
+	while(keep < count && blocks[keep].id != sizeof(directory) && blocks[keep].id < sizeof(directory) + sizeof(block_header)) {
+		keep++;
+	}
+
+	block_id start = keep < count ? blocks[keep].id : oldEnd;
+
+	if(start != sizeof(directory) && start < sizeof(directory) + sizeof(block_header)) {
+		fprintf(stderr, "%s is too small to be converted to this version's format.\n", filename);
+		_exit(3);
+	}
+
+	// the run of blocks to move, from the first allocated one in the way to the end of the last.
+	block_id from = 0, to = 0;
+	for(uint64_t i = 0; i < keep; i++) {
+		if(!blocks[i].free) {
+			from = from == 0 ? blocks[i].id : from;
+			to = blocks[i].id + blocks[i].span;
+		}
+	}
+
+	if(to > from) {
+		if(ftruncate(p->fd, oldEnd + (to - from)) != 0) {
+			fprintf(stderr, "Unable to completely allocate the partition!!\n");
+			_exit(1);
+		}
+
+		// the copy is past the end of the old partition, so it's harmless until the descriptor is written.
+		copy_out(p, from, oldEnd, to - from);
+		fsync(p->fd);
+	}
+
+	uint64_t delta = oldEnd - from;
+	block_id newEnd = oldEnd + (to - from);
+
+	// the blocks in address order, the moved ones last.
+	legacy_block *order = malloc((count + 1) * sizeof(legacy_block));
+	uint64_t n = 0;
+
+	if(start > sizeof(directory)) {
+		order[n++] = (legacy_block){ sizeof(directory), start - sizeof(directory), true };
+	}
+	for(uint64_t i = keep; i < count; i++) {
+		order[n++] = blocks[i];
+	}
+	for(uint64_t i = 0; i < keep; i++) {
+		if(blocks[i].id >= from && blocks[i].id < to) {
+			order[n++] = (legacy_block){ blocks[i].id + delta, blocks[i].span, blocks[i].free };
+		}
+	}
+
+	// merge neighbouring free blocks, as free_block would have.
+	uint64_t merged = 0;
+	for(uint64_t i = 0; i < n; i++) {
+		if(merged > 0 && order[i].free && order[merged - 1].free) {
+			order[merged - 1].span += order[i].span;
+		} else {
+			order[merged++] = order[i];
+		}
+	}
+
+	memset(&p->dir, 0, sizeof(directory));
+	p->dir.partition_size = newEnd - sizeof(directory);
+	p->dir.magic = SUPERBLOCK;
+	p->dir.version = FORMAT_OLDEST;
+	p->dir.layout = LAYOUT_MIXED;
+	p->dir.root_dir_id = old->root_dir_id >= from && old->root_dir_id < to ? old->root_dir_id + delta : old->root_dir_id;
+	p->dir.relocated_from = to > from ? from : 0;
+	p->dir.relocated_to = to > from ? oldEnd : 0;
+	p->dir.relocated_size = to - from;
+
+	journal_start(p->journal);
+
+	block_id lastAlloc = 0, lastFree = 0;
+	for(uint64_t i = 0; i < merged; i++) {
+		block_header bh;
+		block_id *last = order[i].free ? &lastFree : &lastAlloc;
+
+		bh.magic = order[i].free ? FREE : ALLOCATED;
+		bh.size = order[i].free ? order[i].span : order[i].span - sizeof(block_header);
+		bh.previous_id = *last;
+		bh.next_id = 0;
+		write_header(p, order[i].id, &bh);
+
+		if(*last != 0) {
+			block_header prev;
+			readPartition(p, *last, &prev, sizeof(block_header));
+			prev.next_id = order[i].id;
+			write_header(p, *last, &prev);
+		} else if(order[i].free) {
+			p->dir.free_block_id = order[i].id;
+		} else {
+			p->dir.alloc_block_id = order[i].id;
+		}
+
+		*last = order[i].id;
+	}
+
+	writePartition(p, 0, &p->dir, sizeof(directory));
+
+	journal_stop(p->journal);
+	journal_flush(p->journal);
+
+	free(order);
+	free(blocks);
+}
+
+//////
+//
+// PUBLICLY ACCESSIBLE FUNCTIONS BELOW.
+//
+/////
+
+
+/**
+ * Creates a file represting our file system partition on
+ * in the current OS's filesystem.
+ *
+ * If the file specified already exists, it is simply loaded in order
+ * to allow for further interaction with the partition.
+ *
+ * If the file does not exist, one is created with at least the specified
+ * number of bytes.
+ *
+ * Returns a non-zero value if it opened an existing file.
+ *
+ */
+int initialize(char* filename, uint64_t numBytes) {
+	return initializeWithLayout(filename, numBytes, LAYOUT_MIXED);
+}
+
+/**
+ * Same as initialize, but a newly created partition uses the given layout.
+ * The layout of an existing partition is whatever it was created with.
+ */
+int initializeWithLayout(char* filename, uint64_t numBytes, partition_layout layout) {
+	bool created;
+
+	defaultPartition = open_partition(filename, numBytes, layout, &created);
+
+	return created ? 0 : 1;
+}
+
+/**
+ * Opens the partition in filename, creating it with numBytes bytes and the
+ * given layout if it doesn't exist yet, and sets created to say which
+ * happened. Unlike initialize this doesn't change which partition the
+ * other functions act on, see use_partition. Returns NULL if a new
+ * partition file can't be given its full size.
+ */
+partition *open_partition(char *filename, uint64_t numBytes, partition_layout layout, bool *created) {
+	partition *p = calloc(1, sizeof(partition));
+
+	pthread_rwlock_init(&p->lock, NULL);
+	for(int i = 0; i <= NUM_STRIPES; i++) {
+		pthread_mutex_init(&p->stripes[i], NULL);
+	}
+	pthread_mutex_init(&p->allocLock, NULL);
+	pthread_mutex_init(&p->mapLock, NULL);
+	pthread_mutex_init(&p->snapMutex, NULL);
+	pthread_mutex_init(&p->shareMutex, NULL);
+	pthread_mutex_init(&p->dedupMutex, NULL);
+
+	// someone waiting to take a snapshot shouldn't be starved by a stream of commands.
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&p->snapLock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	p->punchMode = PUNCH_OFF;
+	p->growth.mode = GROW_DOUBLE;
+	p->verify = VERIFY_FILL;
+
+	// the journal lives next to the partition file.
+	char *journalPath = malloc(strlen(filename) + sizeof(JOURNAL_SUFFIX));
+	strcpy(journalPath, filename);
+	strcat(journalPath, JOURNAL_SUFFIX);
+
+	if(access(filename, F_OK ) != -1) {
+		// file already exists
+
+		p->fd = open(filename, O_RDWR);
+
+		if(p->fd < 0) {
+			fprintf(stderr, "Unable to open file!\n");
+			_exit(2);
+		}
+
+		// finish whatever was committed before the program last stopped.
+		p->journal = journal_open(journalPath, p->fd, false);
+		free(journalPath);
+
+		// copy directory to memory.
+		readPartition(p, 0, &p->dir, sizeof(directory));
+
+		legacy_directory old;
+		if(p->dir.magic != SUPERBLOCK && is_legacy(p, &old)) {
+			convert_legacy(p, &old, filename);
+		}
+
+		directory *dirPtr = &p->dir;
+		if(dirPtr->magic != SUPERBLOCK || dirPtr->version < FORMAT_OLDEST || dirPtr->version > FORMAT_VERSION) {
+			fprintf(stderr, "%s was made by an incompatible version of this program, delete it and start over.\n", filename);
+			_exit(3);
+		}
+
+		if(!load_checkpoint(p)) {
+			build_index(p);
+			finish_frees(p);
+		}
+
+		// older partitions are counted once, and marked as counted unless
+		// they still have their headers converted ahead of them, see
+		// checksum_block_headers.
+		if(dirPtr->version < FORMAT_COUNTERS) {
+			count_space(p);
+
+			if(dirPtr->version >= FORMAT_CHECKSUMS) {
+				raise_version(p, FORMAT_COUNTERS);
+			}
+		}
+		load_snapshots(p);
+		load_shares(p);
+		load_dedup(p);
+
+		// the checkpoint is stale as soon as anything changes, and only
+		// matches again once close_partition writes it.
+		p->dir.generation++;
+		save_field(p, generation);
+
+		*created = false;
+		return p;
+
+	} else {
+		p->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644); // open for read/write, at beginning
+
+		if(p->fd < 0) {
+			fprintf(stderr, "Unable to open file!\n");
+			_exit(2);
+		}
+
+		// a log left over from an older partition by this name doesn't apply.
+		p->journal = journal_open(journalPath, p->fd, true);
+		free(journalPath);
+
+		directory *dirPtr = &p->dir;
+
+		dirPtr->free_block_id = sizeof(directory); // we know the id's are just byte offsets, this is the first block.
+		dirPtr->partition_size = numBytes;
+		dirPtr->magic = SUPERBLOCK;
+		dirPtr->version = FORMAT_VERSION;
+		dirPtr->layout = layout;
+
+		if(layout == LAYOUT_SPLIT) {
+			// keep the zone boundary on a group boundary when the partition is big enough.
+			dirPtr->meta_zone_size = numBytes / META_ZONE_SHARE;
+			if(dirPtr->meta_zone_size >= GROUP_SIZE) {
+				dirPtr->meta_zone_size -= dirPtr->meta_zone_size % GROUP_SIZE;
+			}
+		}
+
+		writePartition(p, 0, dirPtr, sizeof(directory));
+
+
+		block_header newBlock;
+		newBlock.size = numBytes;
+		newBlock.magic = FREE;
+		newBlock.previous_id = 0;
+		newBlock.next_id = 0;
+
+		// now we need to fill the file in with enough space for the sectors to
+		// have it simulate being a hard drive. Extending the file reads back as
+		// zeros, but the host only allocates storage as it gets written.
+		if(ftruncate(p->fd, sizeof(directory) + numBytes) != 0) {
+			fprintf(stderr, "Unable to completely allocate the partition!!\n");
+			return NULL;
+		}
+
+		// now we need to initialize the initial free block
+		write_header(p, dirPtr->free_block_id, &newBlock);
+		count_space(p);
+
+		build_index(p);
+		load_snapshots(p);
+		load_shares(p);
+		load_dedup(p);
+
+		*created = true;
+		return p;
+
+	}
+}
+
+/**
+ * Makes p the partition this thread's calls act on, so several partitions can
+ * be used at once. Passing NULL goes back to the one opened by initialize.
+ */
+void use_partition(partition *p) {
+	threadPartition = p;
+}
+
+/**
+ * Retrieves the partition this thread's calls act on.
+ */
+partition *current_partition() {
+	return current();
+}
+
+/**
+ * Closes a partition opened with open_partition, once everything written
+ * to it is committed and in the partition file. Ends the calling thread's
+ * transaction if it's in one; no other thread may still be using it.
+ */
+void close_partition(partition *p) {
+	if(transactionDepth > 0) {
+		transactionDepth = 0;
+		pthread_rwlock_unlock(&p->snapLock);
+	}
+
+	drain_all(p);
+
+	// a partition fsck_open opened and never mounted has no index to keep.
+	if(p->groups != NULL) {
+		save_checkpoint(p);
+	}
+
+	// everything written makes it to the file before it's closed.
+	journal_close(p->journal);
+
+	if(p->mapping != NULL) {
+		munmap((void*)p->mapping, p->mappingSize);
+	}
+
+	while(p->oldMappings != NULL) {
+		old_mapping *m = p->oldMappings;
+		p->oldMappings = m->next;
+		munmap((void*)m->addr, m->size);
+		free(m);
+	}
+
+	pthread_rwlock_destroy(&p->lock);
+	for(int i = 0; i <= NUM_STRIPES; i++) {
+		pthread_mutex_destroy(&p->stripes[i]);
+	}
+	pthread_mutex_destroy(&p->allocLock);
+	pthread_mutex_destroy(&p->mapLock);
+	pthread_mutex_destroy(&p->snapMutex);
+	pthread_mutex_destroy(&p->shareMutex);
+	pthread_mutex_destroy(&p->dedupMutex);
+	pthread_rwlock_destroy(&p->snapLock);
+
+	while(p->snapshots != NULL) {
+		snapshot *s = p->snapshots;
+		p->snapshots = s->next;
+		rangemap_destroy(s->remap);
+		free(s);
+	}
+
+	rangemap_destroy(p->births);
+	rangemap_destroy(p->refs);
+	rangemap_destroy(p->shares);
+	rangemap_destroy(p->byHash);
+	rangemap_destroy(p->byBlock);
+
+	close(p->fd);
+	free(p->groups);
+
+	if(defaultPartition == p) {
+		defaultPartition = NULL;
+	}
+
+	free(p);
+}
+
+/**
+ * Starts a transaction: everything the calling thread writes to its partition
+ * until end_transaction is committed to the journal together, so after a
+ * crash either all of it is there or none of it is. Commands from every
+ * thread that end around the same time are committed as a group with a
+ * single sync. Transactions nest, and must be started before taking any
+ * locks that another thread's transaction may wait on.
+ */
+void begin_transaction() {
+	partition *p = current();
+
+	if(p != NULL) {
+		journal_start(p->journal);
+
+		// snapshots are only taken between transactions.
+		if(transactionDepth++ == 0) {
+			pthread_rwlock_rdlock(&p->snapLock);
+		}
+	}
+}
+
+/**
+ * Ends the calling thread's transaction. It's committed shortly after, in
+ * the background. Under DURABILITY_FLUSH or DURABILITY_FSYNC (the calling
+ * thread's, if it has one, see setSessionDurability) it waits until it's
+ * committed, or synced, before returning.
+ */
+void end_transaction() {
+	partition *p = current();
+
+	if(p == NULL) {
+		return;
+	}
+
+	if(transactionDepth > 0 && --transactionDepth == 0) {
+		pthread_rwlock_unlock(&p->snapLock);
+	}
+
+	if(!journal_stop(p->journal)) {
+		return;
+	}
+
+	durability_mode mode = sessionDurable ? sessionDurability : journal_get_policy(p->journal).mode;
+
+	if(mode == DURABILITY_FLUSH) {
+		journal_flush(p->journal);
+	} else if(mode == DURABILITY_FSYNC) {
+		journal_sync(p->journal);
+	}
+}
+
+/**
+ * Waits until everything written to the partition so far, including the
+ * calling thread's transaction, is committed to stable storage.
+ */
+void sync_partition() {
+	journal_sync(current()->journal);
+}
+
+/**
+ * Changes when the partition's journal commits and syncs, see
+ * durability_mode. Defaults to DURABILITY_PERIODIC every 5 milliseconds.
+ */
+void setDurability(durability_policy policy) {
+	journal_set_policy(current()->journal, policy);
+}
+
+/**
+ * Retrieves the partition's durability policy.
+ */
+durability_policy getDurability() {
+	return journal_get_policy(current()->journal);
+}
+
+/**
+ * Makes end_transaction on the calling thread wait as mode says rather than
+ * as the partition's policy does, for a session that wants its commands kept
+ * more (or less) carefully than everyone else's. Only whether and how long
+ * commands wait changes, DURABILITY_PERIODIC waits as little as
+ * DURABILITY_NONE. Pass false for own to follow the partition again.
+ */
+void setSessionDurability(bool own, durability_mode mode) {
+	sessionDurable = own;
+	sessionDurability = mode;
+}
+
+/**
+ * Retrieves what the partition's journal has done since it was opened.
+ */
+journal_stats getJournalStats() {
+	return journal_get_stats(current()->journal);
+}
+
+/**
+ * Prints info about the state of the partition (descriptor block and free block table stats)
+ * to the specified file descriptor.
+ */
+void printInfo(FILE *dest) {
+	partition *p = current();
+
+	// nothing may change while we walk the lists.
+	pthread_rwlock_wrlock(&p->lock);
+
+	// so queued frees show up as free space.
+	drain_all(p);
+
+	fprintf(dest, "\n\t* Partition Information *\n\nAllocated Space:\n");
+
+	directory d = p->dir;
+	block_size_t totalBytes = 0;
+
+	block_id i = d.alloc_block_id;
+	uint64_t numBlocks = 0;
+	block_header bh;
+	while(i != 0) {
+		read_header(p, i, &bh);
+		fprintf(dest, "offset %llu: %llu bytes  (%llu usable)\n", i, bh.size + sizeof(block_header), bh.size);
+		totalBytes += bh.size + sizeof(block_header);
+		i = bh.next_id;
+		numBlocks++;
+	}
+
+	fprintf(dest, "--> total allocated: %llu bytes  (%llu usable)\n\nFree Space:\n", totalBytes, totalBytes - (numBlocks * sizeof(block_header)));
+
+	totalBytes = 0;
+	numBlocks = 0;
+
+	i = d.free_block_id;
+	while(i != 0) {
+		read_header(p, i, &bh);
+		fprintf(dest, "offset %llu: %llu bytes\n", i, bh.size);
+		totalBytes += bh.size;
+		i = bh.next_id;
+		numBlocks++;
+	}
+
+	fprintf(dest, "--> total free: %llu bytes\n\n", totalBytes);
+
+	pthread_rwlock_unlock(&p->lock);
+}
+
+// what the bytes of a stretch of the partition are, for exportLayout.
+typedef enum span_kind {
+	SPAN_ALLOCATED,
+	SPAN_FREE,
+	SPAN_QUEUED,
+	SPAN_UNREADABLE
+} span_kind;
+
+// exportLayout's pass, and the bucket it's in.
+typedef struct layout_pass {
+	FILE *dest;
+	export_format format;
+	block_id start; // where the first bucket starts.
+	block_id end;
+	uint64_t width; // bytes in each bucket, the last may have fewer.
+	uint64_t index; // the bucket being filled.
+	uint64_t bytes[4]; // by span_kind, in this bucket.
+	uint64_t blocks; // starting in this bucket.
+	block_size_t largest; // the biggest free block reaching into this bucket.
+	block_size_t largestSoFar;
+	uint64_t totals[4];
+	uint64_t classBlocks[FREE_CLASSES];
+	block_size_t classBytes[FREE_CLASSES];
+} layout_pass;
+
+// writes out the bucket the pass is through with and starts the next.
+static void emit_bucket(layout_pass *lp) {
+	block_id from = lp->start + lp->index * lp->width;
+	block_id to = lp->end - from < lp->width ? lp->end : from + lp->width;
+
+	if(lp->format == EXPORT_JSON) {
+		fprintf(lp->dest, "%s\n    {\"start\": %" PRIu64 ", \"end\": %" PRIu64 ", \"allocated\": %" PRIu64 ", \"free\": %" PRIu64
+			", \"queued\": %" PRIu64 ", \"unreadable\": %" PRIu64 ", \"blocks\": %" PRIu64 ", \"largest_free\": %" PRIu64
+			", \"largest_free_so_far\": %" PRIu64 "}", lp->index == 0 ? "" : ",", from, to, lp->bytes[SPAN_ALLOCATED],
+			lp->bytes[SPAN_FREE], lp->bytes[SPAN_QUEUED], lp->bytes[SPAN_UNREADABLE], lp->blocks, lp->largest, lp->largestSoFar);
+	} else {
+		fprintf(lp->dest, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+			from, to, lp->bytes[SPAN_ALLOCATED], lp->bytes[SPAN_FREE], lp->bytes[SPAN_QUEUED], lp->bytes[SPAN_UNREADABLE],
+			lp->blocks, lp->largest, lp->largestSoFar);
+	}
+
+	lp->index++;
+	memset(lp->bytes, 0, sizeof(lp->bytes));
+	lp->blocks = 0;
+	lp->largest = 0;
+}
+
+// adds size bytes at pos, of kind, to the buckets they fall in, writing out
+// every bucket they finish.
+static void add_span(layout_pass *lp, block_id pos, uint64_t size, span_kind kind) {
+	block_id to = pos + size;
+
+	lp->totals[kind] += size;
+	if(kind == SPAN_FREE && size > lp->largestSoFar) {
+		lp->largestSoFar = size;
+	}
+
+	while(pos < to) {
+		block_id bucketEnd = lp->start + (lp->index + 1) * lp->width;
+		if(bucketEnd > lp->end) {
+			bucketEnd = lp->end;
+		}
+
+		block_id upto = to < bucketEnd ? to : bucketEnd;
+		lp->bytes[kind] += upto - pos;
+		if(kind == SPAN_FREE && size > lp->largest) {
+			lp->largest = size;
+		}
+
+		pos = upto;
+		if(pos == bucketEnd) {
+			emit_bucket(lp);
+		}
+	}
+}
+
+/**
+ * Writes how the partition is laid out to dest in format, taking one pass
+ * over the blocks in address order with nothing changing meanwhile. The
+ * partition is cut into at most buckets equal stretches, each written as
+ * soon as the pass is through it with the bytes in it that are allocated,
+ * free, waiting to be freed or unreadable, the blocks starting in it, the
+ * biggest free block reaching into it and the biggest one so far. A
+ * histogram of free blocks by size class and the totals follow.
+ */
+void exportLayout(FILE *dest, uint64_t buckets, export_format format) {
+	partition *p = current();
+	layout_pass lp = { 0 };
+
+	// nothing may change while we walk the blocks.
+	pthread_rwlock_wrlock(&p->lock);
+
+	lp.dest = dest;
+	lp.format = format;
+	lp.start = sizeof(directory);
+	lp.end = partition_end(p);
+
+	uint64_t span = lp.end - lp.start;
+	if(buckets == 0) {
+		buckets = 1;
+	}
+	lp.width = span / buckets + (span % buckets != 0);
+	if(lp.width == 0) {
+		lp.width = 1;
+	}
+
+	if(format == EXPORT_JSON) {
+		fprintf(dest, "{\n  \"size\": %" PRIu64 ",\n  \"layout\": \"%s\",\n  \"metadata_zone\": %" PRIu64 ",\n  \"bucket_bytes\": %" PRIu64
+			",\n  \"buckets\": [", p->dir.partition_size, p->dir.layout == LAYOUT_SPLIT ? "split" : "mixed",
+			p->dir.layout == LAYOUT_SPLIT ? p->dir.meta_zone_size : 0, lp.width);
+	} else {
+		fprintf(dest, "start,end,allocated,free,queued,unreadable,blocks,largest_free,largest_free_so_far\n");
+	}
+
+	uint64_t blocks = 0;
+	block_id pos = lp.start;
+
+	while(pos < lp.end) {
+		block_header bh;
+		readPartition(p, pos, &bh, sizeof(block_header));
+
+		// allocated blocks, and those whose free is queued, don't count their header.
+		uint64_t size = bh.magic == FREE ? bh.size : bh.size + sizeof(block_header);
+
+		if((bh.magic != ALLOCATED && bh.magic != FREE && bh.magic != 0) || size < sizeof(block_header) || size > lp.end - pos) {
+			// there's no telling where the next block starts, fsck can find it.
+			add_span(&lp, pos, lp.end - pos, SPAN_UNREADABLE);
+			break;
+		}
+
+		lp.blocks++;
+		blocks++;
+
+		if(bh.magic == FREE) {
+			int c = free_class(size);
+			lp.classBlocks[c]++;
+			lp.classBytes[c] += size;
+			add_span(&lp, pos, size, SPAN_FREE);
+		} else {
+			add_span(&lp, pos, size, bh.magic == ALLOCATED ? SPAN_ALLOCATED : SPAN_QUEUED);
+		}
+
+		pos += size;
+	}
+
+	pthread_rwlock_unlock(&p->lock);
+
+	uint64_t freeBlocks = 0;
+	for(int i = 0; i < FREE_CLASSES; i++) {
+		freeBlocks += lp.classBlocks[i];
+	}
+
+	// how much of the free space can't go to a single allocation.
+	double fragmentation = lp.totals[SPAN_FREE] > 0 ? 1.0 - (double)lp.largestSoFar / lp.totals[SPAN_FREE] : 0.0;
+
+	if(format == EXPORT_JSON) {
+		fprintf(dest, "\n  ],\n  \"free_histogram\": [");
+	} else {
+		fprintf(dest, "\nmin,max,blocks,bytes\n");
+	}
+
+	for(int i = 0; i < FREE_CLASSES; i++) {
+		// nothing smaller than a header gets this far, so the first class starts at one.
+		uint64_t min = (uint64_t)32 << i;
+
+		// the last class has no upper bound, which is null in JSON and left empty in CSV.
+		char max[24] = "";
+		if(i < FREE_CLASSES - 1) {
+			snprintf(max, sizeof(max), "%" PRIu64, ((uint64_t)64 << i) - 1);
+		}
+
+		if(format == EXPORT_JSON) {
+			fprintf(dest, "%s\n    {\"min\": %" PRIu64 ", \"max\": %s, \"blocks\": %" PRIu64 ", \"bytes\": %" PRIu64 "}",
+				i == 0 ? "" : ",", min, max[0] != '\0' ? max : "null", lp.classBlocks[i], lp.classBytes[i]);
+		} else {
+			fprintf(dest, "%" PRIu64 ",%s,%" PRIu64 ",%" PRIu64 "\n", min, max, lp.classBlocks[i], lp.classBytes[i]);
+		}
+	}
+
+	if(format == EXPORT_JSON) {
+		fprintf(dest, "\n  ],\n  \"totals\": {\"blocks\": %" PRIu64 ", \"allocated\": %" PRIu64 ", \"free\": %" PRIu64
+			", \"free_blocks\": %" PRIu64 ", \"queued\": %" PRIu64 ", \"unreadable\": %" PRIu64 ", \"largest_free\": %" PRIu64
+			", \"fragmentation\": %.4f}\n}\n", blocks, lp.totals[SPAN_ALLOCATED], lp.totals[SPAN_FREE], freeBlocks,
+			lp.totals[SPAN_QUEUED], lp.totals[SPAN_UNREADABLE], lp.largestSoFar, fragmentation);
+	} else {
+		fprintf(dest, "\nblocks,allocated,free,free_blocks,queued,unreadable,largest_free,fragmentation\n");
+		fprintf(dest, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.4f\n", blocks,
+			lp.totals[SPAN_ALLOCATED], lp.totals[SPAN_FREE], freeBlocks, lp.totals[SPAN_QUEUED], lp.totals[SPAN_UNREADABLE],
+			lp.largestSoFar, fragmentation);
+	}
+}
+
+// finds the biggest free blocks again by walking the free list, once the
+// ones in the descriptor have all gone. The caller holds the partition lock
+// exclusively.
+static void rank_again(partition *p) {
+	directory *d = &p->dir;
+	block_header bh;
+
+	memset(d->largest, 0, sizeof(d->largest));
+	d->free_floor = 0;
+
+	for(block_id i = d->free_block_id; i != 0; i = bh.next_id) {
+		read_header(p, i, &bh);
+		rank_free(d, i, bh.size);
+	}
+
+	save_field(p, largest);
+	save_field(p, free_floor);
+}
+
+// fills stats in from the descriptor. The caller holds allocLock, or the
+// partition lock exclusively.
+static void fill_stats(partition *p, space_stats *stats) {
+	directory *d = &p->dir;
+
+	stats->size = d->partition_size;
+	stats->allocatedBytes = d->allocated_bytes;
+	stats->allocatedBlocks = d->allocated_blocks;
+	stats->freeBytes = d->free_bytes;
+	stats->freeBlocks = d->free_blocks;
+	stats->queuedBytes = d->partition_size - d->allocated_bytes - d->free_bytes;
+	stats->largestFree = d->largest[0].size;
+	memcpy(stats->classes, d->free_classes, sizeof(stats->classes));
+}
+
+/**
+ * Retrieves how the partition's space is used, see space_stats. Only takes
+ * a walk over the free list if the free blocks that were the biggest have
+ * all gone since it last did.
+ */
+space_stats getSpaceStats() {
+	partition *p = current();
+	space_stats stats;
+
+	pthread_rwlock_rdlock(&p->lock);
+	pthread_mutex_lock(&p->allocLock);
+
+	bool stale = p->dir.largest[0].id == 0 && p->dir.free_floor > 0;
+	if(!stale) {
+		fill_stats(p, &stats);
+	}
+
+	pthread_mutex_unlock(&p->allocLock);
+	pthread_rwlock_unlock(&p->lock);
+
+	if(stale) {
+		pthread_rwlock_wrlock(&p->lock);
+
+		// somebody else may have walked it while we waited.
+		if(p->dir.largest[0].id == 0 && p->dir.free_floor > 0) {
+			rank_again(p);
+		}
+
+		fill_stats(p, &stats);
+		pthread_rwlock_unlock(&p->lock);
+	}
+
+	return stats;
+}
+
+// takes the block off the allocated list and gives it back to the free list.
+// The caller holds the partition lock (shared).
+static void free_locked(partition *p, block_id blk) {
+	block_id left_id;
+	block_id right_id;
+
+	block_header leftHead, rightHead, currentHead;
+
+	pthread_mutex_lock(&p->allocLock);
+
+	read_header(p, blk, &currentHead);
+
+	if(currentHead.magic != ALLOCATED) {
+		fprintf(stderr, "You're trying to free a block that is not allocated!\n");
+		_exit(31337);
+	}
+
+	// remove from allocated list
+
+	left_id = currentHead.previous_id;
+	right_id = currentHead.next_id;
+
+	if(left_id != 0) {
+		read_header(p, left_id, &leftHead);
+	}
+
+	if(right_id != 0) {
+		read_header(p, right_id, &rightHead);
+	}
+
+	if(left_id == 0) {
+		p->dir.alloc_block_id = right_id;
+		save_field(p, alloc_block_id);
+
+	} else {
+		leftHead.next_id = right_id;
+		write_header(p, left_id, &leftHead);
+	}
+
+	if(right_id != 0) {
+		// update right_id too
+		rightHead.previous_id = left_id;
+		write_header(p, right_id, &rightHead);
+	}
+
+	// it may sit in a queue for a while before it's on the free list, and
+	// shouldn't look allocated in the meantime.
+	uint64_t gone = 0;
+	writePartition(p, blk, &gone, sizeof(gone));
+
+	note_allocated(p, -(int64_t)(currentHead.size + sizeof(block_header)), -1);
+
+	pthread_mutex_unlock(&p->allocLock);
+
+	release_from(p, blk, currentHead.size + sizeof(block_header)); // allocated blocks don't include header in its field
+}
+
+/**
+ * Resizes an already allocated block in this partition, potentially moving it,
+ * so you should upate the pointer to the one that is returned.
+ * The old contents are carried over (cut short if the block shrinks),
+ * anything past them is not initialized.
+ *
+ * Passing 0 in for the blk is equivalent to calling allocate_block.
+ *
+ */
+block_id resize_block(block_id blk, block_size_t size) {
+
+	if(blk == 0) {
+		return allocate_block(size);
+	}
+
+	partition *p = current();
+	check_writable();
+
+	block_header head;
+	read_header(p, blk, &head);
+
+	block_id newBlk = allocate_locked(size, blk, zone_of(p, blk));
+	if(newBlk == 0) {
+		fprintf(stderr, "Error: request to resize block in partition failed, not enough space!");
+		_exit(-1);
+	}
+
+	void* buf = malloc(size);
+	if(buf == NULL) {
+		fprintf(stderr, "The file you're moving is quite large, and this version of the partitioner only supports files that can wholly fit in the heap.\n");
+		_exit(-1);
+	}
+
+	// will truncate the file if the request is smaller. Anything past the old
+	// contents is left as it was, it's up to the caller to fill it in.
+	block_size_t keep = size < head.size ? size : head.size;
+
+	load_block(blk, buf, keep);
+
+	save_block(newBlk, buf, keep);
+
+	free(buf);
+
+	// the old block may be left to a snapshot instead.
+	free_block(blk);
+
+	return newBlk;
+}
+
+// grows the partition. The caller holds the partition lock exclusively.
+static int grow_locked(partition *p, block_size_t numBytes) {
+	block_id oldEnd = partition_end(p);
+
+	// anything smaller couldn't even hold a free block header.
+	if(numBytes < sizeof(block_header)) {
+		return 1;
+	}
+
+	if(ftruncate(p->fd, oldEnd + numBytes) != 0) {
+		return 1;
+	}
+
+	// getPartitionSize reads it without the lock.
+	__atomic_store_n(&p->dir.partition_size, p->dir.partition_size + numBytes, __ATOMIC_RELAXED);
+	save_field(p, partition_size);
+
+	uint64_t oldGroups = p->numGroups;
+	p->numGroups = (p->dir.partition_size + GROUP_SIZE - 1) / GROUP_SIZE;
+	p->groups = realloc(p->groups, p->numGroups * sizeof(group_info));
+	memset(p->groups + oldGroups, 0, (p->numGroups - oldGroups) * sizeof(group_info));
+
+	release(p, oldEnd, numBytes);
+
+	return 0;
+}
+
+/**
+ * Adds numBytes bytes to the end of the partition, extending the host file.
+ * The new space joins the free list, merging with a free block at the old end.
+ * In the split layout it all goes to the data zone. The growth policy's limit
+ * does not apply. Returns a non-zero value if the host file can't be extended.
+ */
+int grow_partition(block_size_t numBytes) {
+	partition *p = current();
+
+	pthread_rwlock_wrlock(&p->lock);
+	int ret = grow_locked(p, numBytes);
+	pthread_rwlock_unlock(&p->lock);
+
+	return ret;
+}
+
+// grows the partition according to the growth policy so that a block of size
+// bytes (header included) fits at the end. Returns non-zero if it can't.
+// The caller holds the partition lock shared, which is let go while growing.
+static int grow_for(partition *p, block_size_t size) {
+	block_size_t seen = p->dir.partition_size;
+
+	pthread_rwlock_unlock(&p->lock);
+	pthread_rwlock_wrlock(&p->lock);
+
+	int ret = 0;
+
+	// somebody else may have grown it while we waited, then just try again.
+	if(p->dir.partition_size == seen) {
+		if(p->growth.mode == GROW_OFF) {
+			ret = 1;
+		} else {
+			block_size_t by = p->growth.mode == GROW_DOUBLE ? p->dir.partition_size : p->growth.increment;
+			if(by < size) {
+				by = size;
+			}
+
+			block_size_t limit = p->growth.limit;
+			if(limit != 0 && p->dir.partition_size + by > limit) {
+				// the last step only goes as far as the limit.
+				by = p->dir.partition_size + size > limit ? 0 : limit - p->dir.partition_size;
+			}
+
+			ret = by == 0 ? 1 : grow_locked(p, by);
+		}
+	}
+
+	pthread_rwlock_unlock(&p->lock);
+	pthread_rwlock_rdlock(&p->lock);
+
+	return ret;
+}
+
+/**
+ * Changes how the partition grows when it runs out of space, see growth_mode.
+ * Defaults to GROW_DOUBLE with no limit.
+ */
+void setGrowthPolicy(growth_policy policy) {
+	partition *p = current();
+
+	pthread_rwlock_wrlock(&p->lock);
+	p->growth = policy;
+	pthread_rwlock_unlock(&p->lock);
+}
+
+/**
+ * Retrieves the current growth policy.
+ */
+growth_policy getGrowthPolicy() {
+	return current()->growth;
+}
+
+/**
+ * Retrieves the number of bytes in the partition, not counting the descriptor.
+ */
+block_size_t getPartitionSize() {
+	return __atomic_load_n(&current()->dir.partition_size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Whether numBytes bytes of contents of a block at blk would lie inside the
+ * partition, for ids read from something that may be damaged.
+ */
+bool block_in_bounds(block_id blk, size_t numBytes) {
+	partition *p = current();
+
+	return blk >= sizeof(directory) && blk + sizeof(block_header) + numBytes <= partition_end(p);
+}
+
+/**
+ * Allocates a new block in the partition.
+ */
+block_id allocate_block(block_size_t request_size) {
+	return allocate_block_near(request_size, 0);
+}
+
+// Picks where inside the free block at pos (described by fb) an allocation of
+// size bytes (header included) should start, given that we'd like it to land
+// at or after goal. Returns 0 if it doesn't fit.
+static block_id fit_in(block_id pos, block_header *fb, block_id goal, uint64_t size) {
+	block_id start = pos;
+
+	if(pos < goal) {
+		// carve out of the middle so we land in the goal group, unless the piece
+		// left over on the left would be too small to be worth anything.
+		start = goal;
+		if(start - pos < MIN_REMNANT) {
+			start = pos;
+		}
+	}
+
+	if(start + size > pos + fb->size) {
+		return 0;
+	}
+
+	return start;
+}
+
+// Walks the free list from the block overlapping from, looking for room for
+// size bytes (header included) that starts at or after min and before hi.
+// Sets found to the free block to carve from (0 if nothing fits), with its
+// header in fb and where the allocation should start in start.
+// Returns false if the list changed while we were walking it.
+static bool scan_free(partition *p, block_id from, block_id min, block_id hi, uint64_t size, block_header *fb, block_id *start, block_id *found) {
+	block_id currentPosition;
+
+	*found = 0;
+
+	if(!free_block_before(p, from, &currentPosition)) {
+		return false;
+	}
+
+	if(currentPosition == 0) {
+		currentPosition = __atomic_load_n(&p->dir.free_block_id, __ATOMIC_RELAXED);
+	}
+
+	while(currentPosition != 0 && currentPosition < hi) {
+		if(!read_free(p, currentPosition, fb)) {
+			return false;
+		}
+
+		*start = fit_in(currentPosition, fb, min, size);
+		if(*start != 0 && *start < hi) {
+			*found = currentPosition;
+			return true;
+		}
+
+		currentPosition = fb->next_id;
+	}
+
+	return true;
+}
+
+// Carves an allocation of size bytes (header included) starting at start out of
+// the free block at currentPosition, and puts it on the allocated list.
+// Locks the free blocks involved, unless held says the caller has every
+// stripe already, and returns 0 without changing anything if current no
+// longer describes the block once they're held.
+static block_id carve(partition *p, block_id currentPosition, block_header current, block_id start, uint64_t size, bool held) {
+	directory *dir = &p->dir;
+
+	// now we have a usable free block, which we split into up to three pieces:
+	// [free remainder on the left][the allocation][free remainder on the right]
+	block_size_t oldSize = current.size;
+	block_id oldNext = current.next_id;
+	block_id oldPrev = current.previous_id;
+	block_size_t leftSize = start - currentPosition;
+	block_size_t rightSize = oldSize - leftSize - size;
+	block_id rightPosition = 0;
+	block_header temp;
+
+	// If the residual free block is less than 512 bytes, we give the whole block to the request...
+	// there's enough overhead to make that remaining amount of space almost useless anyway.
+	if(rightSize < MIN_REMNANT) {
+		size += rightSize;
+		rightSize = 0;
+	} else {
+		rightPosition = start + size;
+	}
+
+	lockset set = { {0}, 0, false };
+	lockset_add(&set, currentPosition);
+	lockset_add(&set, oldPrev);
+	lockset_add(&set, oldNext);
+	lockset_add(&set, rightPosition);
+	if(oldPrev == 0) {
+		lockset_add_head(&set);
+	}
+
+	if(held) {
+		set.count = 0;
+	}
+
+	lockset_lock(p, &set);
+
+	// make sure nobody got to the block between finding it and locking it.
+	read_header(p, currentPosition, &temp);
+	if(temp.magic != FREE || temp.size != oldSize || temp.next_id != oldNext || temp.previous_id != oldPrev
+			|| (oldPrev == 0 && dir->free_block_id != currentPosition)) {
+		lockset_unlock(p, &set);
+		return 0;
+	}
+
+	index_account(p, start, size, false);
+
+	if(leftSize != 0) {
+		// the free block stays where it is, just smaller.
+		current.size = leftSize;
+
+		if(rightPosition != 0) {
+			current.next_id = rightPosition;
+		}
+
+		write_header(p, currentPosition, &current);
+
+	} else {
+		// the free block goes away, the right remainder (if any) takes its place.
+		index_unlink(p, currentPosition, rightPosition != 0 ? rightPosition : oldNext);
+
+		if(oldPrev == 0) {
+			__atomic_store_n(&dir->free_block_id, rightPosition != 0 ? rightPosition : oldNext, __ATOMIC_RELAXED);
+			save_field(p, free_block_id);
+		} else {
+			read_header(p, oldPrev, &temp);
+			temp.next_id = rightPosition != 0 ? rightPosition : oldNext;
+			write_header(p, oldPrev, &temp);
+		}
+	}
+
+	if(rightPosition != 0) {
+		block_header newFree;
+		newFree.magic = FREE;
+		newFree.size = rightSize;
+		newFree.previous_id = leftSize != 0 ? currentPosition : oldPrev;
+		newFree.next_id = oldNext;
+
+		write_header(p, rightPosition, &newFree);
+		index_link(p, rightPosition);
+	}
+
+	if(oldNext != 0 && (leftSize == 0 || rightPosition != 0)) {
+		read_header(p, oldNext, &temp);
+		temp.previous_id = rightPosition != 0 ? rightPosition : oldPrev;
+		write_header(p, oldNext, &temp);
+	}
+
+	// now that free list is fixed, we need to add this newly allocated block
+	// to the allocated list. there's no actual reason why the allocated
+	// list needs to be sorted by id, it only matters for the free list in order
+	// to support a simpler block coalescing system.
+
+	current.magic = ALLOCATED;
+	current.size = size - sizeof(block_header);
+	current.previous_id = 0;
+	current.next_id = 0;
+
+	pthread_mutex_lock(&p->allocLock);
+
+	note_free(p, currentPosition, oldSize, true);
+	if(leftSize != 0) {
+		note_free(p, currentPosition, leftSize, false);
+	}
+	if(rightPosition != 0) {
+		note_free(p, rightPosition, rightSize, false);
+	}
+	note_allocated(p, size, 1);
+
+	if(dir->alloc_block_id != 0) {
+		uint64_t currentFirstPos = dir->alloc_block_id;
+		block_header currentFirst;
+
+		read_header(p, currentFirstPos, &currentFirst);
+		currentFirst.previous_id = start;
+		write_header(p, currentFirstPos, &currentFirst);
+
+		current.next_id = currentFirstPos;
+	}
+
+	dir->alloc_block_id = start;
+	save_field(p, alloc_block_id);
+
+	// and save the new header.
+	write_header(p, start, &current);
+
+	pthread_mutex_unlock(&p->allocLock);
+
+	lockset_unlock(p, &set);
+
+	return start;
+
+}
+
+// Allocates within the given zone. The goal group is the one containing hint,
+// or if hint is outside the zone, the group at the same relative position in it.
+// The caller holds the partition lock (shared).
+static block_id allocate_zone(partition *p, block_size_t request_size, block_id hint, zone z) {
+	block_header current;
+	block_id currentPosition;
+	block_id start = 0;
+	block_id lo, hi;
+
+	// actual size of the block we'll be allocating must include space for the header.
+	uint64_t size = request_size + sizeof(block_header);
+
+	// pick up what other threads freed in our slice, and with no better idea
+	// of where to go, start from it.
+	int a = arena_of(p);
+	drain_arena(p, &p->arenas[a]);
+
+	if(hint == 0) {
+		hint = group_start(arena_home(p, a));
+	}
+
+	for(int attempts = 0; ; attempts++) {
+		if(__atomic_load_n(&p->dir.free_block_id, __ATOMIC_RELAXED) == 0) {
+			if(drain_all(p) || grow_for(p, size) == 0) {
+				continue;
+			}
+
+			fprintf(stderr, "Error: Partition is full!!\n");
+			_exit(2);
+		}
+
+		zone_bounds(p, z, &lo, &hi);
+
+		block_id goal = lo;
+		if(hint >= lo && hint < hi) {
+			goal = group_start(group_of(hint));
+		} else if(hint >= sizeof(directory) && hint < partition_end(p)) {
+			// so a directory in the metadata zone gets the matching slice of the data zone.
+			block_id otherLo, otherHi;
+			zone_bounds(p, z == ZONE_META ? ZONE_DATA : ZONE_META, &otherLo, &otherHi);
+			goal = group_start(group_of(lo + (hint - otherLo) * (double)(hi - lo) / (otherHi - otherLo)));
+		}
+
+		if(goal < lo) {
+			goal = lo;
+		}
+
+		// one that keeps losing races holds every stripe while it looks.
+		lockset all = { {0}, 0, false };
+		if(attempts >= MAX_RETRIES) {
+			lockset_all(&all);
+		}
+
+		lockset_lock(p, &all);
+
+		// the free list is sorted, so starting from the block overlapping the goal
+		// and walking forward visits the goal group first, then the ones after it.
+		bool looked = scan_free(p, goal, goal, hi, size, &current, &start, &currentPosition);
+
+		if(looked && currentPosition == 0 && goal > lo) {
+			// spill over into the groups before the goal.
+			looked = scan_free(p, lo, lo, goal, size, &current, &start, &currentPosition);
+		}
+
+		block_id blk = 0;
+		if(looked && currentPosition != 0) {
+			blk = carve(p, currentPosition, current, start, size, all.all);
+		}
+
+		lockset_unlock(p, &all);
+
+		if(all.all && (!looked || (currentPosition != 0 && blk == 0))) {
+			list_broken();
+		}
+
+		if(blk != 0) {
+			return blk;
+		}
+
+		if(!looked || currentPosition != 0) {
+			// somebody else changed the list first, look again.
+			continue;
+		}
+
+		if(currentPosition == 0 && drain_all(p)) {
+			// frees queued for other arenas may have made room.
+			continue;
+		}
+
+		if(currentPosition == 0 && z == ZONE_META) {
+			// metadata may spill into the data zone, but never the other way around.
+			return allocate_zone(p, request_size, hint, ZONE_ANY);
+		}
+
+		// then we must not have found a block large enough.
+		if(grow_for(p, size) == 0) {
+			continue;
+		}
+
+		fprintf(stderr, "Error: There are no free blocks large enough for a %" PRIu64 " byte request!\n", size);
+		_exit(1);
+	}
+}
+
+// takes the partition lock around an allocation.
+static block_id allocate_locked(block_size_t request_size, block_id hint, zone z) {
+	partition *p = current();
+	check_writable();
+
+	pthread_rwlock_rdlock(&p->lock);
+	block_id blk = allocate_zone(p, request_size, hint, z);
+	pthread_rwlock_unlock(&p->lock);
+
+	note_birth(p, blk);
+
+	return blk;
+}
+
+/**
+ * Allocates a new block in the partition, preferring the allocation group
+ * containing hint. If that group can't satisfy the request, the following
+ * groups are tried in address order, wrapping around to the start of the partition.
+ *
+ * Passing 0 in for the hint is equivalent to calling allocate_block.
+ */
+block_id allocate_block_near(block_size_t request_size, block_id hint) {
+	return allocate_locked(request_size, hint, ZONE_ANY);
+}
+
+/**
+ * Allocates a block for file headers or directory entries. In the split layout
+ * these go in the metadata zone (spilling into the data zone only once it is full),
+ * otherwise this is the same as allocate_block_near.
+ */
+block_id allocate_metadata_block(block_size_t request_size, block_id hint) {
+	return allocate_locked(request_size, hint, ZONE_META);
+}
+
+/**
+ * Allocates a block for file contents. In the split layout these go in the
+ * data zone, in the slice matching the hint's position in the metadata zone,
+ * otherwise this is the same as allocate_block_near.
+ */
+block_id allocate_data_block(block_size_t request_size, block_id hint) {
+	return allocate_locked(request_size, hint, ZONE_DATA);
+}
+
+/**
+ * Picks a placement hint for a new directory created under parent.
+ * New directories stay in their parent's group, unless that group is
+ * getting crowded, in which case they move to the emptiest group so
+ * their own children have room to cluster around them.
+ */
+block_id directory_hint(block_id parent) {
+	partition *p = current();
+	block_id lo, hi;
+
+	pthread_rwlock_rdlock(&p->lock);
+
+	zone_bounds(p, ZONE_META, &lo, &hi);
+
+	uint64_t first = group_of(lo);
+	uint64_t last = group_of(hi - 1);
+	block_size_t crowded = (hi - lo < GROUP_SIZE ? hi - lo : GROUP_SIZE) / 4;
+
+	block_id hint;
+	if(parent >= lo && parent < hi && __atomic_load_n(&p->groups[group_of(parent)].free_bytes, __ATOMIC_RELAXED) >= crowded) {
+		hint = parent;
+	} else {
+		uint64_t best = first;
+		block_size_t bestFree = __atomic_load_n(&p->groups[first].free_bytes, __ATOMIC_RELAXED);
+		for(uint64_t i = first + 1; i <= last; i++) {
+			block_size_t f = __atomic_load_n(&p->groups[i].free_bytes, __ATOMIC_RELAXED);
+			if(f > bestFree) {
+				best = i;
+				bestFree = f;
+			}
+		}
+
+		hint = group_start(best);
+	}
+
+	pthread_rwlock_unlock(&p->lock);
+
+	return hint;
+}
+
+/**
+ * Frees the given block.
+ * Do not call free on an already freed block pls.
+ * Coalesces adjacent blocks.
+ */
+void free_block(block_id blk) {
+	partition *p = current();
+	check_writable();
+
+	// a block other files still use only loses this one's share.
+	if(keep_shared(p, blk)) {
+		return;
+	}
+
+	// a block some snapshot still shares is left to it instead.
+	if(__atomic_load_n(&p->numSnapshots, __ATOMIC_ACQUIRE) > 0 && keep_block(p, blk)) {
+		return;
+	}
+
+	pthread_rwlock_rdlock(&p->lock);
+	free_locked(p, blk);
+	pthread_rwlock_unlock(&p->lock);
+}
+
+/**
+ * Gives blk one more owner, so files can share a block rather than each
+ * having a copy. free_block on a shared block only gives up one owner's
+ * share of it, and the block is freed once its last owner frees it. The
+ * contents are the same for every owner, so whoever is about to change them
+ * should check block_refs and move to a copy of their own first, which is
+ * what resize_block does. A shared block must not be truncated.
+ */
+void share_block(block_id blk) {
+	partition *p = current();
+	check_writable();
+
+	pthread_mutex_lock(&p->shareMutex);
+
+	range *r = rangemap_find(p->shares, blk);
+	if(r == NULL) {
+		r = rangemap_add(p->shares, blk, blk + 1, 1, 0);
+		__atomic_store_n(&p->numShared, rangemap_count(p->shares), __ATOMIC_RELEASE);
+
+		raise_version(p, FORMAT_SHARES);
+	}
+
+	r->value++;
+	save_share(p, r->index);
+
+	pthread_mutex_unlock(&p->shareMutex);
+}
+
+/**
+ * Retrieves how many owners blk has, 1 unless it's been shared with
+ * share_block.
+ */
+uint64_t block_refs(block_id blk) {
+	partition *p = current();
+
+	if(__atomic_load_n(&p->numShared, __ATOMIC_ACQUIRE) == 0) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&p->shareMutex);
+	range *r = rangemap_find(p->shares, blk);
+	uint64_t refs = r != NULL ? r->value : 1;
+	pthread_mutex_unlock(&p->shareMutex);
+
+	return refs;
+}
+
+/**
+ * Turns deduplication of file contents on or off, see dedup_block. This
+ * only tells the layers above whether to use it, the index is kept either
+ * way. Defaults to off.
+ */
+void setDedup(bool on) {
+	__atomic_store_n(&current()->dedup, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * Retrieves whether deduplication is on.
+ */
+bool getDedup() {
+	return __atomic_load_n(&current()->dedup, __ATOMIC_RELAXED);
+}
+
+/**
+ * Turns compression of file contents on or off. Like setDedup this only
+ * tells the layers above whether to compress what they write, whatever is
+ * compressed already stays readable either way. Defaults to off.
+ */
+void setCompression(bool on) {
+	__atomic_store_n(&current()->compress, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * Retrieves whether compression is on.
+ */
+bool getCompression() {
+	return __atomic_load_n(&current()->compress, __ATOMIC_RELAXED);
+}
+
+/**
+ * Changes when checksums are checked, see verify_mode. Defaults to
+ * VERIFY_FILL.
+ */
+void setVerification(verify_mode mode) {
+	__atomic_store_n(&current()->verify, mode, __ATOMIC_RELAXED);
+}
+
+/**
+ * Retrieves the current verification mode.
+ */
+verify_mode getVerification() {
+	return __atomic_load_n(&current()->verify, __ATOMIC_RELAXED);
+}
+
+/**
+ * Looks in the partition's dedup index for a block other than blk whose
+ * first numBytes bytes are the same as data. If there is one it gets another
+ * owner, as with share_block, and is returned for the caller to use instead
+ * of blk. Otherwise blk, unless it's 0, is added to the index as holding
+ * data, and 0 is returned. Blocks are looked up by a hash of their bytes and
+ * then compared byte for byte. A block in the index must not be changed
+ * until claim_block has taken it out.
+ */
+block_id dedup_block(block_id blk, const void *data, block_size_t numBytes) {
+	partition *p = current();
+	check_writable();
+
+	uint64_t hash = hash_bytes(data, numBytes);
+	block_id same = 0;
+
+	pthread_mutex_lock(&p->dedupMutex);
+
+	range *r = rangemap_find(p->byHash, hash);
+
+	if(r != NULL) {
+		if(r->value != blk && r->extra == numBytes && same_bytes(p, r->value, data, numBytes)) {
+			share_block(r->value);
+			same = r->value;
+			p->dedupHits++;
+		}
+	} else if(blk != 0 && rangemap_find(p->byBlock, blk) == NULL) {
+		r = rangemap_add(p->byHash, hash, hash + 1, blk, numBytes);
+		rangemap_add(p->byBlock, blk, blk + 1, hash, 0);
+		__atomic_store_n(&p->numIndexed, rangemap_count(p->byHash), __ATOMIC_RELEASE);
+
+		raise_version(p, FORMAT_DEDUP);
+
+		save_dedup(p, r->index);
+	}
+
+	pthread_mutex_unlock(&p->dedupMutex);
+
+	return same;
+}
+
+/**
+ * Takes blk out of the dedup index, so nobody can start sharing it, and
+ * returns whether the caller is its only owner. If so its contents can be
+ * changed in place, otherwise the caller should move to a copy of its own.
+ */
+bool claim_block(block_id blk) {
+	partition *p = current();
+
+	if(block_refs(blk) > 1) {
+		return false;
+	}
+
+	if(__atomic_load_n(&p->numIndexed, __ATOMIC_ACQUIRE) == 0) {
+		return true;
+	}
+
+	pthread_mutex_lock(&p->dedupMutex);
+	forget_block(p, blk);
+	bool mine = block_refs(blk) == 1;
+	pthread_mutex_unlock(&p->dedupMutex);
+
+	return mine;
+}
+
+/**
+ * Retrieves how big the dedup index is and what it has found.
+ */
+dedup_stats getDedupStats() {
+	partition *p = current();
+	dedup_stats stats;
+
+	pthread_mutex_lock(&p->dedupMutex);
+	stats.entries = rangemap_count(p->byHash);
+	stats.memory = rangemap_memory(p->byHash) + rangemap_memory(p->byBlock);
+	stats.hits = p->dedupHits;
+	pthread_mutex_unlock(&p->dedupMutex);
+
+	return stats;
+}
+
+/**
+ * Shrinks an allocated block in place to size bytes, handing the tail back to
+ * the free list. Unlike resize_block the block never moves, though the tail
+ * is kept if it is too small to be worth freeing.
+ */
+void truncate_block(block_id blk, block_size_t size) {
+	partition *p = current();
+	block_header head;
+
+	check_writable();
+
+	if(__atomic_load_n(&p->numSnapshots, __ATOMIC_ACQUIRE) > 0) {
+		read_header(p, blk, &head);
+
+		// the tail is about to be freed, so snapshots need their own copy of it.
+		if(size > 0 && size <= head.size && head.size - size >= MIN_REMNANT) {
+			uint64_t start = blk + sizeof(block_header);
+
+			keep_copy(p, start + size, start + head.size);
+
+			pthread_mutex_lock(&p->snapMutex);
+			range *b = rangemap_find(p->births, start);
+			if(b != NULL) {
+				uint64_t born = b->value;
+				rangemap_remove(p->births, b);
+				rangemap_add(p->births, start, start + size, born, 0);
+			}
+			pthread_mutex_unlock(&p->snapMutex);
+		}
+	}
+
+	pthread_rwlock_rdlock(&p->lock);
+
+	// the list links in the header belong to the allocated list.
+	pthread_mutex_lock(&p->allocLock);
+
+	read_header(p, blk, &head);
+
+	if(head.magic != ALLOCATED) {
+		fprintf(stderr, "You're trying to truncate a block that is not allocated!\n");
+		_exit(31337);
+	}
+
+	if(size > head.size || head.size - size < MIN_REMNANT) {
+		pthread_mutex_unlock(&p->allocLock);
+		pthread_rwlock_unlock(&p->lock);
+		return;
+	}
+
+	block_size_t tail = head.size - size;
+	head.size = size;
+	write_header(p, blk, &head);
+
+	note_allocated(p, -(int64_t)tail, 0);
+
+	pthread_mutex_unlock(&p->allocLock);
+
+	release(p, blk + sizeof(block_header) + size, tail);
+
+	pthread_rwlock_unlock(&p->lock);
+}
+
+// Puts the byte range starting at blk on the free list, coalescing it with its
+// neighbours. The group index tells us which free blocks surround this one, so
+// there's no need to walk the partition to find them.
+// The caller holds the partition lock, either way.
+static void release(partition *p, block_id blk, block_size_t size) {
+	block_id left_id;
+	block_id right_id;
+
+	block_header leftHead, rightHead;
+	block_header newFree;
+	directory *dir = &p->dir;
+	lockset set;
+
+	for(int attempts = 0; ; attempts++) {
+		set.count = 0;
+		set.all = false;
+
+		// one that keeps losing races holds every stripe while it looks.
+		if(attempts >= MAX_RETRIES) {
+			lockset_all(&set);
+			lockset_lock(p, &set);
+		}
+
+		// find the neighbours without locks, then lock them and make sure
+		// they're still the neighbours.
+		bool looked = free_block_before(p, blk, &left_id);
+
+		if(looked && left_id != 0) {
+			looked = read_free(p, left_id, &leftHead);
+			right_id = leftHead.next_id;
+		} else if(looked) {
+			right_id = __atomic_load_n(&dir->free_block_id, __ATOMIC_RELAXED);
+		}
+
+		if(looked && right_id != 0) {
+			looked = read_free(p, right_id, &rightHead);
+		}
+
+		if(!looked && set.all) {
+			list_broken();
+		} else if(!looked) {
+			continue;
+		}
+
+		if(!set.all) {
+			lockset_add(&set, left_id);
+			lockset_add(&set, blk);
+			lockset_add(&set, right_id);
+			if(right_id != 0) {
+				lockset_add(&set, rightHead.next_id);
+			}
+			if(left_id == 0) {
+				lockset_add_head(&set);
+			}
+
+			lockset_lock(p, &set);
+		}
+
+		bool same = true;
+		if(left_id != 0) {
+			same = read_free(p, left_id, &leftHead) && leftHead.next_id == right_id;
+		} else {
+			same = dir->free_block_id == right_id;
+		}
+
+		if(same && right_id != 0) {
+			block_id after = rightHead.next_id;
+			same = read_free(p, right_id, &rightHead) && rightHead.next_id == after && rightHead.previous_id == left_id;
+		}
+
+		if(same) {
+			break;
+		}
+
+		if(set.all) {
+			list_broken();
+		}
+
+		lockset_unlock(p, &set);
+	}
+
+	newFree.magic = FREE;
+	newFree.size = size;
+
+	index_account(p, blk, newFree.size, true);
+
+	// since the free list is ordered, the neighbours in the list are the
+	// physically adjacent blocks exactly when they touch this one.
+	bool mergeLeft = left_id != 0 && left_id + leftHead.size == blk;
+	bool mergeRight = right_id != 0 && blk + newFree.size == right_id;
+
+	pthread_mutex_lock(&p->allocLock);
+	if(mergeLeft) {
+		note_free(p, left_id, leftHead.size, true);
+	}
+	if(mergeRight) {
+		note_free(p, right_id, rightHead.size, true);
+	}
+	note_free(p, mergeLeft ? left_id : blk, (mergeLeft ? leftHead.size : 0) + size + (mergeRight ? rightHead.size : 0), false);
+	pthread_mutex_unlock(&p->allocLock);
+
+	if(mergeRight) {
+		// the right block disappears into this one.
+		index_unlink(p, right_id, rightHead.next_id);
+		newFree.size += rightHead.size;
+		newFree.next_id = rightHead.next_id;
+
+		// its header is left behind inside this block, make sure nobody
+		// walking the list without locks mistakes it for a free block.
+		uint64_t gone = 0;
+		writePartition(p, right_id, &gone, sizeof(gone));
+
+		if(rightHead.next_id != 0) {
+			block_header after;
+			read_header(p, rightHead.next_id, &after);
+			after.previous_id = mergeLeft ? left_id : blk;
+			write_header(p, rightHead.next_id, &after);
+		}
+	} else {
+		newFree.next_id = right_id;
+
+		if(right_id != 0 && !mergeLeft) {
+			rightHead.previous_id = blk;
+			write_header(p, right_id, &rightHead);
+		}
+	}
+
+	if(mergeLeft) {
+		// just extend the left block
+		leftHead.size += newFree.size;
+		leftHead.next_id = newFree.next_id;
+		write_header(p, left_id, &leftHead);
+
+	} else {
+		newFree.previous_id = left_id;
+
+		if(left_id == 0) {
+			// we're about to become the first free block.
+			__atomic_store_n(&dir->free_block_id, blk, __ATOMIC_RELAXED);
+			save_field(p, free_block_id);
+		} else {
+			leftHead.next_id = blk;
+			write_header(p, left_id, &leftHead);
+		}
+
+		write_header(p, blk, &newFree);
+		index_link(p, blk);
+	}
+
+	if(mergeLeft) {
+		punch_freed(p, left_id, leftHead.size, size);
+	} else {
+		punch_freed(p, blk, newFree.size, size);
+	}
+
+	lockset_unlock(p, &set);
+
+	// the deferred pass takes the stripes itself.
+	if(p->punchMode == PUNCH_DEFERRED && __atomic_load_n(&p->punchPending, __ATOMIC_RELAXED) >= PUNCH_BATCH) {
+		punch_pass(p);
+	}
+}
+
+// hands the page aligned interior of the free block at blk back to the host.
+// The block header stays, since the free list runs through it. The caller
+// holds the block's stripe so nobody can allocate from it in the meantime.
+static void punch_interior(partition *p, block_id blk, block_size_t size) {
+	if(size < PUNCH_MIN) {
+		return;
+	}
+
+	uint64_t lo = (blk + sizeof(block_header) + PUNCH_PAGE - 1) / PUNCH_PAGE * PUNCH_PAGE;
+	uint64_t hi = (blk + size) / PUNCH_PAGE * PUNCH_PAGE;
+	if(hi <= lo) {
+		return;
+	}
+
+	// the block only really is free once the transaction freeing it is
+	// committed, so the journal punches it then.
+	journal_punch(p->journal, lo, hi - lo);
+}
+
+// called once released bytes have ended up in the free block at blk.
+static void punch_freed(partition *p, block_id blk, block_size_t size, block_size_t released) {
+	if(p->punchMode == PUNCH_IMMEDIATE) {
+		punch_interior(p, blk, size);
+	} else if(p->punchMode == PUNCH_DEFERRED) {
+		__atomic_fetch_add(&p->punchPending, released, __ATOMIC_RELAXED);
+	}
+}
+
+// punches every large free block, locking each one while it's punched.
+// The caller holds the partition lock, either way.
+static void punch_pass(partition *p) {
+	__atomic_store_n(&p->punchPending, 0, __ATOMIC_RELAXED);
+
+	block_header bh, now;
+	block_id i = __atomic_load_n(&p->dir.free_block_id, __ATOMIC_RELAXED);
+	while(i != 0) {
+		if(!read_free(p, i, &bh)) {
+			// the list changed under us, whatever we missed gets done next time.
+			return;
+		}
+
+		if(bh.size >= PUNCH_MIN) {
+			lockset set = { {0}, 0, false };
+			lockset_add(&set, i);
+			lockset_lock(p, &set);
+
+			if(read_free(p, i, &now) && now.size == bh.size) {
+				punch_interior(p, i, now.size);
+			}
+
+			lockset_unlock(p, &set);
+		}
+
+		i = bh.next_id;
+	}
+}
+
+/**
+ * Hands the interior of every large free block back to the host right away,
+ * whatever the mode. Use this to finish what PUNCH_DEFERRED has put off.
+ */
+void punch_free_space() {
+	partition *p = current();
+
+	pthread_rwlock_rdlock(&p->lock);
+	punch_pass(p);
+	pthread_rwlock_unlock(&p->lock);
+}
+
+/**
+ * Changes how freed space is handed back to the host, see punch_mode.
+ * Defaults to PUNCH_OFF.
+ */
+void setPunchMode(punch_mode mode) {
+	partition *p = current();
+
+	pthread_rwlock_wrlock(&p->lock);
+	p->punchMode = mode;
+	p->punchPending = 0;
+	pthread_rwlock_unlock(&p->lock);
+}
+
+/**
+ * Retrieves the current punch mode.
+ */
+punch_mode getPunchMode() {
+	return current()->punchMode;
+}
+
+/**
+ * Copies at most numBytes bytes from this block into the specified pointer.
+ * Use this to read the block, and you can modify and save it back.
+ */
+void load_block(block_id blk, void* destination, size_t numBytes) {
+	partition *p = current();
+
+	//TODO: check that they're not reading past the end.
+	readPartition(p, blk + sizeof(block_header), destination, numBytes);
+
+	// a snapshot has what it's kept of them instead.
+	if(threadView != 0 && numBytes > 0) {
+		overlay_snapshot(p, blk + sizeof(block_header), destination, numBytes);
+	}
+}
+
+/**
+ * Loads the block like load_block, and returns whether what it loaded should
+ * be checked against its checksum under the current verification mode. For
+ * the layers above, which keep checksums of their own in what they store.
+ */
+bool load_block_checking(block_id blk, void* destination, size_t numBytes) {
+	partition *p = current();
+
+	bool fromJournal = readPartition(p, blk + sizeof(block_header), destination, numBytes);
+
+	if(threadView != 0 && numBytes > 0) {
+		overlay_snapshot(p, blk + sizeof(block_header), destination, numBytes);
+	}
+
+	return should_check(p, fromJournal);
+}
+
+/**
+ * Overwrites the block's contents (starting at the beginning of the block) with
+ * at most min(numBytes, block size) bytes, effectively saving it to the disk.
+ *
+ */
+void save_block(block_id blk, void *source, size_t numBytes) {
+	partition *p = current();
+	check_writable();
+
+	// whatever snapshots share of the old contents is copied aside first.
+	if(numBytes > 0 && __atomic_load_n(&p->numSnapshots, __ATOMIC_ACQUIRE) > 0) {
+		keep_copy(p, blk + sizeof(block_header), blk + sizeof(block_header) + numBytes);
+	}
+
+	//TODO: check that they're not writing past the end.
+	writePartition(p, blk + sizeof(block_header), source, numBytes);
+}
+
+/**
+ * Retrieves how many bytes of contents the block can hold. This can be more
+ * than was asked for when it was allocated, since small remnants are absorbed.
+ */
+block_size_t block_capacity(block_id blk) {
+	block_header head;
+	read_header(current(), blk, &head);
+
+	if(head.magic != ALLOCATED) {
+		fprintf(stderr, "You're trying to measure a block that is not allocated!\n");
+		_exit(31337);
+	}
+
+	return head.size;
+}
+
+/**
+ * Returns a pointer to numBytes bytes of the block without copying them, or
+ * NULL if the partition can't be mapped. The bytes are read-only and only
+ * valid until the next call that writes to the partition.
+ */
+const void *map_block(block_id blk, size_t numBytes) {
+	partition *p = current();
+	const uint8_t *ptr = NULL;
+
+	// the file has the partition as it is, not as a snapshot has it.
+	if(threadView != 0) {
+		return NULL;
+	}
+
+	// the file doesn't have what the journal is still holding on to.
+	if(journal_pending(p->journal, blk + sizeof(block_header), numBytes)) {
+		return NULL;
+	}
+
+	pthread_rwlock_rdlock(&p->lock);
+	pthread_mutex_lock(&p->mapLock);
+
+	size_t want = partition_end(p);
+
+	if(p->mappingSize < want) {
+		void *m = mmap(NULL, want, PROT_READ, MAP_SHARED, p->fd, 0);
+
+		if(m != MAP_FAILED) {
+			// other threads may still be looking through the old one.
+			if(p->mapping != NULL) {
+				old_mapping *old = malloc(sizeof(old_mapping));
+				old->addr = p->mapping;
+				old->size = p->mappingSize;
+				old->next = p->oldMappings;
+				p->oldMappings = old;
+			}
+
+			p->mapping = m;
+			p->mappingSize = want;
+		}
+	}
+
+	if(p->mapping != NULL && blk + sizeof(block_header) + numBytes <= p->mappingSize) {
+		ptr = p->mapping + blk + sizeof(block_header);
+	}
+
+	pthread_mutex_unlock(&p->mapLock);
+	pthread_rwlock_unlock(&p->lock);
+
+	return ptr;
+}
+
+/**
+ * Saves the block_id represting the root directory in our filesystem structure
+ * to the partition descriptor.
+ */
+void saveRootID(block_id id) {
+	partition *p = current();
+
+	p->dir.root_dir_id = id;
+	 // no need to save the bitmap here anyway
+	save_field(p, root_dir_id);
+}
+
+/**
+ * Retrieves the block_id representing the root directory in this partition.
+ * If the returned value is equal to 0, then there does not exist a root directory
+ * that was saved to the descriptor.
+ */
+block_id getRootID() {
+	return current()->dir.root_dir_id;
+}
+
+
+
+
+
+/**
+ * Where the block at id is now, for ids saved before the partition was
+ * converted from the format it had before the descriptor grew, which moved
+ * the blocks in its way. Other ids come back as they are.
+ */
+block_id relocated_id(block_id id) {
+	directory *dir = &current()->dir;
+
+	if(id >= dir->relocated_from && id < dir->relocated_from + dir->relocated_size) {
+		return id - dir->relocated_from + dir->relocated_to;
+	}
+
+	return id;
+}
+
+/**
+ * Forgets where the conversion moved blocks to, once the layers above have
+ * updated every id they saved, see relocated_id.
+ */
+void forget_relocation() {
+	partition *p = current();
+
+	if(p->dir.relocated_size == 0) {
+		return;
+	}
+
+	p->dir.relocated_from = 0;
+	p->dir.relocated_to = 0;
+	p->dir.relocated_size = 0;
+	save_field(p, relocated_from);
+	save_field(p, relocated_to);
+	save_field(p, relocated_size);
+}
+
+/**
+ * Saves the block holding the layers above's usage table in the descriptor,
+ * so it can be found again when the partition is reopened. 0 for none.
+ */
+void saveUsageTableID(block_id id) {
+	partition *p = current();
+
+	p->dir.usage_table = id;
+	save_field(p, usage_table);
+}
+
+/**
+ * Retrieves the block saved with saveUsageTableID, 0 if there isn't one.
+ */
+block_id getUsageTableID() {
+	return current()->dir.usage_table;
+}
+
+/**
+ * Retrieves the layout this partition was created with.
+ */
+partition_layout getLayout() {
+	return current()->dir.layout;
+}
+
+/**
+ * Retrieves the on-disk format version of this partition.
+ */
+uint64_t getFormatVersion() {
+	return __atomic_load_n(&current()->dir.version, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records that the partition has been converted to the given format version.
+ */
+void saveFormatVersion(uint64_t version) {
+	partition *p = current();
+
+	p->dir.version = version;
+	save_field(p, version);
+}
+
+/**
+ * Raises the partition's format version to at least version, for the layers
+ * above to mark a partition older builds mustn't open once they start using
+ * something those builds don't understand. Safe to call from any thread.
+ */
+void requireFormatVersion(uint64_t version) {
+	partition *p = current();
+	check_writable();
+
+	raise_version(p, version);
+}
+
+/**
+ * Gives every block header a checksum if the partition is from before they
+ * had them, and marks it as having them. The layers above call this while
+ * upgrading, once they're done with anything that depends on the old version.
+ */
+void checksum_block_headers() {
+	partition *p = current();
+	check_writable();
+
+	if(getFormatVersion() >= FORMAT_CHECKSUMS) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&p->lock);
+
+	// blocks whose free is still queued are on neither list, and get a new
+	// header once it goes through.
+	block_id lists[] = { p->dir.alloc_block_id, p->dir.free_block_id };
+
+	for(int l = 0; l < 2; l++) {
+		block_header bh;
+		block_id i = lists[l];
+
+		while(i != 0) {
+			readPartition(p, i, &bh, sizeof(block_header));
+			write_header(p, i, &bh);
+			i = bh.next_id;
+		}
+	}
+
+	// the space has been counted since the partition was opened.
+	raise_version(p, FORMAT_COUNTERS);
+
+	pthread_rwlock_unlock(&p->lock);
+}
+
+// whether a block still starts at id: its header is allocated or free and on
+// its list, where the block before it points at it. Headers of blocks that
+// have been merged into others are left behind, but nothing points at them.
+static bool live_block(partition *p, block_id id, block_header *bh) {
+	readPartition(p, id, bh, sizeof(block_header));
+
+	if(bh->magic != ALLOCATED && bh->magic != FREE) {
+		return false;
+	}
+
+	if(bh->previous_id == 0) {
+		return (bh->magic == FREE ? p->dir.free_block_id : p->dir.alloc_block_id) == id;
+	}
+
+	if(bh->previous_id < sizeof(directory) || bh->previous_id + sizeof(block_header) > partition_end(p)) {
+		return false;
+	}
+
+	block_header prev;
+	readPartition(p, bh->previous_id, &prev, sizeof(block_header));
+
+	return prev.magic == bh->magic && prev.next_id == id;
+}
+
+// the last free block at or before pos, found through the group index and
+// read without checking, 0 if there is none or the list is damaged.
+static block_id scrub_free_before(partition *p, block_id pos) {
+	block_header bh;
+	uint64_t g = group_of(pos) < p->numGroups ? group_of(pos) + 1 : p->numGroups;
+
+	for(; g > 0; g--) {
+		block_id id = __atomic_load_n(&p->groups[g - 1].first_free, __ATOMIC_RELAXED);
+
+		if(id == 0 || id > pos) {
+			continue;
+		}
+
+		readPartition(p, id, &bh, sizeof(block_header));
+		while(bh.magic == FREE && bh.next_id != 0 && bh.next_id <= pos) {
+			id = bh.next_id;
+			readPartition(p, id, &bh, sizeof(block_header));
+		}
+
+		return bh.magic == FREE ? id : 0;
+	}
+
+	return 0;
+}
+
+// Where a scrub left off, see scrub_blocks. Blocks may have been split or
+// merged since, so unless a block still starts at from, it picks up again
+// from the last free block before it. Sets *expectFree to the first free
+// block the free list should have from there on.
+static block_id scrub_resume(partition *p, block_id from, block_id *expectFree) {
+	block_id before = scrub_free_before(p, from);
+	block_header bh;
+
+	*expectFree = p->dir.free_block_id;
+
+	if(from < partition_end(p) && live_block(p, from, &bh)) {
+		if(bh.magic == FREE) {
+			*expectFree = from;
+		} else if(before != 0) {
+			readPartition(p, before, &bh, sizeof(block_header));
+			*expectFree = bh.next_id;
+		}
+
+		return from;
+	}
+
+	if(before != 0) {
+		*expectFree = before;
+		return before;
+	}
+
+	return sizeof(directory);
+}
+
+// the first free block after pos, where a scrub carries on when it can't
+// make sense of the block at pos. Returns the end of the partition if there
+// is none, or the list is damaged too.
+static block_id scrub_skip(partition *p, block_id pos) {
+	block_id end = partition_end(p);
+	block_id id = scrub_free_before(p, pos);
+	block_header bh;
+
+	if(id == 0) {
+		id = p->dir.free_block_id;
+	}
+
+	while(id != 0 && id <= pos) {
+		if(id < sizeof(directory) || id + sizeof(block_header) > end) {
+			return end;
+		}
+
+		readPartition(p, id, &bh, sizeof(block_header));
+		if(bh.magic != FREE) {
+			return end;
+		}
+		id = bh.next_id;
+	}
+
+	return id != 0 && id < end ? id : end;
+}
+
+// checks that the neighbour at id on a block's list points back at blk,
+// reading its header. Returns the bytes read.
+static uint64_t scrub_link(partition *p, block_id blk, block_id id, uint32_t magic, bool previous, scrub_finding found, void *ctx) {
+	block_header bh;
+
+	if(id < sizeof(directory) || id + sizeof(block_header) > partition_end(p)) {
+		found(ctx, blk, previous ? "the block before it on its list is outside the partition" : "the block after it on its list is outside the partition");
+		return 0;
+	}
+
+	readPartition(p, id, &bh, sizeof(block_header));
+
+	if(bh.magic != magic) {
+		found(ctx, blk, previous ? "the block before it on its list isn't on the same list" : "the block after it on its list isn't on the same list");
+	} else if((previous ? bh.next_id : bh.previous_id) != blk) {
+		found(ctx, blk, previous ? "the block before it on its list doesn't point back at it" : "the block after it on its list doesn't point back at it");
+	}
+
+	return sizeof(block_header);
+}
+
+/**
+ * Checks the blocks of the partition in address order, from where an earlier
+ * call left off (from, or the start of the partition if from is 0), until
+ * about budget bytes have been read. Every block header has to look like one,
+ * fit in the partition and match its checksum. Free blocks have to be on the
+ * free list in address order, with no two next to each other, and start
+ * their group in the group index when they're the first in it. Allocated
+ * blocks have to be on the allocated list, linked both ways. Blocks whose
+ * free is still queued are only checked for their size. Problems are passed
+ * to found rather than exiting. Adds the blocks checked and the bytes read to
+ * *blocks and *bytes and returns where to carry on, 0 once it got to the end
+ * of the partition. Allocations and frees wait while it runs, so budgets
+ * should be small.
+ */
+block_id scrub_blocks(block_id from, uint64_t budget, uint64_t *blocks, uint64_t *bytes, scrub_finding found, void *ctx) {
+	partition *p = current();
+	uint64_t checked = 0; // bytes read checking blocks, as opposed to finding where to start.
+	uint64_t read = 0;
+
+	pthread_rwlock_wrlock(&p->lock);
+
+	block_id end = partition_end(p);
+	block_id expectFree = p->dir.free_block_id; // the next free block the free list has.
+	block_id pos = from == 0 ? sizeof(directory) : scrub_resume(p, from, &expectFree);
+	bool checksums = __atomic_load_n(&p->dir.version, __ATOMIC_RELAXED) >= FORMAT_CHECKSUMS;
+	bool wasFree = false;
+
+	while(pos < end && checked < budget) {
+		block_header bh;
+		readPartition(p, pos, &bh, sizeof(block_header));
+		read += sizeof(block_header);
+
+		bool checking = pos >= from;
+		if(checking) {
+			checked += sizeof(block_header);
+			(*blocks)++;
+		}
+
+		// allocated blocks, and those whose free is queued, don't count their header.
+		uint64_t size = bh.magic == FREE ? bh.size : bh.size + sizeof(block_header);
+
+		if(bh.magic != ALLOCATED && bh.magic != FREE && bh.magic != 0) {
+			found(ctx, pos, "doesn't hold a block header");
+		} else if(size < sizeof(block_header) || size > end - pos) {
+			found(ctx, pos, "its size doesn't fit in the partition");
+		} else {
+			if(checking && checksums && bh.magic != 0) {
+				block_header copy = bh;
+				seal_header(&copy);
+
+				if(copy.check != bh.check) {
+					found(ctx, pos, "its header doesn't match its checksum");
+				}
+			}
+
+			if(bh.magic == FREE) {
+				if(checking) {
+					if(wasFree) {
+						found(ctx, pos, "it's free, and so is the block before it, they should have been merged");
+					}
+
+					if(expectFree != pos) {
+						found(ctx, pos, "the free list skips it, or leads somewhere else before it");
+					}
+
+					if(bh.previous_id == 0) {
+						if(p->dir.free_block_id != pos) {
+							found(ctx, pos, "it says it's first on the free list, but the list starts elsewhere");
+						}
+					} else if(bh.previous_id >= pos) {
+						found(ctx, pos, "the free list is out of order before it");
+					} else {
+						uint64_t n = scrub_link(p, pos, bh.previous_id, FREE, true, found, ctx);
+						read += n;
+						checked += n;
+					}
+
+					if(bh.next_id != 0 && bh.next_id <= pos) {
+						found(ctx, pos, "the free list is out of order after it");
+					}
+
+					uint64_t g = group_of(pos);
+					if((bh.previous_id == 0 || group_of(bh.previous_id) != g) && g < p->numGroups
+							&& __atomic_load_n(&p->groups[g].first_free, __ATOMIC_RELAXED) != pos) {
+						found(ctx, pos, "it's the first free block in its group, but the group index doesn't start there");
+					}
+				}
+
+				expectFree = bh.next_id;
+			} else if(bh.magic == ALLOCATED && checking) {
+				uint64_t n = 0;
+
+				if(bh.previous_id == 0) {
+					if(p->dir.alloc_block_id != pos) {
+						found(ctx, pos, "it says it's first on the allocated list, but the list starts elsewhere");
+					}
+				} else {
+					n += scrub_link(p, pos, bh.previous_id, ALLOCATED, true, found, ctx);
+				}
+
+				if(bh.next_id != 0) {
+					n += scrub_link(p, pos, bh.next_id, ALLOCATED, false, found, ctx);
+				}
+
+				read += n;
+				checked += n;
+			}
+
+			wasFree = bh.magic == FREE;
+			pos += size;
+			continue;
+		}
+
+		// there's no telling where the next block starts, the next free one is
+		// the nearest place that's known.
+		pos = scrub_skip(p, pos);
+		wasFree = false;
+		if(pos < end) {
+			expectFree = pos;
+		}
+	}
+
+	if(pos >= end && expectFree != 0) {
+		found(ctx, expectFree, "the free list goes on past the last free block");
+	}
+
+	pthread_rwlock_unlock(&p->lock);
+
+	*bytes += read;
+	return pos < end ? pos : 0;
+}
+
+// what fsck_blocks found at one block.
+typedef struct fsck_block {
+	block_id id;
+	uint64_t size; // header included.
+	block_id previous_id;
+	block_id next_id;
+	uint32_t magic;
+	uint32_t live; // owners that claimed it, see fsck_claim.
+	uint32_t kept; // snapshots keeping bytes in it.
+	uint32_t refs; // owners the share table gives it, 1 if it isn't in it.
+	bool sealed; // its header matches its checksum.
+	bool indexed; // the dedup index has it.
+	bool release; // fsck_repair frees it.
+	bool wanted; // a gap something expects a block at the start of.
+} fsck_block;
+
+// the magic of a stretch fsck_blocks couldn't find blocks in, which it
+// records as if it were a block.
+#define GAP 1
+
+struct block_table {
+	partition *p;
+	fsck_block *blocks; // in address order.
+	uint64_t count;
+	uint64_t gaps; // stretches of the partition the walk found no blocks in.
+	bool listsDamaged; // the free or allocated list needs relinking.
+	bool snapshotsDamaged; // so which blocks snapshots keep isn't known.
+	bool sharesDamaged; // the share table needs writing again.
+	bool dedupDamaged; // the dedup index needs dropping.
+	bool checkpointDamaged; // the index checkpoint needs dropping.
+	scrub_finding found;
+	void *ctx;
+};
+
+// every segment of the scan reads this much of the partition at a time.
+#define SCAN_WINDOW (1024 * 1024)
+
+// directories with more entries than this are checked a slice at a time.
+#define LIST_SLICE 65536
+
+// fsck_repair commits every so many header writes, so the journal doesn't
+// have to hold all of them at once.
+#define REPAIR_BATCH 4096
+
+/**
+ * Opens the partition in filename for fsck_blocks, replaying what its
+ * journal holds but trusting nothing else: unlike open_partition, the free
+ * list isn't indexed and the snapshot, share and dedup tables aren't loaded
+ * until fsck_mount. Returns NULL, saying why on stderr, if the file doesn't
+ * hold a partition this program can read.
+ */
+partition *fsck_open(char *filename) {
+	int fd = open(filename, O_RDWR);
+	if(fd < 0) {
+		fprintf(stderr, "Unable to open %s!\n", filename);
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(directory)) {
+		fprintf(stderr, "%s is too short to hold a partition.\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	partition *p = calloc(1, sizeof(partition));
+	p->fd = fd;
+
+	pthread_rwlock_init(&p->lock, NULL);
+	for(int i = 0; i <= NUM_STRIPES; i++) {
+		pthread_mutex_init(&p->stripes[i], NULL);
+	}
+	pthread_mutex_init(&p->allocLock, NULL);
+	pthread_mutex_init(&p->mapLock, NULL);
+	pthread_mutex_init(&p->snapMutex, NULL);
+	pthread_mutex_init(&p->shareMutex, NULL);
+	pthread_mutex_init(&p->dedupMutex, NULL);
+	pthread_rwlock_init(&p->snapLock, NULL);
+
+	p->punchMode = PUNCH_OFF;
+	p->growth.mode = GROW_OFF;
+	p->verify = VERIFY_FILL;
+
+	char *journalPath = malloc(strlen(filename) + sizeof(JOURNAL_SUFFIX));
+	strcpy(journalPath, filename);
+	strcat(journalPath, JOURNAL_SUFFIX);
+	p->journal = journal_open(journalPath, p->fd, false);
+	free(journalPath);
+
+	readPartition(p, 0, &p->dir, sizeof(directory));
+
+	// converting it is up to pr4, this never changes the layout.
+	legacy_directory old;
+	if(p->dir.magic != SUPERBLOCK && is_legacy(p, &old)) {
+		fprintf(stderr, "%s holds a partition from before the descriptor grew, open it with pr4 once to convert it.\n", filename);
+		close_partition(p);
+		return NULL;
+	}
+
+	directory *dirPtr = &p->dir;
+	if(dirPtr->magic != SUPERBLOCK || dirPtr->version < FORMAT_OLDEST || dirPtr->version > FORMAT_VERSION) {
+		fprintf(stderr, "%s doesn't hold a partition this version of the program can read.\n", filename);
+		close_partition(p);
+		return NULL;
+	}
+
+	// the journal may have grown it.
+	if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < partition_end(p)) {
+		fprintf(stderr, "%s is shorter than the partition it holds, it was cut off.\n", filename);
+		close_partition(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+// how many bytes the block with header bh takes up, header included, or 0
+// if that doesn't look like a header or runs past end, the end of the partition.
+static uint64_t block_span(block_header *bh, block_id pos, block_id end) {
+	// a block whose free is queued keeps its size, and only that.
+	if((bh->magic != ALLOCATED && bh->magic != FREE && bh->magic != 0) || (bh->magic == 0 && bh->size == 0)) {
+		return 0;
+	}
+
+	uint64_t room = end - pos;
+	if(room < sizeof(block_header) || bh->size > room) {
+		return 0;
+	}
+
+	// allocated blocks, and those whose free is queued, don't count their header.
+	uint64_t size = bh->magic == FREE ? bh->size : bh->size + sizeof(block_header);
+
+	return size >= sizeof(block_header) && size <= room ? size : 0;
+}
+
+// whether bh, read somewhere a block may or may not start, is a header that
+// matches its checksum and fits.
+static bool plausible_header(block_header *bh, block_id pos, block_id end) {
+	if((bh->magic != ALLOCATED && bh->magic != FREE) || block_span(bh, pos, end) == 0) {
+		return false;
+	}
+
+	block_header copy = *bh;
+	seal_header(&copy);
+
+	return copy.check == bh->check;
+}
+
+// reads the partition a window at a time for a scan going forwards.
+typedef struct scan_reader {
+	partition *p;
+	uint8_t *buf;
+	uint64_t start; // where buf starts in the partition.
+	uint64_t len;
+} scan_reader;
+
+// copies numBytes bytes at pos out of the window, moving it if needed.
+static void scan_read(scan_reader *r, uint64_t pos, void *data, uint64_t numBytes) {
+	if(pos < r->start || pos + numBytes > r->start + r->len) {
+		block_id end = partition_end(r->p);
+
+		r->start = pos;
+		r->len = end - pos < SCAN_WINDOW ? end - pos : SCAN_WINDOW;
+		readPartition(r->p, r->start, r->buf, r->len);
+	}
+
+	memcpy(data, r->buf + (pos - r->start), numBytes);
+}
+
+// the first place in [from, to) where a header that checks out starts, or
+// to if there's none. Blocks don't start on any boundary, so every byte is a
+// candidate, but only those starting one of the magics are looked at further.
+static block_id scan_find(scan_reader *r, block_id from, block_id to) {
+	block_id end = partition_end(r->p);
+	uint32_t allocated = ALLOCATED, free = FREE;
+	uint8_t first[2] = { ((uint8_t*)&allocated)[0], ((uint8_t*)&free)[0] };
+
+	for(block_id pos = from; pos < to && end - pos >= sizeof(block_header); pos++) {
+		if(pos < r->start || pos + sizeof(block_header) > r->start + r->len) {
+			block_header bh;
+			scan_read(r, pos, &bh, sizeof(block_header));
+		}
+
+		// the window holds the next header, and usually a lot more.
+		uint8_t *at = r->buf + (pos - r->start);
+		uint8_t *stop = r->buf + r->len - sizeof(block_header) + 1;
+		if(stop > at + (to - pos)) {
+			stop = at + (to - pos);
+		}
+
+		while(at < stop && *at != first[0] && *at != first[1]) {
+			at++;
+		}
+
+		pos = r->start + (at - r->buf);
+		if(at == stop) {
+			pos--;
+			continue;
+		}
+
+		block_header bh;
+		memcpy(&bh, at, sizeof(block_header));
+		if(plausible_header(&bh, pos, end)) {
+			return pos;
+		}
+	}
+
+	return to;
+}
+
+// The scan splits the partition into segments, one for each thread. Only
+// the first knows where its first block starts; the others start at the
+// first header that checks out and hop from there, and fsck_blocks keeps
+// what they found from wherever the chain of blocks from the start of the
+// partition lands on a block they found too.
+typedef struct scan_segment {
+	partition *p;
+	block_id lo; // blocks starting in [lo, hi) are this segment's.
+	block_id hi;
+	bool anchored; // a block is known to start at lo.
+	bool checksums; // headers have checksums to find a start with.
+	fsck_block *blocks;
+	uint64_t count;
+	uint64_t capacity;
+	block_id exit; // where the chain left the segment, or broke off.
+	bool broken; // exit doesn't hold a block header.
+} scan_segment;
+
+static void segment_add(scan_segment *s, block_id pos, block_header *bh, uint64_t size) {
+	if(s->count == s->capacity) {
+		s->capacity = s->capacity ? s->capacity * 2 : 1024;
+		s->blocks = realloc(s->blocks, s->capacity * sizeof(fsck_block));
+	}
+
+	fsck_block *b = &s->blocks[s->count++];
+	memset(b, 0, sizeof(*b));
+
+	b->id = pos;
+	b->size = size;
+	b->previous_id = bh->previous_id;
+	b->next_id = bh->next_id;
+	b->magic = bh->magic;
+	b->refs = 1;
+
+	block_header copy = *bh;
+	seal_header(&copy);
+	b->sealed = !s->checksums || bh->magic == 0 || copy.check == bh->check;
+}
+
+static void *scan_thread(void *arg) {
+	scan_segment *s = arg;
+	partition *p = s->p;
+	block_id end = partition_end(p);
+
+	scan_reader r = { p, malloc(SCAN_WINDOW), 0, 0 };
+	block_header bh;
+	block_id pos = s->lo;
+
+	if(!s->anchored) {
+		// blocks don't start on any boundary, so every byte is a candidate.
+		// a segment that doesn't start a block within a window is most
+		// likely inside a big one, which the walk hops over anyway.
+		block_id limit = s->hi - pos < SCAN_WINDOW ? s->hi : pos + SCAN_WINDOW;
+		pos = scan_find(&r, pos, limit);
+		if(pos == limit) {
+			pos = s->hi;
+		}
+	}
+
+	while(pos < s->hi) {
+		scan_read(&r, pos, &bh, sizeof(block_header));
+
+		uint64_t size = block_span(&bh, pos, end);
+		if(size == 0) {
+			s->broken = true;
+			break;
+		}
+
+		segment_add(s, pos, &bh, size);
+		pos += size;
+	}
+
+	s->exit = pos;
+
+	free(r.buf);
+	return NULL;
+}
+
+// the index of the block starting at id among count blocks in address
+// order, or count if none does.
+static uint64_t find_block(fsck_block *blocks, uint64_t count, block_id id) {
+	uint64_t lo = 0, hi = count;
+
+	while(lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if(blocks[mid].id < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo < count && blocks[lo].id == id ? lo : count;
+}
+
+// the first block starting after pos that any segment from seg on found,
+// where the walk picks up again after something that isn't a block unless
+// there's a header before it.
+static block_id scan_resync(scan_segment *segs, int numSegs, int seg, block_id pos, block_id end) {
+	for(int i = seg; i < numSegs; i++) {
+		scan_segment *s = &segs[i];
+
+		for(uint64_t k = 0; k < s->count; k++) {
+			if(s->blocks[k].id > pos) {
+				return s->blocks[k].id;
+			}
+		}
+	}
+
+	return end;
+}
+
+static void table_add(block_table *t, uint64_t *capacity, fsck_block *b) {
+	if(t->count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 4096;
+		t->blocks = realloc(t->blocks, *capacity * sizeof(fsck_block));
+	}
+
+	t->blocks[t->count++] = *b;
+}
+
+// walks the blocks from the start of the partition to its end with threads
+// segments side by side, filling in t->blocks.
+static void scan_blocks(block_table *t, int threads) {
+	partition *p = t->p;
+	block_id start = sizeof(directory);
+	block_id end = partition_end(p);
+	bool checksums = p->dir.version >= FORMAT_CHECKSUMS;
+
+	// without checksums a segment can't tell a header from data that looks like one.
+	uint64_t per = (end - start + threads - 1) / threads;
+	if(!checksums || per < SCAN_WINDOW) {
+		threads = 1;
+		per = end - start;
+	}
+
+	scan_segment *segs = calloc(threads, sizeof(scan_segment));
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+
+	for(int i = 0; i < threads; i++) {
+		segs[i].p = p;
+		segs[i].lo = start + i * per;
+		segs[i].hi = i == threads - 1 ? end : start + (i + 1) * per;
+		segs[i].anchored = i == 0;
+		segs[i].checksums = checksums;
+		pthread_create(&tids[i], NULL, scan_thread, &segs[i]);
+	}
+
+	for(int i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	// follow the chain from the start, taking each segment's blocks from
+	// where it lands on one.
+	uint64_t capacity = 0;
+	scan_reader r = { p, malloc(SCAN_WINDOW), 0, 0 };
+	block_id pos = start;
+	int seg = 0;
+	char problem[96];
+
+	while(pos < end) {
+		while(segs[seg].hi <= pos) {
+			seg++;
+		}
+
+		scan_segment *s = &segs[seg];
+		uint64_t k = find_block(s->blocks, s->count, pos);
+
+		if(k < s->count) {
+			for(; k < s->count; k++) {
+				table_add(t, &capacity, &s->blocks[k]);
+			}
+
+			pos = s->exit;
+			if(!s->broken) {
+				continue;
+			}
+		} else {
+			block_header bh;
+			scan_read(&r, pos, &bh, sizeof(block_header));
+
+			uint64_t size = block_span(&bh, pos, end);
+			if(size != 0) {
+				fsck_block b;
+				scan_segment one = { .blocks = &b, .capacity = 1, .checksums = checksums };
+				segment_add(&one, pos, &bh, size);
+				table_add(t, &capacity, &b);
+
+				pos += size;
+				continue;
+			}
+		}
+
+		// there's no telling where the next block starts, the first header
+		// that checks out after this is the best guess.
+		block_id next = scan_resync(segs, threads, seg, pos, end);
+		next = scan_find(&r, pos + 1, next);
+		snprintf(problem, sizeof(problem), "no block header here, the next %" PRIu64 " bytes can't be walked", next - pos);
+		t->found(t->ctx, pos, problem);
+		t->gaps++;
+
+		fsck_block gap = { .id = pos, .size = next - pos, .magic = GAP, .refs = 1, .sealed = true };
+		table_add(t, &capacity, &gap);
+		pos = next;
+	}
+
+	free(r.buf);
+	for(int i = 0; i < threads; i++) {
+		free(segs[i].blocks);
+	}
+	free(segs);
+	free(tids);
+}
+
+// the block starting at id, or NULL.
+static fsck_block *table_find(block_table *t, block_id id) {
+	uint64_t k = find_block(t->blocks, t->count, id);
+	return k < t->count ? &t->blocks[k] : NULL;
+}
+
+// checks the list links of blocks [from, to) of t, see fsck_blocks.
+typedef struct list_check {
+	block_table *t;
+	uint64_t from;
+	uint64_t to;
+	bool damaged;
+} list_check;
+
+static void list_problem(list_check *c, block_id blk, const char *problem) {
+	c->t->found(c->t->ctx, blk, problem);
+	c->damaged = true;
+}
+
+static void *list_thread(void *arg) {
+	list_check *c = arg;
+	block_table *t = c->t;
+	fsck_block *blocks = t->blocks;
+	bool checksums = t->p->dir.version >= FORMAT_CHECKSUMS;
+
+	// the free blocks on either side of the one being looked at.
+	block_id prevFree = 0;
+	for(uint64_t i = c->from; i > 0; i--) {
+		if(blocks[i - 1].magic == FREE) {
+			prevFree = blocks[i - 1].id;
+			break;
+		}
+	}
+
+	// the free block after the one being looked at, found again once it's passed.
+	uint64_t nextFree = c->from;
+
+	for(uint64_t i = c->from; i < c->to; i++) {
+		fsck_block *b = &blocks[i];
+
+		if(b->magic == GAP) {
+			continue;
+		}
+
+		if(checksums && !b->sealed) {
+			list_problem(c, b->id, "its header doesn't match its checksum");
+		}
+
+		if(b->magic == FREE) {
+			if(i > 0 && blocks[i - 1].magic == FREE && blocks[i - 1].id + blocks[i - 1].size == b->id) {
+				list_problem(c, b->id, "it's free, and so is the block before it, they should have been merged");
+			}
+
+			if(nextFree <= i) {
+				for(nextFree = i + 1; nextFree < t->count && blocks[nextFree].magic != FREE; nextFree++) {
+				}
+			}
+			block_id nextId = nextFree < t->count ? blocks[nextFree].id : 0;
+
+			if(b->previous_id != prevFree) {
+				list_problem(c, b->id, prevFree == 0 ? "it's the first free block, but the free list has something before it"
+					: "the free list doesn't come to it from the free block before it");
+			} else if(prevFree == 0 && t->p->dir.free_block_id != b->id) {
+				list_problem(c, b->id, "it's the first free block, but the free list starts elsewhere");
+			}
+
+			if(b->next_id != nextId) {
+				list_problem(c, b->id, "the free list doesn't go from it to the next free block");
+			}
+
+			prevFree = b->id;
+		} else if(b->magic == ALLOCATED) {
+			if(b->previous_id == 0) {
+				if(t->p->dir.alloc_block_id != b->id) {
+					list_problem(c, b->id, "it says it's first on the allocated list, but the list starts elsewhere");
+				}
+			} else {
+				fsck_block *prev = table_find(t, b->previous_id);
+				if(prev == NULL || prev->magic != ALLOCATED || prev->next_id != b->id) {
+					list_problem(c, b->id, "the block before it on the allocated list doesn't point back at it");
+				}
+			}
+
+			if(b->next_id != 0) {
+				fsck_block *next = table_find(t, b->next_id);
+				if(next == NULL || next->magic != ALLOCATED || next->previous_id != b->id) {
+					list_problem(c, b->id, "the block after it on the allocated list doesn't point back at it");
+				}
+			}
+		} else {
+			list_problem(c, b->id, "its free never finished, so it's on neither list");
+			b->release = true;
+		}
+	}
+
+	return NULL;
+}
+
+// checks both lists, see fsck_blocks.
+static void check_lists(block_table *t, int threads) {
+	partition *p = t->p;
+
+	list_check *checks = calloc(threads, sizeof(list_check));
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	uint64_t per = (t->count + threads - 1) / threads;
+
+	for(int i = 0; i < threads; i++) {
+		checks[i].t = t;
+		checks[i].from = i * per < t->count ? i * per : t->count;
+		checks[i].to = (i + 1) * per < t->count ? (i + 1) * per : t->count;
+		pthread_create(&tids[i], NULL, list_thread, &checks[i]);
+	}
+
+	for(int i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		t->listsDamaged |= checks[i].damaged;
+	}
+
+	free(checks);
+	free(tids);
+
+	// a free list that starts on the wrong block, or an empty one that
+	// doesn't, wasn't caught by the blocks themselves.
+	block_id firstFree = 0;
+	uint64_t allocated = 0;
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		if(t->blocks[i].magic == FREE && firstFree == 0) {
+			firstFree = t->blocks[i].id;
+		}
+		allocated += t->blocks[i].magic == ALLOCATED;
+	}
+
+	if(p->dir.free_block_id != firstFree) {
+		t->found(t->ctx, p->dir.free_block_id, "the free list starts here, but that's not the first free block");
+		t->listsDamaged = true;
+	}
+
+	// links that point back at each other can still form loops apart from
+	// the list, the only way to find those is to go down it.
+	uint64_t onList = 0;
+	block_id id = p->dir.alloc_block_id;
+	fsck_block *b;
+
+	while(id != 0 && onList <= allocated && (b = table_find(t, id)) != NULL && b->magic == ALLOCATED) {
+		onList++;
+		id = b->next_id;
+	}
+
+	if(id != 0 || onList != allocated) {
+		char problem[96];
+		snprintf(problem, sizeof(problem), "the allocated list starts here, but only %" PRIu64 " of %" PRIu64 " allocated blocks are on it",
+			onList < allocated ? onList : allocated, allocated);
+		t->found(t->ctx, p->dir.alloc_block_id, problem);
+		t->listsDamaged = true;
+	}
+}
+
+// reads count records of size bytes after the table head at the start of
+// the contents of blk, if blk is an allocated block with room for them.
+// Returns NULL otherwise.
+static void *read_table(block_table *t, block_id blk, uint64_t head, uint64_t size, uint64_t count) {
+	fsck_block *b = table_find(t, blk);
+
+	if(b == NULL || b->magic != ALLOCATED || count > (b->size - sizeof(block_header)) / size
+			|| head + count * size > b->size - sizeof(block_header)) {
+		return NULL;
+	}
+
+	void *all = malloc(count * size + 1);
+	readPartition(t->p, blk + sizeof(block_header) + head, all, count * size);
+
+	return all;
+}
 
-	if(left_id != 0) {
-		readPartition(left_id, &leftHead, sizeof(block_header));
+// whether the index checkpoint, if it's current, has the group index the
+// free blocks t found make.
+static bool checkpoint_matches(block_table *t) {
+	partition *p = t->p;
+	uint64_t numGroups = (p->dir.partition_size + GROUP_SIZE - 1) / GROUP_SIZE;
+	checkpoint_head *head = read_table(t, p->dir.checkpoint, 0, sizeof(checkpoint_head) + numGroups * sizeof(group_info), 1);
+
+	if(head == NULL || head->magic != CHECKPOINT) {
+		free(head);
+		return false;
 	}
 
-	if(right_id != 0) {
-		readPartition(right_id, &rightHead, sizeof(block_header));
+	// one from before the partition was last opened is ignored anyway.
+	if(head->generation != p->dir.generation) {
+		free(head);
+		return true;
 	}
 
-	//fprintf(stderr, "Looking around, I see: %llu (free? %i) <- %llu -> %llu (free? %i)\n", left_id, leftHead.magic == FREE, blk, right_id, rightHead.magic == FREE);
+	group_info *want = calloc(numGroups, sizeof(group_info));
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		fsck_block *b = &t->blocks[i];
+		if(b->magic != FREE) {
+			continue;
+		}
 
-	// yeah... the below logic could be optimized, but it's 4am
+		if(want[group_of(b->id)].first_free == 0) {
+			want[group_of(b->id)].first_free = b->id;
+		}
 
-	// ADJUST SIZE OF NEW FREE BLOCK
-	if(leftHead.magic == FREE) {
-		// we can extend left!
-		newFree_id = left_id;
-		// we add the _entire_ left block, we already account for header space from our old size.
-		newFree.size += leftHead.size;
-	}
+		// the same as index_account.
+		for(block_id at = b->id; at < b->id + b->size; ) {
+			uint64_t g = group_of(at);
+			uint64_t piece = group_start(g + 1) - at < b->id + b->size - at ? group_start(g + 1) - at : b->id + b->size - at;
 
-	if(rightHead.magic == FREE) {
-		// aww yiss, we can extend right 
-		newFree.size += rightHead.size;
+			if(g < numGroups) {
+				want[g].free_bytes += piece;
+			}
+			at += piece;
+		}
 	}
 
-	
-	// By the property that the free list is _ordered_, by block_id, we
-	// adjust the pointers very simply:
-	if(leftHead.magic == FREE && rightHead.magic == FREE) {
-		// hit the jackpot here... this block is between two free blocks.
-		// we can just update the left one, and remove the right one.
+	bool matches = head->numGroups == numGroups && memcmp(want, head + 1, numGroups * sizeof(group_info)) == 0;
 
-		leftHead.size = newFree.size;
-		leftHead.next_id = rightHead.next_id;
-		writePartition(left_id, &leftHead, sizeof(block_header));
+	free(want);
+	free(head);
+	return matches;
+}
 
-	} else if(leftHead.magic == FREE) {
-		// just extend the left block
+// claims the blocks holding the partition's own tables, and notes which
+// blocks snapshots keep, which are shared and which the dedup index has.
+static void check_tables(block_table *t) {
+	partition *p = t->p;
+	char problem[96];
 
-		leftHead.size = newFree.size;
-		writePartition(left_id, &leftHead, sizeof(block_header));
+	if(p->dir.snapshot_table != 0) {
+		snapshot_table head;
+		snapshot_record *recs = NULL;
 
-	} else if(rightHead.magic == FREE) {
-		// remove the right block, and and make this one bigger
+		if(fsck_claim(t, p->dir.snapshot_table) == 1) {
+			readPartition(p, p->dir.snapshot_table + sizeof(block_header), &head, sizeof(head));
+			if(head.magic == SNAPSHOTS) {
+				recs = read_table(t, p->dir.snapshot_table, sizeof(head), sizeof(snapshot_record), head.count);
+			}
+		}
 
-		newFree.previous_id = rightHead.previous_id;
-		newFree.next_id = rightHead.next_id;
+		if(recs == NULL) {
+			t->found(t->ctx, p->dir.snapshot_table, "the snapshot table is damaged");
+			t->snapshotsDamaged = true;
+		}
 
-		if(newFree.previous_id == 0) {
-			((directory*)partDir)->free_block_id = newFree_id;
-			writePartition(0, partDir, sizeof(directory));
+		for(uint64_t i = 0; recs != NULL && i < head.count; i++) {
+			if(recs[i].count == 0) {
+				continue;
+			}
+
+			remap_entry *all = NULL;
+			if(fsck_claim(t, recs[i].entries) == 1) {
+				all = read_table(t, recs[i].entries, 0, sizeof(remap_entry), recs[i].count);
+			}
+
+			if(all == NULL) {
+				snprintf(problem, sizeof(problem), "what snapshot %" PRIu64 " keeps is damaged", recs[i].gen);
+				t->found(t->ctx, recs[i].entries, problem);
+				t->snapshotsDamaged = true;
+				continue;
+			}
+
+			// every block counts once for each snapshot keeping something in it.
+			rangemap *seen = rangemap_create();
+
+			for(uint64_t j = 0; j < recs[i].count; j++) {
+				if(rangemap_find(seen, all[j].blk) != NULL) {
+					continue;
+				}
+				rangemap_add(seen, all[j].blk, all[j].blk + 1, 0, 0);
+
+				fsck_block *b = table_find(t, all[j].blk);
+				if(b == NULL || b->magic != ALLOCATED) {
+					snprintf(problem, sizeof(problem), "snapshot %" PRIu64 " keeps bytes here, but it isn't an allocated block", recs[i].gen);
+					t->found(t->ctx, all[j].blk, problem);
+					t->snapshotsDamaged = true;
+				} else {
+					b->kept++;
+				}
+			}
+
+			rangemap_destroy(seen);
+			free(all);
 		}
 
-		writePartition(newFree_id, &newFree, sizeof(block_header));
+		free(recs);
+	}
+
+	if(p->dir.share_table != 0) {
+		share_table head;
+		share_entry *all = NULL;
 
-	} else {
-		// we're surrounded by allocated blocks, so we must traverse the
-		// free list and find the right place for this block.
+		if(fsck_claim(t, p->dir.share_table) == 1) {
+			readPartition(p, p->dir.share_table + sizeof(block_header), &head, sizeof(head));
+			if(head.magic == SHARES) {
+				all = read_table(t, p->dir.share_table, sizeof(head), sizeof(share_entry), head.count);
+			}
+		}
 
-		block_header guyInfo;
-		block_id guy = ((directory*)partDir)->free_block_id;
-		readPartition(guy, &guyInfo, sizeof(block_header));
+		if(all == NULL) {
+			t->found(t->ctx, p->dir.share_table, "the share table is damaged");
+			t->sharesDamaged = true;
+		}
 
-		newFree.previous_id = 0;
-		newFree.next_id = 0;
+		for(uint64_t i = 0; all != NULL && i < head.count; i++) {
+			fsck_block *b = table_find(t, all[i].blk);
 
-		if(guy == 0) {
-			// there are no free blocks, you're the first and only one.
+			if(b == NULL || b->magic != ALLOCATED) {
+				t->found(t->ctx, all[i].blk, "the share table has it, but it isn't an allocated block");
+				t->sharesDamaged = true;
+			} else {
+				b->refs = all[i].refs;
+			}
+		}
 
-			((directory*)partDir)->free_block_id = newFree_id;
-			writePartition(0, partDir, sizeof(directory));
+		free(all);
+	}
 
-		} else {
+	if(p->dir.checkpoint != 0) {
+		if(fsck_claim(t, p->dir.checkpoint) != 1 || !checkpoint_matches(t)) {
+			t->found(t->ctx, p->dir.checkpoint, "the index checkpoint doesn't match the free list");
+			t->checkpointDamaged = true;
+		}
+	}
 
-			while(guy < newFree_id && guyInfo.next_id != 0) {
-				guy = guyInfo.next_id;
-				readPartition(guy, &guyInfo, sizeof(block_header));
+	if(p->dir.dedup_table != 0) {
+		dedup_table head;
+		dedup_entry *all = NULL;
+
+		if(fsck_claim(t, p->dir.dedup_table) == 1) {
+			readPartition(p, p->dir.dedup_table + sizeof(block_header), &head, sizeof(head));
+			if(head.magic == DEDUP) {
+				all = read_table(t, p->dir.dedup_table, sizeof(head), sizeof(dedup_entry), head.count);
 			}
+		}
 
-			if(guy < newFree_id) {
-				// we go _after_ guy
-				guyInfo.next_id = newFree_id;
-				newFree.previous_id = guy;
+		if(all == NULL) {
+			t->found(t->ctx, p->dir.dedup_table, "the dedup table is damaged");
+			t->dedupDamaged = true;
+		}
 
-				writePartition(guy, &guyInfo, sizeof(block_header));
+		for(uint64_t i = 0; all != NULL && i < head.count; i++) {
+			fsck_block *b = table_find(t, all[i].blk);
 
+			if(b == NULL || b->magic != ALLOCATED) {
+				t->found(t->ctx, all[i].blk, "the dedup index has it, but it isn't an allocated block");
+				t->dedupDamaged = true;
 			} else {
-				// we go _before_ guy
+				b->indexed = true;
+			}
+		}
 
-				// need to let the block before guy know who's really next
-				if(guyInfo.previous_id == 0) {
-					// we're about to become the first free block.
-					((directory*)partDir)->free_block_id = newFree_id;
-					writePartition(0, partDir, sizeof(directory));
-				} else {
-					// this is a block we need to update.
+		free(all);
+	}
+}
 
-					readPartition(guyInfo.previous_id, &leftHead, sizeof(block_header));
-					leftHead.next_id = newFree_id;
-					writePartition(guyInfo.previous_id, &leftHead, sizeof(block_header));
-				}
+// whether the descriptor's space counters are what the blocks t found add
+// up to, see note_free. Blocks whose free never finished are on neither list
+// and left out of both. Only meaningful once every block was found.
+static bool space_matches(block_table *t) {
+	directory *d = &t->p->dir;
+	directory want = { 0 };
+	block_size_t unlisted = 0;
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		fsck_block *b = &t->blocks[i];
+
+		if(b->magic == ALLOCATED) {
+			want.allocated_bytes += b->size;
+			want.allocated_blocks++;
+		} else if(b->magic == FREE) {
+			want.free_bytes += b->size;
+			want.free_blocks++;
+			want.free_classes[free_class(b->size)]++;
+
+			bool listed = false;
+			for(int j = 0; j < FREE_TOP; j++) {
+				listed |= d->largest[j].id == b->id && d->largest[j].size == b->size;
+			}
+
+			if(!listed && b->size > unlisted) {
+				unlisted = b->size;
+			}
+		}
+	}
+
+	// every block in the list has to be a free block of its size, and
+	// nothing left out of it can be bigger than the floor.
+	for(int j = 0; j < FREE_TOP && d->largest[j].id != 0; j++) {
+		fsck_block *b = table_find(t, d->largest[j].id);
+
+		if(b == NULL || b->magic != FREE || b->size != d->largest[j].size || (j > 0 && d->largest[j].size > d->largest[j - 1].size)) {
+			return false;
+		}
+	}
+
+	return want.allocated_bytes == d->allocated_bytes && want.allocated_blocks == d->allocated_blocks
+		&& want.free_bytes == d->free_bytes && want.free_blocks == d->free_blocks
+		&& memcmp(want.free_classes, d->free_classes, sizeof(want.free_classes)) == 0 && unlisted <= d->free_floor;
+}
+
+/**
+ * Walks every block of the current partition, which fsck_open opened, from
+ * its start to its end, split across threads. Every header has to look
+ * like one, match its checksum and fit, and the blocks have to follow each
+ * other without overlapping all the way to the end of the partition. The
+ * free list has to hold every free block in address order, with no two
+ * next to each other, and the allocated list every allocated block, linked
+ * both ways. The snapshot, share and dedup tables have to hold allocated
+ * blocks, the index checkpoint has to match the free list if it's current,
+ * and the descriptor's space counts have to match the blocks. Problems are
+ * passed to found, which is called from several threads at once. Returns
+ * what it found, for fsck_claim.
+ */
+block_table *fsck_blocks(int threads, scrub_finding found, void *ctx) {
+	block_table *t = calloc(1, sizeof(block_table));
+	t->p = current();
+	t->found = found;
+	t->ctx = ctx;
+
+	scan_blocks(t, threads);
+	check_lists(t, threads);
+	check_tables(t);
+
+	// fsck_repair counts the space again whatever it finds.
+	if(t->p->dir.version >= FORMAT_COUNTERS && t->gaps == 0 && !space_matches(t)) {
+		t->found(t->ctx, 0, "the descriptor's space counts don't match the blocks");
+	}
+
+	return t;
+}
+
+/**
+ * Claims the allocated block starting at blk for something that uses it: a
+ * file header, a directory's entries, a chunk. Returns how many times it's
+ * been claimed, this time included, or 0 if no allocated block starts there.
+ * Safe to call from several threads at once.
+ */
+uint32_t fsck_claim(block_table *t, block_id blk) {
+	fsck_block *b = table_find(t, blk);
+
+	// fsck_repair puts back the header of a block that used to be there.
+	if(b != NULL && b->magic == GAP && b->size > sizeof(block_header)) {
+		__atomic_store_n(&b->wanted, true, __ATOMIC_RELAXED);
+	}
+
+	if(b == NULL || b->magic != ALLOCATED) {
+		return 0;
+	}
+
+	return __atomic_add_fetch(&b->live, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Takes back a claim fsck_claim made, for something found not to use the
+ * block after all.
+ */
+void fsck_unclaim(block_table *t, block_id blk) {
+	fsck_block *b = table_find(t, blk);
+
+	if(b != NULL && b->magic == ALLOCATED) {
+		__atomic_sub_fetch(&b->live, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Checks the claims made on every allocated block once everything using
+ * blocks has claimed them. A block has to be claimed once, or as many times
+ * as the share table says it's shared, unless snapshots are keeping it. If
+ * complete is false, not everything could be read, so blocks nobody claimed
+ * aren't taken to be lost. Problems are passed to found.
+ */
+void fsck_finish(block_table *t, bool complete, scrub_finding found, void *ctx) {
+	char problem[96];
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		fsck_block *b = &t->blocks[i];
 
-				newFree.previous_id = guyInfo.previous_id;
-				newFree.next_id = guy;
+		if(b->magic != ALLOCATED) {
+			continue;
+		}
 
-				// update guy itself
-				guyInfo.previous_id = newFree_id;
-				writePartition(guy, &guyInfo, sizeof(block_header));
+		if(b->kept > 0) {
+			if(b->live > 0) {
+				found(ctx, b->id, "snapshots keep it, but it's in use too");
 			}
+			continue;
 		}
 
-		// gotta update newFree in all cases.
-		writePartition(newFree_id, &newFree, sizeof(block_header));
+		if(b->live == 0) {
+			if(complete && !t->snapshotsDamaged) {
+				found(ctx, b->id, "nothing uses it, it's lost");
+				b->release = true;
+			}
+		} else if(b->live != b->refs) {
+			snprintf(problem, sizeof(problem), "it's used %" PRIu32 " times, but the share table says %" PRIu32, b->live, b->refs);
+			found(ctx, b->id, problem);
+			t->sharesDamaged = true;
+		}
 
-	}	
+		if(b->indexed && b->live == 0) {
+			found(ctx, b->id, "the dedup index has it, but nothing uses it");
+			t->dedupDamaged = true;
+		}
+	}
 }
 
 /**
- * Copies at most numBytes bytes from this block into the specified pointer.
- * Use this to read the block, and you can modify and save it back.
+ * Retrieves how many blocks fsck_blocks found allocated and free (or being
+ * freed), and how many stretches of the partition it couldn't find blocks in.
  */
-void load_block(block_id blk, void* destination, size_t numBytes) {
-	//TODO: check that they're not reading past the end.
-	readPartition(blk + sizeof(block_header), destination, numBytes);
+void fsck_counts(block_table *t, uint64_t *allocated, uint64_t *unused, uint64_t *gaps) {
+	*allocated = 0;
+	*unused = 0;
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		*allocated += t->blocks[i].magic == ALLOCATED;
+		*unused += t->blocks[i].magic != ALLOCATED && t->blocks[i].magic != GAP;
+	}
+
+	*gaps = t->gaps;
+}
+
+// writes the header of the block at id if it isn't what's there already,
+// committing every REPAIR_BATCH writes.
+static void repair_header(block_table *t, fsck_block *old, block_id id, block_header *bh, uint64_t *pending) {
+	seal_header(bh);
+
+	if(old != NULL && old->magic == bh->magic && old->size == (bh->magic == FREE ? bh->size : bh->size + sizeof(block_header))
+			&& old->previous_id == bh->previous_id && old->next_id == bh->next_id && old->sealed) {
+		return;
+	}
+
+	writePartition(t->p, id, bh, sizeof(block_header));
+
+	if(++*pending == REPAIR_BATCH) {
+		end_transaction();
+		begin_transaction();
+		*pending = 0;
+	}
+}
+
+// writes the share table again from the claims, in the block it has.
+static void repair_shares(block_table *t) {
+	partition *p = t->p;
+	uint64_t count = 0;
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		count += t->blocks[i].magic == ALLOCATED && !t->blocks[i].release && t->blocks[i].kept == 0 && t->blocks[i].live > 1;
+	}
+
+	fsck_block *table = p->dir.share_table != 0 ? table_find(t, p->dir.share_table) : NULL;
+	uint64_t size = sizeof(share_table) + count * sizeof(share_entry);
+
+	if(count > 0 && (table == NULL || table->magic != ALLOCATED || table->size - sizeof(block_header) < size)) {
+		t->found(t->ctx, p->dir.share_table, "the share table has no room for every shared block, so it's left as it is");
+		return;
+	}
+
+	if(count == 0) {
+		if(table != NULL) {
+			table->release = true;
+		}
+		p->dir.share_table = 0;
+		save_field(p, share_table);
+		return;
+	}
+
+	share_table *head = malloc(size);
+	share_entry *all = (share_entry*)(head + 1);
+	head->magic = SHARES;
+	head->count = 0;
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		fsck_block *b = &t->blocks[i];
+
+		if(b->magic == ALLOCATED && !b->release && b->kept == 0 && b->live > 1) {
+			all[head->count++] = (share_entry){ b->id, b->live };
+		}
+	}
+
+	writePartition(p, p->dir.share_table + sizeof(block_header), head, size);
+	free(head);
 }
 
 /**
- * Overwrites the block's contents (starting at the beginning of the block) with
- * at most min(numBytes, block size) bytes, effectively saving it to the disk. 
- * 
+ * Fixes what fsck_blocks and fsck_finish found that can be fixed without
+ * knowing what the blocks hold: frees blocks nothing uses and blocks whose
+ * free never finished, merges free blocks that are next to each other,
+ * links both lists again in address order if they need it, writes headers
+ * that don't match their checksum again, writes the share table again from
+ * the claims, drops a damaged dedup index or index checkpoint, and counts
+ * the space again. Stretches the walk found no blocks in are left as they
+ * are, unless something claimed a block at the start of one, which is then
+ * given back its header as a single block. Returns whether the partition
+ * can be mounted with fsck_mount afterwards.
  */
-void save_block(block_id blk, void *source, size_t numBytes) {
-	//TODO: check that they're not writing past the end.
-	writePartition(blk + sizeof(block_header), source, numBytes);
+bool fsck_repair(block_table *t) {
+	partition *p = t->p;
+
+	if(t->snapshotsDamaged) {
+		t->found(t->ctx, p->dir.snapshot_table, "snapshots can't be repaired, so nothing is");
+		return false;
+	}
+
+	begin_transaction();
+
+	// the index changes with the free list, so whatever checkpoint there is
+	// can't be trusted after this even if the rest never gets written.
+	p->dir.generation++;
+	save_field(p, generation);
+
+	if(t->checkpointDamaged) {
+		fsck_block *cp = table_find(t, p->dir.checkpoint);
+		if(cp != NULL && cp->magic == ALLOCATED) {
+			cp->release = true;
+		}
+
+		p->dir.checkpoint = 0;
+		save_field(p, checkpoint);
+	}
+
+	if(t->dedupDamaged && p->dir.dedup_table != 0) {
+		fsck_block *table = table_find(t, p->dir.dedup_table);
+		if(table != NULL && table->magic == ALLOCATED) {
+			table->release = true;
+		}
+
+		p->dir.dedup_table = 0;
+		save_field(p, dedup_table);
+	}
+
+	if(t->sharesDamaged) {
+		repair_shares(t);
+	}
+
+	// which blocks are free once this is done, merged with the free blocks
+	// right after them, and the next block of the same kind after each, going
+	// backwards so every block only has to be looked at once.
+	uint64_t *span = calloc(t->count + 1, sizeof(uint64_t));
+	bool *isFree = calloc(t->count + 1, sizeof(bool));
+	block_id *following = calloc(t->count + 1, sizeof(block_id));
+	block_id nextFree = 0, nextAlloc = 0;
+	bool relink = t->listsDamaged;
+
+	for(uint64_t i = t->count; i > 0; i--) {
+		fsck_block *b = &t->blocks[i - 1];
+
+		isFree[i - 1] = (b->magic != ALLOCATED && b->magic != GAP) || b->release;
+		relink |= (b->magic == ALLOCATED && b->release) || (b->magic == GAP && b->wanted);
+		span[i - 1] = b->magic == GAP && !b->wanted ? 0 : b->size;
+
+		if(isFree[i - 1] && i < t->count && isFree[i] && b->id + b->size == t->blocks[i].id) {
+			span[i - 1] += span[i];
+			span[i] = 0;
+		}
+	}
+
+	for(uint64_t i = t->count; i > 0; i--) {
+		if(span[i - 1] == 0) {
+			continue;
+		}
+
+		if(isFree[i - 1]) {
+			following[i - 1] = nextFree;
+			nextFree = t->blocks[i - 1].id;
+		} else {
+			following[i - 1] = nextAlloc;
+			nextAlloc = t->blocks[i - 1].id;
+		}
+	}
+
+	uint64_t pending = 0;
+	block_id prevFree = 0, prevAlloc = 0;
+
+	// the space is counted again along with the lists.
+	clear_space(&p->dir);
+
+	for(uint64_t i = 0; i < t->count; i++) {
+		fsck_block *b = &t->blocks[i];
+		if(span[i] == 0) {
+			continue;
+		}
+
+		block_header bh = { 0 };
+
+		if(isFree[i]) {
+			bh.magic = FREE;
+			bh.size = span[i];
+			bh.previous_id = prevFree;
+			bh.next_id = following[i];
+			prevFree = b->id;
+		} else {
+			bh.magic = ALLOCATED;
+			bh.size = b->size - sizeof(block_header);
+			bh.previous_id = relink ? prevAlloc : b->previous_id;
+			bh.next_id = relink ? following[i] : b->next_id;
+			prevAlloc = b->id;
+		}
+
+		count_block(&p->dir, b->id, &bh);
+		repair_header(t, b, b->id, &bh, &pending);
+	}
+
+	save_space(p);
+
+	if(p->dir.free_block_id != nextFree) {
+		p->dir.free_block_id = nextFree;
+		save_field(p, free_block_id);
+	}
+
+	if(relink && p->dir.alloc_block_id != nextAlloc) {
+		p->dir.alloc_block_id = nextAlloc;
+		save_field(p, alloc_block_id);
+	}
+
+	free(span);
+	free(isFree);
+	free(following);
+
+	end_transaction();
+
+	return true;
 }
 
 /**
- * Saves the block_id represting the root directory in our filesystem structure
- * to the partition descriptor.
+ * Finishes opening the partition fsck_open opened, once fsck_repair has
+ * made its lists sound, so it can be written to like any other.
  */
-void saveRootID(block_id id) {
-	((directory*)partDir)->root_dir_id = id;
-	 // no need to save the bitmap here anyway
-	writePartition(0, partDir, sizeof(directory));
+void fsck_mount() {
+	partition *p = current();
+
+	build_index(p);
+	load_snapshots(p);
+	load_shares(p);
+	load_dedup(p);
 }
 
 /**
- * Retrieves the block_id representing the root directory in this partition.
- * If the returned value is equal to 0, then there does not exist a root directory
- * that was saved to the descriptor.
+ * Frees what fsck_blocks returned.
  */
-block_id getRootID() {
-	return ((directory*)partDir)->root_dir_id;
+void fsck_free(block_table *t) {
+	free(t->blocks);
+	free(t);
+}
+
+// takes snapLock exclusively, letting go of this thread's own share first.
+static void snapshots_exclusive(partition *p) {
+	if(transactionDepth > 0) {
+		pthread_rwlock_unlock(&p->snapLock);
+	}
+
+	pthread_rwlock_wrlock(&p->snapLock);
+}
+
+// gives snapLock back, keeping this thread's share if it's in a transaction.
+static void snapshots_shared(partition *p) {
+	pthread_rwlock_unlock(&p->snapLock);
+
+	if(transactionDepth > 0) {
+		pthread_rwlock_rdlock(&p->snapLock);
+	}
+}
+
+// copies what there is to know about s into info.
+static void describe(snapshot *s, snapshot_info *info) {
+	info->id = s->gen;
+	memcpy(info->name, s->name, sizeof(info->name));
+	info->root = s->root;
+	info->created = s->created;
+	info->kept = s->kept;
+}
+
+/**
+ * Takes a snapshot of the partition called name: the directory tree as it is
+ * now, kept as it is however the partition changes later. Nothing is copied
+ * when it's taken. Writing to bytes a snapshot still shares copies them to a
+ * new block first, and freeing a block it still shares leaves the block to it.
+ * Waits until every other thread is between transactions. Returns the
+ * snapshot's id, or 0 if there already is one called name.
+ */
+uint64_t create_snapshot(char *name) {
+	partition *p = current();
+	uint64_t id = 0;
+
+	check_writable();
+
+	snapshots_exclusive(p);
+	pthread_mutex_lock(&p->snapMutex);
+
+	if(find_snapshot(name) == 0) {
+		snapshot *s = calloc(1, sizeof(snapshot));
+
+		strncpy(s->name, name, SNAPSHOT_NAME_MAX);
+		s->gen = p->nextGen++;
+		s->root = p->dir.root_dir_id;
+		s->created = time(NULL);
+		s->remap = rangemap_create();
+
+		snapshot **tail = &p->snapshots;
+		while(*tail != NULL) {
+			tail = &(*tail)->next;
+		}
+		*tail = s;
+
+		__atomic_store_n(&p->numSnapshots, p->numSnapshots + 1, __ATOMIC_RELEASE);
+
+		raise_version(p, FORMAT_SNAPSHOTS);
+
+		save_snapshots(p);
+
+		id = s->gen;
+	}
+
+	pthread_mutex_unlock(&p->snapMutex);
+	snapshots_shared(p);
+
+	return id;
+}
+
+/**
+ * Deletes a snapshot, freeing whatever was kept only for it. Waits until
+ * every other thread is between transactions. Returns a non-zero value,
+ * without deleting it, if it's mounted.
+ */
+int delete_snapshot(uint64_t id) {
+	partition *p = current();
+	int ret = 0;
+
+	check_writable();
+
+	snapshots_exclusive(p);
+	pthread_mutex_lock(&p->snapMutex);
+
+	snapshot **link = &p->snapshots;
+	while(*link != NULL && (*link)->gen != id) {
+		link = &(*link)->next;
+	}
+
+	if(*link != NULL && (*link)->mounts > 0) {
+		ret = 1;
+	} else if(*link != NULL) {
+		snapshot *s = *link;
+		*link = s->next;
+
+		__atomic_store_n(&p->numSnapshots, p->numSnapshots - 1, __ATOMIC_RELEASE);
+
+		drop_snapshot(p, s);
+
+		// with nothing left to share blocks with, their ages don't matter.
+		if(p->numSnapshots == 0) {
+			rangemap_destroy(p->births);
+			p->births = rangemap_create();
+		}
+
+		save_snapshots(p);
+	}
+
+	pthread_mutex_unlock(&p->snapMutex);
+	snapshots_shared(p);
+
+	return ret;
+}
+
+/**
+ * Returns the id of the snapshot called name, or 0 if there isn't one.
+ */
+uint64_t find_snapshot(char *name) {
+	partition *p = current();
+
+	for(snapshot *s = p->snapshots; s != NULL; s = s->next) {
+		if(strcmp(s->name, name) == 0) {
+			return s->gen;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Fills info with up to max of the partition's snapshots, oldest first, and
+ * returns how many there are.
+ */
+uint64_t list_snapshots(snapshot_info *info, uint64_t max) {
+	partition *p = current();
+	uint64_t count = 0;
+
+	pthread_mutex_lock(&p->snapMutex);
+
+	for(snapshot *s = p->snapshots; s != NULL; s = s->next, count++) {
+		if(count < max) {
+			describe(s, &info[count]);
+		}
+	}
+
+	pthread_mutex_unlock(&p->snapMutex);
+
+	return count;
+}
+
+/**
+ * Marks the snapshot with the given id as mounted, so it isn't deleted until
+ * it's unmounted as many times, and fills info in. Returns false if there's
+ * no such snapshot.
+ */
+bool mount_snapshot(uint64_t id, snapshot_info *info) {
+	partition *p = current();
+
+	pthread_mutex_lock(&p->snapMutex);
+
+	snapshot *s = find_gen(p, id);
+	if(s != NULL) {
+		s->mounts++;
+		describe(s, info);
+	}
+
+	pthread_mutex_unlock(&p->snapMutex);
+
+	return s != NULL;
 }
 
+/**
+ * Undoes one mount_snapshot.
+ */
+void unmount_snapshot(uint64_t id) {
+	partition *p = current();
 
+	pthread_mutex_lock(&p->snapMutex);
+	find_gen(p, id)->mounts--;
+	pthread_mutex_unlock(&p->snapMutex);
+}
 
+/**
+ * Makes the calling thread's reads see the snapshot with the given id
+ * instead of the partition as it is now, or the partition again for 0. The
+ * thread can't change anything while it's viewing a snapshot, and map_block
+ * always returns NULL.
+ */
+void view_snapshot(uint64_t id) {
+	threadView = id;
+}
 
+/**
+ * Retrieves the id of the snapshot the calling thread is viewing, 0 if none.
+ */
+uint64_t viewed_snapshot() {
+	return threadView;
+}
@@ -6,8 +6,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "partitioner.h"
+#include "fileheader.h"
+#include "fileio.h"
+#include "dircache.h"
+#include "server.h"
+#include "batch.h"
+#include "scrub.h"
+#include "fsck.h"
+#include "usage.h"
 
 /*--------------------------------------------------------------------------------*/
 
@@ -21,6 +30,7 @@ int debug = 0;	// extra output; 1 = on, 0 = off
 * command action
 * ------- ------
 * root initialize root directory
+* (root split lays a new partition out with separate metadata and data zones)
 * print print current working directory and all descendants
 * chdir change current working directory
 * (.. refers to parent directory, as in Unix)
@@ -30,8 +40,43 @@ int debug = 0;	// extra output; 1 = on, 0 = off
 * mkfil file create
 * rmfil delete
 * mvfil rename
+* cpfil copy a file, as in cpfil <file> <copy>; the copy shares the file's chunks until either is written
 * szfil resize (sz = size)
+* write append the second argument to a file
+* cat print a file's contents
+* set change a setting, as in set <setting> <value>
+* (set punch off|immediate|deferred controls handing freed space back to the host)
+* (set dedup on|off controls sharing chunks written with the same contents as one already there)
+* (set compress on|off controls compressing chunks as they fill up)
+* (set verify always|fill|never controls checking checksums on reads, fill only checks
+*  what comes from the partition file and not what the journal still holds)
+* (set grow off|double|<bytes> and set growlimit <bytes> control automatic growth)
+* (set durability none|flush|periodic|<n>ms|<n>ops|fsync controls what's synced when,
+*  set sessiondurability none|flush|fsync|partition overrides it for one session)
+* grow add the given number of bytes to the partition
+* sync wait until everything so far is on stable storage, and report what syncing cost
+* dedup share every chunk of every file that has the same contents as another, and report the dedup ratio
+* scrub report what the background scrubber has checked and found so far
+* info report how the partition's space is used: allocated, free, queued, the largest free block and free blocks by size
+* du report the bytes, files and directories in the current directory, or in the named one in it, all the way down
+* layout write how the partition is laid out, as in layout json|csv [buckets], see exportLayout
+* (set scrub off|<bytes> stops it or has it check the partition at that many bytes a second)
+* snapshot take a snapshot of the whole partition, with the given name
+* snapshots list the snapshots
+* mount go to the root of a snapshot, which is read-only (unmount goes back)
+* rmsnap delete a snapshot
 * exit quit the program immediately
+*
+* Run as pr4 serve <socket> [workers] [mixed|split] to serve the same commands
+* to any number of clients over a Unix domain socket instead, see serveClients.
+* There, exit only ends the client's session and root goes back to the root.
+*
+* Run as pr4 batch [workers] to read the whole script up front and run the
+* commands that don't depend on each other at the same time, see runBatch.
+* The output is the same as running it line by line.
+*
+* Run as pr4 fsck [-r] [-j threads] [file], or pr4fsck, to check a partition
+* file that nothing has open (./partition.data by default), see runFsck.
 */
 
 /* The size argument is usually ignored.
@@ -46,45 +91,104 @@ int do_mvdir(char *name, char *size);
 int do_mkfil(char *name, char *size);
 int do_rmfil(char *name, char *size);
 int do_mvfil(char *name, char *size);
+int do_cpfil(char *name, char *size);
 int do_szfil(char *name, char *size);
+int do_write(char *name, char *text);
+int do_cat  (char *name, char *size);
+int do_set  (char *name, char *value);
+int do_grow (char *name, char *size);
+int do_sync (char *name, char *size);
+int do_dedup(char *name, char *size);
+int do_scrub(char *name, char *size);
+int do_info (char *name, char *size);
+int do_du   (char *name, char *size);
+int do_layout(char *name, char *size);
+int do_snapshot (char *name, char *size);
+int do_snapshots(char *name, char *size);
+int do_mount (char *name, char *size);
+int do_unmount(char *name, char *size);
+int do_rmsnap(char *name, char *size);
 int do_exit (char *name, char *size);
 
 struct action {
   char *cmd;	// pointer to string
   int (*action)(char *name, char *size);	// pointer to function
+  bool writes;	// refused while a snapshot is mounted
 } table[] = {
-    { "root" , do_root },
-    { "print", do_print },
-    { "chdir", do_chdir },
-    { "mkdir", do_mkdir },
-    { "rmdir", do_rmdir },
-    { "mvdir", do_mvdir },
-    { "mkfil", do_mkfil },
-    { "rmfil", do_rmfil },
-    { "mvfil", do_mvfil },
-    { "szfil", do_szfil },
-    { "exit" , do_exit },
-    { NULL, NULL }	// end marker, do not remove
+    { "root" , do_root, false },
+    { "print", do_print, false },
+    { "chdir", do_chdir, false },
+    { "mkdir", do_mkdir, true },
+    { "rmdir", do_rmdir, true },
+    { "mvdir", do_mvdir, true },
+    { "mkfil", do_mkfil, true },
+    { "rmfil", do_rmfil, true },
+    { "mvfil", do_mvfil, true },
+    { "cpfil", do_cpfil, true },
+    { "szfil", do_szfil, true },
+    { "write", do_write, true },
+    { "cat"  , do_cat, false },
+    { "set"  , do_set, false },
+    { "grow" , do_grow, false },
+    { "sync" , do_sync, false },
+    { "dedup", do_dedup, true },
+    { "scrub", do_scrub, false },
+    { "info" , do_info, false },
+    { "du"   , do_du, false },
+    { "layout", do_layout, false },
+    { "snapshot", do_snapshot, true },
+    { "snapshots", do_snapshots, false },
+    { "mount", do_mount, false },
+    { "unmount", do_unmount, false },
+    { "rmsnap", do_rmsnap, true },
+    { "exit" , do_exit, false },
+    { NULL, NULL, false }	// end marker, do not remove
 };
 
-#define MAX_FILENAME 128
-
-typedef struct fileHeader
-{
-  bool isDirectory;
-  block_id parent;
-  block_id currentID;
-  block_id contents;
-  block_size_t size;
-  char name[MAX_FILENAME+1];   // max filename size is 128 characters
-} fileHeader;
-
-fileHeader *currentDir;
+// each client of the server has its own working directory, and gets its own output.
+__thread fileHeader *currentDir;
+__thread FILE *out;
+
+// what a client (or stdin) asked of its own commands, see do_set.
+typedef struct session {
+  bool ownDurability; // whether it overrides the partition's durability.
+  durability_mode durability;
+  uint64_t snapshot; // the snapshot it has mounted, 0 for none.
+  block_id snapshotRoot;
+} session;
+
+session stdinSession;
+__thread session *currentSession;
+
+// guards file contents, striped by where the file's header is. Reading a file
+// takes its stripe shared, anything that changes or frees the file's contents
+// exclusively.
+#define FILE_STRIPES 64
+pthread_rwlock_t fileLocks[FILE_STRIPES];
+
+unsigned int growDirectory(fileHeader *dir, block_id **info);
+void enterDirectory(block_id id);
+bool directoryInUse(block_id dir);
+void lockDirectory();
+void unlockDirectory();
+pthread_rwlock_t *fileLock(block_id id);
+block_id findFile(char *name);
+block_id lockFile(char *name, bool exclusive);
+void unlockFile(block_id id);
+void *openClient();
+void closeClient(void *state);
+void scrubFiles(scrubber *s);
+void stopScrubbing();
 
 /*--------------------------------------------------------------------------------*/
 
 void parse(char *buf, int *argc, char *argv[]);
 
+int runCommand(char *in);
+int serveClients(char *socketPath, int workers, char *layout);
+int runBatch(FILE *script, int workers);
+int runFsck(int argc, char *argv[]);
+
 #define LINESIZE 128
 
 /*--------------------------------------------------------------------------------*/
@@ -131,68 +235,174 @@ void testPartition() {
 int main(int argc, char *argv[])
 {  
   char in[LINESIZE];
+  char dummy[] = "";
+
+  out = stdout;
+
+  for (int i = 0; i < FILE_STRIPES; i++)
+    { pthread_rwlock_init(&fileLocks[i], NULL); }
+
+  // installed as pr4fsck too, which is pr4 fsck.
+  char *name = strrchr(argv[0], '/');
+  name = (name != NULL) ? name + 1 : argv[0];
+
+  if (strcmp(name, "pr4fsck") == 0)
+    { return runFsck(argc - 1, argv + 1); }
+
+  if (argc > 1 && strcmp(argv[1], "fsck") == 0)
+    { return runFsck(argc - 2, argv + 2); }
+
+  if (argc > 2 && strcmp(argv[1], "serve") == 0)
+    {
+      int workers = (argc > 3) ? atoi(argv[3]) : 4;
+      if (workers < 1)
+        { fprintf(stderr, "need at least one worker\n"); return 1; }
+
+      return serveClients(argv[2], workers, (argc > 4) ? argv[4] : dummy);
+    }
+
+  if (argc > 1 && strcmp(argv[1], "batch") == 0)
+    {
+      int workers = (argc > 2) ? atoi(argv[2]) : 4;
+      if (workers < 1)
+        { fprintf(stderr, "need at least one worker\n"); return 1; }
+
+      return runBatch(stdin, workers);
+    }
+
+  while (fgets(in, LINESIZE, stdin) != NULL)
+    {
+      runCommand(in);
+    }
+
+  return do_exit(dummy, dummy);
+}
+
+// runs one line of input, printing whatever it prints to out. Returns the
+// command's result, and 0 for a blank line.
+int runCommand(char *in)
+{
   char *cmd, *fnm, *fsz;
   char dummy[] = "";
 
   int n;
   char *a[LINESIZE];
 
-  while (fgets(in, LINESIZE, stdin) != NULL)
-    {
-      // commands are all like "cmd filename filesize\n" with whitespace between
+  // commands are all like "cmd filename filesize\n" with whitespace between
 
-      // parse in
-      parse(in, &n, a);
+  // parse in
+  parse(in, &n, a);
 
-      cmd = (n > 0) ? a[0] : dummy;
-      fnm = (n > 1) ? a[1] : dummy;
-      fsz = (n > 2) ? a[2] : dummy;
-      if (debug) printf(":%s:%s:%s:\n", cmd, fnm, fsz);
+  cmd = (n > 0) ? a[0] : dummy;
+  fnm = (n > 1) ? a[1] : dummy;
+  fsz = (n > 2) ? a[2] : dummy;
+  if (debug) fprintf(out, ":%s:%s:%s:\n", cmd, fnm, fsz);
 
-      if (n == 0) continue;	// blank line
+  if (n == 0) return 0;	// blank line
 
-      int found = 0;
-      for (struct action *ptr = table; ptr->cmd != NULL; ptr++)
+  for (struct action *ptr = table; ptr->cmd != NULL; ptr++)
+    {
+      if (strcmp(ptr->cmd, cmd) == 0)
         {
-if (strcmp(ptr->cmd, cmd) == 0)
-{
-found = 1;
-int ret = (ptr->action)(fnm, fsz);
-if (ret == -1)
-{ printf(" %s %s %s: failed\n", cmd, fnm, fsz); }
-break;
-}
-}
-      if (!found)
-        { printf("command not found: %s\n", cmd); }
+          // the session may want its commands kept differently than the partition does.
+          session *sess = (currentSession != NULL) ? currentSession : &stdinSession;
+          setSessionDurability(sess->ownDurability, sess->durability);
+          view_snapshot(sess->snapshot);
+
+          // whatever the command writes is committed as a whole.
+          begin_transaction();
+          int ret;
+          if (ptr->writes && sess->snapshot != 0)
+            {
+              fprintf(out, "a snapshot is mounted, it can't be changed\n");
+              ret = -1;
+            }
+          else
+            { ret = (ptr->action)(fnm, fsz); }
+          end_transaction();
+
+          if (ret == -1)
+            { fprintf(out, " %s %s %s: failed\n", cmd, fnm, fsz); }
+          return ret;
+        }
     }
 
-  return 0;
+  fprintf(out, "command not found: %s\n", cmd);
+  return -1;
 }
 
 /*--------------------------------------------------------------------------------*/
 
 bool calledRoot = false;
 
+// set while serving clients over a socket rather than reading stdin.
+bool serving = false;
+
+// set while running a planned batch, see runBatch.
+bool batching = false;
+
+// a client of the server, see serveClients.
+typedef struct client {
+  fileHeader cwd;
+  block_id cwdId; // where cwd is, for other clients to look at.
+  session session;
+  struct client *next;
+} client;
+
+// guards the list of clients and where they are. Changing directory takes it
+// shared, deleting a directory exclusively, so nobody is ever left in a
+// directory that no longer exists.
+pthread_rwlock_t clientsLock = PTHREAD_RWLOCK_INITIALIZER;
+client *clients = NULL;
+__thread client *currentClient = NULL;
+
+// the background scrubber, if set scrub turned it on, see scrubFiles.
+#define SCRUB_REPORT "./partition.data.scrub"
+pthread_mutex_t scrubbingLock = PTHREAD_MUTEX_INITIALIZER;
+scrubber *scrubbing = NULL;
+
 int do_root(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(calledRoot && serving) {
+    // the server opened the partition already, this just goes back to the
+    // root, of the mounted snapshot if there is one.
+    pthread_rwlock_rdlock(&clientsLock);
+    enterDirectory(currentSession->snapshot != 0 ? currentSession->snapshotRoot : getRootID());
+    pthread_rwlock_unlock(&clientsLock);
+    return 0;
+  }
 
   if(calledRoot) {
-    printf("If you want to reinitialize the partition, delete ./partition.data and reopen the program.\n");
+    fprintf(out, "If you want to reinitialize the partition, delete ./partition.data and reopen the program.\n");
+    return -1;
+  }
+
+  partition_layout layout = LAYOUT_MIXED;
+  if(strcmp(name, "split") == 0) {
+    layout = LAYOUT_SPLIT;
+  } else if(strcmp(name, "") != 0 && strcmp(name, "mixed") != 0) {
+    fprintf(out, "unknown layout %s, expected mixed or split\n", name);
     return -1;
   }
 
   calledRoot = true;
 
-  int ret = initialize("./partition.data", 64 * 1024 * 1024); // 64MB default partition size.
+  int ret = initializeWithLayout("./partition.data", 64 * 1024 * 1024, layout); // 64MB default partition size.
 
   if(ret != 0) {
     // we opened an existing file. just load the exisiting root.
-    printf("loading exisiting partition ./partition.data...\n");
+    fprintf(out, "loading exisiting partition ./partition.data...\n");
+
+    // partitions from older versions store headers in the old raw format.
+    upgrade_headers();
+
+    // and have no usage table, which gives every directory its slot.
+    usage_load();
 
     currentDir = calloc(1, sizeof(fileHeader));
-    load_block(getRootID(), currentDir, sizeof(fileHeader));
+    load_header(getRootID(), currentDir);
 
     return 0;
   }
@@ -205,23 +415,41 @@ int do_root(char *name, char *size)
   currentDir->isDirectory = true;
   currentDir->parent = 0;
   currentDir->size = 128 * sizeof(block_id);
-  currentDir->currentID = allocate_block(currentDir->size + sizeof(fileHeader));
-  currentDir->contents = currentDir->currentID + sizeof(fileHeader);
+  allocateObject(currentDir, 0);
 
   void *initialContents = calloc(128, sizeof(block_id));
 
-  save_block(currentDir->currentID, currentDir, sizeof(fileHeader));
+  save_header(currentDir);
   save_block(currentDir->contents, initialContents, currentDir->size);
 
   saveRootID(currentDir->currentID);
 
+  // the root only gets its slot in the usage table once there is one.
+  usage_load();
+  load_header(currentDir->currentID, currentDir);
+
   free(initialContents);
 
   return 0;
 }
 
-char* path = NULL;
-unsigned int pathLen = 0;
+// Doubles the number of entries in dir and saves its header. info is grown to
+// match, and the index of the first new (empty) entry is returned.
+unsigned int growDirectory(fileHeader *dir, block_id **info) {
+  unsigned int oldCount = dir->size / sizeof(block_id);
+
+  resizeContents(dir, dir->size * 2);
+  save_header(dir);
+
+  // the new entries are zeroed on disk already, our copy just has to match.
+  *info = realloc(*info, dir->size);
+  memset(*info + oldCount, 0, dir->size - oldCount * sizeof(block_id));
+
+  return oldCount;
+}
+
+__thread char* path = NULL;
+__thread unsigned int pathLen = 0;
 
 void printAll(fileHeader *dir) {
   if(path == NULL) {
@@ -240,7 +468,7 @@ void printAll(fileHeader *dir) {
 
   strcat(path, dir->name);
 
-  printf("%s:\n", path);
+  fprintf(out, "%s:\n", path);
 
   fileHeader *fh = malloc(sizeof(fileHeader));
 
@@ -254,24 +482,24 @@ void printAll(fileHeader *dir) {
       continue;
     }
 
-    load_block(child_id[i], fh, sizeof(fileHeader));
+    load_header(child_id[i], fh);
 
     if(fh->isDirectory) {
       // we'll print you later bro
       continue;
     }
 
-    printf("  %s, %llu bytes\n", fh->name, fh->size);
+    fprintf(out, "  %s, %llu bytes\n", fh->name, fh->size);
 
     atLeastOneFile = true;
 
   }
 
   if(!atLeastOneFile) {
-    printf("  <no files>\n");
+    fprintf(out, "  <no files>\n");
   }
 
-  printf("\n");
+  fprintf(out, "\n");
 
   if(dir->name[0] != '\0') {
     strcat(path, "/");
@@ -282,7 +510,7 @@ void printAll(fileHeader *dir) {
       continue;
     }
 
-    load_block(child_id[i], fh, sizeof(fileHeader));
+    load_header(child_id[i], fh);
 
     if(fh->isDirectory == false) {
       // already printed!
@@ -303,24 +531,24 @@ void printAll(fileHeader *dir) {
 
 int do_print(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
-  printInfo(stdout);
-  printf("\n\n\t* Current Directory Information *\n\n");
+  printInfo(out);
+  fprintf(out, "\n\n\t* Current Directory Information *\n\n");
   printAll(currentDir);
   return 0;
 }
 
 int do_chdir(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   if(strcmp(name, "") == 0) {
-    printf("specify a directory\n");
+    fprintf(out, "specify a directory\n");
     return -1;
   }
   
@@ -329,75 +557,66 @@ int do_chdir(char *name, char *size)
 
     if(currentDir->parent != 0) {
       // actually move up a directory.
-      load_block(currentDir->parent, currentDir, sizeof(fileHeader));
+      pthread_rwlock_rdlock(&clientsLock);
+      enterDirectory(currentDir->parent);
+      pthread_rwlock_unlock(&clientsLock);
     } else {
-      printf("already at root\n");
+      fprintf(out, "already at root\n");
       return -1;
     }
 
     return 0;
   }
 
-  // otherwise, search for the requested directory.
-  block_id *info = malloc(currentDir->size);
-  load_block(currentDir->contents, info, currentDir->size);
-
-  fileHeader *temp = malloc(sizeof(fileHeader));
-
-  for(unsigned int i = 0; i < currentDir->size / sizeof(block_id); i++) {
-    if(info[i] == 0) {
-      continue;
-    }
-
-    load_block(info[i], temp, sizeof(fileHeader));
-
-    if(!(temp->isDirectory)) {
-      continue;
-    }
+  // otherwise, search for the requested directory. The cached copy of this
+  // directory is read without waiting on anyone changing other directories,
+  // only on someone deleting one.
+  pthread_rwlock_rdlock(&clientsLock);
 
-    if(strcmp(temp->name, name) == 0) {
-      // we found it, change directory.
-      free(currentDir);
-      free(info);
-      currentDir = temp;
-      return 0;
-    }
+  block_id id = dcache_lookup(currentDir->currentID, name, true);
 
+  if(id != 0) {
+    // we found it, change directory.
+    enterDirectory(id);
   }
 
-  free(info);
-  free(temp);
+  pthread_rwlock_unlock(&clientsLock);
 
-  // couldn't find the directory, command failed.
-  printf("directory doesn't exist.\n");
+  if(id == 0) {
+    // couldn't find the directory, command failed.
+    fprintf(out, "directory doesn't exist.\n");
+    return -1;
+  }
 
-  return -1;
+  return 0;
 }
 
 int do_mkdir(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   if(strcmp(name, "") == 0) {
-    printf("specify a directory name\n");
+    fprintf(out, "specify a directory name\n");
     return -1;
   }
 
   if(strlen(name) > MAX_FILENAME) {
-    printf("filename too long, max is 128 characters");
+    fprintf(out, "filename too long, max is 128 characters");
     return -1;
   }
 
   if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    printf("invalid dir name: %s\n", name);
+    fprintf(out, "invalid dir name: %s\n", name);
     return -1;
   }
 
   // search this directory for a open slot while also checking to see if
   // there's a name conflict.
 
+  lockDirectory();
+
   block_id *info = malloc(currentDir->size);
   load_block(currentDir->contents, info, currentDir->size);
 
@@ -412,14 +631,15 @@ int do_mkdir(char *name, char *size)
       continue;
     }
 
-    load_block(info[i], temp, sizeof(fileHeader));
+    load_header_hot(info[i], temp);
 
     if(temp->isDirectory == false) {
       continue;
     }
 
-    if(strcmp(temp->name, name) == 0) {
-      printf("directory already exists\n");
+    if(header_name_is(temp, name)) {
+      unlockDirectory();
+      fprintf(out, "directory already exists\n");
       return -1;
     }
 
@@ -428,75 +648,8 @@ int do_mkdir(char *name, char *size)
   // at this point, there at least isn't a name conflict
 
   if(openSlot == -1) {
-    // shit, the directory is full.
-
-    block_id old_id = currentDir->currentID;
-
-    currentDir->size = currentDir->size * 2;
-    currentDir->currentID = resize_block(currentDir->currentID, currentDir->size + sizeof(fileHeader));
-    currentDir->contents = currentDir->currentID + sizeof(fileHeader);
-
-    info = realloc(info, currentDir->size);
-    load_block(currentDir->contents, info, currentDir->size);
-
-    // we gotta zero out the new entries, resize does not guarentee that they're zero.
-    // we continue where we left off.
-    for(; i < currentDir->size / sizeof(block_id); i++) {
-      info[i] = 0;
-      if(info[i] == 0 && openSlot == -1) {
-        // trip first time.
-        openSlot = i;
-      }
-    }
-
-    // now there's an open slot, but if the id changed, we need to update parent and children
-    // before continuing.
-    if(old_id != currentDir->currentID) {
-      if(currentDir->parent != 0) {
-        load_block(currentDir->currentID, temp, sizeof(fileHeader));
-
-        block_id *parContent = malloc(temp->size);
-        load_block(temp->contents, parContent, temp->size);
-        bool updateOccured = false;
-
-        for(unsigned int i = 0; i < temp->size / sizeof(block_id) && !updateOccured; i++) {
-          if(parContent[i] == old_id) {
-            parContent[i] = currentDir->currentID;
-            save_block(temp->contents, parContent, temp->size);
-            updateOccured = true;
-          }
-        }
-
-        if(!updateOccured) {
-          printf("directory structure is corrupt.\n");
-          return -1;
-        }
-
-        free(parContent);
-
-      } else {
-        // updating the parent is just saving this as the new rootID
-        saveRootID(currentDir->currentID);
-      }
-
-      //childn' are gettin adopted
-      for(unsigned int k = 0; k < currentDir->size / sizeof(block_id); k++) {
-        if(info[k] == 0) {
-          continue;
-        }
-
-        load_block(info[k], temp, sizeof(fileHeader));
-
-        if(temp->parent != old_id) {
-          printf("directory structure is corrupt.\n");
-          return -1;
-        }
-
-        temp->parent = currentDir->currentID;
-
-        save_block(info[k], temp, sizeof(fileHeader));
-      }
-    }
+    // the directory is full, make room for more entries.
+    openSlot = growDirectory(currentDir, &info);
   }
 
   fileHeader *newDir = calloc(1, sizeof(fileHeader));
@@ -504,9 +657,8 @@ int do_mkdir(char *name, char *size)
   newDir->isDirectory = true;
   newDir->parent = currentDir->currentID;
   newDir->size = 128 * sizeof(block_id);
-  newDir->currentID = allocate_block(newDir->size + sizeof(fileHeader));
-  newDir->contents = newDir->currentID + sizeof(fileHeader);
   strncpy(newDir->name, name, MAX_FILENAME);
+  allocateObject(newDir, directory_hint(currentDir->currentID));
 
   // save info and this header.
 
@@ -515,9 +667,12 @@ int do_mkdir(char *name, char *size)
 
   void *initialContents = calloc(128, sizeof(block_id));
 
-  save_block(newDir->currentID, newDir, sizeof(fileHeader));
+  save_header(newDir);
   save_block(newDir->contents, initialContents, newDir->size);
 
+  dcache_publish(currentDir->currentID);
+  unlockDirectory();
+
   free(info);
   free(temp);
 
@@ -527,7 +682,7 @@ int do_mkdir(char *name, char *size)
 void deleteDir(fileHeader *fh) {
 
   if(!fh->isDirectory) {
-    printf("internal error: trying to deleteDir on a file!\n");
+    fprintf(out, "internal error: trying to deleteDir on a file!\n");
     exit(1);
   }
 
@@ -541,7 +696,7 @@ void deleteDir(fileHeader *fh) {
       continue;
     }
 
-    load_block(child[i], subHead, sizeof(fileHeader));
+    load_header_hot(child[i], subHead);
 
     if(subHead->isDirectory) {
 
@@ -549,16 +704,15 @@ void deleteDir(fileHeader *fh) {
 
     } else {
 
-      fileHeader *save = currentDir;
-      currentDir = fh;
-      do_rmfil(subHead->name, NULL);
-      currentDir = save;
+      // the entry table goes away with this directory, no need to clear it.
+      freeObject(subHead);
 
     }
   }
 
   // now to delete self.
-  free_block(fh->currentID);
+  dcache_forget(fh->currentID);
+  freeObject(fh);
   free(subHead);
   free(child);
 
@@ -566,21 +720,27 @@ void deleteDir(fileHeader *fh) {
 
 int do_rmdir(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   if(strcmp(name, "") == 0) {
-    printf("specify a directory\n");
+    fprintf(out, "specify a directory\n");
     return -1;
   }
 
   if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    printf("cannot delete %s", name);
+    fprintf(out, "cannot delete %s", name);
     return -1;
   }
   
+  // nobody can move into it while we hold this. Taken before the directory,
+  // like changing directory does.
+  pthread_rwlock_wrlock(&clientsLock);
+
   // find dir
+  lockDirectory();
+
   block_id *info = malloc(currentDir->size);
   load_block(currentDir->contents, info, currentDir->size);
 
@@ -592,29 +752,44 @@ int do_rmdir(char *name, char *size)
       continue;
     }
 
-    load_block(info[i], temp, sizeof(fileHeader));
+    load_header_hot(info[i], temp);
 
     if(temp->isDirectory == false) {
       continue;
     }
 
-    if(strcmp(temp->name, name) == 0) {
-      deleteDir(temp);
+    if(header_name_is(temp, name)) {
       didDelete = true;
       break;
     }
 
   }
 
-  //zero out id
-  if(didDelete) {
-    info[i] = 0;
-    save_block(currentDir->contents, info, currentDir->size);
-  } else {
-    printf("directory doesn't exist\n");
+  if(!didDelete) {
+    unlockDirectory();
+    pthread_rwlock_unlock(&clientsLock);
+    fprintf(out, "directory doesn't exist\n");
+    return -1;
+  }
+
+  if(directoryInUse(info[i])) {
+    unlockDirectory();
+    pthread_rwlock_unlock(&clientsLock);
+    fprintf(out, "directory is in use\n");
     return -1;
   }
 
+  // nobody is in there, so nobody is using the files in there either.
+  deleteDir(temp);
+
+  //zero out id
+  info[i] = 0;
+  save_block(currentDir->contents, info, currentDir->size);
+  dcache_publish(currentDir->currentID);
+
+  unlockDirectory();
+  pthread_rwlock_unlock(&clientsLock);
+
   free(info);
   free(temp);
 
@@ -623,22 +798,22 @@ int do_rmdir(char *name, char *size)
 
 int renameObject(char* name, char* newName, bool isADir) {
   if(strcmp(name, "") == 0 || strcmp(newName, "") == 0) {
-    printf("must specify name and new name\n");
+    fprintf(out, "must specify name and new name\n");
     return -1;
   }
 
   if(strlen(name) > MAX_FILENAME || strlen(newName) > MAX_FILENAME) {
-    printf("new name too long, max is 128 characters");
+    fprintf(out, "new name too long, max is 128 characters");
     return -1;
   }
 
   if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    printf("invalid name: %s\n", name);
+    fprintf(out, "invalid name: %s\n", name);
     return -1;
   }
 
   if(strcmp(newName, ".") == 0 || strcmp(newName, "..") == 0) {
-    printf("invalid name: %s\n", name);
+    fprintf(out, "invalid name: %s\n", name);
     return -1;
   }
 
@@ -646,6 +821,8 @@ int renameObject(char* name, char* newName, bool isADir) {
     return 0; //nothin to do!
   }
   
+  lockDirectory();
+
   block_id *subDir = malloc(currentDir->size);
   load_block(currentDir->contents, subDir, currentDir->size);
 
@@ -657,31 +834,52 @@ int renameObject(char* name, char* newName, bool isADir) {
       continue;
     }
 
-    load_block(subDir[i], fh, sizeof(fileHeader));
+    load_header_hot(subDir[i], fh);
 
     if(fh->isDirectory != isADir) {
       continue;
     }
 
-    if(strcmp(name, fh->name) == 0) {
+    if(header_name_is(fh, name)) {
       target = i;
     }
 
-    if(strcmp(newName, fh->name) == 0) {
-      printf("cannot rename to an already existing %s\n", (isADir ? "directory" : "file"));
+    if(header_name_is(fh, newName)) {
+      unlockDirectory();
+      fprintf(out, "cannot rename to an already existing %s\n", (isADir ? "directory" : "file"));
       return -1;
     }
   }
 
   if(target == -1) {
-    printf("%s %s does not exist!", (isADir ? "directory" : "file"), name);
+    unlockDirectory();
+    fprintf(out, "%s %s does not exist!", (isADir ? "directory" : "file"), name);
     return -1;
   }
 
 
-  strncpy(fh->name, newName, MAX_FILENAME);
+  // fh holds whichever entry we looked at last, not necessarily the target.
+  // Renaming can move a file's contents, so nobody may be reading it, and
+  // rewrites a directory's header, so nobody may be changing the directory.
+  block_id id = subDir[target];
+
+  if(isADir) {
+    dcache_write_lock(id);
+  } else {
+    pthread_rwlock_wrlock(fileLock(id));
+  }
+
+  load_header(id, fh);
+  renameHeader(fh, newName);
+
+  if(isADir) {
+    dcache_write_unlock(id);
+  } else {
+    pthread_rwlock_unlock(fileLock(id));
+  }
 
-  save_block(subDir[target], fh, sizeof(fileHeader));
+  dcache_publish(currentDir->currentID);
+  unlockDirectory();
 
   free(fh);
   free(subDir);
@@ -691,9 +889,9 @@ int renameObject(char* name, char* newName, bool isADir) {
 
 int do_mvdir(char *name, char *newName)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   return renameObject(name, newName, true);
 
@@ -703,9 +901,9 @@ int do_mvdir(char *name, char *newName)
 
 int do_mvfil(char *name, char *newName)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   return renameObject(name, newName, false);  
 
@@ -715,35 +913,37 @@ int do_mvfil(char *name, char *newName)
 
 int do_mkfil(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   if(strcmp(name, "") == 0) {
-    printf("specify a file name\n");
+    fprintf(out, "specify a file name\n");
     return -1;
   }
 
   if(strlen(name) > MAX_FILENAME) {
-    printf("filename too long, max is 128 characters");
+    fprintf(out, "filename too long, max is 128 characters");
     return -1;
   }
 
   if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    printf("invalid file name: %s\n", name);
+    fprintf(out, "invalid file name: %s\n", name);
     return -1;
   }
 
   int requestedSize = atoi(size);
 
   if(requestedSize < 0) {
-    printf("can't allocate negative sized file\n");
+    fprintf(out, "can't allocate negative sized file\n");
     return -1;
   }
 
   // search this directory for a open slot while also checking to see if
   // there's a name conflict.
 
+  lockDirectory();
+
   block_id *info = malloc(currentDir->size);
   load_block(currentDir->contents, info, currentDir->size);
 
@@ -758,14 +958,15 @@ int do_mkfil(char *name, char *size)
       continue;
     }
 
-    load_block(info[i], temp, sizeof(fileHeader));
+    load_header_hot(info[i], temp);
 
     if(temp->isDirectory) {
       continue;
     }
 
-    if(strcmp(temp->name, name) == 0) {
-      printf("file already exists\n");
+    if(header_name_is(temp, name)) {
+      unlockDirectory();
+      fprintf(out, "file already exists\n");
       return -1;
     }
 
@@ -774,115 +975,154 @@ int do_mkfil(char *name, char *size)
   // at this point, there at least isn't a name conflict
 
   if(openSlot == -1) {
-    // shit, the directory is full.
+    // the directory is full, make room for more entries.
+    openSlot = growDirectory(currentDir, &info);
+  }
 
-    block_id old_id = currentDir->currentID;
+  fileHeader *newDir = calloc(1, sizeof(fileHeader));
 
-    currentDir->size = currentDir->size * 2;
-    currentDir->currentID = resize_block(currentDir->currentID, currentDir->size + sizeof(fileHeader));
-    currentDir->contents = currentDir->currentID + sizeof(fileHeader);
+  newDir->isDirectory = false;
+  newDir->parent = currentDir->currentID;
+  newDir->size = requestedSize;
+  strncpy(newDir->name, name, MAX_FILENAME);
+  allocateObject(newDir, currentDir->currentID);
 
-    info = realloc(info, currentDir->size);
-    load_block(currentDir->contents, info, currentDir->size);
+  // save info and this header.
 
-    // we gotta zero out the new entries, resize does not guarentee that they're zero.
-    // we continue where we left off.
-    for(; i < currentDir->size / sizeof(block_id); i++) {
-      info[i] = 0;
-      if(info[i] == 0 && openSlot == -1) {
-        // trip first time.
-        openSlot = i;
-      }
-    }
+  info[openSlot] = newDir->currentID;
+  save_block(currentDir->contents, info, currentDir->size);
 
-    // now there's an open slot, but if the id changed, we need to update parent and children
-    // before continuing.
-    if(old_id != currentDir->currentID) {
-      if(currentDir->parent != 0) {
-        load_block(currentDir->currentID, temp, sizeof(fileHeader));
+  save_header(newDir);
 
-        block_id *parContent = malloc(temp->size);
-        load_block(temp->contents, parContent, temp->size);
-        bool updateOccured = false;
+  dcache_publish(currentDir->currentID);
+  unlockDirectory();
 
-        for(unsigned int i = 0; i < temp->size / sizeof(block_id) && !updateOccured; i++) {
-          if(parContent[i] == old_id) {
-            parContent[i] = currentDir->currentID;
-            save_block(temp->contents, parContent, temp->size);
-            updateOccured = true;
-          }
-        }
+  free(info);
+  free(temp);
 
-        if(!updateOccured) {
-          printf("directory structure is corrupt.\n");
-          return -1;
-        }
+  return 0;
+}
+int do_cpfil(char *name, char *newName)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
 
-        free(parContent);
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
-      } else {
-        // updating the parent is just saving this as the new rootID
-        saveRootID(currentDir->currentID);
-      }
+  if(strcmp(name, "") == 0 || strcmp(newName, "") == 0) {
+    fprintf(out, "specify a file and a name for the copy\n");
+    return -1;
+  }
 
-      //childn' are gettin adopted
-      for(unsigned int k = 0; k < currentDir->size / sizeof(block_id); k++) {
-        if(info[k] == 0) {
-          continue;
-        }
+  if(strlen(newName) > MAX_FILENAME) {
+    fprintf(out, "filename too long, max is 128 characters");
+    return -1;
+  }
+
+  if(strcmp(newName, ".") == 0 || strcmp(newName, "..") == 0) {
+    fprintf(out, "invalid file name: %s\n", newName);
+    return -1;
+  }
 
-        load_block(info[k], temp, sizeof(fileHeader));
+  // find the file and an open slot, checking the copy's name is free.
 
-        if(temp->parent != old_id) {
-          printf("directory structure is corrupt.\n");
-          return -1;
-        }
+  lockDirectory();
 
-        temp->parent = currentDir->currentID;
+  block_id *info = malloc(currentDir->size);
+  load_block(currentDir->contents, info, currentDir->size);
 
-        save_block(info[k], temp, sizeof(fileHeader));
+  fileHeader *temp = malloc(sizeof(fileHeader));
+  fileHeader *src = malloc(sizeof(fileHeader));
+  block_id srcId = 0;
+  int openSlot = -1;
+  unsigned int i = 0;
+  for(; i < currentDir->size / sizeof(block_id); i++) {
+    if(info[i] == 0) {
+      if(openSlot == -1) {
+        openSlot = i;
       }
+      continue;
+    }
+
+    load_header_hot(info[i], temp);
+
+    if(temp->isDirectory) {
+      continue;
+    }
+
+    if(header_name_is(temp, newName)) {
+      unlockDirectory();
+      fprintf(out, "file already exists\n");
+      free(info);
+      free(temp);
+      free(src);
+      return -1;
+    }
+
+    if(header_name_is(temp, name)) {
+      srcId = info[i];
     }
   }
 
-  fileHeader *newDir = calloc(1, sizeof(fileHeader));
+  if(srcId == 0) {
+    unlockDirectory();
+    fprintf(out, "file doesn't exist\n");
+    free(info);
+    free(temp);
+    free(src);
+    return -1;
+  }
 
-  newDir->isDirectory = false;
-  newDir->parent = currentDir->currentID;
-  newDir->size = requestedSize;
-  newDir->currentID = allocate_block(newDir->size + sizeof(fileHeader));
-  newDir->contents = newDir->currentID + sizeof(fileHeader);
-  strncpy(newDir->name, name, MAX_FILENAME);
+  if(openSlot == -1) {
+    openSlot = growDirectory(currentDir, &info);
+  }
 
-  // save info and this header.
+  // nobody writes to the file while its chunks are being shared.
+  pthread_rwlock_rdlock(fileLock(srcId));
+  load_header(srcId, src);
 
-  info[openSlot] = newDir->currentID;
+  fileHeader *copy = calloc(1, sizeof(fileHeader));
+
+  copy->parent = currentDir->currentID;
+  strncpy(copy->name, newName, MAX_FILENAME);
+  cloneObject(src, copy, currentDir->currentID);
+
+  pthread_rwlock_unlock(fileLock(srcId));
+
+  info[openSlot] = copy->currentID;
   save_block(currentDir->contents, info, currentDir->size);
 
-  save_block(newDir->currentID, newDir, sizeof(fileHeader));
+  save_header(copy);
+
+  dcache_publish(currentDir->currentID);
+  unlockDirectory();
 
   free(info);
   free(temp);
+  free(src);
+  free(copy);
 
   return 0;
 }
+
 int do_rmfil(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
 
   if(strcmp(name, "") == 0) {
-    printf("specify a file\n");
+    fprintf(out, "specify a file\n");
     return -1;
   }
 
   if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    printf("cannot delete %s", name);
+    fprintf(out, "cannot delete %s", name);
     return -1;
   }
   
   // find file
+  lockDirectory();
+
   block_id *info = malloc(currentDir->size);
   load_block(currentDir->contents, info, currentDir->size);
 
@@ -894,14 +1134,24 @@ int do_rmfil(char *name, char *size)
       continue;
     }
 
-    load_block(info[i], temp, sizeof(fileHeader));
+    load_header_hot(info[i], temp);
 
     if(temp->isDirectory) {
       continue;
     }
 
-    if(strcmp(temp->name, name) == 0) {
-      free_block(temp->currentID);
+    if(header_name_is(temp, name)) {
+      // a write may have moved the contents since the hot copy was read,
+      // so free what the header says once nobody can change it.
+      pthread_rwlock_wrlock(fileLock(info[i]));
+      load_header(info[i], temp);
+
+      if(temp->isDirectory || !header_name_is(temp, name)) {
+        pthread_rwlock_unlock(fileLock(info[i]));
+        continue;
+      }
+
+      freeObject(temp);
       didDelete = true;
       break;
     }
@@ -910,10 +1160,15 @@ int do_rmfil(char *name, char *size)
 
   //zero out id
   if(didDelete) {
+    block_id id = info[i];
     info[i] = 0;
     save_block(currentDir->contents, info, currentDir->size);
+    dcache_publish(currentDir->currentID);
+    pthread_rwlock_unlock(fileLock(id));
+    unlockDirectory();
   } else {
-    printf("file doesn't exist\n");
+    unlockDirectory();
+    fprintf(out, "file doesn't exist\n");
     return -1;
   }
 
@@ -925,79 +1180,1384 @@ int do_rmfil(char *name, char *size)
 
 int do_szfil(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
+  if (debug) fprintf(out, "%s\n", __func__);
 
-  if(!calledRoot) { printf("haven't initialized partition yet.\n"); return -1; }
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
   
   if(strcmp(name, "") == 0) {
-    printf("specify a file\n");
+    fprintf(out, "specify a file\n");
     return -1;
   }
 
   if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    printf("cannot resize %s", name);
+    fprintf(out, "cannot resize %s", name);
     return -1;
   }
 
   int requestedSize = atoi(size);
 
   if(requestedSize < 0) {
-    printf("negative sizes don't make sense.\n");
+    fprintf(out, "negative sizes don't make sense.\n");
     return -1;
   }
   
   // find file
-  block_id *info = malloc(currentDir->size);
-  load_block(currentDir->contents, info, currentDir->size);
+  block_id id = lockFile(name, true);
+  if(id == 0) {
+    fprintf(out, "file doesn't exist\n");
+    return -1;
+  }
 
   fileHeader *temp = malloc(sizeof(fileHeader));
-  bool didResize = false;
-  unsigned int i = 0;
-  for(; i < currentDir->size / sizeof(block_id); i++) {
-    if(info[i] == 0) {
-      continue;
-    }
+  load_header(id, temp);
 
-    load_block(info[i], temp, sizeof(fileHeader));
+  if((unsigned int)requestedSize < temp->size) {
+    fprintf(out, "warning: truncating file.\n");
+  }
+  resizeContents(temp, requestedSize);
 
-    if(temp->isDirectory) {
-      continue;
+  // the header stays put, so only it needs saving.
+  save_header(temp);
+
+  unlockFile(id);
+
+  free(temp);
+
+  return 0;
+}
+
+// returns the header id of the file called name in the current directory, or 0.
+block_id findFile(char *name) {
+  return dcache_lookup(currentDir->currentID, name, false);
+}
+
+// the stripe of fileLocks guarding the file whose header is at id.
+pthread_rwlock_t *fileLock(block_id id) {
+  return &fileLocks[(id * 0x9E3779B97F4A7C15ull) >> 58];
+}
+
+// finds the file called name in the current directory like findFile, and
+// locks its contents for reading, or for changing if exclusive.
+block_id lockFile(char *name, bool exclusive) {
+  while(true) {
+    block_id id = findFile(name);
+    if(id == 0) {
+      return 0;
     }
 
-    if(strcmp(temp->name, name) == 0) {
-      if((unsigned int)requestedSize < temp->size) {
-        printf("warning: truncating file.\n");
-      }
-      temp->size = requestedSize;
-      temp->currentID = resize_block(temp->currentID, temp->size + sizeof(fileHeader));
-      temp->contents = temp->currentID + sizeof(fileHeader);
-      didResize = true;
-      break;
+    if(exclusive) {
+      pthread_rwlock_wrlock(fileLock(id));
+    } else {
+      pthread_rwlock_rdlock(fileLock(id));
+    }
+
+    // it may have been deleted or renamed while we waited.
+    if(findFile(name) == id) {
+      return id;
     }
 
+    pthread_rwlock_unlock(fileLock(id));
   }
+}
 
-  //update id
-  if(didResize) {
-    info[i] = temp->currentID;
-    save_block(info[i], temp, sizeof(fileHeader));
-    save_block(currentDir->contents, info, currentDir->size);
-  } else {
-    printf("file doesn't exist\n");
+// releases the lock taken by lockFile.
+void unlockFile(block_id id) {
+  pthread_rwlock_unlock(fileLock(id));
+}
+
+int do_write(char *name, char *text)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  if(strcmp(name, "") == 0) {
+    fprintf(out, "specify a file\n");
     return -1;
   }
 
-  free(info);
-  free(temp);
+  block_id id = lockFile(name, true);
+  if(id == 0) {
+    fprintf(out, "file doesn't exist\n");
+    return -1;
+  }
+
+  fileHeader fh;
+  load_header_hot(id, &fh);
+
+  // always appends, the file grows to fit.
+  write_file(id, fh.size, text, strlen(text));
+
+  unlockFile(id);
 
   return 0;
 }
 
-int do_exit(char *name, char *size)
+int do_cat(char *name, char *size)
 {
-  if (debug) printf("%s\n", __func__);
-  
-  exit(0);
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  if(strcmp(name, "") == 0) {
+    fprintf(out, "specify a file\n");
+    return -1;
+  }
+
+  block_id id = lockFile(name, false);
+  if(id == 0) {
+    fprintf(out, "file doesn't exist\n");
+    return -1;
+  }
+
+  fileHeader fh;
+  load_header_hot(id, &fh);
+
+  // print straight out of the mapped partition when we can.
+  uint64_t off = 0;
+  while(off < fh.size) {
+    uint64_t avail;
+    const void *view = view_file(id, off, fh.size - off, &avail);
+
+    if(view != NULL) {
+      fwrite(view, 1, avail, out);
+    } else {
+      void *buf = malloc(avail);
+      read_file(id, off, buf, avail);
+      fwrite(buf, 1, avail, out);
+      free(buf);
+    }
+
+    off += avail;
+  }
+
+  unlockFile(id);
+
+  fprintf(out, "\n");
+
+  return 0;
+}
+
+// parses a byte count like 4096, 64K, 16M or 2G. Returns false if it isn't one.
+bool parseBytes(char *text, block_size_t *bytes) {
+  char *end;
+  unsigned long long n = strtoull(text, &end, 10);
+
+  if(end == text || text[0] == '-') {
+    return false;
+  }
+
+  switch(*end) {
+  case 'G': case 'g': n *= 1024;
+  /* fall through */
+  case 'M': case 'm': n *= 1024;
+  /* fall through */
+  case 'K': case 'k': n *= 1024; end++;
+  /* fall through */
+  case '\0': break;
+  default: return false;
+  }
+
+  if(*end != '\0') {
+    return false;
+  }
+
+  *bytes = n;
+  return true;
+}
+
+// parses a durability setting: none, flush or fsync, or periodic for a sync
+// every 5ms, <n>ms for one every n milliseconds or <n>ops for one every n
+// commands (or a second after the first write, if that comes sooner).
+bool parseDurability(char *text, durability_policy *policy) {
+  policy->intervalMs = 5;
+  policy->ops = 0;
+
+  if(strcmp(text, "none") == 0) {
+    policy->mode = DURABILITY_NONE;
+  } else if(strcmp(text, "flush") == 0) {
+    policy->mode = DURABILITY_FLUSH;
+  } else if(strcmp(text, "fsync") == 0) {
+    policy->mode = DURABILITY_FSYNC;
+  } else if(strcmp(text, "periodic") == 0) {
+    policy->mode = DURABILITY_PERIODIC;
+  } else {
+    char *end;
+    unsigned long long n = strtoull(text, &end, 10);
+
+    if(end == text || text[0] == '-') {
+      return false;
+    }
+
+    policy->mode = DURABILITY_PERIODIC;
+    if(strcmp(end, "ms") == 0) {
+      policy->intervalMs = n;
+    } else if(strcmp(end, "ops") == 0 && n > 0) {
+      policy->intervalMs = 1000;
+      policy->ops = n;
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int do_set(char *name, char *value)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(strcmp(name, "grow") == 0) {
+    growth_policy policy = getGrowthPolicy();
+
+    if(strcmp(value, "off") == 0) {
+      policy.mode = GROW_OFF;
+    } else if(strcmp(value, "double") == 0) {
+      policy.mode = GROW_DOUBLE;
+    } else if(parseBytes(value, &policy.increment) && policy.increment > 0) {
+      policy.mode = GROW_FIXED;
+    } else {
+      fprintf(out, "expected off, double or a number of bytes\n");
+      return -1;
+    }
+
+    setGrowthPolicy(policy);
+    return 0;
+  }
+
+  if(strcmp(name, "growlimit") == 0) {
+    growth_policy policy = getGrowthPolicy();
+
+    if(!parseBytes(value, &policy.limit)) {
+      fprintf(out, "expected a number of bytes, 0 for no limit\n");
+      return -1;
+    }
+
+    setGrowthPolicy(policy);
+    return 0;
+  }
+
+  if(strcmp(name, "durability") == 0) {
+    if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+    durability_policy policy;
+    if(!parseDurability(value, &policy)) {
+      fprintf(out, "expected none, flush, periodic, <n>ms, <n>ops or fsync\n");
+      return -1;
+    }
+
+    setDurability(policy);
+    return 0;
+  }
+
+  if(strcmp(name, "sessiondurability") == 0) {
+    session *sess = (currentSession != NULL) ? currentSession : &stdinSession;
+
+    if(strcmp(value, "none") == 0) {
+      sess->durability = DURABILITY_NONE;
+    } else if(strcmp(value, "flush") == 0) {
+      sess->durability = DURABILITY_FLUSH;
+    } else if(strcmp(value, "fsync") == 0) {
+      sess->durability = DURABILITY_FSYNC;
+    } else if(strcmp(value, "partition") != 0) {
+      fprintf(out, "expected none, flush, fsync or partition\n");
+      return -1;
+    }
+
+    sess->ownDurability = (strcmp(value, "partition") != 0);
+
+    return 0;
+  }
+
+  if(strcmp(name, "dedup") == 0) {
+    if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+    if(strcmp(value, "on") == 0) {
+      setDedup(true);
+    } else if(strcmp(value, "off") == 0) {
+      setDedup(false);
+    } else {
+      fprintf(out, "expected on or off\n");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if(strcmp(name, "compress") == 0) {
+    if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+    if(strcmp(value, "on") == 0) {
+      setCompression(true);
+    } else if(strcmp(value, "off") == 0) {
+      setCompression(false);
+    } else {
+      fprintf(out, "expected on or off\n");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if(strcmp(name, "verify") == 0) {
+    if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+    if(strcmp(value, "always") == 0) {
+      setVerification(VERIFY_ALWAYS);
+    } else if(strcmp(value, "fill") == 0) {
+      setVerification(VERIFY_FILL);
+    } else if(strcmp(value, "never") == 0) {
+      setVerification(VERIFY_NEVER);
+    } else {
+      fprintf(out, "expected always, fill or never\n");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if(strcmp(name, "scrub") == 0) {
+    if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+    block_size_t rate = 0;
+    if(strcmp(value, "off") != 0 && (!parseBytes(value, &rate) || rate == 0)) {
+      fprintf(out, "expected off or a number of bytes a second\n");
+      return -1;
+    }
+
+    pthread_mutex_lock(&scrubbingLock);
+
+    if(rate == 0) {
+      if(scrubbing != NULL) {
+        scrub_stop(scrubbing);
+        scrubbing = NULL;
+      }
+    } else if(scrubbing != NULL) {
+      scrub_set_rate(scrubbing, rate);
+    } else {
+      scrubbing = scrub_start(SCRUB_REPORT, rate, scrubFiles);
+
+      if(scrubbing == NULL) {
+        pthread_mutex_unlock(&scrubbingLock);
+        fprintf(out, "couldn't open %s\n", SCRUB_REPORT);
+        return -1;
+      }
+    }
+
+    pthread_mutex_unlock(&scrubbingLock);
+    return 0;
+  }
+
+  if(strcmp(name, "punch") == 0) {
+    if(strcmp(value, "off") == 0) {
+      setPunchMode(PUNCH_OFF);
+    } else if(strcmp(value, "immediate") == 0) {
+      setPunchMode(PUNCH_IMMEDIATE);
+    } else if(strcmp(value, "deferred") == 0) {
+      setPunchMode(PUNCH_DEFERRED);
+    } else {
+      fprintf(out, "expected off, immediate or deferred\n");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  fprintf(out, "unknown setting %s\n", name);
+  return -1;
+}
+
+int do_grow(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  block_size_t bytes;
+  if(!parseBytes(name, &bytes) || bytes == 0) {
+    fprintf(out, "specify how many bytes to grow by\n");
+    return -1;
+  }
+
+  if(grow_partition(bytes) != 0) {
+    fprintf(out, "couldn't grow the partition\n");
+    return -1;
+  }
+
+  fprintf(out, "partition is now %" PRIu64 " bytes\n", getPartitionSize());
+
+  return 0;
+}
+
+int do_sync(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sync_partition();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fprintf(out, "synced in %.3fms\n", (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  // what the durability mode has cost so far.
+  durability_policy policy = getDurability();
+  journal_stats stats = getJournalStats();
+
+  switch(policy.mode) {
+  case DURABILITY_NONE: fprintf(out, "durability none: "); break;
+  case DURABILITY_FLUSH: fprintf(out, "durability flush: "); break;
+  case DURABILITY_FSYNC: fprintf(out, "durability fsync: "); break;
+  case DURABILITY_PERIODIC:
+    if(policy.ops > 0) {
+      fprintf(out, "durability every %" PRIu64 " commands: ", policy.ops);
+    } else {
+      fprintf(out, "durability every %" PRIu64 "ms: ", policy.intervalMs);
+    }
+    break;
+  }
+
+  fprintf(out, "%" PRIu64 " commands in %" PRIu64 " commits, %" PRIu64 " syncs taking %.3fms on average, "
+      "%" PRIu64 " waits for a commit taking %.3fms on average\n",
+      stats.transactions, stats.commits, stats.syncs, stats.syncs ? stats.syncNs / 1e6 / stats.syncs : 0.0,
+      stats.waits, stats.waits ? stats.waitNs / 1e6 / stats.waits : 0.0);
+
+  return 0;
+}
+
+// deduplicates every file in the directory whose header is at id and below
+// it. Each directory stays locked while it's gone through, so nothing in it
+// can be removed, and each file while its chunks are.
+void dedupTree(block_id id, dedup_report *report)
+{
+  dcache_write_lock(id);
+
+  fileHeader dir;
+  load_header(id, &dir);
+
+  block_id *child = malloc(dir.size);
+  load_block(dir.contents, child, dir.size);
+
+  fileHeader fh;
+  for (unsigned int i = 0; i < dir.size / sizeof(block_id); i++)
+    {
+      if (child[i] == 0)
+        { continue; }
+
+      load_header(child[i], &fh);
+
+      if (fh.isDirectory)
+        {
+          dedupTree(child[i], report);
+          continue;
+        }
+
+      pthread_rwlock_wrlock(fileLock(child[i]));
+      load_header(child[i], &fh);
+      dedupContents(&fh, report);
+      pthread_rwlock_unlock(fileLock(child[i]));
+    }
+
+  free(child);
+
+  dcache_write_unlock(id);
+}
+
+int do_dedup(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  dedup_report report = { 0 };
+  dedupTree(getRootID(), &report);
+  dedupFinish(&report);
+
+  dedup_stats stats = getDedupStats();
+
+  fprintf(out, "%" PRIu64 " chunks, %" PRIu64 " merged\n", report.chunks, report.merged);
+  fprintf(out, "dedup ratio %.2f: %" PRIu64 " bytes in files, %" PRIu64 " stored\n",
+          report.physical > 0 ? (double)report.logical / report.physical : 1.0, report.logical, report.physical);
+  fprintf(out, "index: %" PRIu64 " entries, %" PRIu64 " bytes of memory, %" PRIu64 " duplicates found since opened\n",
+          stats.entries, stats.memory, stats.hits);
+
+  return 0;
+}
+
+// whether the i'th entry of the directory whose header is at id is still
+// child. The caller holds the directory's write lock.
+bool stillListed(block_id id, unsigned int i, block_id child)
+{
+  fileHeader dir;
+  load_header(id, &dir);
+
+  block_id now = 0;
+  if (i < dir.size / sizeof(block_id))
+    { load_block(dir.contents + i * sizeof(block_id), &now, sizeof(block_id)); }
+
+  return now == child;
+}
+
+// checks every file header and every file's chunks in the current directory
+// and below it, for the scrubber. The scrubber is in the directory like a
+// client, so it can't be deleted meanwhile. What's in it is read once, and
+// entries are skipped if they're gone by the time they're checked. The
+// directory is only locked while an entry is looked at, each file while it's
+// checked, and nothing while waiting on the budget. Returns false once the
+// scrubber is being stopped.
+bool scrubTree(scrubber *s)
+{
+  block_id id = currentDir->currentID;
+
+  dcache_write_lock(id);
+  fileHeader dir;
+  load_header(id, &dir);
+  unsigned int count = dir.size / sizeof(block_id);
+  block_id *child = malloc(dir.size + 1);
+  load_block(dir.contents, child, dir.size);
+  dcache_write_unlock(id);
+
+  bool running = scrub_throttle(s, FH_SLOT_SIZE + dir.size, 0);
+
+  fileHeader fh;
+  for (unsigned int i = 0; i < count && running; i++)
+    {
+      if (child[i] == 0)
+        { continue; }
+
+      uint64_t bytes = FH_SLOT_SIZE;
+      uint64_t chunks = 0;
+
+      // the header is only read once it's known to be intact, so damage
+      // gets reported instead of stopping everything.
+      dcache_write_lock(id);
+      if (!stillListed(id, i, child[i]))
+        {
+          dcache_write_unlock(id);
+          continue;
+        }
+
+      if (!header_intact(child[i]))
+        {
+          dcache_write_unlock(id);
+          scrub_found(s, child[i], "file header is damaged");
+          running = scrub_throttle(s, bytes, 0);
+          continue;
+        }
+
+      load_header(child[i], &fh);
+
+      if (!fh.isDirectory)
+        {
+          pthread_rwlock_rdlock(fileLock(child[i]));
+          dcache_write_unlock(id);
+          load_header(child[i], &fh);
+          bytes += scrubContents(&fh, scrub_found, s, &chunks);
+          pthread_rwlock_unlock(fileLock(child[i]));
+
+          running = scrub_throttle(s, bytes, chunks);
+          continue;
+        }
+
+      dcache_write_unlock(id);
+
+      // moves in the way chdir does, then looks again: it may have gone
+      // while nothing was locked.
+      pthread_rwlock_rdlock(&clientsLock);
+      dcache_write_lock(id);
+      bool entered = stillListed(id, i, child[i]);
+      if (entered)
+        { enterDirectory(child[i]); }
+      dcache_write_unlock(id);
+      pthread_rwlock_unlock(&clientsLock);
+
+      if (entered)
+        {
+          running = scrub_throttle(s, bytes, 0) && scrubTree(s);
+
+          pthread_rwlock_rdlock(&clientsLock);
+          enterDirectory(id);
+          pthread_rwlock_unlock(&clientsLock);
+        }
+    }
+
+  free(child);
+
+  return running;
+}
+
+// the files part of every pass of the scrubber, run on its thread. It goes
+// through the tree as a client of its own, so rmdir sees it like any other.
+void scrubFiles(scrubber *s)
+{
+  client *c = openClient();
+  currentClient = c;
+  currentDir = &c->cwd;
+  currentSession = &c->session;
+
+  block_id root = getRootID();
+  bool intact;
+
+  pthread_rwlock_rdlock(&clientsLock);
+  dcache_write_lock(root);
+  intact = header_intact(root);
+  if (intact)
+    { enterDirectory(root); }
+  dcache_write_unlock(root);
+  pthread_rwlock_unlock(&clientsLock);
+
+  if (intact)
+    { scrubTree(s); }
+  else
+    { scrub_found(s, root, "root directory header is damaged"); }
+
+  closeClient(c);
+}
+
+// stops the scrubber if it's running, before the partition is closed.
+void stopScrubbing()
+{
+  pthread_mutex_lock(&scrubbingLock);
+
+  if (scrubbing != NULL)
+    {
+      scrub_stop(scrubbing);
+      scrubbing = NULL;
+    }
+
+  pthread_mutex_unlock(&scrubbingLock);
+}
+
+int do_scrub(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  pthread_mutex_lock(&scrubbingLock);
+
+  if(scrubbing == NULL) {
+    pthread_mutex_unlock(&scrubbingLock);
+    fprintf(out, "scrubber is off\n");
+    return -1;
+  }
+
+  scrub_stats stats = scrub_get_stats(scrubbing);
+  pthread_mutex_unlock(&scrubbingLock);
+
+  fprintf(out, "scrubbing at %" PRIu64 " bytes a second: %" PRIu64 " passes, %" PRIu64 " blocks and %" PRIu64
+          " chunks checked, %" PRIu64 " bytes read\n", stats.rate, stats.passes, stats.blocks, stats.chunks, stats.bytes);
+  fprintf(out, "%" PRIu64 " problems found, see %s\n", stats.problems, SCRUB_REPORT);
+
+  return 0;
+}
+
+int do_info(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  space_stats stats = getSpaceStats();
+
+  fprintf(out, "%" PRIu64 " bytes: %" PRIu64 " allocated in %" PRIu64 " blocks, %" PRIu64 " free in %" PRIu64
+          " blocks, %" PRIu64 " waiting to be freed\n", stats.size, stats.allocatedBytes, stats.allocatedBlocks,
+          stats.freeBytes, stats.freeBlocks, stats.queuedBytes);
+  fprintf(out, "largest free block %" PRIu64 " bytes\n", stats.largestFree);
+
+  for(int i = 0; i < FREE_CLASSES; i++) {
+    if(stats.classes[i] == 0) {
+      continue;
+    }
+
+    if(i == 0) {
+      fprintf(out, "under 64 bytes: %" PRIu64 " free blocks\n", stats.classes[i]);
+    } else if(i == FREE_CLASSES - 1) {
+      fprintf(out, "%" PRIu64 " bytes or more: %" PRIu64 " free blocks\n", (uint64_t)32 << i, stats.classes[i]);
+    } else {
+      fprintf(out, "%" PRIu64 " to %" PRIu64 " bytes: %" PRIu64 " free blocks\n",
+              (uint64_t)32 << i, ((uint64_t)64 << i) - 1, stats.classes[i]);
+    }
+  }
+
+  return 0;
+}
+
+// adds up what's in the directory whose header is at id the slow way, for
+// snapshots, which the usage table doesn't describe.
+void walkUsage(block_id id, dir_usage *u)
+{
+  fileHeader dir;
+  load_header_hot(id, &dir);
+
+  block_id *child = malloc(dir.size);
+  load_block(dir.contents, child, dir.size);
+
+  fileHeader fh;
+  for (unsigned int i = 0; i < dir.size / sizeof(block_id); i++)
+    {
+      if (child[i] == 0)
+        { continue; }
+
+      load_header_hot(child[i], &fh);
+
+      if (fh.isDirectory)
+        {
+          u->dirs++;
+          walkUsage(child[i], u);
+        }
+      else
+        {
+          u->bytes += fh.size;
+          u->files++;
+        }
+    }
+
+  free(child);
+}
+
+int do_du(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  block_id id = currentDir->currentID;
+
+  if(strcmp(name, "") != 0) {
+    id = dcache_lookup(currentDir->currentID, name, true);
+
+    if(id == 0) {
+      fprintf(out, "directory doesn't exist.\n");
+      return -1;
+    }
+  }
+
+  dir_usage u = { 0 };
+  if(!usage_get(id, &u)) {
+    walkUsage(id, &u);
+  }
+
+  fprintf(out, "%s: %" PRIu64 " bytes in %" PRIu64 " files, %" PRIu64 " directories\n",
+          strcmp(name, "") != 0 ? name : ".", u.bytes, u.files, u.dirs);
+
+  return 0;
+}
+
+int do_layout(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  export_format format = EXPORT_JSON;
+  if(strcmp(name, "csv") == 0) {
+    format = EXPORT_CSV;
+  } else if(strcmp(name, "") != 0 && strcmp(name, "json") != 0) {
+    fprintf(out, "unknown format %s, expected json or csv\n", name);
+    return -1;
+  }
+
+  uint64_t buckets = 64;
+  if(strcmp(size, "") != 0) {
+    char *end;
+    buckets = strtoull(size, &end, 10);
+
+    if(*end != '\0' || buckets == 0) {
+      fprintf(out, "specify a number of buckets\n");
+      return -1;
+    }
+  }
+
+  exportLayout(out, buckets, format);
+
+  return 0;
+}
+
+int do_snapshot(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  if(strcmp(name, "") == 0) {
+    fprintf(out, "specify a snapshot name\n");
+    return -1;
+  }
+
+  if(strlen(name) > SNAPSHOT_NAME_MAX) {
+    fprintf(out, "snapshot name too long, max is %d characters\n", SNAPSHOT_NAME_MAX);
+    return -1;
+  }
+
+  if(create_snapshot(name) == 0) {
+    fprintf(out, "snapshot already exists\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int do_snapshots(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  // nobody takes or deletes one while we're in a command.
+  uint64_t count = list_snapshots(NULL, 0);
+  snapshot_info *info = malloc(count * sizeof(snapshot_info) + 1);
+  list_snapshots(info, count);
+
+  if(count == 0) {
+    fprintf(out, "no snapshots\n");
+  }
+
+  for(uint64_t i = 0; i < count; i++) {
+    char when[32];
+    time_t created = info[i].created;
+    struct tm tm;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&created, &tm));
+    fprintf(out, "%s, taken %s, %" PRIu64 " bytes kept\n", info[i].name, when, info[i].kept);
+  }
+
+  free(info);
+
+  return 0;
+}
+
+int do_mount(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  if(batching) {
+    fprintf(out, "snapshots can't be mounted in batch mode\n");
+    return -1;
+  }
+
+  if(strcmp(name, "") == 0) {
+    fprintf(out, "specify a snapshot\n");
+    return -1;
+  }
+
+  snapshot_info info;
+  if(!mount_snapshot(find_snapshot(name), &info)) {
+    fprintf(out, "snapshot doesn't exist\n");
+    return -1;
+  }
+
+  session *sess = (currentSession != NULL) ? currentSession : &stdinSession;
+
+  if(sess->snapshot != 0) {
+    unmount_snapshot(sess->snapshot);
+  }
+
+  sess->snapshot = info.id;
+  sess->snapshotRoot = info.root;
+  view_snapshot(info.id);
+
+  pthread_rwlock_rdlock(&clientsLock);
+  enterDirectory(info.root);
+  pthread_rwlock_unlock(&clientsLock);
+
+  return 0;
+}
+
+int do_unmount(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  session *sess = (currentSession != NULL) ? currentSession : &stdinSession;
+
+  if(sess->snapshot == 0) {
+    fprintf(out, "no snapshot is mounted\n");
+    return -1;
+  }
+
+  unmount_snapshot(sess->snapshot);
+  sess->snapshot = 0;
+  view_snapshot(0);
+
+  pthread_rwlock_rdlock(&clientsLock);
+  enterDirectory(getRootID());
+  pthread_rwlock_unlock(&clientsLock);
+
+  return 0;
+}
+
+int do_rmsnap(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(!calledRoot) { fprintf(out, "haven't initialized partition yet.\n"); return -1; }
+
+  if(strcmp(name, "") == 0) {
+    fprintf(out, "specify a snapshot\n");
+    return -1;
+  }
+
+  uint64_t id = find_snapshot(name);
+  if(id == 0) {
+    fprintf(out, "snapshot doesn't exist\n");
+    return -1;
+  }
+
+  if(delete_snapshot(id) != 0) {
+    fprintf(out, "snapshot is mounted\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int do_exit(char *name, char *size)
+{
+  if (debug) fprintf(out, "%s\n", __func__);
+
+  if(calledRoot) {
+    stopScrubbing();
+
+    // don't leave freed space the deferred mode hasn't gotten to yet.
+    if(getPunchMode() == PUNCH_DEFERRED) {
+      punch_free_space();
+    }
+
+    // writes everything the journal still holds back to the partition file.
+    close_partition(current_partition());
+  }
+
+  exit(0);
+}
+
+/*--------------------------------------------------------------------------------*/
+
+// moves the current client (or stdin) into the directory whose header is at
+// id. The caller holds clientsLock, shared is enough.
+void enterDirectory(block_id id)
+{
+  load_header(id, currentDir);
+
+  if(currentClient != NULL) {
+    currentClient->cwdId = id;
+  }
+}
+
+// whether any client is in dir or somewhere below it. The caller holds
+// clientsLock exclusively.
+bool directoryInUse(block_id dir)
+{
+  fileHeader fh;
+
+  for(client *c = clients; c != NULL; c = c->next) {
+    // a client in a snapshot isn't in the partition as it is now.
+    if(c->session.snapshot != 0) {
+      continue;
+    }
+
+    for(block_id id = c->cwdId; id != 0; id = fh.parent) {
+      if(id == dir) {
+        return true;
+      }
+
+      load_header_hot(id, &fh);
+    }
+  }
+
+  return false;
+}
+
+// takes the write lock of the current directory, then rereads its header,
+// which may have been grown or renamed since we last looked.
+void lockDirectory()
+{
+  dcache_write_lock(currentDir->currentID);
+  load_header(currentDir->currentID, currentDir);
+}
+
+// releases the lock taken by lockDirectory.
+void unlockDirectory()
+{
+  dcache_write_unlock(currentDir->currentID);
+}
+
+void *openClient()
+{
+  client *c = calloc(1, sizeof(client));
+
+  pthread_rwlock_wrlock(&clientsLock);
+
+  c->cwdId = getRootID();
+  c->next = clients;
+  clients = c;
+
+  pthread_rwlock_unlock(&clientsLock);
+
+  return c;
+}
+
+int runClient(void *state, char *line, FILE *output)
+{
+  client *c = state;
+  char word[8];
+
+  if(sscanf(line, "%7s", word) == 1 && strcmp(word, "exit") == 0) {
+    return SESSION_END;
+  }
+
+  currentClient = c;
+  currentDir = &c->cwd;
+  currentSession = &c->session;
+  out = output;
+
+  // other clients may have grown or renamed it since our last command.
+  view_snapshot(c->session.snapshot);
+  load_header(c->cwdId, currentDir);
+
+  return runCommand(line);
+}
+
+void closeClient(void *state)
+{
+  client *c = state;
+
+  pthread_rwlock_wrlock(&clientsLock);
+
+  client **link = &clients;
+  while(*link != c) {
+    link = &(*link)->next;
+  }
+  *link = c->next;
+
+  pthread_rwlock_unlock(&clientsLock);
+
+  if(c->session.snapshot != 0) {
+    unmount_snapshot(c->session.snapshot);
+  }
+
+  free(c);
+}
+
+// Opens (or creates) ./partition.data with the given layout and serves the
+// command set over a Unix domain socket at socketPath, every client with its
+// own working directory starting at the root. Commands from all clients share
+// the partition and the directory cache, and run on a pool of workers threads.
+int serveClients(char *socketPath, int workers, char *layout)
+{
+  if(do_root(layout, "") != 0) {
+    return 1;
+  }
+
+  serving = true;
+
+  session_handler handler = { openClient, runClient, closeClient };
+
+  int ret = serve(socketPath, workers, &handler);
+
+  stopScrubbing();
+
+  // don't leave freed space the deferred mode hasn't gotten to yet.
+  if(getPunchMode() == PUNCH_DEFERRED) {
+    punch_free_space();
+  }
+
+  // gives back space that's still queued up by the arenas.
+  close_partition(current_partition());
+
+  return ret == 0 ? 0 : 1;
+}
+
+/*--------------------------------------------------------------------------------*/
+
+/* A batch is planned before any of it runs. Every command runs in the
+* directory the script would be in at that line, so the planner follows the
+* script's chdirs through a model of the directory tree, predicting which
+* mkdir, rmdir, mvdir and chdir commands succeed the same way the commands
+* themselves decide. Commands in the same directory run in script order, a
+* command in a new directory waits for the mkdir making it, and rmdir and
+* mvdir wait for everything before them inside the directory they change.
+* print, set, grow, sync and the snapshot commands wait for everything
+* before them and everything after waits for them. Snapshots can't be
+* mounted, since every command of the batch runs in the same session.
+*/
+
+// a directory as the planner expects it to be at the line it's planning.
+typedef struct plannedDir {
+  char name[MAX_FILENAME+1];
+  block_id id; // its header, 0 until the mkdir making it has run.
+  bool loaded; // whether children was filled in from the partition yet.
+  int last; // the last command planned to run in it, or -1.
+  struct plannedDir *parent;
+  struct plannedDir *children;
+  struct plannedDir *sibling;
+  struct plannedDir *all; // every planned directory, for freeing them.
+} plannedDir;
+
+// what a command of a batch needs to run.
+typedef struct plannedCommand {
+  plannedDir *dir; // where the script is when it gets to the command.
+  plannedDir *made; // the directory a mkdir makes, if it's expected to.
+  char madeName[MAX_FILENAME+1]; // its name, it may be renamed later in the script.
+} plannedCommand;
+
+plannedDir *allPlanned = NULL;
+
+plannedDir *planDir(plannedDir *parent, char *name, block_id id)
+{
+  plannedDir *d = calloc(1, sizeof(plannedDir));
+
+  strncpy(d->name, name, MAX_FILENAME);
+  d->id = id;
+  d->loaded = (id == 0); // a new directory starts out empty.
+  d->last = -1;
+  d->parent = parent;
+  d->all = allPlanned;
+  allPlanned = d;
+
+  if (parent != NULL)
+    {
+      d->sibling = parent->children;
+      parent->children = d;
+    }
+
+  return d;
+}
+
+// the directory called name in d, or NULL. Reads what's in d from the
+// partition the first time, which still holds what the script started with.
+plannedDir *plannedChild(plannedDir *d, char *name)
+{
+  if (!d->loaded)
+    {
+      d->loaded = true;
+
+      dcache_enter();
+
+      const dir_version *v = dcache_get(d->id);
+      for (uint64_t i = 0; i < v->count; i++)
+        {
+          if (v->entries[i].isDirectory)
+            { planDir(d, (char*)v->entries[i].name, v->entries[i].id); }
+        }
+
+      dcache_exit();
+    }
+
+  for (plannedDir *c = d->children; c != NULL; c = c->sibling)
+    {
+      if (strcmp(c->name, name) == 0)
+        { return c; }
+    }
+
+  return NULL;
+}
+
+// whether name could be given to a new directory, as do_mkdir and renameObject check.
+bool plannedName(char *name)
+{
+  return strcmp(name, "") != 0 && strlen(name) <= MAX_FILENAME
+    && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// makes job wait for everything planned to run in d or below it.
+void dependOnTree(batch *b, int job, plannedDir *d)
+{
+  batch_depend(b, job, d->last);
+
+  // only what's loaded can have had anything planned in it.
+  for (plannedDir *c = d->children; c != NULL; c = c->sibling)
+    { dependOnTree(b, job, c); }
+}
+
+// runs one command of a batch, where the planner said the script would be.
+void runPlanned(void *ctx, char *line, FILE *output)
+{
+  plannedCommand *cmd = ctx;
+  fileHeader cwd;
+
+  currentDir = &cwd;
+  out = output;
+
+  load_header(cmd->dir->id, currentDir);
+
+  runCommand(line);
+
+  if (cmd->made != NULL)
+    { cmd->made->id = dcache_lookup(cwd.currentID, cmd->madeName, true); }
+}
+
+// Runs the script in script on workers threads. Everything up to the first
+// root that succeeds runs line by line, since there's nothing to plan with
+// before the partition is open. The rest is read up to the end or an exit,
+// planned, and then run. Exits like the exit command.
+int runBatch(FILE *script, int workers)
+{
+  char in[LINESIZE];
+  char dummy[] = "";
+
+  while (!calledRoot && fgets(in, LINESIZE, script) != NULL)
+    {
+      runCommand(in);
+    }
+
+  if (!calledRoot)
+    { return do_exit(dummy, dummy); }
+
+  batching = true;
+
+  batch *b = batch_create();
+  plannedDir *cwd = planDir(NULL, dummy, currentDir->currentID);
+  plannedCommand **cmds = NULL;
+  int cap = 0, count = 0;
+  int barrier = -1; // the last command everything after it waits for.
+
+  while (fgets(in, LINESIZE, script) != NULL)
+    {
+      char line[LINESIZE];
+      int n;
+      char *a[LINESIZE];
+
+      strcpy(line, in);
+      parse(line, &n, a);
+
+      if (n == 0)
+        { continue; }	// blank lines print nothing.
+
+      char *cmd = a[0];
+      char *fnm = (n > 1) ? a[1] : dummy;
+      char *fsz = (n > 2) ? a[2] : dummy;
+
+      if (strcmp(cmd, "exit") == 0)
+        { break; }
+
+      if (count == cap)
+        {
+          cap = cap ? cap * 2 : 256;
+          cmds = realloc(cmds, cap * sizeof(plannedCommand*));
+        }
+
+      plannedCommand *c = calloc(1, sizeof(plannedCommand));
+      c->dir = cwd;
+      cmds[count++] = c;
+
+      int job = batch_add(b, in, c);
+
+      if (strcmp(cmd, "print") == 0 || strcmp(cmd, "set") == 0 || strcmp(cmd, "grow") == 0
+          || strcmp(cmd, "sync") == 0 || strcmp(cmd, "dedup") == 0 || strcmp(cmd, "snapshot") == 0 || strcmp(cmd, "snapshots") == 0
+          || strcmp(cmd, "info") == 0 || strcmp(cmd, "du") == 0 || strcmp(cmd, "layout") == 0
+          || strcmp(cmd, "mount") == 0 || strcmp(cmd, "unmount") == 0 || strcmp(cmd, "rmsnap") == 0)
+        {
+          for (int i = barrier + 1; i < job; i++)
+            { batch_depend(b, job, i); }
+          batch_depend(b, job, barrier);
+          barrier = job;
+          continue;
+        }
+
+      // even a command that only complains needs its directory to exist.
+      batch_depend(b, job, barrier);
+      batch_depend(b, job, cwd->last);
+      cwd->last = job;
+
+      if (strcmp(cmd, "chdir") == 0)
+        {
+          if (strcmp(fnm, "..") == 0)
+            {
+              if (cwd->parent != NULL)
+                { cwd = cwd->parent; }
+            }
+          else if (strcmp(fnm, "") != 0)
+            {
+              plannedDir *d = plannedChild(cwd, fnm);
+              if (d != NULL)
+                { cwd = d; }
+            }
+        }
+      else if (strcmp(cmd, "mkdir") == 0)
+        {
+          if (plannedName(fnm) && plannedChild(cwd, fnm) == NULL)
+            {
+              c->made = planDir(cwd, fnm, 0);
+              c->made->last = job;
+              strcpy(c->madeName, fnm);
+            }
+        }
+      else if (strcmp(cmd, "rmdir") == 0)
+        {
+          plannedDir *d = plannedChild(cwd, fnm);
+
+          if (d != NULL)
+            {
+              dependOnTree(b, job, d);
+
+              plannedDir **link = &cwd->children;
+              while (*link != d)
+                { link = &(*link)->sibling; }
+              *link = d->sibling;
+            }
+        }
+      else if (strcmp(cmd, "mvdir") == 0)
+        {
+          plannedDir *d = plannedChild(cwd, fnm);
+
+          if (d != NULL && plannedName(fsz) && strcmp(fnm, fsz) != 0 && plannedChild(cwd, fsz) == NULL)
+            {
+              // the directory's own header changes too.
+              batch_depend(b, job, d->last);
+              d->last = job;
+              strcpy(d->name, fsz);
+            }
+        }
+    }
+
+  batch_run(b, workers, runPlanned, stdout);
+
+  for (int i = 0; i < count; i++)
+    { free(cmds[i]); }
+  free(cmds);
+
+  while (allPlanned != NULL)
+    {
+      plannedDir *d = allPlanned;
+      allPlanned = d->all;
+      free(d);
+    }
+
+  return do_exit(dummy, dummy);
+}
+
+// Checks a partition file with fsck_partition, for pr4 fsck and pr4fsck,
+// whose arguments are [-r] [-j threads] [file]. -r repairs what can be, and
+// file defaults to ./partition.data. Returns fsck_partition's result.
+int runFsck(int argc, char *argv[])
+{
+  bool repair = false;
+  int threads = 4;
+  char *file = "./partition.data";
+
+  for (int i = 0; i < argc; i++)
+    {
+      if (strcmp(argv[i], "-r") == 0)
+        { repair = true; }
+      else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        { threads = atoi(argv[++i]); }
+      else if (argv[i][0] != '-')
+        { file = argv[i]; }
+      else
+        {
+          fprintf(stderr, "usage: pr4fsck [-r] [-j threads] [file]\n");
+          return FSCK_UNCHECKED;
+        }
+    }
+
+  if (threads < 1)
+    { fprintf(stderr, "need at least one thread\n"); return FSCK_UNCHECKED; }
+
+  return fsck_partition(file, threads, repair, stdout);
 }
 
 /*--------------------------------------------------------------------------------*/
@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rangemap.h"
+
+// ranges are filed under every page of this many bytes they touch.
+#define RANGE_PAGE 4096
+
+// the ranges touching one page, in no particular order.
+typedef struct page_node {
+	uint64_t page;
+	range **ranges;
+	uint32_t count;
+	uint32_t capacity;
+	struct page_node *next;
+} page_node;
+
+struct rangemap {
+	page_node **buckets;
+	uint64_t numBuckets; // always a power of two.
+	uint64_t numPages;
+
+	range **all;
+	uint64_t count;
+	uint64_t capacity;
+};
+
+static uint64_t bucket_of(rangemap *m, uint64_t page) {
+	return ((page * 0x9E3779B97F4A7C15ull) >> 32) & (m->numBuckets - 1);
+}
+
+static page_node *find_page(rangemap *m, uint64_t page) {
+	page_node *n = m->buckets[bucket_of(m, page)];
+
+	while(n != NULL && n->page != page) {
+		n = n->next;
+	}
+
+	return n;
+}
+
+// doubles the number of buckets once there are twice as many pages as buckets.
+static void rehash(rangemap *m) {
+	uint64_t oldCount = m->numBuckets;
+	page_node **old = m->buckets;
+
+	m->numBuckets *= 2;
+	m->buckets = calloc(m->numBuckets, sizeof(page_node*));
+
+	for(uint64_t i = 0; i < oldCount; i++) {
+		while(old[i] != NULL) {
+			page_node *n = old[i];
+			old[i] = n->next;
+
+			uint64_t b = bucket_of(m, n->page);
+			n->next = m->buckets[b];
+			m->buckets[b] = n;
+		}
+	}
+
+	free(old);
+}
+
+static void file_under(rangemap *m, uint64_t page, range *r) {
+	page_node *n = find_page(m, page);
+
+	if(n == NULL) {
+		if(m->numPages >= m->numBuckets * 2) {
+			rehash(m);
+		}
+
+		uint64_t b = bucket_of(m, page);
+
+		n = calloc(1, sizeof(page_node));
+		n->page = page;
+		n->next = m->buckets[b];
+		m->buckets[b] = n;
+		m->numPages++;
+	}
+
+	if(n->count == n->capacity) {
+		n->capacity = n->capacity ? n->capacity * 2 : 4;
+		n->ranges = realloc(n->ranges, n->capacity * sizeof(range*));
+	}
+
+	n->ranges[n->count++] = r;
+}
+
+static void unfile(rangemap *m, uint64_t page, range *r) {
+	page_node **link = &m->buckets[bucket_of(m, page)];
+
+	while((*link)->page != page) {
+		link = &(*link)->next;
+	}
+
+	page_node *n = *link;
+
+	for(uint32_t i = 0; i < n->count; i++) {
+		if(n->ranges[i] == r) {
+			n->ranges[i] = n->ranges[--n->count];
+			break;
+		}
+	}
+
+	if(n->count == 0) {
+		*link = n->next;
+		free(n->ranges);
+		free(n);
+		m->numPages--;
+	}
+}
+
+/**
+ * Creates an empty map.
+ */
+rangemap *rangemap_create() {
+	rangemap *m = calloc(1, sizeof(rangemap));
+
+	m->numBuckets = 64;
+	m->buckets = calloc(m->numBuckets, sizeof(page_node*));
+
+	return m;
+}
+
+/**
+ * Frees the map and every range in it. Does nothing given NULL.
+ */
+void rangemap_destroy(rangemap *m) {
+	if(m == NULL) {
+		return;
+	}
+
+	for(uint64_t i = 0; i < m->numBuckets; i++) {
+		while(m->buckets[i] != NULL) {
+			page_node *n = m->buckets[i];
+			m->buckets[i] = n->next;
+			free(n->ranges);
+			free(n);
+		}
+	}
+
+	for(uint64_t i = 0; i < m->count; i++) {
+		free(m->all[i]);
+	}
+
+	free(m->buckets);
+	free(m->all);
+	free(m);
+}
+
+/**
+ * Adds the range [start, end), which must not overlap any range already in
+ * the map. The range returned stays valid until it's removed, only its
+ * values may be changed.
+ */
+range *rangemap_add(rangemap *m, uint64_t start, uint64_t end, uint64_t value, uint64_t extra) {
+	range *r = malloc(sizeof(range));
+
+	r->start = start;
+	r->end = end;
+	r->value = value;
+	r->extra = extra;
+
+	if(m->count == m->capacity) {
+		m->capacity = m->capacity ? m->capacity * 2 : 64;
+		m->all = realloc(m->all, m->capacity * sizeof(range*));
+	}
+
+	r->index = m->count;
+	m->all[m->count++] = r;
+
+	for(uint64_t page = start / RANGE_PAGE; page <= (end - 1) / RANGE_PAGE; page++) {
+		file_under(m, page, r);
+	}
+
+	return r;
+}
+
+/**
+ * Removes (and frees) a range of the map.
+ */
+void rangemap_remove(rangemap *m, range *r) {
+	for(uint64_t page = r->start / RANGE_PAGE; page <= (r->end - 1) / RANGE_PAGE; page++) {
+		unfile(m, page, r);
+	}
+
+	m->all[r->index] = m->all[--m->count];
+	m->all[r->index]->index = r->index;
+
+	free(r);
+}
+
+/**
+ * Returns the range containing addr, or NULL.
+ */
+range *rangemap_find(rangemap *m, uint64_t addr) {
+	page_node *n = find_page(m, addr / RANGE_PAGE);
+
+	if(n == NULL) {
+		return NULL;
+	}
+
+	for(uint32_t i = 0; i < n->count; i++) {
+		if(n->ranges[i]->start <= addr && addr < n->ranges[i]->end) {
+			return n->ranges[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int by_start(const void *a, const void *b) {
+	const range *x = *(range* const*)a;
+	const range *y = *(range* const*)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**
+ * Calls fn on every range overlapping [start, end), in address order. fn
+ * must not change the map.
+ */
+void rangemap_each(rangemap *m, uint64_t start, uint64_t end, void (*fn)(range *r, void *ctx), void *ctx) {
+	range *few[16];
+	range **found = few;
+	uint64_t count = 0, capacity = 16;
+
+	if(start >= end || m->count == 0) {
+		return;
+	}
+
+	uint64_t first = start / RANGE_PAGE;
+
+	for(uint64_t page = first; page <= (end - 1) / RANGE_PAGE; page++) {
+		page_node *n = find_page(m, page);
+
+		for(uint32_t i = 0; n != NULL && i < n->count; i++) {
+			range *r = n->ranges[i];
+
+			// a range touching several of these pages is only counted at the first.
+			uint64_t home = r->start / RANGE_PAGE > first ? r->start / RANGE_PAGE : first;
+			if(r->start >= end || r->end <= start || home != page) {
+				continue;
+			}
+
+			if(count == capacity) {
+				capacity *= 2;
+				if(found == few) {
+					found = malloc(capacity * sizeof(range*));
+					memcpy(found, few, sizeof(few));
+				} else {
+					found = realloc(found, capacity * sizeof(range*));
+				}
+			}
+
+			found[count++] = r;
+		}
+	}
+
+	qsort(found, count, sizeof(range*), by_start);
+
+	for(uint64_t i = 0; i < count; i++) {
+		fn(found[i], ctx);
+	}
+
+	if(found != few) {
+		free(found);
+	}
+}
+
+/**
+ * Retrieves how many ranges are in the map.
+ */
+uint64_t rangemap_count(rangemap *m) {
+	return m->count;
+}
+
+/**
+ * Retrieves the i'th range of the map, in no particular order, for going
+ * through all of them. Removing a range moves the last one into its place.
+ */
+range *rangemap_get(rangemap *m, uint64_t i) {
+	return m->all[i];
+}
+
+/**
+ * Retrieves roughly how many bytes of memory the map takes up.
+ */
+uint64_t rangemap_memory(rangemap *m) {
+	uint64_t bytes = sizeof(rangemap) + m->numBuckets * sizeof(page_node*) + m->capacity * sizeof(range*);
+
+	bytes += m->count * sizeof(range);
+
+	for(uint64_t i = 0; i < m->numBuckets; i++) {
+		for(page_node *n = m->buckets[i]; n != NULL; n = n->next) {
+			bytes += sizeof(page_node) + n->capacity * sizeof(range*);
+		}
+	}
+
+	return bytes;
+}
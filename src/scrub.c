@@ -0,0 +1,240 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scrub.h"
+
+// bytes of block headers checked with the partition locked at a time.
+#define WINDOW_BYTES 4096
+
+// a pass takes at least this long, so a small partition isn't gone over
+// again and again as fast as the budget allows.
+#define MIN_PASS_MS 1000
+
+struct scrubber {
+	partition *partition;
+	void (*files)(scrubber *s);
+	pthread_t thread;
+
+	pthread_mutex_t lock; // guards everything below.
+	pthread_cond_t wake; // signalled when stopping or the rate changes.
+	bool stopping;
+	FILE *report;
+	scrub_stats stats;
+	uint64_t passProblems; // found in the running pass.
+
+	// when the scrubber will have stayed within its rate for everything it's
+	// read so far. It doesn't read again before then.
+	struct timespec due;
+};
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns) {
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static bool timespec_before(struct timespec *a, struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// waits until the time at until (which may move meanwhile) or until the
+// scrubber is being stopped, with s->lock held. Returns false in the second case.
+static bool wait_until(scrubber *s, struct timespec *until) {
+	while(!s->stopping) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if(!timespec_before(&now, until)) {
+			return true;
+		}
+
+		struct timespec t = *until;
+		pthread_cond_timedwait(&s->wake, &s->lock, &t);
+	}
+
+	return false;
+}
+
+// starts a line of the report with the time, with s->lock held.
+static void report_time(scrubber *s) {
+	time_t now = time(NULL);
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&now, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(s->report, "%s ", buf);
+}
+
+/**
+ * Writes a problem to the scrubber's report. A scrub_finding, with the
+ * scrubber as its context.
+ */
+void scrub_found(void *ctx, block_id blk, const char *problem) {
+	scrubber *s = ctx;
+
+	pthread_mutex_lock(&s->lock);
+	s->stats.problems++;
+	s->passProblems++;
+	report_time(s);
+	fprintf(s->report, "block %" PRIu64 ": %s\n", blk, problem);
+	fflush(s->report);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Counts bytes read and chunks checked by the files function, then waits
+ * until the budget allows for them. Returns false if the scrubber is being
+ * stopped, in which case the files function should return. Nothing should
+ * be locked while calling it.
+ */
+bool scrub_throttle(scrubber *s, uint64_t bytes, uint64_t chunks) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	pthread_mutex_lock(&s->lock);
+	s->stats.bytes += bytes;
+	s->stats.chunks += chunks;
+
+	// time spent not reading doesn't save up for a burst later.
+	if(timespec_before(&s->due, &now)) {
+		s->due = now;
+	}
+	timespec_add_ns(&s->due, (uint64_t)((double)bytes * 1e9 / s->stats.rate));
+
+	bool running = wait_until(s, &s->due);
+	pthread_mutex_unlock(&s->lock);
+
+	return running;
+}
+
+static void *scrub_thread(void *arg) {
+	scrubber *s = arg;
+	use_partition(s->partition);
+
+	block_id pos = 0;
+	struct timespec passStart;
+	clock_gettime(CLOCK_REALTIME, &passStart);
+
+	while(true) {
+		uint64_t blocks = 0;
+		uint64_t bytes = 0;
+		pos = scrub_blocks(pos, WINDOW_BYTES, &blocks, &bytes, scrub_found, s);
+
+		pthread_mutex_lock(&s->lock);
+		s->stats.blocks += blocks;
+		pthread_mutex_unlock(&s->lock);
+
+		if(!scrub_throttle(s, bytes, 0)) {
+			break;
+		}
+
+		if(pos != 0) {
+			continue;
+		}
+
+		s->files(s);
+
+		pthread_mutex_lock(&s->lock);
+		if(s->stopping) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+
+		s->stats.passes++;
+		report_time(s);
+		fprintf(s->report, "pass %" PRIu64 " done, %" PRIu64 " problems\n", s->stats.passes, s->passProblems);
+		fflush(s->report);
+		s->passProblems = 0;
+
+		timespec_add_ns(&passStart, (uint64_t)MIN_PASS_MS * 1000000);
+		bool running = wait_until(s, &passStart);
+		pthread_mutex_unlock(&s->lock);
+
+		if(!running) {
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &passStart);
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts scrubbing the current partition at rate bytes a second, appending
+ * problems to the file at reportPath. files is called from the scrubber's
+ * thread at the end of every pass, with the partition in use, and should
+ * report through scrub_found and pace itself with scrub_throttle. Returns
+ * NULL if the report can't be opened.
+ */
+scrubber *scrub_start(char *reportPath, uint64_t rate, void (*files)(scrubber *s)) {
+	FILE *report = fopen(reportPath, "a");
+	if(report == NULL) {
+		return NULL;
+	}
+
+	scrubber *s = calloc(1, sizeof(scrubber));
+	if(s == NULL) {
+		fprintf(stderr, "Error: could not allocate the scrubber.\n");
+		_exit(2);
+	}
+
+	s->partition = current_partition();
+	s->files = files;
+	s->report = report;
+	s->stats.rate = rate;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->wake, NULL);
+
+	if(pthread_create(&s->thread, NULL, scrub_thread, s) != 0) {
+		fprintf(stderr, "Error: could not start the scrubber.\n");
+		_exit(2);
+	}
+
+	return s;
+}
+
+/**
+ * Stops the scrubber, waiting for whatever it's checking to finish, and frees it.
+ */
+void scrub_stop(scrubber *s) {
+	pthread_mutex_lock(&s->lock);
+	s->stopping = true;
+	pthread_cond_broadcast(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->thread, NULL);
+
+	fclose(s->report);
+	pthread_cond_destroy(&s->wake);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/**
+ * Changes how many bytes a second the scrubber may read.
+ */
+void scrub_set_rate(scrubber *s, uint64_t rate) {
+	pthread_mutex_lock(&s->lock);
+	s->stats.rate = rate;
+
+	// whatever it's waiting for was worked out at the old rate.
+	clock_gettime(CLOCK_REALTIME, &s->due);
+	pthread_cond_broadcast(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+}
+
+scrub_stats scrub_get_stats(scrubber *s) {
+	pthread_mutex_lock(&s->lock);
+	scrub_stats stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+
+	return stats;
+}
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// longer lines are cut into pieces, the same way fgets would.
+#define MAX_LINE 128
+
+// a line waiting for its turn to run.
+typedef struct pending {
+	char *text;
+	struct pending *next;
+} pending;
+
+typedef struct session {
+	int fd;
+	void *state;
+
+	char partial[MAX_LINE]; // what has arrived of the next line.
+	size_t used;
+
+	// the rest is guarded by lock.
+	pending *head, *tail; // lines waiting to run.
+	bool scheduled; // on the ready queue, or being run by a worker.
+	bool eof; // the client won't send anything more.
+	bool ended; // the session is over, whatever it still sent is dropped.
+
+	struct session *nextReady;
+	struct session *next; // all sessions, only touched by the polling thread.
+} session;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readyCond = PTHREAD_COND_INITIALIZER;
+static session *readyHead, *readyTail;
+static bool stopping;
+
+// written to by workers and signal handlers to get the polling thread's attention.
+static int wakeup[2];
+static volatile sig_atomic_t stopRequested;
+
+static session_handler *handler;
+
+static void on_signal(int sig) {
+	stopRequested = 1;
+
+	char c = 's';
+	if(write(wakeup[1], &c, 1) < 0) {
+		// the pipe is full, so the polling thread is waking up anyway.
+	}
+}
+
+static void wake_poller() {
+	char c = 'w';
+	if(write(wakeup[1], &c, 1) < 0) {
+		// the pipe is full, so the polling thread is waking up anyway.
+	}
+}
+
+// sends all of len bytes. Returns false if the client is gone.
+static bool send_all(int fd, const char *data, size_t len) {
+	while(len > 0) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(n <= 0) {
+			return false;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+// queues a line to run in s, and s to run if it isn't already. With lock held.
+static void enqueue(session *s, char *text, size_t len) {
+	pending *p = malloc(sizeof(pending));
+	p->text = malloc(len + 1);
+	memcpy(p->text, text, len);
+	p->text[len] = '\0';
+	p->next = NULL;
+
+	if(s->tail != NULL) {
+		s->tail->next = p;
+	} else {
+		s->head = p;
+	}
+	s->tail = p;
+
+	if(!s->scheduled) {
+		s->scheduled = true;
+		s->nextReady = NULL;
+
+		if(readyTail != NULL) {
+			readyTail->nextReady = s;
+		} else {
+			readyHead = s;
+		}
+		readyTail = s;
+
+		pthread_cond_signal(&readyCond);
+	}
+}
+
+// reads whatever the client sent and queues the complete lines in it.
+static void receive(session *s) {
+	char buf[4096];
+	ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+
+	if(n < 0 && errno == EINTR) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	if(n <= 0) {
+		s->eof = true;
+	}
+
+	for(ssize_t i = 0; i < n; i++) {
+		s->partial[s->used++] = buf[i];
+
+		if(buf[i] == '\n' || s->used == MAX_LINE - 1) {
+			enqueue(s, s->partial, s->used);
+			s->used = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+// runs one line of s and sends back what it printed. With lock not held.
+// Returns false if the session is over.
+static bool run_line(session *s, char *text) {
+	bool ended = false;
+
+	char *output = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&output, &size);
+
+	int ret = handler->run(s->state, text, out);
+	fclose(out);
+
+	if(ret == SESSION_END) {
+		ended = true;
+	} else {
+		char status[16];
+		int len = snprintf(status, sizeof(status), "== %d\n", ret);
+
+		ended = !send_all(s->fd, output, size) || !send_all(s->fd, status, len);
+	}
+
+	free(output);
+
+	if(ended) {
+		// stop listening to the client too, the polling thread takes it from here.
+		shutdown(s->fd, SHUT_RDWR);
+	}
+
+	return !ended;
+}
+
+static void *worker(void *arg) {
+	pthread_mutex_lock(&lock);
+
+	while(true) {
+		while(readyHead == NULL && !stopping) {
+			pthread_cond_wait(&readyCond, &lock);
+		}
+
+		if(stopping) {
+			break;
+		}
+
+		session *s = readyHead;
+		readyHead = s->nextReady;
+		if(readyHead == NULL) {
+			readyTail = NULL;
+		}
+
+		// a session's lines are only ever run by the worker that took it off the queue.
+		while(s->head != NULL && !stopping) {
+			pending *p = s->head;
+			s->head = p->next;
+			if(s->head == NULL) {
+				s->tail = NULL;
+			}
+
+			bool ended = s->ended;
+			pthread_mutex_unlock(&lock);
+
+			if(!ended) {
+				ended = !run_line(s, p->text);
+			}
+
+			free(p->text);
+			free(p);
+
+			pthread_mutex_lock(&lock);
+			s->ended |= ended;
+		}
+
+		s->scheduled = false;
+
+		if(s->eof || s->ended) {
+			wake_poller();
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+static void free_session(session *s) {
+	while(s->head != NULL) {
+		pending *p = s->head;
+		s->head = p->next;
+		free(p->text);
+		free(p);
+	}
+
+	close(s->fd);
+	handler->close(s->state);
+	free(s);
+}
+
+/**
+ * Listens on a Unix domain socket at socketPath, replacing whatever is there,
+ * and serves every client that connects as a session of its own with a pool
+ * of workers threads. Clients send one command per line and may send many
+ * without waiting; each gets back the command's output followed by a line
+ * "== 0" or "== -1" with its result, in the order they were sent. Returns 0
+ * after SIGINT or SIGTERM once the sessions in progress have finished the
+ * lines they were running, or -1 if the socket can't be set up.
+ */
+int serve(char *socketPath, int workers, session_handler *h) {
+	struct sockaddr_un addr;
+
+	if(strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", socketPath);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath);
+
+	if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", socketPath, strerror(errno));
+		return -1;
+	}
+
+	// never block a worker or a signal handler on a full pipe.
+	if(pipe2(wakeup, O_NONBLOCK) != 0) {
+		fprintf(stderr, "Unable to create a pipe: %s\n", strerror(errno));
+		return -1;
+	}
+
+	handler = h;
+	stopping = false;
+	stopRequested = 0;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pthread_t *threads = malloc(workers * sizeof(pthread_t));
+	for(int i = 0; i < workers; i++) {
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+
+	session *sessions = NULL;
+	size_t numSessions = 0;
+	struct pollfd *fds = NULL;
+	session **polled = NULL;
+
+	while(!stopRequested) {
+		// the two fds we always watch, then every client that may still send something.
+		fds = realloc(fds, (numSessions + 2) * sizeof(struct pollfd));
+		polled = realloc(polled, (numSessions + 2) * sizeof(session*));
+
+		fds[0].fd = wakeup[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = listener;
+		fds[1].events = POLLIN;
+
+		int count = 2;
+
+		pthread_mutex_lock(&lock);
+		for(session *s = sessions; s != NULL; s = s->next) {
+			if(!s->eof && !s->ended) {
+				fds[count].fd = s->fd;
+				fds[count].events = POLLIN;
+				polled[count] = s;
+				count++;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+
+		if(poll(fds, count, -1) < 0) {
+			continue;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			char drain[64];
+			if(read(wakeup[0], drain, sizeof(drain)) < 0) {
+				// nothing to drain after all.
+			}
+		}
+
+		if(fds[1].revents & POLLIN) {
+			int fd = accept(listener, NULL, NULL);
+
+			if(fd >= 0) {
+				session *s = calloc(1, sizeof(session));
+				s->fd = fd;
+				s->state = handler->open();
+				s->next = sessions;
+				sessions = s;
+				numSessions++;
+			}
+		}
+
+		for(int i = 2; i < count; i++) {
+			if(fds[i].revents != 0) {
+				receive(polled[i]);
+			}
+		}
+
+		// let go of the clients that are done, once no worker has them.
+		pthread_mutex_lock(&lock);
+
+		session **link = &sessions;
+		while(*link != NULL) {
+			session *s = *link;
+
+			if((s->eof || s->ended) && !s->scheduled) {
+				*link = s->next;
+				numSessions--;
+				free_session(s);
+			} else {
+				link = &s->next;
+			}
+		}
+
+		pthread_mutex_unlock(&lock);
+	}
+
+	// finish what's running, drop what's queued.
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&readyCond);
+	pthread_mutex_unlock(&lock);
+
+	for(int i = 0; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	while(sessions != NULL) {
+		session *s = sessions;
+		sessions = s->next;
+		free_session(s);
+	}
+
+	free(threads);
+	free(fds);
+	free(polled);
+
+	close(listener);
+	close(wakeup[0]);
+	close(wakeup[1]);
+	unlink(socketPath);
+
+	return 0;
+}
@@ -0,0 +1,345 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usage.h"
+
+// marks the start of the usage table.
+#define USAGE_MAGIC 0x4741535552494455
+
+// partitions with a usage table need at least this version, so older builds
+// that would change the tree without keeping the table up to date refuse them.
+#define FORMAT_USAGE 11
+
+// slots a new table has room for beyond the ones it starts out with.
+#define USAGE_SPARE 64
+
+// The table starts with this, in the room slot 0 would take up. Slots that
+// are given back are chained through their parent field.
+typedef struct usage_head {
+	uint64_t magic;
+	uint64_t count; // slots handed out so far, slot 0 included.
+	uint64_t freeSlot; // the first slot given back, 0 if there's none.
+	uint64_t reserved[2];
+} usage_head;
+
+// fails to compile if the head stops taking up exactly slot 0.
+typedef char usage_head_is_a_slot[sizeof(usage_head) == sizeof(usage_slot) ? 1 : -1];
+
+// guards the table, which moves when it grows. Only ever held briefly.
+static pthread_mutex_t usageLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void read_slot(block_id table, uint64_t i, void *slot) {
+	load_block(table + i * sizeof(usage_slot), slot, sizeof(usage_slot));
+}
+
+static void write_slot(block_id table, uint64_t i, void *slot) {
+	save_block(table + i * sizeof(usage_slot), slot, sizeof(usage_slot));
+}
+
+// the slot of the directory at dir, 0 if it has none.
+static uint64_t slot_of(block_id dir) {
+	fileHeader fh;
+
+	if(dir == 0) {
+		return 0;
+	}
+
+	load_header_hot(dir, &fh);
+	return fh.extents;
+}
+
+// adds the changes to slot i and every slot above it. The caller holds usageLock.
+static void add_up(block_id table, uint64_t i, int64_t bytes, int64_t files, int64_t dirs) {
+	usage_head head;
+	read_slot(table, 0, &head);
+
+	// a damaged chain mustn't go round in circles.
+	for(uint64_t steps = 0; i != 0 && i < head.count && steps < head.count; steps++) {
+		usage_slot s;
+		read_slot(table, i, &s);
+
+		s.usage.bytes += bytes;
+		s.usage.files += files;
+		s.usage.dirs += dirs;
+		write_slot(table, i, &s);
+
+		i = s.parent;
+	}
+}
+
+/**
+ * Adds what changed below the directory at dir to it and every directory
+ * above it. Any of the changes can be negative.
+ */
+void usage_add(block_id dir, int64_t bytes, int64_t files, int64_t dirs) {
+	if(getUsageTableID() == 0 || (bytes == 0 && files == 0 && dirs == 0)) {
+		return;
+	}
+
+	uint64_t slot = slot_of(dir);
+
+	pthread_mutex_lock(&usageLock);
+	add_up(getUsageTableID(), slot, bytes, files, dirs);
+	pthread_mutex_unlock(&usageLock);
+}
+
+/**
+ * Gives the new directory fh a slot, for its header to be saved with, and
+ * counts it in the directories above it.
+ */
+void usage_attach(fileHeader *fh) {
+	fh->extents = 0;
+
+	if(getUsageTableID() == 0) {
+		return;
+	}
+
+	uint64_t parent = slot_of(fh->parent);
+
+	pthread_mutex_lock(&usageLock);
+
+	block_id table = getUsageTableID();
+	usage_head head;
+	usage_slot s;
+	read_slot(table, 0, &head);
+
+	uint64_t slot = head.freeSlot;
+
+	if(slot != 0) {
+		read_slot(table, slot, &s);
+		head.freeSlot = s.parent;
+	} else {
+		slot = head.count++;
+
+		if(head.count * sizeof(usage_slot) > block_capacity(table)) {
+			table = resize_block(table, block_capacity(table) * 2);
+			saveUsageTableID(table);
+		}
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.dir = fh->currentID;
+	s.parent = parent;
+	write_slot(table, slot, &s);
+	write_slot(table, 0, &head);
+
+	add_up(table, parent, 0, 0, 1);
+
+	pthread_mutex_unlock(&usageLock);
+
+	fh->extents = slot;
+}
+
+/**
+ * Gives back the slot of the directory fh, which is being deleted, and takes
+ * it and whatever is still counted below it off the directories above it.
+ */
+void usage_detach(fileHeader *fh) {
+	if(getUsageTableID() == 0 || fh->extents == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&usageLock);
+
+	block_id table = getUsageTableID();
+	usage_head head;
+	usage_slot s;
+	read_slot(table, 0, &head);
+
+	if(fh->extents < head.count) {
+		read_slot(table, fh->extents, &s);
+
+		if(s.dir == fh->currentID) {
+			add_up(table, s.parent, -(int64_t)s.usage.bytes, -(int64_t)s.usage.files, -(int64_t)s.usage.dirs - 1);
+
+			memset(&s, 0, sizeof(s));
+			s.parent = head.freeSlot;
+			head.freeSlot = fh->extents;
+			write_slot(table, fh->extents, &s);
+			write_slot(table, 0, &head);
+		}
+	}
+
+	pthread_mutex_unlock(&usageLock);
+}
+
+/**
+ * Fills u in with what the directory at dir holds. Returns false if that
+ * isn't known without walking it: the partition has no usage table, or the
+ * calling thread is viewing a snapshot, whose tree the table doesn't
+ * describe.
+ */
+bool usage_get(block_id dir, dir_usage *u) {
+	if(getUsageTableID() == 0 || viewed_snapshot() != 0) {
+		return false;
+	}
+
+	uint64_t slot = slot_of(dir);
+	bool found = false;
+
+	pthread_mutex_lock(&usageLock);
+
+	block_id table = getUsageTableID();
+	usage_head head;
+	read_slot(table, 0, &head);
+
+	if(slot != 0 && slot < head.count) {
+		usage_slot s;
+		read_slot(table, slot, &s);
+
+		if(s.dir == dir) {
+			*u = s.usage;
+			found = true;
+		}
+	}
+
+	pthread_mutex_unlock(&usageLock);
+
+	return found;
+}
+
+// a table being built, in memory.
+typedef struct building {
+	usage_slot *slots;
+	uint64_t count;
+	uint64_t capacity;
+} building;
+
+// gives the directory at id, in the slot parent, a slot and counts what's
+// below it, giving its subdirectories theirs. Returns its slot, 0 if its
+// header is damaged.
+static uint64_t build_slot(building *b, block_id id, uint64_t parent) {
+	fileHeader fh, child;
+
+	if(!header_intact(id)) {
+		return 0;
+	}
+
+	load_header(id, &fh);
+
+	if(b->count == b->capacity) {
+		b->capacity *= 2;
+		b->slots = realloc(b->slots, b->capacity * sizeof(usage_slot));
+	}
+
+	uint64_t slot = b->count++;
+	memset(&b->slots[slot], 0, sizeof(usage_slot));
+	b->slots[slot].dir = id;
+	b->slots[slot].parent = parent;
+
+	if(fh.extents != slot) {
+		fh.extents = slot;
+		save_header(&fh);
+	}
+
+	block_id *entries = malloc(fh.size + 1);
+	load_block(fh.contents, entries, fh.size);
+
+	for(uint64_t i = 0; i < fh.size / sizeof(block_id); i++) {
+		if(entries[i] == 0 || !header_intact(entries[i])) {
+			continue;
+		}
+
+		load_header_hot(entries[i], &child);
+
+		if(!child.isDirectory) {
+			b->slots[slot].usage.bytes += child.size;
+			b->slots[slot].usage.files++;
+			continue;
+		}
+
+		uint64_t sub = build_slot(b, entries[i], slot);
+		if(sub != 0) {
+			b->slots[slot].usage.bytes += b->slots[sub].usage.bytes;
+			b->slots[slot].usage.files += b->slots[sub].usage.files;
+			b->slots[slot].usage.dirs += b->slots[sub].usage.dirs + 1;
+		}
+	}
+
+	free(entries);
+
+	return slot;
+}
+
+/**
+ * Throws the usage table away and builds it again by walking the tree, for
+ * after fsck has changed it. Damaged headers are left out, along with
+ * everything below them.
+ */
+void usage_rebuild() {
+	pthread_mutex_lock(&usageLock);
+
+	if(getUsageTableID() != 0) {
+		free_block(getUsageTableID());
+		saveUsageTableID(0);
+	}
+
+	if(getRootID() == 0) {
+		pthread_mutex_unlock(&usageLock);
+		return;
+	}
+
+	building b;
+	b.capacity = 64;
+	b.count = 1;
+	b.slots = malloc(b.capacity * sizeof(usage_slot));
+
+	build_slot(&b, getRootID(), 0);
+
+	usage_head *head = (usage_head*)&b.slots[0];
+	memset(head, 0, sizeof(usage_head));
+	head->magic = USAGE_MAGIC;
+	head->count = b.count;
+
+	block_id table = allocate_metadata_block((b.count + USAGE_SPARE) * sizeof(usage_slot), getRootID());
+	save_block(table, b.slots, b.count * sizeof(usage_slot));
+
+	saveUsageTableID(table);
+	requireFormatVersion(FORMAT_USAGE);
+
+	free(b.slots);
+
+	pthread_mutex_unlock(&usageLock);
+}
+
+/**
+ * Builds the usage table by walking the tree if the partition doesn't have
+ * one yet, as partitions from older versions don't. Call it once the
+ * partition is open and its headers are in the current format, before
+ * loading any directory header that's saved again later, since this gives
+ * every directory its slot.
+ */
+void usage_load() {
+	if(getUsageTableID() == 0) {
+		usage_rebuild();
+	}
+}
+
+/**
+ * Reads the whole usage table for fsck, slot 0 included, and sets count to
+ * how many slots it has. Returns NULL if there's no table or it doesn't look
+ * like one. The caller frees it.
+ */
+usage_slot *usage_read_all(uint64_t *count) {
+	block_id table = getUsageTableID();
+	usage_head head;
+
+	*count = 0;
+
+	if(table == 0) {
+		return NULL;
+	}
+
+	read_slot(table, 0, &head);
+
+	if(head.magic != USAGE_MAGIC || head.count == 0 || head.count > block_capacity(table) / sizeof(usage_slot)) {
+		return NULL;
+	}
+
+	usage_slot *all = malloc(head.count * sizeof(usage_slot));
+	load_block(table, all, head.count * sizeof(usage_slot));
+
+	*count = head.count;
+	return all;
+}
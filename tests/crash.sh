@@ -0,0 +1,53 @@
+#!/bin/sh
+# Kills pr4 batch with SIGKILL while 8 workers are allocating and freeing
+# in 8 directories at once, then opens the partition again and checks that
+# fsck finds nothing wrong with it: the journal has to leave every command
+# either done or not done at all, frees queued for other arenas included.
+#
+# Run from the top of the tree, as make check does.
+
+set -e
+
+top=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$dir"
+
+# every directory gets commands of its own, so the workers run side by side.
+awk 'BEGIN {
+	print "root"
+	for(d = 0; d < 8; d++) print "mkdir d" d
+	for(i = 0; i < 1000; i++) {
+		for(d = 0; d < 8; d++) {
+			print "chdir d" d
+			print "mkfil f" i % 5 " 5000"
+			print "write f" i % 5 " hello"
+			print "mkfil g" i " 100"
+			print "rmfil f" (i + 2) % 5
+			print "rmfil g" i
+			print "chdir .."
+		}
+	}
+	print "exit"
+}' > script.in
+
+for delay in 0.1 0.2 0.4 0.7 1.0; do
+	rm -f partition.data partition.data.journal
+
+	"$top/pr4" batch 8 < script.in > /dev/null 2>&1 &
+	pid=$!
+	sleep $delay
+	kill -9 $pid 2> /dev/null || true
+	wait $pid 2> /dev/null || true
+
+	printf 'root\nexit\n' | "$top/pr4" > /dev/null
+
+	if ! "$top/pr4" fsck partition.data > fsck.txt; then
+		cat fsck.txt
+		echo "crash: FAILED after killing it at ${delay}s"
+		exit 1
+	fi
+done
+
+echo "crash: passed"
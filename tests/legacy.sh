@@ -0,0 +1,33 @@
+#!/bin/sh
+# Opens a partition made before the descriptor grew from 32 bytes and checks
+# that it's converted with its tree intact and passes fsck, see convert_legacy.
+#
+# tests/data/baseline.data.gz was made by the first version of pr4 running
+# tests/data/baseline.in. That version couldn't write to files, so each file's
+# contents were then filled in with its name, one per line, to have something
+# to check them against.
+#
+# Run from the top of the tree, as make check does.
+
+set -e
+
+top=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+gunzip -c tests/data/baseline.data.gz > "$dir/partition.data"
+
+cd "$dir"
+
+# the second run opens the converted partition like any other.
+"$top/pr4" < "$top/tests/legacy.in" > out.txt
+"$top/pr4" < "$top/tests/legacy.in" >> out.txt
+# fsck says how long it took, which changes from run to run.
+"$top/pr4" fsck partition.data | sed 's/, [0-9.]*s$//' >> out.txt
+
+if ! diff -u "$top/tests/legacy.out" out.txt; then
+	echo "legacy: FAILED"
+	exit 1
+fi
+
+echo "legacy: passed"